@@ -0,0 +1,247 @@
+# Archive support for executables built with --archive.
+#
+# The scripts and data files in the archive are not extracted. They are
+# stored uncompressed in the executable, and the table of contents of
+# OCRA_EXECUTABLE says where. This file is preloaded through RUBYOPT.
+# It serves require, require_relative and load from the archive when
+# they find an archived script in the load path, and OcraResource reads
+# archived data files. Everything else, such as native extensions, is
+# a real file and goes through the original methods.
+#
+# The archive is addressed by the paths the files would have had if
+# they had been extracted, so that __FILE__ and __dir__ work as usual.
+# OcraResource also reads real files, and is defined while Ocra builds
+# the executable, so that programs can read their data with it
+# everywhere:
+#
+#   data = OcraResource.read(File.join(__dir__, "data", "table.txt"))
+#
+# Its methods fall back to File when there is no archive, for example
+# when this file is preloaded into a system Ruby without the stub.
+require_relative "ocra_preload"
+
+module OcraResource
+  class << self
+    def init(root, executable)
+      @root = File.expand_path(root).b.downcase + "/"
+      @executable = executable
+      @image = nil
+      @mutex = Mutex.new
+      @archive = {}
+      @loaded = {}
+      @locks = {}
+      @load_path = nil
+      @load_path_keys = nil
+      @dlext = defined?(RbConfig) ? RbConfig::CONFIG["DLEXT"] : "so"
+      read_toc(executable)
+    end
+
+    # Reads the offsets and sizes of the archived files from the table
+    # of contents, keyed by lower case relative path with forward
+    # slashes. Archived files are always stored, so the offset is a
+    # position in the executable.
+    def read_toc(executable)
+      OcraPreload.each_toc_entry(executable) do |name, flags, _codec, stream, offset, size|
+        next unless flags & OcraPreload::TOC_FLAG_ARCHIVE != 0 && stream == 0
+        @archive[name.tr("\\", "/").downcase] = [offset, size]
+      end
+    end
+
+    def enabled?
+      !@archive.nil? && !@archive.empty?
+    end
+
+    # Returns the key of path if it is in the archive.
+    def key(path)
+      return nil unless enabled?
+      path = path.to_path if path.respond_to?(:to_path)
+      return nil unless path.is_a?(String)
+      path = File.expand_path(path).b.downcase rescue nil
+      return nil unless path && path.start_with?(@root)
+      key = path[@root.size..-1]
+      @archive.key?(key) ? key : nil
+    end
+
+    # Returns true if path is in the archive.
+    def archived?(path)
+      !key(path).nil?
+    end
+
+    # Returns true if path is in the archive or is a real file.
+    def exist?(path)
+      archived?(path) || File.file?(path)
+    end
+
+    # Returns the size of the file at path.
+    def size(path)
+      k = key(path)
+      k ? @archive[k][1] : File.size(path)
+    end
+
+    # Returns the contents of the file at path, like File.binread.
+    def binread(path)
+      k = key(path)
+      return File.binread(path) unless k
+      offset, size = @archive[k]
+      @mutex.synchronize do
+        @image ||= File.open(@executable, "rb")
+        @image.seek(offset)
+        data = size > 0 ? @image.read(size) : "".b
+        raise IOError, "#{@executable} is truncated" unless data && data.bytesize == size
+        data
+      end
+    end
+
+    # Returns the contents of the file at path in the default external
+    # encoding, like File.read.
+    def read(path)
+      return File.read(path) unless archived?(path)
+      binread(path).force_encoding(Encoding.default_external)
+    end
+
+    # Yields a StringIO with the contents of the file at path, or
+    # returns it when no block is given.
+    def open(path)
+      require "stringio"
+      io = StringIO.new(read(path))
+      return io unless block_given?
+      yield io
+    end
+
+    # Returns the path of the archived script that require would load
+    # for a feature, or nil if it would load something else. Load path
+    # directories are searched in order, so that real files in earlier
+    # directories come first, as they do for require.
+    def find_feature(feature)
+      return nil unless enabled?
+      feature = feature.to_path if feature.respond_to?(:to_path)
+      return nil unless feature.is_a?(String)
+      extension = File.extname(feature)
+      return nil unless extension.empty? || extension == ".rb"
+      name = extension.empty? ? feature + ".rb" : feature
+      if feature =~ /\A(?:[a-z]:)?[\\\/]|\A~|\A\.\.?[\\\/]/i
+        path = File.expand_path(name)
+        return key(path) ? path : nil
+      end
+      load_path_keys.each do |dir, prefix|
+        return File.join(dir, name) if prefix && @archive.key?(prefix + name.b.downcase)
+        return nil if real_feature?(dir, feature, extension)
+      end
+      nil
+    end
+
+    # Returns the load path with the key prefix of each directory in
+    # the archive, or nil for directories outside it. Recomputed when
+    # the load path changes.
+    def load_path_keys
+      unless @load_path == $LOAD_PATH
+        @load_path = $LOAD_PATH.dup
+        @load_path_keys = @load_path.map do |dir|
+          dir = File.expand_path(dir.to_s)
+          prefix = (dir.b.downcase + "/")
+          [dir, prefix.start_with?(@root) ? prefix[@root.size..-1] : nil]
+        end
+      end
+      @load_path_keys
+    end
+
+    def real_feature?(dir, feature, extension)
+      base = File.join(dir, feature)
+      return File.file?(base) unless extension.empty?
+      File.file?(base + ".rb") || File.file?(base + "." + @dlext)
+    end
+
+    # Returns the path of the archived script that load would run for
+    # a file name, or nil if it would run a real file.
+    def find_file(file)
+      return nil unless enabled?
+      file = file.to_path if file.respond_to?(:to_path)
+      return nil unless file.is_a?(String) && !File.file?(file)
+      return File.expand_path(file) if archived?(file)
+      return nil if file =~ /\A(?:[a-z]:)?[\\\/]|\A~|\A\.\.?[\\\/]/i
+      load_path_keys.each do |dir, prefix|
+        return File.join(dir, file) if prefix && @archive.key?(prefix + file.b.downcase)
+        return nil if File.file?(File.join(dir, file))
+      end
+      nil
+    end
+
+    # Activates the gem that has an archived script for a feature in
+    # its require paths. RubyGems only finds gems by their real files.
+    def activate_gem(feature)
+      return false unless enabled? && defined?(Gem::Specification)
+      feature = feature.to_path if feature.respond_to?(:to_path)
+      return false unless feature.is_a?(String) && File.extname(feature) =~ /\A(\.rb)?\z/
+      name = File.extname(feature).empty? ? feature + ".rb" : feature
+      spec = Gem::Specification.find do |s|
+        !s.activated? && s.full_require_paths.any? { |dir| archived?(File.join(dir, name)) }
+      end
+      spec ? spec.activate : false
+    rescue Gem::LoadError
+      false
+    end
+
+    # Compiles and runs an archived script, like load does.
+    def evaluate(path, wrap = false)
+      source = binread(path).force_encoding(Encoding::UTF_8)
+      if wrap
+        (wrap.is_a?(Module) ? wrap : Module.new).module_eval(source, path, 1)
+      else
+        RubyVM::InstructionSequence.compile(source, path, path, 1).eval
+      end
+    end
+
+    # Requires an archived script once. Like require, it returns false
+    # when another require of the same script on this thread is still
+    # in progress, and makes other threads wait for it. The script is
+    # added to $LOADED_FEATURES before it runs, since that is how
+    # autoload tells that the constant it is defining is being loaded.
+    def require_archived(path)
+      lock = @mutex.synchronize do
+        return false if @loaded[path]
+        @locks[path] ||= Mutex.new
+      end
+      return false if lock.owned?
+      lock.synchronize do
+        return false if @loaded[path]
+        $LOADED_FEATURES << path
+        begin
+          evaluate(path)
+        rescue Exception
+          $LOADED_FEATURES.delete(path)
+          raise
+        end
+        @loaded[path] = true
+      end
+      true
+    end
+
+    def install
+      Kernel.send(:alias_method, :ocra_archive_original_require, :require)
+      Kernel.send(:define_method, :require) do |feature|
+        path = OcraResource.find_feature(feature)
+        return OcraResource.require_archived(path) if path
+        begin
+          ocra_archive_original_require(feature)
+        rescue LoadError
+          raise unless OcraResource.activate_gem(feature) && (path = OcraResource.find_feature(feature))
+          OcraResource.require_archived(path)
+        end
+      end
+      Kernel.send(:alias_method, :ocra_archive_original_load, :load)
+      Kernel.send(:define_method, :load) do |file, wrap = false|
+        path = OcraResource.find_file(file)
+        return ocra_archive_original_load(file, wrap) unless path
+        OcraResource.evaluate(path, wrap)
+        true
+      end
+      Kernel.send(:private, :require, :load)
+      OcraPreload.install_require_relative
+    end
+  end
+end
+
+if ENV["OCRA_EXECUTABLE"]
+  OcraResource.init(File.expand_path("..", __dir__), ENV["OCRA_EXECUTABLE"])
+  OcraResource.install if OcraResource.enabled?
+end
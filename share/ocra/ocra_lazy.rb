@@ -0,0 +1,187 @@
+# Lazy extraction support for executables built with --lazy-extract
+# or --early-launch.
+#
+# The stub only extracts the files that Ruby needs to start, and
+# serves the others on demand on the pipe named by OCRA_LAZY_PIPE.
+# With --early-launch, it also extracts them in the background while
+# the program runs, and a request for one it is writing is answered
+# once it is done. This file is preloaded through RUBYOPT. It reads the
+# names of the lazy files from the table of contents of
+# OCRA_EXECUTABLE, and asks the stub for each one before Ruby requires,
+# loads, opens or lists it.
+require_relative "ocra_preload"
+
+module OcraLazyExtract
+  # Methods that take a file name as their first argument.
+  FILE_METHODS = {
+    IO.singleton_class => [:read, :binread, :readlines, :foreach],
+    File.singleton_class => [:open, :new, :exist?, :file?, :readable?,
+                             :size, :size?, :zero?, :empty?, :stat,
+                             :lstat, :mtime, :ctime, :atime, :realpath,
+                             :ftype, :symlink?],
+  }
+
+  # Methods that take a directory name as their first argument.
+  DIR_METHODS = [:entries, :children, :each_child, :foreach]
+
+  class << self
+    def init(root, executable, pipe)
+      @root = File.expand_path(root).b.downcase + "/"
+      @pipe_name = pipe
+      @pipe = nil
+      @mutex = Mutex.new
+      @lazy = {}
+      @features = {}
+      @load_path_size = nil
+      read_toc(executable)
+    end
+
+    # Reads the lazy file names from the table of contents, keyed by
+    # lower case relative path with forward slashes.
+    def read_toc(executable)
+      OcraPreload.each_toc_entry(executable) do |name, flags|
+        @lazy[name.tr("\\", "/").downcase] = name if flags & OcraPreload::TOC_FLAG_LAZY != 0
+      end
+    end
+
+    # Returns the key of path if it is a lazy file that has not been
+    # extracted yet.
+    def lazy_key(path)
+      return nil if @lazy.empty?
+      path = path.to_path if path.respond_to?(:to_path)
+      return nil unless path.is_a?(String)
+      path = File.expand_path(path).b.downcase rescue nil
+      return nil unless path && path.start_with?(@root)
+      key = path[@root.size..-1]
+      @lazy.key?(key) ? key : nil
+    end
+
+    # Extracts path if it is a lazy file. Returns true if it was.
+    def fetch(path)
+      key = lazy_key(path)
+      key ? request(key) : false
+    end
+
+    # Extracts the lazy files in a directory.
+    def fetch_tree(dir)
+      return if @lazy.empty?
+      dir = dir.to_path if dir.respond_to?(:to_path)
+      return unless dir.is_a?(String)
+      prefix = (File.expand_path(dir).b.downcase rescue nil)
+      return unless prefix && (prefix + "/").start_with?(@root)
+      prefix = (prefix + "/")[@root.size..-1]
+      @lazy.keys.each do |key|
+        request(key) if key.start_with?(prefix) && !key.index("/", prefix.size)
+      end
+    end
+
+    # Extracts the lazy files that a glob pattern matches.
+    def fetch_glob(pattern, base = nil)
+      return if @lazy.empty?
+      pattern = pattern.to_path if pattern.respond_to?(:to_path)
+      return unless pattern.is_a?(String)
+      pattern = (File.expand_path(pattern, base || Dir.pwd).b.downcase rescue nil)
+      return unless pattern
+      flags = File::FNM_PATHNAME | File::FNM_EXTGLOB
+      @lazy.keys.each do |key|
+        request(key) if File.fnmatch?(pattern, @root + key, flags)
+      end
+    end
+
+    # Extracts the file that require or load would find for a feature.
+    # Native extensions are never lazy, so only .rb files are checked.
+    # Features are searched for once per load path.
+    def fetch_feature(feature)
+      return if @lazy.empty?
+      feature = feature.to_path if feature.respond_to?(:to_path)
+      return unless feature.is_a?(String)
+      if @load_path_size != $LOAD_PATH.size
+        @features.clear
+        @load_path_size = $LOAD_PATH.size
+      end
+      return if @features[feature]
+      @features[feature] = true
+      names = File.extname(feature) == ".rb" ? [feature] : [feature + ".rb", feature]
+      if feature =~ /\A(?:[a-z]:)?[\\\/]|\A\.\.?[\\\/]/i
+        names.each { |name| return if fetch(name) }
+      else
+        $LOAD_PATH.each do |dir|
+          names.each do |name|
+            path = File.join(dir.to_s, name)
+            return if fetch(path) || real_file?(path)
+          end
+        end
+      end
+    end
+
+    def real_file?(path)
+      File.ocra_lazy_original_file?(path)
+    end
+
+    def request(key)
+      @mutex.synchronize do
+        name = @lazy[key]
+        return true unless name
+        connect unless @pipe
+        @pipe.write(name + "\n")
+        if @pipe.read(1) == "1"
+          @lazy.delete(key)
+          true
+        else
+          false
+        end
+      end
+    end
+
+    # Connects to the stub. The pipe is briefly unavailable while the
+    # stub accepts another client.
+    def connect
+      attempts = 0
+      begin
+        @pipe = File.ocra_lazy_original_open(@pipe_name, "r+b")
+        @pipe.sync = true
+      rescue SystemCallError
+        attempts += 1
+        raise if attempts > 500
+        sleep 0.01
+        retry
+      end
+    end
+
+    def hook(klass, name, &fetcher)
+      return unless klass.method_defined?(name) || klass.private_method_defined?(name)
+      original = :"ocra_lazy_original_#{name}"
+      klass.send(:alias_method, original, name)
+      klass.send(:define_method, name) do |*args, &block|
+        fetcher.call(*args)
+        send(original, *args, &block)
+      end
+      klass.send(:ruby2_keywords, name) if klass.respond_to?(:ruby2_keywords, true)
+    end
+
+    def install
+      FILE_METHODS.each do |klass, names|
+        names.each { |name| hook(klass, name) { |path, *| fetch(path) } }
+      end
+      DIR_METHODS.each do |name|
+        hook(Dir.singleton_class, name) { |dir, *| fetch_tree(dir) }
+      end
+      hook(Dir.singleton_class, :glob) do |patterns, *rest|
+        options = rest.last.is_a?(Hash) ? rest.last : {}
+        Array(patterns).each { |pattern| fetch_glob(pattern, options[:base]) }
+      end
+      hook(Dir.singleton_class, :[]) do |*patterns|
+        patterns.flatten.each { |pattern| fetch_glob(pattern) if pattern.is_a?(String) }
+      end
+      hook(Kernel, :require) { |feature| fetch_feature(feature) }
+      hook(Kernel, :load) { |file, *| fetch_feature(file) }
+      Kernel.send(:private, :require, :load)
+      OcraPreload.install_require_relative
+    end
+  end
+end
+
+if ENV["OCRA_LAZY_PIPE"] && ENV["OCRA_EXECUTABLE"]
+  OcraLazyExtract.init(File.expand_path("..", __dir__), ENV["OCRA_EXECUTABLE"], ENV["OCRA_LAZY_PIPE"])
+  OcraLazyExtract.install
+end
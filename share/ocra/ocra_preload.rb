@@ -0,0 +1,71 @@
+# Code shared by the scripts that OCRA preloads through RUBYOPT
+# (ocra_lazy.rb, ocra_archive.rb and ocra_trace.rb). Each of them
+# requires this file from the same directory.
+module OcraPreload
+  TOC_SIGNATURE = "\x41\xb6\xba\x54".b
+  TOC_VERSION = 2
+  TOC_FLAG_LAZY = 1
+  TOC_FLAG_ARCHIVE = 8
+
+  class << self
+    # Yields the name, flags, codec, stream, offset and size of each
+    # file in the table of contents of an executable (the format is
+    # described in src/ocrapack.c). Names are as stored, with
+    # backslashes. Yields nothing when the executable has no table of
+    # contents, or one of another version.
+    def each_toc_entry(executable)
+      data = File.open(executable, "rb") do |f|
+        f.seek(-16, IO::SEEK_END)
+        offset, signature = f.read(8).unpack("Va4")
+        return unless signature == TOC_SIGNATURE
+        f.seek(offset)
+        f.read
+      end
+      version, streams, dirs, entries = data.unpack("V4")
+      return unless version == TOC_VERSION
+      pos = 28
+      varint = lambda do
+        value = shift = 0
+        begin
+          byte = data.getbyte(pos)
+          pos += 1
+          value |= (byte & 0x7f) << shift
+          shift += 7
+        end while byte >= 0x80
+        value
+      end
+      name = nil
+      next_name = lambda do
+        shared = varint.call
+        length = varint.call
+        name = name.to_s[0, shared] + data[pos, length]
+        pos += length
+        name
+      end
+      (2 * streams).times { varint.call }
+      dirs.times { next_name.call }
+      name = nil
+      entries.times do
+        next_name.call
+        flags = varint.call
+        codec, stream, offset, size = Array.new(4) { varint.call }
+        pos += 4
+        yield name, flags, codec, stream, offset, size
+      end
+    end
+
+    # Makes require_relative go through require, which the built-in
+    # one does not, so that the hooks the scripts install on require
+    # see it too. Only the first call defines it.
+    def install_require_relative
+      return if @require_relative_installed
+      @require_relative_installed = true
+      Kernel.send(:define_method, :require_relative) do |feature|
+        base = caller_locations(1, 1)[0].absolute_path
+        raise LoadError, "cannot infer basepath" unless base
+        require(File.expand_path(feature, File.dirname(base)))
+      end
+      Kernel.send(:private, :require_relative)
+    end
+  end
+end
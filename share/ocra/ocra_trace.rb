@@ -0,0 +1,123 @@
+# Require tracing for executables built with --trace.
+#
+# When OCRA_TRACE is set, this file records how long every require,
+# load and require_relative takes, and when the main script starts,
+# as Chrome trace events. The stub sets OCRA_TRACE_START to the
+# monotonic time (in microseconds) at which it started, so that the
+# events line up with its own. They are appended to the OCRA_TRACE
+# file when Ruby exits, and the stub adds them to its trace when the
+# program has ended.
+#
+# Without the stub, for example when preloading this file into a
+# system Ruby with "ruby -r./ocra_trace.rb script.rb", it writes a
+# complete trace file of its own instead.
+require_relative "ocra_preload"
+
+module OcraTrace
+  class << self
+    def init(path, start)
+      @path = path
+      @merge = !start.nil?
+      @start = start ? start.to_f : now
+      @events = []
+      @threads = {}
+      @mutex = Mutex.new
+      instant("preload")
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :float_microsecond)
+    end
+
+    def thread_id
+      @threads[Thread.current] ||= @threads.size + 1
+    end
+
+    def record(event)
+      @mutex.synchronize do
+        event["pid"] = Process.pid
+        event["tid"] = thread_id
+        @events << event
+      end
+    end
+
+    def instant(name)
+      record("ph" => "i", "s" => "p", "cat" => "ruby", "name" => name, "ts" => (now - @start).round(3))
+    end
+
+    # Records the time the block takes as a span named after the
+    # feature or file.
+    def span(category, name)
+      start = now
+      begin
+        yield
+      ensure
+        record("ph" => "X", "cat" => category, "name" => name.to_s,
+               "ts" => (start - @start).round(3), "dur" => (now - start).round(3))
+      end
+    end
+
+    def json(value)
+      case value
+      when Hash then "{" + value.map { |k, v| "#{json(k.to_s)}:#{json(v)}" }.join(",") + "}"
+      when String
+        string = value.dup.force_encoding("UTF-8").scrub("?")
+        "\"" + string.gsub(/["\\\x00-\x1f]/) { |c| c == "\"" || c == "\\" ? "\\" + c : format("\\u%04x", c.ord) } + "\""
+      else value.to_s
+      end
+    end
+
+    def write
+      metadata = { "ph" => "M", "name" => "process_name", "pid" => Process.pid, "args" => { "name" => "ruby" } }
+      events = [metadata] + @mutex.synchronize { @events.dup }
+      text = events.map { |event| ",\n" + json(event) }.join
+      if @merge
+        File.open(@path, "ab") { |f| f << text }
+      else
+        File.open(@path, "wb") { |f| f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" << text[2..-1] << "\n]}\n" }
+      end
+    rescue SystemCallError
+    end
+
+    # Records when the first line of the main script runs. Lines run
+    # by the preloaded scripts and by libraries come first, so whether
+    # a path is the main script is remembered rather than expanded on
+    # every line.
+    def watch_main
+      name = $0.dup
+      script = File.expand_path(name)
+      main = {}
+      trace = TracePoint.new(:line) do |tp|
+        path = tp.path
+        if main.fetch(path) { main[path] = path == name || File.expand_path(path) == script }
+          trace.disable
+          instant("main")
+        end
+      end
+      trace.enable
+    end
+
+    def hook(category, name)
+      original = :"ocra_trace_original_#{name}"
+      Kernel.send(:alias_method, original, name)
+      Kernel.send(:define_method, name) do |feature, *args, &block|
+        OcraTrace.span(category, feature) { send(original, feature, *args, &block) }
+      end
+      Kernel.send(:ruby2_keywords, name) if Kernel.respond_to?(:ruby2_keywords, true)
+      Kernel.send(:private, name)
+    end
+
+    def install
+      hook("require", :require)
+      hook("load", :load)
+      OcraPreload.install_require_relative
+      watch_main
+      at_exit { OcraTrace.write }
+    end
+  end
+end
+
+if ENV["OCRA_TRACE"]
+  OcraTrace.init(ENV["OCRA_TRACE"], ENV["OCRA_TRACE_START"])
+  OcraTrace.install
+end
@@ -0,0 +1,353 @@
+/*
+  OCRA Codec Benchmark
+
+  Compares the codecs that ocrapack can compress a payload with. The
+  given files and directories (for example Ruby's library directory)
+  are laid out as OP_CREATE_FILE records, the way ocrapack writes
+  them, and split into blocks. Each codec then compresses the blocks
+  and decodes them again, and the compressed size and decoding speed
+  are printed. Decoding runs on one thread, so the speeds are per
+  core; the stub decodes blocks on one thread per processor.
+
+  Usage: codecbench [--block-size N] [--runs N] [--bcj] PATH...
+
+  The LZMA and LZ4 settings are those of ocrapack. Decoding is timed
+  RUNS times (default 5) and the fastest run is reported. The "none"
+  codec copies each block, which is the least any codec can cost.
+
+  With --bcj, executables and shared libraries (.exe, .dll and .so
+  files with a PE or ELF header) go through the x86 branch converter
+  first, as ocrapack does for codefile records. Comparing the sizes
+  with those of a run without --bcj shows what the filter saves. The
+  time the stub takes to convert the code back is not included.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <LzmaEnc.h>
+#include <LzmaDec.h>
+#include <Lz4Enc.h>
+#include <Lz4Dec.h>
+#include <Bra.h>
+
+#include "ocratools.h"
+
+#define OP_CREATE_FILE 2
+#define OP_CREATE_FILE_X86 12
+
+/* As in ocrapack. */
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define LZ4_DEPTH 16
+
+/** A block of the payload, with its compressed form. */
+typedef struct
+{
+   ISeqOutStream Stream; /* Writes to Out; must be the first member. */
+   Buffer In;
+   Buffer Out;
+} Block;
+
+typedef struct
+{
+   const char* Name;
+   void (*Compress)(Block* b);
+   int (*Decode)(Block* b, unsigned char* Dest);
+} Codec;
+
+Block* Blocks = NULL;
+int BlockCount = 0;
+unsigned long BlockSize = DEFAULT_BLOCK_SIZE;
+int FileCount = 0;
+int Bcj = 0;
+int CodeFileCount = 0;
+unsigned long long CodeFileSize = 0;
+
+static size_t BlockStreamWrite(void* p, const void* Data, size_t Size)
+{
+   BufferAppend(&((Block*)p)->Out, Data, Size);
+   return Size;
+}
+
+/**
+   Payload
+*/
+
+Block* CurrentBlock(void)
+{
+   if (BlockCount == 0 || Blocks[BlockCount - 1].In.Size >= BlockSize)
+   {
+      Blocks = (Block*)realloc(Blocks, (BlockCount + 1) * sizeof(Block));
+      if (Blocks == NULL)
+         Fatal("Out of memory");
+      memset(&Blocks[BlockCount], 0, sizeof(Block));
+      Blocks[BlockCount].Stream.Write = BlockStreamWrite;
+      BlockCount++;
+   }
+   return &Blocks[BlockCount - 1];
+}
+
+/** Returns true if a file looks like x86 code to filter with --bcj. */
+int IsCodeFile(const char* Path, FILE* f)
+{
+   const char* Extension = strrchr(Path, '.');
+   unsigned char Header[4] = { 0 };
+   size_t n;
+
+   if (Extension == NULL || (strcmp(Extension, ".exe") != 0 &&
+                             strcmp(Extension, ".dll") != 0 &&
+                             strcmp(Extension, ".so") != 0))
+      return 0;
+   n = fread(Header, 1, sizeof(Header), f);
+   fseek(f, 0, SEEK_SET);
+   return n == sizeof(Header) && (memcmp(Header, "MZ", 2) == 0 || memcmp(Header, "\x7f" "ELF", 4) == 0);
+}
+
+/** Adds a file as an OP_CREATE_FILE or OP_CREATE_FILE_X86 record. */
+void AddFile(const char* Path, const char* Name)
+{
+   FILE* f = fopen(Path, "rb");
+   Block* b;
+   unsigned char Data[65536];
+   size_t n, Start;
+   long Size;
+   int X86;
+
+   if (f == NULL)
+      Fatal("Failed to open %s", Path);
+   fseek(f, 0, SEEK_END);
+   Size = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   X86 = Bcj && IsCodeFile(Path, f);
+
+   b = CurrentBlock();
+   BufferAppendUInt32(&b->In, X86 ? OP_CREATE_FILE_X86 : OP_CREATE_FILE);
+   BufferAppend(&b->In, Name, strlen(Name) + 1);
+   BufferAppendUInt32(&b->In, (unsigned int)Size);
+   Start = b->In.Size;
+   while ((n = fread(Data, 1, sizeof(Data), f)) > 0)
+      BufferAppend(&b->In, Data, n);
+   fclose(f);
+   if (X86)
+   {
+      UInt32 State;
+      x86_Convert_Init(State);
+      x86_Convert(b->In.Data + Start, b->In.Size - Start, 0, &State, 1);
+      CodeFileCount++;
+      CodeFileSize += b->In.Size - Start;
+   }
+   FileCount++;
+}
+
+/** Adds a file, or the files in a directory and its subdirectories. */
+void AddPath(const char* Path, const char* Name)
+{
+   struct stat st;
+   DIR* d;
+   struct dirent* e;
+
+   if (stat(Path, &st) != 0)
+      Fatal("Not found: %s", Path);
+   if (!S_ISDIR(st.st_mode))
+   {
+      AddFile(Path, Name);
+      return;
+   }
+
+   d = opendir(Path);
+   if (d == NULL)
+      Fatal("Failed to read %s", Path);
+   while ((e = readdir(d)) != NULL)
+   {
+      char* ChildPath;
+      char* ChildName;
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+         continue;
+      ChildPath = (char*)MustAlloc(strlen(Path) + strlen(e->d_name) + 2);
+      ChildName = (char*)MustAlloc(strlen(Name) + strlen(e->d_name) + 2);
+      sprintf(ChildPath, "%s/%s", Path, e->d_name);
+      sprintf(ChildName, "%s%s%s", Name, *Name ? "\\" : "", e->d_name);
+      AddPath(ChildPath, ChildName);
+      free(ChildPath);
+      free(ChildName);
+   }
+   closedir(d);
+}
+
+/**
+   Codecs. Blocks have the headers that ocrapack writes: the LZMA
+   properties and the uncompressed size, or just the size for LZ4.
+*/
+
+void AppendUnpackSize(Block* b)
+{
+   unsigned char Size[8];
+   int i;
+   for (i = 0; i < 8; i++)
+      Size[i] = (unsigned char)((unsigned long long)b->In.Size >> (8 * i));
+   BufferAppend(&b->Out, Size, sizeof(Size));
+}
+
+void CompressNone(Block* b)
+{
+   BufferAppend(&b->Out, b->In.Data, b->In.Size);
+}
+
+int DecodeNone(Block* b, unsigned char* Dest)
+{
+   memcpy(Dest, b->Out.Data, b->Out.Size);
+   return 1;
+}
+
+void CompressLzma(Block* b)
+{
+   CLzmaEncProps Props;
+   CLzmaEnc* Enc;
+   unsigned char Properties[LZMA_PROPS_SIZE];
+
+   LzmaEncProps_Init(&Props);
+   Props.reduceSize = b->In.Size;
+   Enc = LzmaEnc_Create(&Props, &b->Stream, &Alloc);
+   if (Enc == NULL)
+      Fatal("Out of memory");
+   LzmaEnc_WriteProperties(Enc, Properties);
+   BufferAppend(&b->Out, Properties, sizeof(Properties));
+   AppendUnpackSize(b);
+   if (LzmaEnc_Write(Enc, b->In.Data, b->In.Size) != SZ_OK || LzmaEnc_Finish(Enc) != SZ_OK)
+      Fatal("LZMA compression failed");
+   LzmaEnc_Destroy(Enc);
+}
+
+int DecodeLzma(Block* b, unsigned char* Dest)
+{
+   SizeT DestLen = b->In.Size;
+   SizeT SrcLen = b->Out.Size - LZMA_PROPS_SIZE - 8;
+   ELzmaStatus Status;
+   SRes Result = LzmaDecode(Dest, &DestLen, b->Out.Data + LZMA_PROPS_SIZE + 8, &SrcLen,
+                            b->Out.Data, LZMA_PROPS_SIZE, LZMA_FINISH_END, &Status, &Alloc);
+   return Result == SZ_OK && DestLen == b->In.Size;
+}
+
+void CompressLz4(Block* b)
+{
+   unsigned char* Dest = (unsigned char*)MustAlloc(Lz4_CompressBound(b->In.Size));
+   size_t Size;
+   AppendUnpackSize(b);
+   Size = Lz4_Compress(Dest, b->In.Data, b->In.Size, LZ4_DEPTH);
+   if (Size == 0)
+      Fatal("Out of memory");
+   BufferAppend(&b->Out, Dest, Size);
+   free(Dest);
+}
+
+int DecodeLz4(Block* b, unsigned char* Dest)
+{
+   return Lz4_Decode(Dest, b->In.Size, b->Out.Data + 8, b->Out.Size - 8);
+}
+
+Codec Codecs[] =
+{
+   { "none", CompressNone, DecodeNone },
+   { "lzma", CompressLzma, DecodeLzma },
+   { "lz4", CompressLz4, DecodeLz4 },
+};
+
+#define CODEC_COUNT (int)(sizeof(Codecs) / sizeof(Codecs[0]))
+
+void Benchmark(Codec* c, int Runs, unsigned long long TotalSize, unsigned char* Dest)
+{
+   unsigned long long OutSize = 0;
+   double Start, CompressTime, DecodeTime = 0;
+   int i, Run;
+
+   Start = Now();
+   for (i = 0; i < BlockCount; i++)
+   {
+      Blocks[i].Out.Size = 0;
+      c->Compress(&Blocks[i]);
+      OutSize += Blocks[i].Out.Size;
+   }
+   CompressTime = Now() - Start;
+
+   for (Run = 0; Run < Runs; Run++)
+   {
+      double Time;
+      Start = Now();
+      for (i = 0; i < BlockCount; i++)
+      {
+         if (!c->Decode(&Blocks[i], Dest))
+            Fatal("Decoding failed with codec %s", c->Name);
+      }
+      Time = Now() - Start;
+      if (Run == 0 || Time < DecodeTime)
+         DecodeTime = Time;
+   }
+
+   for (i = 0; i < BlockCount; i++)
+   {
+      if (!c->Decode(&Blocks[i], Dest) || memcmp(Dest, Blocks[i].In.Data, Blocks[i].In.Size) != 0)
+         Fatal("Decoded data differs with codec %s", c->Name);
+   }
+
+   printf("%-6s %12llu %7.1f%% %10.1f %10.1f %9.1f\n", c->Name, OutSize,
+          100.0 * OutSize / TotalSize, CompressTime * 1000, DecodeTime * 1000,
+          DecodeTime > 0 ? TotalSize / DecodeTime / (1024 * 1024) : 0);
+}
+
+int main(int argc, char** argv)
+{
+   unsigned long long TotalSize = 0;
+   size_t LargestBlock = 0;
+   unsigned char* Dest;
+   int Runs = 5;
+   int i, PathCount = 0;
+
+   ToolName = "codecbench";
+   for (i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc)
+         BlockSize = strtoul(argv[++i], NULL, 10);
+      else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+         Runs = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--bcj") == 0)
+         Bcj = 1;
+      else if (argv[i][0] == '-')
+         Fatal("Unknown option: %s", argv[i]);
+      else
+      {
+         const char* Name = strrchr(argv[i], '/');
+         AddPath(argv[i], Name ? Name + 1 : argv[i]);
+         PathCount++;
+      }
+   }
+   if (PathCount == 0 || BlockSize == 0 || Runs <= 0)
+   {
+      fprintf(stderr, "Usage: codecbench [--block-size N] [--runs N] [--bcj] PATH...\n");
+      return 1;
+   }
+
+   for (i = 0; i < BlockCount; i++)
+   {
+      TotalSize += Blocks[i].In.Size;
+      if (Blocks[i].In.Size > LargestBlock)
+         LargestBlock = Blocks[i].In.Size;
+   }
+   if (TotalSize == 0)
+      Fatal("No data to compress");
+   Dest = (unsigned char*)MustAlloc(LargestBlock);
+
+   printf("%d files, %llu bytes in %d blocks, best of %d runs\n", FileCount, TotalSize, BlockCount, Runs);
+   if (Bcj)
+      printf("%d files of x86 code (%llu bytes) converted\n", CodeFileCount, CodeFileSize);
+   printf("\n");
+   printf("%-6s %12s %8s %10s %10s %9s\n", "codec", "size", "ratio", "pack ms", "decode ms", "MB/s");
+   for (i = 0; i < CODEC_COUNT; i++)
+      Benchmark(&Codecs[i], Runs, TotalSize, Dest);
+
+   free(Dest);
+   return 0;
+}
@@ -0,0 +1,96 @@
+/* Lz4Dec.c -- LZ4 block decoder
+Bounds checked, with fast paths for short literal runs and matches
+that do not overlap their copy : Public domain */
+
+#include "Lz4Dec.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define RUN_MASK 15
+#define COPY_SLACK 16
+
+/* Reads the extra bytes of a length that does not fit in its nibble. */
+static int ReadLength(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+  unsigned b;
+  do
+  {
+    if (*ip >= iend)
+      return 0;
+    b = *(*ip)++;
+    *len += b;
+  }
+  while (b == 255);
+  return 1;
+}
+
+int Lz4_Decode(unsigned char *dest, size_t destSize, const unsigned char *src, size_t srcSize)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + srcSize;
+  unsigned char *op = dest;
+  unsigned char *oend = dest + destSize;
+
+  for (;;)
+  {
+    unsigned token;
+    size_t len, offset;
+    const unsigned char *match;
+
+    if (ip >= iend)
+      return 0;
+    token = *ip++;
+
+    /* Literals */
+    len = token >> 4;
+    if (len == RUN_MASK && !ReadLength(&ip, iend, &len))
+      return 0;
+    if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+      return 0;
+    if (len <= COPY_SLACK && iend - ip >= COPY_SLACK && oend - op >= COPY_SLACK)
+      memcpy(op, ip, COPY_SLACK);
+    else
+      memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    /* The last sequence has no match. */
+    if (ip == iend)
+      return op == oend;
+
+    /* Match */
+    if (iend - ip < 2)
+      return 0;
+    offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dest))
+      return 0;
+    len = token & RUN_MASK;
+    if (len == RUN_MASK && !ReadLength(&ip, iend, &len))
+      return 0;
+    len += MIN_MATCH;
+    if ((size_t)(oend - op) < len)
+      return 0;
+    match = op - offset;
+    if (offset >= 8 && (size_t)(oend - op) >= len + 8)
+    {
+      /* Whole words never overlap their source here, and may run
+         past the end of the match into the slack. */
+      unsigned char *end = op + len;
+      do
+      {
+        memcpy(op, match, 8);
+        op += 8;
+        match += 8;
+      }
+      while (op < end);
+      op = end;
+    }
+    else
+    {
+      while (len-- > 0)
+        *op++ = *match++;
+    }
+  }
+}
@@ -0,0 +1,17 @@
+/* Lz4Dec.h -- LZ4 block decoder
+Reads the block format (without frame) written by Lz4Enc : Public domain */
+
+#ifndef __LZ4DEC_H
+#define __LZ4DEC_H
+
+#include <stddef.h>
+
+/* Lz4_Decode - decodes a whole block. The size of the decoded data
+   must be known, as the block format does not store it.
+Returns:
+  1 - OK, exactly destSize bytes were decoded
+  0 - the block is corrupt or does not decode to destSize bytes
+*/
+int Lz4_Decode(unsigned char *dest, size_t destSize, const unsigned char *src, size_t srcSize);
+
+#endif
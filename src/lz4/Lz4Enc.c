@@ -0,0 +1,142 @@
+/* Lz4Enc.c -- LZ4 block encoder
+Hash chain match finder with greedy parsing : Public domain */
+
+#include "Lz4Enc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define RUN_MASK 15
+/* The last match must start at least MF_LIMIT bytes before the end of
+   the block, and the last LAST_LITERALS bytes are always literals. */
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_DISTANCE 65535
+
+#define HASH_BITS 16
+#define HASH_SIZE (1 << HASH_BITS)
+#define WINDOW_SIZE 65536
+
+static unsigned Hash4(const unsigned char *p)
+{
+  unsigned long v = (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+      ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+  return (unsigned)(((v * 2654435761UL) & 0xFFFFFFFF) >> (32 - HASH_BITS));
+}
+
+static unsigned char *WriteLength(unsigned char *op, size_t len)
+{
+  while (len >= 255)
+  {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+/* Writes literals followed by a match, or only literals if matchLen
+   is 0 (the last sequence). */
+static unsigned char *WriteSequence(unsigned char *op, const unsigned char *literals, size_t litLen,
+    size_t offset, size_t matchLen)
+{
+  unsigned char *token = op++;
+  *token = (unsigned char)((litLen >= RUN_MASK ? RUN_MASK : litLen) << 4);
+  if (litLen >= RUN_MASK)
+    op = WriteLength(op, litLen - RUN_MASK);
+  memcpy(op, literals, litLen);
+  op += litLen;
+  if (matchLen > 0)
+  {
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    matchLen -= MIN_MATCH;
+    *token |= (unsigned char)(matchLen >= RUN_MASK ? RUN_MASK : matchLen);
+    if (matchLen >= RUN_MASK)
+      op = WriteLength(op, matchLen - RUN_MASK);
+  }
+  return op;
+}
+
+size_t Lz4_CompressBound(size_t srcSize)
+{
+  return srcSize + srcSize / 255 + 16;
+}
+
+size_t Lz4_Compress(unsigned char *dest, const unsigned char *src, size_t srcSize, unsigned depth)
+{
+  unsigned char *op = dest;
+  size_t anchor = 0;
+
+  if (srcSize > MF_LIMIT)
+  {
+    /* Positions are stored plus one, so that 0 means none. */
+    size_t *head = (size_t *)calloc(HASH_SIZE, sizeof(size_t));
+    size_t *chain = (size_t *)malloc(WINDOW_SIZE * sizeof(size_t));
+    size_t matchLimit = srcSize - LAST_LITERALS;
+    size_t pos = 0;
+    if (head == NULL || chain == NULL)
+    {
+      free(head);
+      free(chain);
+      return 0;
+    }
+
+    while (pos + MF_LIMIT <= srcSize)
+    {
+      unsigned h = Hash4(src + pos);
+      size_t candidate = head[h];
+      size_t bestLen = 0, bestOffset = 0;
+      unsigned tries = depth;
+
+      while (candidate != 0 && tries-- > 0)
+      {
+        size_t c = candidate - 1;
+        if (pos - c > MAX_DISTANCE)
+          break;
+        if (src[c + bestLen] == src[pos + bestLen])
+        {
+          size_t len = 0;
+          while (pos + len < matchLimit && src[c + len] == src[pos + len])
+            len++;
+          if (len > bestLen)
+          {
+            bestLen = len;
+            bestOffset = pos - c;
+            if (pos + len == matchLimit)
+              break;
+          }
+        }
+        candidate = chain[c % WINDOW_SIZE];
+      }
+
+      chain[pos % WINDOW_SIZE] = head[h];
+      head[h] = pos + 1;
+
+      if (bestLen < MIN_MATCH)
+      {
+        pos++;
+        continue;
+      }
+
+      op = WriteSequence(op, src + anchor, pos - anchor, bestOffset, bestLen);
+      anchor = pos + bestLen;
+      for (pos++; pos < anchor; pos++)
+      {
+        if (pos + MIN_MATCH <= srcSize)
+        {
+          h = Hash4(src + pos);
+          chain[pos % WINDOW_SIZE] = head[h];
+          head[h] = pos + 1;
+        }
+      }
+    }
+
+    free(head);
+    free(chain);
+  }
+
+  op = WriteSequence(op, src + anchor, srcSize - anchor, 0, 0);
+  return (size_t)(op - dest);
+}
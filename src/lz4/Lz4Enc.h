@@ -0,0 +1,22 @@
+/* Lz4Enc.h -- LZ4 block encoder
+Writes the LZ4 block format read by Lz4Dec : Public domain */
+
+#ifndef __LZ4ENC_H
+#define __LZ4ENC_H
+
+#include <stddef.h>
+
+/* Lz4_CompressBound - returns the largest compressed size of srcSize
+   bytes of input. */
+size_t Lz4_CompressBound(size_t srcSize);
+
+/* Lz4_Compress - compresses src into dest, which must hold at least
+   Lz4_CompressBound(srcSize) bytes. depth is the number of earlier
+   positions with the same hash that are tried for each match; higher
+   values compress better and more slowly.
+Returns:
+  the compressed size, or 0 if there is not enough memory
+*/
+size_t Lz4_Compress(unsigned char *dest, const unsigned char *src, size_t srcSize, unsigned depth);
+
+#endif
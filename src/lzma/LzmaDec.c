@@ -24,6 +24,16 @@
   { UPDATE_1(p); i = (i + i) + 1; A1; }
 #define GET_BIT(p, i) GET_BIT2(p, i, ; , ;)
 
+/* Decodes a bit without branching on it. Literal bits are close to
+   random, so a branch on them is mispredicted about half of the time.
+   The result is the same as that of GET_BIT. */
+#define GET_BIT_NB(p, i) \
+  { UInt32 mask; ttt = *(p); NORMALIZE; bound = (range >> kNumBitModelTotalBits) * ttt; \
+  mask = (UInt32)0 - (UInt32)(code >= bound); \
+  range = bound ^ ((bound ^ (range - bound)) & mask); code -= bound & mask; \
+  *(p) = (CLzmaProb)(ttt + (((kBitModelTotal - ttt) >> kNumMoveBits) & ~mask) - ((ttt >> kNumMoveBits) & mask)); \
+  i = (i + i) - mask; }
+
 #define TREE_GET_BIT(probs, i) { GET_BIT((probs + i), i); }
 #define TREE_DECODE(probs, limit, i) \
   { i = 1; do { TREE_GET_BIT(probs, i); } while (i < limit); i -= limit; }
@@ -32,6 +42,7 @@
 
 #ifdef _LZMA_SIZE_OPT
 #define TREE_6_DECODE(probs, i) TREE_DECODE(probs, (1 << 6), i)
+#define TREE_3_DECODE(probs, i) TREE_DECODE(probs, (1 << 3), i)
 #else
 #define TREE_6_DECODE(probs, i) \
   { i = 1; \
@@ -42,8 +53,19 @@
   TREE_GET_BIT(probs, i); \
   TREE_GET_BIT(probs, i); \
   i -= 0x40; }
+#define TREE_3_DECODE(probs, i) \
+  { i = 1; \
+  TREE_GET_BIT(probs, i); \
+  TREE_GET_BIT(probs, i); \
+  TREE_GET_BIT(probs, i); \
+  i -= 0x8; }
 #endif
 
+#define LIT_GET_BIT(probs, i) GET_BIT_NB((probs + i), i)
+#define MATCHED_LIT_GET_BIT(probs, i) \
+  { unsigned bit; CLzmaProb *probLit; matchByte <<= 1; bit = (matchByte & offs); \
+  probLit = probs + offs + bit + i; GET_BIT2(probLit, i, offs &= ~bit, offs &= bit) }
+
 #define NORMALIZE_CHECK if (range < kTopValue) { if (buf >= bufLimit) return DUMMY_ERROR; range <<= 8; code = (code << 8) | (*buf++); }
 
 #define IF_BIT_0_CHECK(p) ttt = *(p); NORMALIZE_CHECK; bound = (range >> kNumBitModelTotalBits) * ttt; if (code < bound)
@@ -176,23 +198,36 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
       if (state < kNumLitStates)
       {
         symbol = 1;
-        do { GET_BIT(prob + symbol, symbol) } while (symbol < 0x100);
+        #ifdef _LZMA_SIZE_OPT
+        do { LIT_GET_BIT(prob, symbol) } while (symbol < 0x100);
+        #else
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        LIT_GET_BIT(prob, symbol)
+        #endif
       }
       else
       {
         unsigned matchByte = p->dic[(dicPos - rep0) + ((dicPos < rep0) ? dicBufSize : 0)];
         unsigned offs = 0x100;
         symbol = 1;
-        do
-        {
-          unsigned bit;
-          CLzmaProb *probLit;
-          matchByte <<= 1;
-          bit = (matchByte & offs);
-          probLit = prob + offs + bit + symbol;
-          GET_BIT2(probLit, symbol, offs &= ~bit, offs &= bit)
-        }
-        while (symbol < 0x100);
+        #ifdef _LZMA_SIZE_OPT
+        do { MATCHED_LIT_GET_BIT(prob, symbol) } while (symbol < 0x100);
+        #else
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        MATCHED_LIT_GET_BIT(prob, symbol)
+        #endif
       }
       dic[dicPos++] = (Byte)symbol;
       processedPos++;
@@ -266,14 +301,12 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
         prob = probs + RepLenCoder;
       }
       {
-        unsigned limit, offset;
         CLzmaProb *probLen = prob + LenChoice;
         IF_BIT_0(probLen)
         {
           UPDATE_0(probLen);
           probLen = prob + LenLow + (posState << kLenNumLowBits);
-          offset = 0;
-          limit = (1 << kLenNumLowBits);
+          TREE_3_DECODE(probLen, len);
         }
         else
         {
@@ -283,19 +316,17 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
           {
             UPDATE_0(probLen);
             probLen = prob + LenMid + (posState << kLenNumMidBits);
-            offset = kLenNumLowSymbols;
-            limit = (1 << kLenNumMidBits);
+            TREE_3_DECODE(probLen, len);
+            len += kLenNumLowSymbols;
           }
           else
           {
             UPDATE_1(probLen);
             probLen = prob + LenHigh;
-            offset = kLenNumLowSymbols + kLenNumMidSymbols;
-            limit = (1 << kLenNumHighBits);
+            TREE_DECODE(probLen, (1 << kLenNumHighBits), len);
+            len += kLenNumLowSymbols + kLenNumMidSymbols;
           }
         }
-        TREE_DECODE(probLen, limit, len);
-        len += offset;
       }
 
       if (state >= kNumStates)
@@ -399,9 +430,16 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
           ptrdiff_t src = (ptrdiff_t)pos - (ptrdiff_t)dicPos;
           const Byte *lim = dest + curLen;
           dicPos += curLen;
-          do
+          /* Copy 8 bytes at a time when the source and destination of
+             each copy do not overlap. */
+          if (src >= 8 || src <= -8)
+            for (; lim - dest >= 8; dest += 8)
+              memcpy(dest, dest + src, 8);
+          while (dest != lim)
+          {
             *(dest) = (Byte)*(dest + src);
-          while (++dest != lim);
+            dest++;
+          }
         }
         else
         {
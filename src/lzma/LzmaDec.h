@@ -8,7 +8,8 @@
 
 /* #define _LZMA_PROB32 */
 /* _LZMA_PROB32 can increase the speed on some CPUs,
-   but memory usage for CLzmaDec::probs will be doubled in that case */
+   but memory usage for CLzmaDec::probs will be doubled in that case.
+   Build with make LZMA_PROB=32 to enable it. */
 
 #ifdef _LZMA_PROB32
 #define CLzmaProb UInt32
@@ -0,0 +1,726 @@
+/* LzmaEnc.c -- LZMA Encoder
+Hash chain match finder with one step of lazy matching : Public domain */
+
+#include "LzmaEnc.h"
+
+#include <string.h>
+
+#define kNumTopBits 24
+#define kTopValue ((UInt32)1 << kNumTopBits)
+
+#define kNumBitModelTotalBits 11
+#define kBitModelTotal (1 << kNumBitModelTotalBits)
+#define kNumMoveBits 5
+#define kProbInitValue (kBitModelTotal >> 1)
+
+#define LZMA_LC 3
+#define LZMA_PB 2
+#define kNumPosStates (1 << LZMA_PB)
+
+#define kNumStates 12
+#define kNumLitStates 7
+#define kNumReps 4
+
+#define kNumLenToPosStates 4
+#define kNumPosSlotBits 6
+#define kStartPosModelIndex 4
+#define kEndPosModelIndex 14
+#define kNumFullDistances (1 << (kEndPosModelIndex >> 1))
+#define kNumAlignBits 4
+#define kAlignTableSize (1 << kNumAlignBits)
+
+#define kLenNumLowBits 3
+#define kLenNumLowSymbols (1 << kLenNumLowBits)
+#define kLenNumMidBits 3
+#define kLenNumMidSymbols (1 << kLenNumMidBits)
+#define kLenNumHighBits 8
+#define kLenNumHighSymbols (1 << kLenNumHighBits)
+
+#define kMatchMinLen 2
+#define kMatchMaxLen (kMatchMinLen + kLenNumLowSymbols + kLenNumMidSymbols + kLenNumHighSymbols - 1)
+
+/* Input needed beyond the current position before it is encoded, so
+   that matches at the next position can reach kMatchMaxLen. */
+#define kLookAhead (kMatchMaxLen + 2)
+
+#define kBufExtra ((UInt32)1 << 21)
+#define kRcBufSize ((size_t)1 << 16)
+#define kMaxInSize ((UInt32)0xFFFFFFFF - kBufExtra)
+
+typedef UInt16 CLzmaProb;
+
+typedef struct
+{
+  UInt64 low;
+  UInt32 range;
+  Byte cache;
+  UInt64 cacheSize;
+  Byte *buf;
+  Byte *bufLim;
+  Byte *bufBase;
+  ISeqOutStream *outStream;
+  UInt64 processed;
+  SRes res;
+} CRangeEnc;
+
+typedef struct
+{
+  CLzmaProb choice;
+  CLzmaProb choice2;
+  CLzmaProb low[kNumPosStates][kLenNumLowSymbols];
+  CLzmaProb mid[kNumPosStates][kLenNumMidSymbols];
+  CLzmaProb high[kLenNumHighSymbols];
+} CLenEnc;
+
+struct _CLzmaEnc
+{
+  CRangeEnc rc;
+
+  CLzmaProb isMatch[kNumStates][kNumPosStates];
+  CLzmaProb isRep[kNumStates];
+  CLzmaProb isRepG0[kNumStates];
+  CLzmaProb isRepG1[kNumStates];
+  CLzmaProb isRepG2[kNumStates];
+  CLzmaProb isRep0Long[kNumStates][kNumPosStates];
+  CLzmaProb posSlotEncoder[kNumLenToPosStates][1 << kNumPosSlotBits];
+  CLzmaProb posEncoders[kNumFullDistances - kEndPosModelIndex];
+  CLzmaProb posAlignEncoder[kAlignTableSize];
+  CLzmaProb litProbs[0x300 << LZMA_LC];
+  CLenEnc lenEnc;
+  CLenEnc repLenEnc;
+
+  unsigned state;
+  UInt32 reps[kNumReps];
+
+  UInt32 dictSize;
+  unsigned depth;
+  unsigned niceLen;
+
+  /* Positions are counted from the start of the stream. buf holds the
+     input from bufBase to end; at least dictSize bytes before pos are
+     kept so that every match candidate is still in the buffer. */
+  Byte *buf;
+  UInt32 bufSize;
+  UInt32 bufBase;
+  UInt32 pos;
+  UInt32 end;
+
+  /* Hash heads and chain links store position + 1, so 0 is empty.
+     hashPos is the next position inserted into the hash chains. */
+  UInt32 *hash;
+  UInt32 *chain;
+  unsigned hashShift;
+  UInt32 chainMask;
+  UInt32 hashPos;
+
+  /* Match found at pos while looking one position ahead. */
+  Bool haveNext;
+  unsigned nextLen;
+  UInt32 nextDist;
+
+  ISzAlloc *alloc;
+};
+
+void LzmaEncProps_Init(CLzmaEncProps *p)
+{
+  p->dictSize = (UInt32)1 << 24;
+  p->depth = 32;
+  p->niceLen = 64;
+  p->reduceSize = (UInt64)(Int64)-1;
+}
+
+/* ---------- Range Encoder ---------- */
+
+static void RangeEnc_FlushData(CRangeEnc *p)
+{
+  size_t num;
+  if (p->res != SZ_OK)
+  {
+    p->buf = p->bufBase;
+    return;
+  }
+  num = p->buf - p->bufBase;
+  if (num != p->outStream->Write(p->outStream, p->bufBase, num))
+    p->res = SZ_ERROR_WRITE;
+  p->processed += num;
+  p->buf = p->bufBase;
+}
+
+static void RangeEnc_ShiftLow(CRangeEnc *p)
+{
+  if ((UInt32)p->low < (UInt32)0xFF000000 || (int)(p->low >> 32) != 0)
+  {
+    Byte temp = p->cache;
+    do
+    {
+      Byte *buf = p->buf;
+      *buf++ = (Byte)(temp + (Byte)(p->low >> 32));
+      p->buf = buf;
+      if (buf == p->bufLim)
+        RangeEnc_FlushData(p);
+      temp = 0xFF;
+    }
+    while (--p->cacheSize != 0);
+    p->cache = (Byte)((UInt32)p->low >> 24);
+  }
+  p->cacheSize++;
+  p->low = (UInt32)p->low << 8;
+}
+
+static void RangeEnc_Init(CRangeEnc *p)
+{
+  p->low = 0;
+  p->range = 0xFFFFFFFF;
+  p->cache = 0;
+  p->cacheSize = 1;
+  p->buf = p->bufBase;
+  p->processed = 0;
+  p->res = SZ_OK;
+}
+
+static void RangeEnc_FlushStream(CRangeEnc *p)
+{
+  int i;
+  for (i = 0; i < 5; i++)
+    RangeEnc_ShiftLow(p);
+  RangeEnc_FlushData(p);
+}
+
+static void RangeEnc_EncodeBit(CRangeEnc *p, CLzmaProb *prob, UInt32 symbol)
+{
+  UInt32 ttt = *prob;
+  UInt32 newBound = (p->range >> kNumBitModelTotalBits) * ttt;
+  if (symbol == 0)
+  {
+    p->range = newBound;
+    ttt += (kBitModelTotal - ttt) >> kNumMoveBits;
+  }
+  else
+  {
+    p->low += newBound;
+    p->range -= newBound;
+    ttt -= ttt >> kNumMoveBits;
+  }
+  *prob = (CLzmaProb)ttt;
+  if (p->range < kTopValue)
+  {
+    p->range <<= 8;
+    RangeEnc_ShiftLow(p);
+  }
+}
+
+static void RangeEnc_EncodeDirectBits(CRangeEnc *p, UInt32 value, unsigned numBits)
+{
+  do
+  {
+    p->range >>= 1;
+    p->low += p->range & (0 - ((value >> --numBits) & 1));
+    if (p->range < kTopValue)
+    {
+      p->range <<= 8;
+      RangeEnc_ShiftLow(p);
+    }
+  }
+  while (numBits != 0);
+}
+
+static void RcTree_Encode(CRangeEnc *rc, CLzmaProb *probs, unsigned numBitLevels, UInt32 symbol)
+{
+  UInt32 m = 1;
+  do
+  {
+    UInt32 bit;
+    numBitLevels--;
+    bit = (symbol >> numBitLevels) & 1;
+    RangeEnc_EncodeBit(rc, probs + m, bit);
+    m = (m << 1) | bit;
+  }
+  while (numBitLevels != 0);
+}
+
+static void RcTree_ReverseEncode(CRangeEnc *rc, CLzmaProb *probs, unsigned numBitLevels, UInt32 symbol)
+{
+  UInt32 m = 1;
+  do
+  {
+    UInt32 bit = symbol & 1;
+    RangeEnc_EncodeBit(rc, probs + m, bit);
+    m = (m << 1) | bit;
+    symbol >>= 1;
+  }
+  while (--numBitLevels != 0);
+}
+
+/* ---------- Symbol Coding ---------- */
+
+static void LitEnc_Encode(CRangeEnc *p, CLzmaProb *probs, UInt32 symbol)
+{
+  symbol |= 0x100;
+  do
+  {
+    RangeEnc_EncodeBit(p, probs + (symbol >> 8), (symbol >> 7) & 1);
+    symbol <<= 1;
+  }
+  while (symbol < 0x10000);
+}
+
+static void LitEnc_EncodeMatched(CRangeEnc *p, CLzmaProb *probs, UInt32 symbol, UInt32 matchByte)
+{
+  UInt32 offs = 0x100;
+  symbol |= 0x100;
+  do
+  {
+    matchByte <<= 1;
+    RangeEnc_EncodeBit(p, probs + (offs + (matchByte & offs) + (symbol >> 8)), (symbol >> 7) & 1);
+    symbol <<= 1;
+    offs &= ~(matchByte ^ symbol);
+  }
+  while (symbol < 0x10000);
+}
+
+static void LenEnc_Encode(CLenEnc *p, CRangeEnc *rc, UInt32 symbol, unsigned posState)
+{
+  if (symbol < kLenNumLowSymbols)
+  {
+    RangeEnc_EncodeBit(rc, &p->choice, 0);
+    RcTree_Encode(rc, p->low[posState], kLenNumLowBits, symbol);
+  }
+  else
+  {
+    RangeEnc_EncodeBit(rc, &p->choice, 1);
+    if (symbol < kLenNumLowSymbols + kLenNumMidSymbols)
+    {
+      RangeEnc_EncodeBit(rc, &p->choice2, 0);
+      RcTree_Encode(rc, p->mid[posState], kLenNumMidBits, symbol - kLenNumLowSymbols);
+    }
+    else
+    {
+      RangeEnc_EncodeBit(rc, &p->choice2, 1);
+      RcTree_Encode(rc, p->high, kLenNumHighBits, symbol - kLenNumLowSymbols - kLenNumMidSymbols);
+    }
+  }
+}
+
+static UInt32 GetPosSlot(UInt32 dist)
+{
+  unsigned n = 1;
+  if (dist < kStartPosModelIndex)
+    return dist;
+  while ((dist >> (n + 1)) != 0)
+    n++;
+  return (n << 1) | ((dist >> (n - 1)) & 1);
+}
+
+#define LiteralNextState(s) ((s) < 4 ? 0 : ((s) < 10 ? (s) - 3 : (s) - 6))
+#define MatchNextState(s) ((s) < kNumLitStates ? 7 : 10)
+#define RepNextState(s) ((s) < kNumLitStates ? 8 : 11)
+#define ShortRepNextState(s) ((s) < kNumLitStates ? 9 : 11)
+
+#define CUR(p, pos) ((p)->buf + ((pos) - (p)->bufBase))
+
+static void LzmaEnc_EncodeLiteral(CLzmaEnc *p)
+{
+  UInt32 pos = p->pos;
+  const Byte *data = CUR(p, pos);
+  unsigned prevByte = (pos == 0 ? 0 : data[-1]);
+  CLzmaProb *probs = p->litProbs + 0x300 * (prevByte >> (8 - LZMA_LC));
+  RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][pos & (kNumPosStates - 1)], 0);
+  if (p->state < kNumLitStates)
+    LitEnc_Encode(&p->rc, probs, data[0]);
+  else
+    LitEnc_EncodeMatched(&p->rc, probs, data[0], data[-(Int64)p->reps[0] - 1]);
+  p->state = LiteralNextState(p->state);
+}
+
+static void LzmaEnc_EncodeRep(CLzmaEnc *p, unsigned repIndex, unsigned len)
+{
+  unsigned posState = p->pos & (kNumPosStates - 1);
+  unsigned state = p->state;
+  RangeEnc_EncodeBit(&p->rc, &p->isMatch[state][posState], 1);
+  RangeEnc_EncodeBit(&p->rc, &p->isRep[state], 1);
+  if (repIndex == 0)
+  {
+    RangeEnc_EncodeBit(&p->rc, &p->isRepG0[state], 0);
+    RangeEnc_EncodeBit(&p->rc, &p->isRep0Long[state][posState], len == 1 ? 0 : 1);
+  }
+  else
+  {
+    UInt32 distance = p->reps[repIndex];
+    RangeEnc_EncodeBit(&p->rc, &p->isRepG0[state], 1);
+    if (repIndex == 1)
+      RangeEnc_EncodeBit(&p->rc, &p->isRepG1[state], 0);
+    else
+    {
+      RangeEnc_EncodeBit(&p->rc, &p->isRepG1[state], 1);
+      RangeEnc_EncodeBit(&p->rc, &p->isRepG2[state], repIndex - 2);
+      if (repIndex == 3)
+        p->reps[3] = p->reps[2];
+      p->reps[2] = p->reps[1];
+    }
+    p->reps[1] = p->reps[0];
+    p->reps[0] = distance;
+  }
+  if (len == 1)
+    p->state = ShortRepNextState(state);
+  else
+  {
+    LenEnc_Encode(&p->repLenEnc, &p->rc, len - kMatchMinLen, posState);
+    p->state = RepNextState(state);
+  }
+}
+
+static void LzmaEnc_EncodeMatch(CLzmaEnc *p, UInt32 distance, unsigned len)
+{
+  unsigned posState = p->pos & (kNumPosStates - 1);
+  unsigned lenToPosState = len - kMatchMinLen;
+  UInt32 posSlot = GetPosSlot(distance);
+  RangeEnc_EncodeBit(&p->rc, &p->isMatch[p->state][posState], 1);
+  RangeEnc_EncodeBit(&p->rc, &p->isRep[p->state], 0);
+  LenEnc_Encode(&p->lenEnc, &p->rc, len - kMatchMinLen, posState);
+  if (lenToPosState >= kNumLenToPosStates)
+    lenToPosState = kNumLenToPosStates - 1;
+  RcTree_Encode(&p->rc, p->posSlotEncoder[lenToPosState], kNumPosSlotBits, posSlot);
+  if (posSlot >= kStartPosModelIndex)
+  {
+    unsigned footerBits = (unsigned)((posSlot >> 1) - 1);
+    UInt32 base = ((2 | (posSlot & 1)) << footerBits);
+    UInt32 posReduced = distance - base;
+    if (posSlot < kEndPosModelIndex)
+      RcTree_ReverseEncode(&p->rc, p->posEncoders + base - posSlot - 1, footerBits, posReduced);
+    else
+    {
+      RangeEnc_EncodeDirectBits(&p->rc, posReduced >> kNumAlignBits, footerBits - kNumAlignBits);
+      RcTree_ReverseEncode(&p->rc, p->posAlignEncoder, kNumAlignBits, posReduced & (kAlignTableSize - 1));
+    }
+  }
+  p->reps[3] = p->reps[2];
+  p->reps[2] = p->reps[1];
+  p->reps[1] = p->reps[0];
+  p->reps[0] = distance;
+  p->state = MatchNextState(p->state);
+}
+
+/* ---------- Match Finder ---------- */
+
+#define HASH3(p, cur) \
+  (((((UInt32)(cur)[0] << 16) | ((UInt32)(cur)[1] << 8) | (cur)[2]) * (UInt32)2654435761U) >> (p)->hashShift)
+
+/* Inserts hashPos into the hash chains and returns the length of the
+   longest match found there (0 if none), storing its distance - 1. */
+static unsigned MatchFinder_Find(CLzmaEnc *p, UInt32 *distRes)
+{
+  UInt32 cur = p->hashPos++;
+  const Byte *data = CUR(p, cur);
+  UInt32 avail = p->end - cur;
+  UInt32 h, cand;
+  unsigned maxLen, best = 1, depth = p->depth;
+
+  if (avail < 3)
+    return 0;
+  maxLen = (avail < kMatchMaxLen ? avail : kMatchMaxLen);
+  h = HASH3(p, data);
+  cand = p->hash[h];
+  p->hash[h] = cur + 1;
+  p->chain[cur & p->chainMask] = cand;
+
+  while (cand != 0 && depth-- != 0)
+  {
+    UInt32 delta = cur - (cand - 1);
+    const Byte *m = data - delta;
+    if (delta == 0 || delta > p->dictSize)
+      break;
+    if (m[best] == data[best] && m[0] == data[0])
+    {
+      unsigned len = 1;
+      while (len < maxLen && m[len] == data[len])
+        len++;
+      if (len > best)
+      {
+        best = len;
+        *distRes = delta - 1;
+        if (len >= p->niceLen || len == maxLen)
+          break;
+      }
+    }
+    cand = p->chain[(cand - 1) & p->chainMask];
+  }
+  return (best >= kMatchMinLen ? best : 0);
+}
+
+static void MatchFinder_Skip(CLzmaEnc *p, unsigned num)
+{
+  for (; num != 0; num--)
+  {
+    UInt32 cur = p->hashPos++;
+    if (p->end - cur >= 3)
+    {
+      UInt32 h = HASH3(p, CUR(p, cur));
+      p->chain[cur & p->chainMask] = p->hash[h];
+      p->hash[h] = cur + 1;
+    }
+  }
+}
+
+static unsigned GetRepLen(const CLzmaEnc *p, UInt32 pos, UInt32 rep, unsigned maxLen)
+{
+  const Byte *data = CUR(p, pos);
+  const Byte *m;
+  unsigned len = 0;
+  if (rep >= pos)
+    return 0;
+  m = data - rep - 1;
+  while (len < maxLen && m[len] == data[len])
+    len++;
+  return len;
+}
+
+#define ChangePair(smallDist, bigDist) (((bigDist) >> 7) > (smallDist))
+
+/* Chooses how to encode the data at pos, encodes it and advances pos.
+   Follows the fast mode of the reference encoder: a match is taken
+   unless the next position starts a clearly better one. */
+static void LzmaEnc_EncodeOne(CLzmaEnc *p)
+{
+  UInt32 pos = p->pos;
+  UInt32 avail = p->end - pos;
+  unsigned maxLen = (avail < kMatchMaxLen ? avail : kMatchMaxLen);
+  unsigned mainLen, repLen = 0, repIndex = 0, i;
+  UInt32 mainDist = 0;
+
+  if (p->haveNext)
+  {
+    mainLen = p->nextLen;
+    mainDist = p->nextDist;
+    p->haveNext = False;
+  }
+  else
+    mainLen = MatchFinder_Find(p, &mainDist);
+
+  if (maxLen < kMatchMinLen)
+  {
+    LzmaEnc_EncodeLiteral(p);
+    p->pos++;
+    return;
+  }
+
+  for (i = 0; i < kNumReps; i++)
+  {
+    unsigned len = GetRepLen(p, pos, p->reps[i], maxLen);
+    if (len >= p->niceLen)
+    {
+      LzmaEnc_EncodeRep(p, i, len);
+      MatchFinder_Skip(p, len - 1);
+      p->pos += len;
+      return;
+    }
+    if (len > repLen)
+    {
+      repLen = len;
+      repIndex = i;
+    }
+  }
+
+  if (mainLen >= p->niceLen)
+  {
+    LzmaEnc_EncodeMatch(p, mainDist, mainLen);
+    MatchFinder_Skip(p, mainLen - 1);
+    p->pos += mainLen;
+    return;
+  }
+
+  if (mainLen == 2 && mainDist >= 0x80)
+    mainLen = 1;
+
+  if (repLen >= 2 && (
+      (repLen + 1 >= mainLen) ||
+      (repLen + 2 >= mainLen && mainDist >= (1 << 9)) ||
+      (repLen + 3 >= mainLen && mainDist >= (1 << 15))))
+  {
+    LzmaEnc_EncodeRep(p, repIndex, repLen);
+    MatchFinder_Skip(p, repLen - 1);
+    p->pos += repLen;
+    return;
+  }
+
+  if (mainLen < kMatchMinLen || avail <= 2)
+  {
+    LzmaEnc_EncodeLiteral(p);
+    p->pos++;
+    return;
+  }
+
+  p->nextLen = MatchFinder_Find(p, &p->nextDist);
+  p->haveNext = True;
+  if (p->nextLen >= 2)
+  {
+    unsigned nextLen = p->nextLen;
+    UInt32 nextDist = p->nextDist;
+    if ((nextLen >= mainLen && nextDist < mainDist) ||
+        (nextLen == mainLen + 1 && !ChangePair(mainDist, nextDist)) ||
+        (nextLen > mainLen + 1) ||
+        (nextLen + 1 >= mainLen && mainLen >= 3 && ChangePair(nextDist, mainDist)))
+    {
+      LzmaEnc_EncodeLiteral(p);
+      p->pos++;
+      return;
+    }
+  }
+
+  for (i = 0; i < kNumReps; i++)
+  {
+    if (GetRepLen(p, pos + 1, p->reps[i], mainLen - 1) >= mainLen - 1)
+    {
+      LzmaEnc_EncodeLiteral(p);
+      p->pos++;
+      return;
+    }
+  }
+
+  p->haveNext = False;
+  LzmaEnc_EncodeMatch(p, mainDist, mainLen);
+  MatchFinder_Skip(p, mainLen - 2);
+  p->pos += mainLen;
+}
+
+static SRes LzmaEnc_EncodeAvailable(CLzmaEnc *p, Bool finish)
+{
+  UInt32 limit = (finish ? 0 : kLookAhead);
+  while (p->end - p->pos > limit && p->rc.res == SZ_OK)
+    LzmaEnc_EncodeOne(p);
+  return p->rc.res;
+}
+
+/* ---------- Interface ---------- */
+
+CLzmaEnc *LzmaEnc_Create(const CLzmaEncProps *props, ISeqOutStream *outStream, ISzAlloc *alloc)
+{
+  CLzmaEnc *p;
+  UInt32 dictSize = props->dictSize;
+  UInt32 chainSize;
+  unsigned hashBits;
+  unsigned i;
+
+  if (dictSize < ((UInt32)1 << 12))
+    dictSize = (UInt32)1 << 12;
+  if (dictSize > ((UInt32)1 << 27))
+    dictSize = (UInt32)1 << 27;
+  for (i = 12; i < 27; i++)
+    if (props->reduceSize <= ((UInt64)1 << i) && dictSize > ((UInt32)1 << i))
+    {
+      dictSize = (UInt32)1 << i;
+      break;
+    }
+
+  for (chainSize = (UInt32)1 << 12, hashBits = 12; chainSize < dictSize; chainSize <<= 1)
+    hashBits++;
+  hashBits = (hashBits > 22 ? 20 : (hashBits > 13 ? hashBits - 2 : 12));
+
+  p = (CLzmaEnc *)alloc->Alloc(alloc, sizeof(CLzmaEnc));
+  if (p == 0)
+    return 0;
+  memset(p, 0, sizeof(CLzmaEnc));
+  p->alloc = alloc;
+  p->dictSize = dictSize;
+  p->depth = (props->depth == 0 ? 1 : props->depth);
+  p->niceLen = props->niceLen;
+  if (p->niceLen < kMatchMinLen)
+    p->niceLen = kMatchMinLen;
+  if (p->niceLen > kMatchMaxLen)
+    p->niceLen = kMatchMaxLen;
+  p->bufSize = dictSize + kBufExtra;
+  p->hashShift = 32 - hashBits;
+  p->chainMask = chainSize - 1;
+
+  p->buf = (Byte *)alloc->Alloc(alloc, p->bufSize);
+  p->hash = (UInt32 *)alloc->Alloc(alloc, ((size_t)1 << hashBits) * sizeof(UInt32));
+  p->chain = (UInt32 *)alloc->Alloc(alloc, (size_t)chainSize * sizeof(UInt32));
+  p->rc.bufBase = (Byte *)alloc->Alloc(alloc, kRcBufSize);
+  if (p->buf == 0 || p->hash == 0 || p->chain == 0 || p->rc.bufBase == 0)
+  {
+    LzmaEnc_Destroy(p);
+    return 0;
+  }
+  memset(p->hash, 0, ((size_t)1 << hashBits) * sizeof(UInt32));
+
+  p->rc.bufLim = p->rc.bufBase + kRcBufSize;
+  p->rc.outStream = outStream;
+  RangeEnc_Init(&p->rc);
+
+  {
+    CLzmaProb *probs = &p->isMatch[0][0];
+    CLzmaProb *lim = (CLzmaProb *)(&p->lenEnc);
+    for (; probs < lim; probs++)
+      *probs = kProbInitValue;
+    probs = &p->lenEnc.choice;
+    lim = (CLzmaProb *)(&p->repLenEnc + 1);
+    for (; probs < lim; probs++)
+      *probs = kProbInitValue;
+  }
+  return p;
+}
+
+void LzmaEnc_Destroy(CLzmaEnc *p)
+{
+  ISzAlloc *alloc;
+  if (p == 0)
+    return;
+  alloc = p->alloc;
+  alloc->Free(alloc, p->buf);
+  alloc->Free(alloc, p->hash);
+  alloc->Free(alloc, p->chain);
+  alloc->Free(alloc, p->rc.bufBase);
+  alloc->Free(alloc, p);
+}
+
+void LzmaEnc_WriteProperties(const CLzmaEnc *p, Byte *props)
+{
+  unsigned i;
+  props[0] = (Byte)((LZMA_PB * 5 + 0) * 9 + LZMA_LC);
+  for (i = 0; i < 4; i++)
+    props[1 + i] = (Byte)(p->dictSize >> (8 * i));
+}
+
+SRes LzmaEnc_Write(CLzmaEnc *p, const void *data, size_t size)
+{
+  const Byte *src = (const Byte *)data;
+  while (size != 0)
+  {
+    UInt32 used = p->end - p->bufBase;
+    UInt32 space = p->bufSize - used;
+    if (space == 0)
+    {
+      UInt32 keep;
+      RINOK(LzmaEnc_EncodeAvailable(p, False));
+      keep = (p->pos > p->dictSize ? p->pos - p->dictSize : 0);
+      memmove(p->buf, CUR(p, keep), p->end - keep);
+      p->bufBase = keep;
+      continue;
+    }
+    if (space > size)
+      space = (UInt32)size;
+    if (space > kMaxInSize - p->end)
+      return SZ_ERROR_PARAM;
+    memcpy(p->buf + used, src, space);
+    p->end += space;
+    src += space;
+    size -= space;
+  }
+  return SZ_OK;
+}
+
+SRes LzmaEnc_Finish(CLzmaEnc *p)
+{
+  RINOK(LzmaEnc_EncodeAvailable(p, True));
+  RangeEnc_FlushStream(&p->rc);
+  return p->rc.res;
+}
+
+UInt64 LzmaEnc_GetInSize(const CLzmaEnc *p)
+{
+  return p->end;
+}
+
+UInt64 LzmaEnc_GetOutSize(const CLzmaEnc *p)
+{
+  return p->rc.processed + (p->rc.buf - p->rc.bufBase);
+}
@@ -0,0 +1,59 @@
+/* LzmaEnc.h -- LZMA Encoder
+Streaming encoder for the LZMA format read by LzmaDec : Public domain */
+
+#ifndef __LZMAENC_H
+#define __LZMAENC_H
+
+#include "Types.h"
+
+#ifndef LZMA_PROPS_SIZE
+#define LZMA_PROPS_SIZE 5
+#endif
+
+/* ---------- Encoder Properties ---------- */
+
+typedef struct _CLzmaEncProps
+{
+  UInt32 dictSize;  /* (1 << 12) <= dictSize <= (1 << 27), default = (1 << 24) */
+  unsigned depth;   /* hash chain links followed per position, default = 32 */
+  unsigned niceLen; /* matches this long are taken at once, 2 <= niceLen <= 273, default = 64 */
+  UInt64 reduceSize; /* expected input size, if known; (UInt64)(Int64)-1 otherwise.
+                        The dictionary is not made larger than the input. */
+} CLzmaEncProps;
+
+void LzmaEncProps_Init(CLzmaEncProps *p);
+
+/* ---------- Streaming Interface ---------- */
+
+/* The encoder always uses lc = 3, lp = 0, pb = 2 and writes no end
+   marker, so the uncompressed size must be stored by the caller. */
+
+typedef struct _CLzmaEnc CLzmaEnc;
+
+/* LzmaEnc_Create - allocates an encoder that writes the compressed
+   stream (without the properties header) to outStream. Returns NULL if
+   there is not enough memory. */
+CLzmaEnc *LzmaEnc_Create(const CLzmaEncProps *props, ISeqOutStream *outStream, ISzAlloc *alloc);
+void LzmaEnc_Destroy(CLzmaEnc *p);
+
+/* LzmaEnc_WriteProperties - writes the LZMA_PROPS_SIZE bytes read by
+   LzmaProps_Decode. */
+void LzmaEnc_WriteProperties(const CLzmaEnc *p, Byte *props);
+
+/* LzmaEnc_Write - feeds input to the encoder. Compressed data is
+   written to outStream as it becomes available.
+Returns:
+  SZ_OK
+  SZ_ERROR_WRITE - outStream failed
+  SZ_ERROR_PARAM - more than 4 GB of input
+*/
+SRes LzmaEnc_Write(CLzmaEnc *p, const void *data, size_t size);
+
+/* LzmaEnc_Finish - encodes the remaining input and flushes the range
+   coder. No data may be written afterwards. */
+SRes LzmaEnc_Finish(CLzmaEnc *p);
+
+UInt64 LzmaEnc_GetInSize(const CLzmaEnc *p);
+UInt64 LzmaEnc_GetOutSize(const CLzmaEnc *p);
+
+#endif
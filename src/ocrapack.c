@@ -0,0 +1,1740 @@
+/*
+  OCRA Packer
+
+  Writes the opcodes and payload of an OCRA executable. Reads a
+  manifest of directories, files, environment variables and programs
+  to launch, streams the file contents through an in-process encoder
+  and appends the payload, the opcode offset and the signature to the
+  stub image.
+
+  Usage: ocrapack [options] OUTPUT [MANIFEST]
+
+  The manifest (standard input by default) has one record per line,
+  with fields separated by tabs. Backslashes, tabs and newlines in
+  fields must be escaped as \\, \t and \n.
+
+    debug                              enable debug mode in the stub
+    cache       CHDIR                  extract to the extraction cache
+    shared      CHDIR                  extract to a directory shared by
+                                       the instances running at once
+    instdir     NEXT_TO_EXE DELETE CHDIR
+    mkdir       TARGET
+    file        TARGET SOURCE
+    codefile    TARGET SOURCE          a file of x86 or x64 machine code
+    lazyfile    TARGET SOURCE          extracted on demand (needs --toc)
+    bgfile      TARGET SOURCE          extracted on demand, or in the
+                                       background once the program has
+                                       started (needs --toc)
+    archivefile TARGET SOURCE          never extracted; read from the
+                                       executable (needs --toc)
+    link        TARGET EXISTING        same contents as the file EXISTING
+    process     IMAGE CMDLINE
+    postprocess IMAGE CMDLINE
+    env         NAME VALUE
+
+  DELETE is 1 to delete the installation directory before the stub
+  exits, or 2 to move it to the trash and delete it in the background.
+  debug, cache and shared must come before any other record. env and
+  postprocess records are written after the payload, so that they are
+  run even when a cached payload is skipped. SOURCE is a UTF-8 path;
+  all other fields are copied to the executable unchanged.
+
+  codefile contents go through the x86 branch converter (BCJ) of
+  7-Zip, which turns the relative targets of CALL and JMP instructions
+  into absolute ones. Calls to the same function then look alike, and
+  compress better. They are written as OP_CREATE_FILE_X86 records,
+  which are like OP_CREATE_FILE, and the stub converts them back
+  before writing the file.
+
+  link records refer to the TARGET of an earlier file record. They
+  are written after all file contents, and the stub hard links or
+  copies the earlier file.
+
+  lazyfile contents are not part of the opcodes. They follow OP_END,
+  either stored or in compressed blocks of their own, and the stub
+  extracts them when the program first asks for them (see
+  share/ocra/ocra_lazy.rb).
+
+  bgfile records are lazy files with TOC_FLAG_BACKGROUND as well. The
+  stub starts the program once the opcodes are done, and extracts
+  these files on a separate thread while it runs, in the order of the
+  records, so the manifest should list them in the order the program
+  uses them.
+
+  archivefile records are for files that Ruby reads straight from the
+  executable instead (see share/ocra/ocra_archive.rb). They have
+  TOC_FLAG_ARCHIVE and not TOC_FLAG_LAZY, so the stub never extracts
+  them, and are always stored, whatever the codec, since Ruby cannot
+  decode LZMA or LZ4. They come before the other lazy files, so that
+  together they make one contiguous section of the executable.
+
+  --codec selects how file contents are compressed: none, lzma (the
+  same as --lzma) or lz4, which compresses less but decodes several
+  times faster. LZ4 is only used for blocks, so --codec lz4 implies a
+  --block-size of DEFAULT_BLOCK_SIZE unless one is given. Blocks are
+  written as OP_DECOMPRESS_BLOCKS:
+
+    UINT32 Codec, Count
+    UINT32 Size[Count]
+    Block[Count]          header, then the compressed data
+
+  The header of an LZMA block is the LZMA properties followed by the
+  uncompressed size as a UINT64; that of an LZ4 block is just the
+  size. Blocks only hold OP_CREATE_FILE and OP_CREATE_FILE_X86
+  records.
+
+  With --toc, a table of contents follows the opcodes. It is located by
+  a TocSignature and its offset just before the opcode offset:
+
+    UINT32 Version, StreamCount, DirectoryCount, EntryCount
+    UINT32 TotalSize (low, high)    sum of all file sizes
+    UINT32 PayloadSize              bytes of payload in the executable
+    Streams:     Offset, Size
+    Directories: Name
+    Entries:     Name, Flags, Codec, Stream, Offset, Size, UINT32 Crc32
+
+  Names are sorted and front coded (length of the prefix shared with
+  the previous name, length of the rest, the rest). All other numbers
+  are LEB128 varints. Streams are the compressed blocks, with the
+  offset and size of their compressed data (including the block
+  header) in the executable. Flags is a combination of TOC_FLAG_*.
+  Codec is one of TOC_CODEC_*, as in OP_DECOMPRESS_BLOCKS. Stream 0
+  is the main payload and stream n + 1 is block n. Offset is the
+  position of the file contents in the executable for stored files,
+  and in the decompressed stream otherwise. The contents of files with
+  TOC_FLAG_X86 are converted as described for codefile; Crc32 is that
+  of the original contents.
+
+  With --block-cache DIR, compressed blocks are also saved in DIR,
+  named after the SHA-1 of their contents and the encoder settings,
+  and blocks found there are not compressed again. Since a block only
+  changes when the files in it do, rebuilding an executable after
+  editing a few files only compresses the blocks that hold them.
+
+  With --report FILE, the packer writes where the bytes of the
+  executable went, in the same format as the manifest:
+
+    stream      STREAM SIZE COMPRESSED
+    entry       TARGET SIZE COMPRESSED STREAM
+
+  for every compressed stream, numbered as in the table of contents,
+  and every file. A compressed stream cannot tell which of its bytes
+  came from which file, so each file is given the share of the
+  stream's compressed size that its contents make up of the stream's
+  uncompressed size. Smaller blocks make this more precise. Stored
+  files count with their size, and links with 0.
+
+  Unlike the stub, this program also builds on POSIX systems, so that
+  executables can be packed without Windows.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <LzmaEnc.h>
+#include <Bra.h>
+#include <Lz4Enc.h>
+
+#include "ocratools.h"
+
+const unsigned char Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
+const unsigned char TocSignature[] = { 0x41, 0xb6, 0xba, 0x54 };
+
+#define OP_END 0
+#define OP_CREATE_DIRECTORY 1
+#define OP_CREATE_FILE 2
+#define OP_CREATE_PROCESS 3
+#define OP_DECOMPRESS_LZMA 4
+#define OP_SETENV 5
+#define OP_POST_CREATE_PROCESS 6
+#define OP_ENABLE_DEBUG_MODE 7
+#define OP_CREATE_INST_DIRECTORY 8
+#define OP_CREATE_CACHE_DIRECTORY 9
+#define OP_DECOMPRESS_BLOCKS 10
+#define OP_CREATE_LINK 11
+#define OP_CREATE_FILE_X86 12
+
+#define TOC_VERSION 2
+#define TOC_CODEC_STORED 0
+#define TOC_CODEC_LZMA 1
+#define TOC_CODEC_LZ4 2
+#define TOC_FLAG_LAZY 1
+#define TOC_FLAG_X86 2
+#define TOC_FLAG_BACKGROUND 4
+#define TOC_FLAG_ARCHIVE 8
+
+/* Block size for lazy files when --block-size is not given. Small
+   blocks keep the cost of extracting a single file low. */
+#define LAZY_BLOCK_SIZE (1024 * 1024)
+
+/* Block size for codecs that only compress blocks. */
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+
+/* Hash chain depth of the LZ4 encoder. */
+#define LZ4_DEPTH 16
+
+#define CACHE_KEY_LENGTH 40
+#define BLOCK_CACHE_VERSION 2 /* Changes when the encoder output does */
+#define COPY_BUFFER_SIZE 65536
+#define MAX_THREADS 64
+#define MAX_FIELDS 4
+
+#ifdef _WIN32
+#define Tell(f) _ftelli64(f)
+#define Seek(f, o) _fseeki64(f, o, SEEK_SET)
+#else
+#define Tell(f) ftello(f)
+#define Seek(f, o) fseeko(f, o, SEEK_SET)
+#endif
+
+/** A block of file records, compressed on its own thread. */
+typedef struct
+{
+   ISeqOutStream Stream; /* Writes to Out; must be the first member. */
+   Buffer In;
+   Buffer Out;
+   SRes Result;
+   int Index;
+   BOOL Started;
+   BOOL CacheHit;
+#ifdef _WIN32
+   HANDLE Thread;
+#else
+   pthread_t Thread;
+#endif
+} Block;
+
+/** SHA-1 state used for the extraction cache key. */
+typedef struct
+{
+   UINT32 State[5];
+   unsigned long long Length;
+   unsigned char Pending[64];
+} Sha1;
+
+/** A file in the table of contents. */
+typedef struct
+{
+   char* Name;
+   unsigned int Flags;
+   unsigned int Codec;
+   unsigned int Stream;
+   unsigned long long Offset;
+   unsigned long long Size;
+   UINT32 Crc;
+   BOOL Link; /* Only used for the report */
+} TocEntry;
+
+typedef void (*RecordHandler)(char** Fields);
+
+typedef struct
+{
+   const char* Name;
+   int FieldCount;
+   RecordHandler Handler;
+} RecordType;
+
+const char* OutputPath = NULL;
+FILE* Output = NULL;
+BOOL Quiet = FALSE;
+int Codec = TOC_CODEC_STORED;
+unsigned long BlockSize = 0;
+int ThreadCount = 0;
+CLzmaEncProps EncoderProps;
+
+BOOL PayloadStarted = FALSE;
+BOOL CacheEnabled = FALSE;
+UINT32 CacheChdir = 0;
+UINT32 CacheShared = 0;
+long long CacheHeaderOffset = 0;
+long long PayloadOffset = 0;
+long long LzmaHeaderOffset = 0;
+Sha1 CacheHash;
+CLzmaEnc* Encoder = NULL;
+Buffer Launch;
+
+unsigned long long MainOffset = 0;
+
+BOOL TocEnabled = FALSE;
+TocEntry* TocEntries = NULL;
+int TocEntryCount = 0;
+char** TocDirectories = NULL;
+int TocDirectoryCount = 0;
+unsigned long long TocTotalSize = 0;
+long long PayloadEnd = 0;
+unsigned long long* TocStreams = NULL; /* Offset and size pairs */
+int TocStreamCount = 0;
+const char* ReportPath = NULL;
+unsigned long long* StreamSizes = NULL; /* Uncompressed and compressed size pairs */
+int StreamSizeCount = 0;
+char** LazyFiles = NULL; /* Target and source pairs */
+unsigned int* LazyFlags = NULL;
+int LazyFileCount = 0;
+Buffer Links; /* OP_CREATE_LINK records */
+int LinkCount = 0;
+Buffer Code = { 0 };
+int CodeFileCount = 0;
+unsigned long long CodeFileSize = 0;
+
+Block* Filling = NULL;
+int BlockCount = 0;
+Block* Queued[MAX_THREADS];
+int QueuedCount = 0;
+Block* Running[MAX_THREADS];
+int RunningCount = 0;
+Block** Finished = NULL;
+int FinishedCount = 0;
+
+const char* BlockCacheDir = NULL;
+int BlockCacheHits = 0;
+int BlockCacheMisses = 0;
+
+/** Removes the partly written output when ocrapack fails. */
+void RemoveOutput(void)
+{
+   if (Output)
+   {
+      fclose(Output);
+      remove(OutputPath);
+   }
+}
+
+void Message(const char* Format, ...)
+{
+   va_list Args;
+   if (Quiet)
+      return;
+   printf("=== ");
+   va_start(Args, Format);
+   vprintf(Format, Args);
+   va_end(Args);
+   printf("\n");
+   fflush(stdout);
+}
+
+/**
+   Buffers
+*/
+
+void BufferAppendString(Buffer* b, const char* String)
+{
+   BufferAppend(b, String, strlen(String) + 1);
+}
+
+void BufferAppendVarint(Buffer* b, unsigned long long Value)
+{
+   do
+   {
+      unsigned char Byte = (unsigned char)(Value & 0x7F);
+      Value >>= 7;
+      if (Value)
+         Byte |= 0x80;
+      BufferAppend(b, &Byte, 1);
+   } while (Value);
+}
+
+/**
+   SHA-1
+*/
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+void Sha1Init(Sha1* s)
+{
+   s->State[0] = 0x67452301;
+   s->State[1] = 0xEFCDAB89;
+   s->State[2] = 0x98BADCFE;
+   s->State[3] = 0x10325476;
+   s->State[4] = 0xC3D2E1F0;
+   s->Length = 0;
+}
+
+void Sha1Transform(Sha1* s, const unsigned char* Chunk)
+{
+   UINT32 w[80];
+   UINT32 a = s->State[0], b = s->State[1], c = s->State[2], d = s->State[3], e = s->State[4];
+   int i;
+   for (i = 0; i < 16; i++)
+      w[i] = ((UINT32)Chunk[i * 4] << 24) | ((UINT32)Chunk[i * 4 + 1] << 16) | ((UINT32)Chunk[i * 4 + 2] << 8) | Chunk[i * 4 + 3];
+   for (i = 16; i < 80; i++)
+      w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+   for (i = 0; i < 80; i++)
+   {
+      UINT32 f, k, t;
+      if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+      else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+      t = ROL32(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = ROL32(b, 30);
+      b = a;
+      a = t;
+   }
+   s->State[0] += a;
+   s->State[1] += b;
+   s->State[2] += c;
+   s->State[3] += d;
+   s->State[4] += e;
+}
+
+void Sha1Update(Sha1* s, const void* Data, size_t Size)
+{
+   const unsigned char* p = (const unsigned char*)Data;
+   size_t Used = (size_t)(s->Length & 63);
+   s->Length += Size;
+   if (Used)
+   {
+      size_t n = 64 - Used < Size ? 64 - Used : Size;
+      memcpy(s->Pending + Used, p, n);
+      p += n;
+      Size -= n;
+      if (Used + n < 64)
+         return;
+      Sha1Transform(s, s->Pending);
+   }
+   for (; Size >= 64; p += 64, Size -= 64)
+      Sha1Transform(s, p);
+   memcpy(s->Pending, p, Size);
+}
+
+/** Finishes the hash and writes it as lower case hex digits. */
+void Sha1HexDigest(Sha1* s, char* Hex)
+{
+   unsigned long long BitLength = s->Length * 8;
+   unsigned char Trailer[8];
+   int i;
+   for (i = 0; i < 8; i++)
+      Trailer[i] = (unsigned char)(BitLength >> (56 - i * 8));
+   Sha1Update(s, "\x80", 1);
+   while ((s->Length & 63) != 56)
+      Sha1Update(s, "", 1);
+   Sha1Update(s, Trailer, 8);
+   for (i = 0; i < 20; i++)
+      sprintf(Hex + i * 2, "%02x", (s->State[i / 4] >> (24 - (i % 4) * 8)) & 0xFF);
+}
+
+/**
+   Output
+*/
+
+void WriteOutput(const void* Data, size_t Size)
+{
+   if (fwrite(Data, 1, Size, Output) != Size)
+      Fatal("Failed to write %s", OutputPath);
+}
+
+void WriteOutputUInt32(UINT32 Value)
+{
+   Buffer b = { 0 };
+   BufferAppendUInt32(&b, Value);
+   WriteOutput(b.Data, b.Size);
+   BufferFree(&b);
+}
+
+/** Overwrites bytes that were reserved earlier in the output. */
+void PatchOutput(long long Offset, const void* Data, size_t Size)
+{
+   long long Position = Tell(Output);
+   if (Seek(Output, Offset) != 0)
+      Fatal("Failed to seek in %s", OutputPath);
+   WriteOutput(Data, Size);
+   if (Seek(Output, Position) != 0)
+      Fatal("Failed to seek in %s", OutputPath);
+}
+
+static size_t OutputStreamWrite(void* p, const void* Data, size_t Size)
+{
+   return fwrite(Data, 1, Size, Output);
+}
+
+ISeqOutStream OutputStream = { OutputStreamWrite };
+
+/**
+   Compressed blocks
+*/
+
+static size_t BlockStreamWrite(void* p, const void* Data, size_t Size)
+{
+   BufferAppend(&((Block*)p)->Out, Data, Size);
+   return Size;
+}
+
+/**
+   Returns the size of the header of a compressed block. Its last 8
+   bytes are the uncompressed size.
+*/
+size_t BlockHeaderSize(void)
+{
+   return Codec == TOC_CODEC_LZMA ? LZMA_PROPS_SIZE + 8 : 8;
+}
+
+/** Returns the uncompressed size from the header of a compressed block. */
+unsigned long long BlockUnpackSize(Block* b)
+{
+   unsigned char* Header = b->Out.Data + BlockHeaderSize() - 8;
+   unsigned long long Size = 0;
+   int i;
+   for (i = 0; i < 8; i++)
+      Size |= (unsigned long long)Header[i] << (8 * i);
+   return Size;
+}
+
+/**
+   Returns the path of the block cache file for a block, named after
+   the SHA-1 of the encoder settings and the block contents.
+*/
+char* BlockCachePath(Block* b)
+{
+   Buffer Settings = { 0 };
+   Sha1 Hash;
+   char Key[CACHE_KEY_LENGTH + 1];
+   char* Path;
+
+   BufferAppendUInt32(&Settings, BLOCK_CACHE_VERSION);
+   BufferAppendUInt32(&Settings, (UINT32)Codec);
+   BufferAppendUInt32(&Settings, (UINT32)EncoderProps.dictSize);
+   BufferAppendUInt32(&Settings, (UINT32)EncoderProps.depth);
+   BufferAppendUInt32(&Settings, (UINT32)EncoderProps.niceLen);
+   Sha1Init(&Hash);
+   Sha1Update(&Hash, Settings.Data, Settings.Size);
+   Sha1Update(&Hash, b->In.Data, b->In.Size);
+   Sha1HexDigest(&Hash, Key);
+   BufferFree(&Settings);
+
+   Path = (char*)MustAlloc(strlen(BlockCacheDir) + CACHE_KEY_LENGTH + 2);
+   sprintf(Path, "%s/%s", BlockCacheDir, Key);
+   return Path;
+}
+
+/**
+   Reads a compressed block from the block cache into Out. Returns
+   FALSE if it is not there or does not match the block.
+*/
+BOOL BlockCacheLoad(Block* b, const char* Path)
+{
+   BOOL Failed;
+   FILE* f = fopen(Path, "rb");
+   if (f == NULL)
+      return FALSE;
+   for (;;)
+   {
+      unsigned char* Data = BufferReserve(&b->Out, COPY_BUFFER_SIZE);
+      size_t Count = fread(Data, 1, COPY_BUFFER_SIZE, f);
+      if (Count == 0)
+         break;
+      b->Out.Size += Count;
+   }
+   Failed = ferror(f) != 0;
+   fclose(f);
+   if (Failed || b->Out.Size < BlockHeaderSize() || BlockUnpackSize(b) != b->In.Size)
+   {
+      b->Out.Size = 0;
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Saves a compressed block in the block cache. The block is written
+   to a temporary file first, so that concurrent builds never see a
+   partial block. Failures are ignored; the block is then compressed
+   again next time.
+*/
+void BlockCacheStore(Block* b, const char* Path)
+{
+   char* TempPath = (char*)MustAlloc(strlen(Path) + 32);
+   FILE* f;
+#ifdef _WIN32
+   sprintf(TempPath, "%s.%d.%d", Path, _getpid(), b->Index);
+#else
+   sprintf(TempPath, "%s.%d.%d", Path, (int)getpid(), b->Index);
+#endif
+   f = fopen(TempPath, "wb");
+   if (f)
+   {
+      size_t Written = fwrite(b->Out.Data, 1, b->Out.Size, f);
+      if (fclose(f) != 0 || Written != b->Out.Size || rename(TempPath, Path) != 0)
+         remove(TempPath);
+   }
+   free(TempPath);
+}
+
+/** Appends the uncompressed size of a block to its header. */
+void AppendUnpackSize(Block* b)
+{
+   unsigned char Size[8];
+   int i;
+   for (i = 0; i < 8; i++)
+      Size[i] = (unsigned char)((unsigned long long)b->In.Size >> (8 * i));
+   BufferAppend(&b->Out, Size, sizeof(Size));
+}
+
+void CompressBlockLzma(Block* b)
+{
+   CLzmaEncProps Props = EncoderProps;
+   CLzmaEnc* Enc;
+   unsigned char Properties[LZMA_PROPS_SIZE];
+
+   Props.reduceSize = b->In.Size;
+   Enc = LzmaEnc_Create(&Props, &b->Stream, &Alloc);
+   if (Enc == NULL)
+   {
+      b->Result = SZ_ERROR_MEM;
+      return;
+   }
+   LzmaEnc_WriteProperties(Enc, Properties);
+   BufferAppend(&b->Out, Properties, sizeof(Properties));
+   AppendUnpackSize(b);
+   b->Result = LzmaEnc_Write(Enc, b->In.Data, b->In.Size);
+   if (b->Result == SZ_OK)
+      b->Result = LzmaEnc_Finish(Enc);
+   LzmaEnc_Destroy(Enc);
+}
+
+void CompressBlockLz4(Block* b)
+{
+   size_t Size;
+   AppendUnpackSize(b);
+   BufferReserve(&b->Out, Lz4_CompressBound(b->In.Size));
+   Size = Lz4_Compress(b->Out.Data + b->Out.Size, b->In.Data, b->In.Size, LZ4_DEPTH);
+   if (Size == 0)
+   {
+      b->Result = SZ_ERROR_MEM;
+      return;
+   }
+   b->Out.Size += Size;
+}
+
+/** Compresses a block into Out, including its header. */
+void CompressBlock(Block* b)
+{
+   char* CachePath = NULL;
+
+   if (BlockCacheDir)
+   {
+      CachePath = BlockCachePath(b);
+      b->CacheHit = BlockCacheLoad(b, CachePath);
+      if (b->CacheHit)
+      {
+         free(CachePath);
+         BufferFree(&b->In);
+         return;
+      }
+   }
+
+   if (Codec == TOC_CODEC_LZ4)
+      CompressBlockLz4(b);
+   else
+      CompressBlockLzma(b);
+   BufferFree(&b->In);
+
+   if (CachePath)
+   {
+      if (b->Result == SZ_OK)
+         BlockCacheStore(b, CachePath);
+      free(CachePath);
+   }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI BlockThread(LPVOID p)
+{
+   CompressBlock((Block*)p);
+   return 0;
+}
+#else
+static void* BlockThread(void* p)
+{
+   CompressBlock((Block*)p);
+   return NULL;
+}
+#endif
+
+/** Starts compressing a block, on the calling thread if no thread can be created. */
+void StartBlock(Block* b)
+{
+#ifdef _WIN32
+   b->Thread = CreateThread(NULL, 0, BlockThread, b, 0, NULL);
+   b->Started = (b->Thread != NULL);
+#else
+   b->Started = (pthread_create(&b->Thread, NULL, BlockThread, b) == 0);
+#endif
+   if (!b->Started)
+      CompressBlock(b);
+}
+
+void JoinBlock(Block* b)
+{
+   if (b->Started)
+   {
+#ifdef _WIN32
+      WaitForSingleObject(b->Thread, INFINITE);
+      CloseHandle(b->Thread);
+#else
+      pthread_join(b->Thread, NULL);
+#endif
+   }
+   if (b->Result != SZ_OK)
+      Fatal("Failed to compress block (error %d)", b->Result);
+}
+
+void JoinRunningBlocks(void)
+{
+   int i;
+   Finished = (Block**)realloc(Finished, (FinishedCount + RunningCount + 1) * sizeof(Block*));
+   if (Finished == NULL)
+      Fatal("Out of memory");
+   for (i = 0; i < RunningCount; i++)
+   {
+      JoinBlock(Running[i]);
+      Finished[FinishedCount++] = Running[i];
+   }
+   RunningCount = 0;
+}
+
+/**
+   Starts the queued blocks once the previous set has finished. The
+   next set of blocks is read while these are compressed.
+*/
+void RunQueuedBlocks(void)
+{
+   int i;
+   JoinRunningBlocks();
+   for (i = 0; i < QueuedCount; i++)
+   {
+      Running[i] = Queued[i];
+      StartBlock(Running[i]);
+   }
+   RunningCount = QueuedCount;
+   QueuedCount = 0;
+}
+
+void SubmitBlock(void)
+{
+   Queued[QueuedCount++] = Filling;
+   Filling = NULL;
+   if (QueuedCount == ThreadCount)
+      RunQueuedBlocks();
+}
+
+/** Returns the block that the next file record goes to. */
+Block* CurrentBlock(void)
+{
+   if (Filling && Filling->In.Size >= BlockSize)
+      SubmitBlock();
+   if (Filling == NULL)
+   {
+      Filling = (Block*)MustAlloc(sizeof(Block));
+      memset(Filling, 0, sizeof(Block));
+      Filling->Stream.Write = BlockStreamWrite;
+      Filling->Index = BlockCount++;
+   }
+   return Filling;
+}
+
+/** Compresses the remaining blocks. */
+void FinishBlocks(void)
+{
+   if (Filling)
+      SubmitBlock();
+   RunQueuedBlocks();
+   JoinRunningBlocks();
+}
+
+/** Records the sizes of stream n (0 is the main stream) for the report. */
+void SetStreamSize(int n, unsigned long long InSize, unsigned long long OutSize)
+{
+   if (n >= StreamSizeCount)
+   {
+      StreamSizes = (unsigned long long*)realloc(StreamSizes, (n + 1) * 2 * sizeof(unsigned long long));
+      if (StreamSizes == NULL)
+         Fatal("Out of memory");
+      memset(StreamSizes + 2 * StreamSizeCount, 0, (n + 1 - StreamSizeCount) * 2 * sizeof(unsigned long long));
+      StreamSizeCount = n + 1;
+   }
+   StreamSizes[2 * n] = InSize;
+   StreamSizes[2 * n + 1] = OutSize;
+}
+
+/**
+   Writes the compressed data of the finished blocks, recording where
+   each one went for the table of contents.
+*/
+void WriteFinishedBlocks(void)
+{
+   unsigned long long InSize = 0, OutSize = 0;
+   int i;
+   TocStreams = (unsigned long long*)realloc(TocStreams, (TocStreamCount + FinishedCount + 1) * 2 * sizeof(unsigned long long));
+   if (TocStreams == NULL)
+      Fatal("Out of memory");
+   for (i = 0; i < FinishedCount; i++)
+   {
+      Block* b = Finished[i];
+      InSize += BlockUnpackSize(b);
+      OutSize += b->Out.Size;
+      if (BlockCacheDir)
+      {
+         if (b->CacheHit)
+            BlockCacheHits++;
+         else
+            BlockCacheMisses++;
+      }
+      TocStreams[2 * b->Index] = (unsigned long long)Tell(Output);
+      TocStreams[2 * b->Index + 1] = b->Out.Size;
+      SetStreamSize(b->Index + 1, BlockUnpackSize(b), b->Out.Size);
+      if (b->Index >= TocStreamCount)
+         TocStreamCount = b->Index + 1;
+      WriteOutput(b->Out.Data, b->Out.Size);
+      BufferFree(&b->Out);
+      free(b);
+   }
+   Message("Compressed %lu bytes in %d blocks to %lu bytes", (unsigned long)InSize, FinishedCount, (unsigned long)OutSize);
+   free(Finished);
+   Finished = NULL;
+   FinishedCount = 0;
+}
+
+/**
+   Payload
+*/
+
+void BeginPayload(void)
+{
+   if (PayloadStarted)
+      return;
+   PayloadStarted = TRUE;
+
+   if (CacheEnabled)
+   {
+      char Key[CACHE_KEY_LENGTH + 1];
+      Sha1Init(&CacheHash);
+      memset(Key, '0', CACHE_KEY_LENGTH);
+      Key[CACHE_KEY_LENGTH] = 0;
+      CacheHeaderOffset = Tell(Output);
+      WriteOutputUInt32(OP_CREATE_CACHE_DIRECTORY);
+      WriteOutput(Key, sizeof(Key));
+      WriteOutputUInt32(CacheChdir);
+      WriteOutputUInt32(CacheShared);
+      WriteOutputUInt32(0); /* Payload size */
+   }
+
+   PayloadOffset = Tell(Output);
+
+   if (Codec == TOC_CODEC_LZMA)
+   {
+      unsigned char Header[LZMA_PROPS_SIZE + 8];
+      Encoder = LzmaEnc_Create(&EncoderProps, &OutputStream, &Alloc);
+      if (Encoder == NULL)
+         Fatal("Out of memory");
+      LzmaEnc_WriteProperties(Encoder, Header);
+      memset(Header + LZMA_PROPS_SIZE, 0, 8);
+      LzmaHeaderOffset = Tell(Output);
+      WriteOutputUInt32(OP_DECOMPRESS_LZMA);
+      WriteOutputUInt32(0); /* Compressed size */
+      WriteOutput(Header, sizeof(Header));
+   }
+}
+
+/** Adds bytes to the main payload stream. */
+void EmitMain(const void* Data, size_t Size)
+{
+   if (CacheEnabled)
+      Sha1Update(&CacheHash, Data, Size);
+   if (Encoder)
+   {
+      SRes Result = LzmaEnc_Write(Encoder, Data, Size);
+      if (Result != SZ_OK)
+         Fatal("Failed to compress payload (error %d)", Result);
+   }
+   else
+      WriteOutput(Data, Size);
+   MainOffset += Size;
+}
+
+void EmitMainRecord(Buffer* Record)
+{
+   BeginPayload();
+   EmitMain(Record->Data, Record->Size);
+   BufferFree(Record);
+}
+
+void EndPayload(void)
+{
+   BeginPayload();
+
+   if (Encoder)
+   {
+      unsigned long long InSize = LzmaEnc_GetInSize(Encoder);
+      unsigned long long OutSize;
+      unsigned char UnpackSize[8];
+      Buffer CompressedSize = { 0 };
+      SRes Result = LzmaEnc_Finish(Encoder);
+      int i;
+      if (Result != SZ_OK)
+         Fatal("Failed to compress payload (error %d)", Result);
+      OutSize = LZMA_PROPS_SIZE + 8 + LzmaEnc_GetOutSize(Encoder);
+      LzmaEnc_Destroy(Encoder);
+      Encoder = NULL;
+      BufferAppendUInt32(&CompressedSize, (UINT32)OutSize);
+      for (i = 0; i < 8; i++)
+         UnpackSize[i] = (unsigned char)(InSize >> (8 * i));
+      PatchOutput(LzmaHeaderOffset + 4, CompressedSize.Data, 4);
+      PatchOutput(LzmaHeaderOffset + 8 + LZMA_PROPS_SIZE, UnpackSize, 8);
+      BufferFree(&CompressedSize);
+      SetStreamSize(0, InSize, OutSize);
+      Message("Compressed %lu bytes to %lu bytes", (unsigned long)InSize, (unsigned long)OutSize);
+   }
+
+   if (Filling || QueuedCount || RunningCount)
+   {
+      int i;
+      FinishBlocks();
+      WriteOutputUInt32(OP_DECOMPRESS_BLOCKS);
+      WriteOutputUInt32(Codec);
+      WriteOutputUInt32(FinishedCount);
+      for (i = 0; i < FinishedCount; i++)
+         WriteOutputUInt32((UINT32)Finished[i]->Out.Size);
+      WriteFinishedBlocks();
+   }
+
+   if (CodeFileCount)
+      Message("Converted %d files of x86 code (%lu bytes)", CodeFileCount, (unsigned long)CodeFileSize);
+
+   if (LinkCount)
+   {
+      if (CacheEnabled)
+         Sha1Update(&CacheHash, Links.Data, Links.Size);
+      WriteOutput(Links.Data, Links.Size);
+      BufferFree(&Links);
+      Message("Linked %d duplicate files", LinkCount);
+   }
+
+   PayloadEnd = Tell(Output);
+
+   if (CacheEnabled)
+   {
+      Buffer Size = { 0 };
+      BufferAppendUInt32(&Size, (UINT32)(PayloadEnd - PayloadOffset));
+      PatchOutput(CacheHeaderOffset + 4 + CACHE_KEY_LENGTH + 1 + 8, Size.Data, 4);
+      BufferFree(&Size);
+   }
+}
+
+/**
+   Writes the cache key once everything it covers, including the lazy
+   files, has been hashed.
+*/
+void WriteCacheKey(void)
+{
+   char Key[CACHE_KEY_LENGTH + 1];
+   if (!CacheEnabled)
+      return;
+   Sha1HexDigest(&CacheHash, Key);
+   PatchOutput(CacheHeaderOffset + 4, Key, CACHE_KEY_LENGTH);
+   Message("Payload cache key %s", Key);
+}
+
+/**
+   Manifest records
+*/
+
+/** Opens a source file named by a UTF-8 path. */
+FILE* OpenSource(const char* Path, unsigned long long* Size)
+{
+   FILE* f;
+#ifdef _WIN32
+   struct _stati64 st;
+   int Length = MultiByteToWideChar(CP_UTF8, 0, Path, -1, NULL, 0);
+   wchar_t* WidePath;
+   if (Length == 0)
+      return NULL;
+   WidePath = (wchar_t*)MustAlloc(Length * sizeof(wchar_t));
+   MultiByteToWideChar(CP_UTF8, 0, Path, -1, WidePath, Length);
+   f = _wfopen(WidePath, L"rb");
+   free(WidePath);
+   if (f && _fstati64(_fileno(f), &st) == 0)
+#else
+   struct stat st;
+   f = fopen(Path, "rb");
+   if (f && fstat(fileno(f), &st) == 0)
+#endif
+   {
+      *Size = (unsigned long long)st.st_size;
+      return f;
+   }
+   if (f)
+      fclose(f);
+   return NULL;
+}
+
+/**
+   Copies Size bytes of a source file to block b, or to Emit if b is
+   NULL. Returns the CRC-32 of the contents when the table of contents
+   is enabled.
+*/
+UINT32 CopySource(FILE* f, const char* Path, unsigned long long Size, Block* b, void (*Emit)(const void*, size_t))
+{
+   unsigned long long Copied = 0;
+   UINT32 Crc = 0;
+   for (;;)
+   {
+      static unsigned char CopyBuffer[COPY_BUFFER_SIZE];
+      unsigned char* Data = b ? BufferReserve(&b->In, COPY_BUFFER_SIZE) : CopyBuffer;
+      size_t Count = fread(Data, 1, COPY_BUFFER_SIZE, f);
+      if (Count == 0)
+         break;
+      Copied += Count;
+      if (Copied > Size)
+         break;
+      if (TocEnabled)
+         Crc = Crc32Update(Crc, Data, Count);
+      if (b)
+      {
+         if (CacheEnabled)
+            Sha1Update(&CacheHash, Data, Count);
+         b->In.Size += Count;
+      }
+      else
+         Emit(Data, Count);
+   }
+   if (ferror(f) || Copied != Size)
+      Fatal("Failed to read %s", Path);
+   fclose(f);
+   return Crc;
+}
+
+void AddTocEntry(const char* Name, unsigned int Flags, unsigned int Stream, unsigned long long Offset, unsigned long long Size, UINT32 Crc)
+{
+   TocEntry* e;
+   TocEntries = (TocEntry*)realloc(TocEntries, (TocEntryCount + 1) * sizeof(TocEntry));
+   if (TocEntries == NULL)
+      Fatal("Out of memory");
+   e = &TocEntries[TocEntryCount++];
+   e->Name = strdup(Name);
+   e->Flags = Flags;
+   /* Only LZMA compresses the main stream, and archive files are
+      always stored. */
+   e->Codec = Stream || (Codec == TOC_CODEC_LZMA && !(Flags & TOC_FLAG_ARCHIVE)) ? Codec : TOC_CODEC_STORED;
+   e->Stream = Stream;
+   e->Offset = Offset;
+   e->Size = Size;
+   e->Crc = Crc;
+   e->Link = FALSE;
+   TocTotalSize += Size;
+}
+
+unsigned long ParseFlag(const char* Field)
+{
+   if (strcmp(Field, "0") != 0 && strcmp(Field, "1") != 0)
+      Fatal("Invalid flag '%s' in manifest", Field);
+   return Field[0] == '1';
+}
+
+void RecordDebug(char** Fields)
+{
+   if (PayloadStarted)
+      Fatal("debug must come before the payload");
+   WriteOutputUInt32(OP_ENABLE_DEBUG_MODE);
+}
+
+void RecordCache(char** Fields)
+{
+   if (PayloadStarted)
+      Fatal("cache must come before the payload");
+   CacheEnabled = TRUE;
+   CacheChdir = ParseFlag(Fields[0]);
+}
+
+void RecordShared(char** Fields)
+{
+   if (PayloadStarted)
+      Fatal("shared must come before the payload");
+   RecordCache(Fields);
+   CacheShared = 1;
+}
+
+void RecordInstDir(char** Fields)
+{
+   Buffer Record = { 0 };
+   BufferAppendUInt32(&Record, OP_CREATE_INST_DIRECTORY);
+   BufferAppendUInt32(&Record, ParseFlag(Fields[0]));
+   /* DELETE is 2 to defer the deletion until after the stub exits */
+   BufferAppendUInt32(&Record, strcmp(Fields[1], "2") == 0 ? 2 : ParseFlag(Fields[1]));
+   BufferAppendUInt32(&Record, ParseFlag(Fields[2]));
+   EmitMainRecord(&Record);
+}
+
+void RecordMkdir(char** Fields)
+{
+   Buffer Record = { 0 };
+   BufferAppendUInt32(&Record, OP_CREATE_DIRECTORY);
+   BufferAppendString(&Record, Fields[0]);
+   EmitMainRecord(&Record);
+   if (TocEnabled)
+   {
+      TocDirectories = (char**)realloc(TocDirectories, (TocDirectoryCount + 1) * sizeof(char*));
+      if (TocDirectories == NULL)
+         Fatal("Out of memory");
+      TocDirectories[TocDirectoryCount++] = strdup(Fields[0]);
+   }
+}
+
+void AppendCode(const void* Data, size_t Size)
+{
+   BufferAppend(&Code, Data, Size);
+}
+
+/**
+   Streams a file into the payload. With --block-size, file records
+   go to the blocks, which are extracted after the main stream has
+   created the directories. x86 code is read in full and converted
+   before it is added.
+*/
+void AddFile(char** Fields, BOOL X86)
+{
+   unsigned long long Size, Offset;
+   UINT32 Crc = 0;
+   Buffer Record = { 0 };
+   Block* b = NULL;
+   FILE* f = OpenSource(Fields[1], &Size);
+   if (f == NULL)
+      Fatal("Failed to open %s", Fields[1]);
+   if (Size > 0xFFFFFFFFULL)
+      Fatal("%s is too large", Fields[1]);
+
+   if (X86)
+   {
+      UINT32 State;
+      Code.Size = 0;
+      Crc = CopySource(f, Fields[1], Size, NULL, AppendCode);
+      x86_Convert_Init(State);
+      x86_Convert(Code.Data, Code.Size, 0, &State, 1);
+      CodeFileCount++;
+      CodeFileSize += Size;
+   }
+
+   BeginPayload();
+   BufferAppendUInt32(&Record, X86 ? OP_CREATE_FILE_X86 : OP_CREATE_FILE);
+   BufferAppendString(&Record, Fields[0]);
+   BufferAppendUInt32(&Record, (UINT32)Size);
+   if (BlockSize)
+   {
+      b = CurrentBlock();
+      BufferAppend(&b->In, Record.Data, Record.Size);
+      if (CacheEnabled)
+         Sha1Update(&CacheHash, Record.Data, Record.Size);
+      Offset = b->In.Size;
+   }
+   else
+   {
+      EmitMain(Record.Data, Record.Size);
+      Offset = Encoder ? MainOffset : (unsigned long long)Tell(Output);
+   }
+   BufferFree(&Record);
+
+   if (X86 && b)
+   {
+      BufferAppend(&b->In, Code.Data, Code.Size);
+      if (CacheEnabled)
+         Sha1Update(&CacheHash, Code.Data, Code.Size);
+   }
+   else if (X86)
+      EmitMain(Code.Data, Code.Size);
+   else
+      Crc = CopySource(f, Fields[1], Size, b, EmitMain);
+   if (TocEnabled)
+      AddTocEntry(Fields[0], X86 ? TOC_FLAG_X86 : 0, b ? (unsigned int)b->Index + 1 : 0, Offset, Size, Crc);
+}
+
+void RecordFile(char** Fields)
+{
+   AddFile(Fields, FALSE);
+}
+
+void RecordCodeFile(char** Fields)
+{
+   AddFile(Fields, TRUE);
+}
+
+/**
+   Creates a file with the contents of an earlier file record. The
+   records are written at the end of the payload, after the blocks
+   that create the earlier files.
+*/
+void RecordLink(char** Fields)
+{
+   BeginPayload();
+   if (TocEnabled)
+   {
+      TocEntry e;
+      int i = TocEntryCount;
+      while (--i >= 0 && strcmp(TocEntries[i].Name, Fields[1]) != 0)
+         ;
+      if (i < 0)
+         Fatal("link to %s, which is not an earlier file record", Fields[1]);
+      e = TocEntries[i];
+      AddTocEntry(Fields[0], e.Flags & TOC_FLAG_X86, e.Stream, e.Offset, e.Size, e.Crc);
+      TocEntries[TocEntryCount - 1].Link = TRUE;
+   }
+   BufferAppendUInt32(&Links, OP_CREATE_LINK);
+   BufferAppendString(&Links, Fields[0]);
+   BufferAppendString(&Links, Fields[1]);
+   LinkCount++;
+}
+
+/** Defers a file to WriteLazyFiles. */
+void AddLazyFile(char** Fields, unsigned int Flags)
+{
+   if (!TocEnabled)
+      Fatal("lazyfile, bgfile and archivefile records require --toc");
+   LazyFiles = (char**)realloc(LazyFiles, (LazyFileCount + 1) * 2 * sizeof(char*));
+   LazyFlags = (unsigned int*)realloc(LazyFlags, (LazyFileCount + 1) * sizeof(unsigned int));
+   if (LazyFiles == NULL || LazyFlags == NULL)
+      Fatal("Out of memory");
+   LazyFiles[2 * LazyFileCount] = strdup(Fields[0]);
+   LazyFiles[2 * LazyFileCount + 1] = strdup(Fields[1]);
+   LazyFlags[LazyFileCount] = Flags;
+   LazyFileCount++;
+}
+
+void RecordLazyFile(char** Fields)
+{
+   AddLazyFile(Fields, TOC_FLAG_LAZY);
+}
+
+void RecordBackgroundFile(char** Fields)
+{
+   AddLazyFile(Fields, TOC_FLAG_LAZY | TOC_FLAG_BACKGROUND);
+}
+
+void RecordArchiveFile(char** Fields)
+{
+   AddLazyFile(Fields, TOC_FLAG_ARCHIVE);
+}
+
+void EmitLazy(const void* Data, size_t Size)
+{
+   if (CacheEnabled)
+      Sha1Update(&CacheHash, Data, Size);
+   WriteOutput(Data, Size);
+}
+
+/** Writes the contents of lazy file i, stored or to the current block. */
+void WriteLazyFile(int i, BOOL Stored)
+{
+   const char* Target = LazyFiles[2 * i];
+   const char* Source = LazyFiles[2 * i + 1];
+   unsigned long long Size, Offset;
+   Block* b = NULL;
+   UINT32 Crc;
+   FILE* f = OpenSource(Source, &Size);
+   if (f == NULL)
+      Fatal("Failed to open %s", Source);
+   if (Size > 0xFFFFFFFFULL)
+      Fatal("%s is too large", Source);
+   if (CacheEnabled)
+      Sha1Update(&CacheHash, Target, strlen(Target) + 1);
+   if (!Stored)
+   {
+      b = CurrentBlock();
+      Offset = b->In.Size;
+   }
+   else
+      Offset = (unsigned long long)Tell(Output);
+   Crc = CopySource(f, Source, Size, b, EmitLazy);
+   AddTocEntry(Target, LazyFlags[i], b ? (unsigned int)b->Index + 1 : 0, Offset, Size, Crc);
+}
+
+/**
+   Writes the contents of the lazy files after OP_END, where only the
+   table of contents refers to them: first the archive files, stored,
+   and then the others. When compressed, these go in blocks of their
+   own, so that extracting one file only decodes the block holding it.
+*/
+void WriteLazyFiles(void)
+{
+   int i, ArchiveCount = 0;
+   if (LazyFileCount == 0)
+      return;
+   for (i = 0; i < LazyFileCount; i++)
+   {
+      if (LazyFlags[i] & TOC_FLAG_ARCHIVE)
+      {
+         WriteLazyFile(i, TRUE);
+         ArchiveCount++;
+      }
+   }
+   if (ArchiveCount < LazyFileCount)
+   {
+      if (Codec != TOC_CODEC_STORED && BlockSize == 0)
+         BlockSize = LAZY_BLOCK_SIZE;
+      for (i = 0; i < LazyFileCount; i++)
+      {
+         if (!(LazyFlags[i] & TOC_FLAG_ARCHIVE))
+            WriteLazyFile(i, Codec == TOC_CODEC_STORED);
+      }
+      if (Codec != TOC_CODEC_STORED)
+      {
+         FinishBlocks();
+         WriteFinishedBlocks();
+      }
+      Message("Added %d files for lazy extraction", LazyFileCount - ArchiveCount);
+   }
+   if (ArchiveCount > 0)
+      Message("Added %d files to the archive", ArchiveCount);
+}
+
+void RecordProcess(char** Fields)
+{
+   Buffer Record = { 0 };
+   BufferAppendUInt32(&Record, OP_CREATE_PROCESS);
+   BufferAppendString(&Record, Fields[0]);
+   BufferAppendString(&Record, Fields[1]);
+   EmitMainRecord(&Record);
+}
+
+void RecordPostProcess(char** Fields)
+{
+   BufferAppendUInt32(&Launch, OP_POST_CREATE_PROCESS);
+   BufferAppendString(&Launch, Fields[0]);
+   BufferAppendString(&Launch, Fields[1]);
+}
+
+void RecordEnv(char** Fields)
+{
+   BufferAppendUInt32(&Launch, OP_SETENV);
+   BufferAppendString(&Launch, Fields[0]);
+   BufferAppendString(&Launch, Fields[1]);
+}
+
+const RecordType RecordTypes[] = {
+   { "debug", 0, RecordDebug },
+   { "cache", 1, RecordCache },
+   { "shared", 1, RecordShared },
+   { "instdir", 3, RecordInstDir },
+   { "mkdir", 1, RecordMkdir },
+   { "file", 2, RecordFile },
+   { "codefile", 2, RecordCodeFile },
+   { "lazyfile", 2, RecordLazyFile },
+   { "bgfile", 2, RecordBackgroundFile },
+   { "archivefile", 2, RecordArchiveFile },
+   { "link", 2, RecordLink },
+   { "process", 2, RecordProcess },
+   { "postprocess", 2, RecordPostProcess },
+   { "env", 2, RecordEnv },
+   { NULL, 0, NULL }
+};
+
+/**
+   Table of contents
+*/
+
+int CompareNames(const void* a, const void* b)
+{
+   return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int CompareTocEntries(const void* a, const void* b)
+{
+   return strcmp(((const TocEntry*)a)->Name, ((const TocEntry*)b)->Name);
+}
+
+/** Appends Name, front coded against Previous. */
+void BufferAppendFrontCoded(Buffer* b, const char* Name, const char* Previous)
+{
+   size_t Shared = 0, Length = strlen(Name);
+   if (Previous)
+      while (Name[Shared] && Name[Shared] == Previous[Shared])
+         Shared++;
+   BufferAppendVarint(b, Shared);
+   BufferAppendVarint(b, Length - Shared);
+   BufferAppend(b, Name + Shared, Length - Shared);
+}
+
+/** Writes the table of contents and returns its offset. */
+long long WriteToc(void)
+{
+   Buffer Toc = { 0 };
+   long long TocOffset = Tell(Output);
+   int i;
+
+   qsort(TocDirectories, TocDirectoryCount, sizeof(char*), CompareNames);
+   qsort(TocEntries, TocEntryCount, sizeof(TocEntry), CompareTocEntries);
+
+   BufferAppendUInt32(&Toc, TOC_VERSION);
+   BufferAppendUInt32(&Toc, TocStreamCount);
+   BufferAppendUInt32(&Toc, TocDirectoryCount);
+   BufferAppendUInt32(&Toc, TocEntryCount);
+   BufferAppendUInt32(&Toc, (UINT32)TocTotalSize);
+   BufferAppendUInt32(&Toc, (UINT32)(TocTotalSize >> 32));
+   BufferAppendUInt32(&Toc, (UINT32)(PayloadEnd - PayloadOffset));
+   for (i = 0; i < 2 * TocStreamCount; i++)
+      BufferAppendVarint(&Toc, TocStreams[i]);
+   for (i = 0; i < TocDirectoryCount; i++)
+      BufferAppendFrontCoded(&Toc, TocDirectories[i], i ? TocDirectories[i - 1] : NULL);
+   for (i = 0; i < TocEntryCount; i++)
+   {
+      TocEntry* e = &TocEntries[i];
+      BufferAppendFrontCoded(&Toc, e->Name, i ? TocEntries[i - 1].Name : NULL);
+      BufferAppendVarint(&Toc, e->Flags);
+      BufferAppendVarint(&Toc, e->Codec);
+      BufferAppendVarint(&Toc, e->Stream);
+      BufferAppendVarint(&Toc, e->Offset);
+      BufferAppendVarint(&Toc, e->Size);
+      BufferAppendUInt32(&Toc, e->Crc);
+   }
+   WriteOutput(Toc.Data, Toc.Size);
+   Message("Table of contents: %d files, %d directories, %lu bytes", TocEntryCount, TocDirectoryCount, (unsigned long)Toc.Size);
+   BufferFree(&Toc);
+   return TocOffset;
+}
+
+/**
+   Report
+*/
+
+/** Writes a field of the report, escaped like the manifest. */
+void WriteReportField(FILE* f, const char* Field)
+{
+   for (; *Field; Field++)
+   {
+      if (*Field == '\\')
+         fputs("\\\\", f);
+      else if (*Field == '\t')
+         fputs("\\t", f);
+      else if (*Field == '\n')
+         fputs("\\n", f);
+      else
+         putc(*Field, f);
+   }
+}
+
+/** Writes the sizes of the streams and files to ReportPath. */
+void WriteReport(void)
+{
+   FILE* f;
+   int i;
+   if (ReportPath == NULL)
+      return;
+   f = fopen(ReportPath, "wb");
+   if (f == NULL)
+      Fatal("Failed to create %s", ReportPath);
+   for (i = 0; i < StreamSizeCount; i++)
+      if (StreamSizes[2 * i])
+         fprintf(f, "stream\t%d\t%llu\t%llu\n", i, StreamSizes[2 * i], StreamSizes[2 * i + 1]);
+   for (i = 0; i < TocEntryCount; i++)
+   {
+      TocEntry* e = &TocEntries[i];
+      unsigned long long Compressed = e->Size;
+      if (e->Link)
+         Compressed = 0;
+      else if (e->Codec != TOC_CODEC_STORED && e->Stream < (unsigned int)StreamSizeCount && StreamSizes[2 * e->Stream])
+         Compressed = (unsigned long long)((double)e->Size * StreamSizes[2 * e->Stream + 1] / StreamSizes[2 * e->Stream] + 0.5);
+      fputs("entry\t", f);
+      WriteReportField(f, e->Name);
+      fprintf(f, "\t%llu\t%llu\t%u\n", e->Size, Compressed, e->Stream);
+   }
+   if (fclose(f) != 0)
+      Fatal("Failed to write %s", ReportPath);
+}
+
+/** Reads one line into Line, without the line terminator. */
+BOOL ReadLine(FILE* f, Buffer* Line)
+{
+   int c;
+   Line->Size = 0;
+   while ((c = getc(f)) != EOF && c != '\n')
+   {
+      unsigned char Byte = (unsigned char)c;
+      BufferAppend(Line, &Byte, 1);
+   }
+   if (c == EOF && Line->Size == 0)
+      return FALSE;
+   if (Line->Size > 0 && Line->Data[Line->Size - 1] == '\r')
+      Line->Size--;
+   BufferAppend(Line, "", 1);
+   return TRUE;
+}
+
+/** Undoes the escaping of a field in place. */
+void Unescape(char* Field, unsigned long LineNumber)
+{
+   char* Out = Field;
+   for (; *Field; Field++)
+   {
+      if (*Field == '\\')
+      {
+         Field++;
+         if (*Field == '\\')
+            *Out++ = '\\';
+         else if (*Field == 't')
+            *Out++ = '\t';
+         else if (*Field == 'n')
+            *Out++ = '\n';
+         else
+            Fatal("Invalid escape sequence on manifest line %lu", LineNumber);
+      }
+      else
+         *Out++ = *Field;
+   }
+   *Out = 0;
+}
+
+void ProcessManifest(FILE* Manifest)
+{
+   Buffer Line = { 0 };
+   unsigned long LineNumber = 0;
+
+   while (ReadLine(Manifest, &Line))
+   {
+      char* Fields[MAX_FIELDS + 1];
+      char* p = (char*)Line.Data;
+      int FieldCount = 0;
+      const RecordType* Type;
+      int i;
+
+      LineNumber++;
+      if (*p == 0 || *p == '#')
+         continue;
+      for (;;)
+      {
+         char* Tab = strchr(p, '\t');
+         if (FieldCount > MAX_FIELDS)
+            Fatal("Too many fields on manifest line %lu", LineNumber);
+         Fields[FieldCount++] = p;
+         if (Tab == NULL)
+            break;
+         *Tab = 0;
+         p = Tab + 1;
+      }
+
+      for (Type = RecordTypes; Type->Name; Type++)
+         if (strcmp(Type->Name, Fields[0]) == 0)
+            break;
+      if (Type->Name == NULL)
+         Fatal("Unknown record '%s' on manifest line %lu", Fields[0], LineNumber);
+      if (FieldCount - 1 != Type->FieldCount)
+         Fatal("'%s' takes %d fields on manifest line %lu", Type->Name, Type->FieldCount, LineNumber);
+      for (i = 1; i <= Type->FieldCount; i++)
+         Unescape(Fields[i], LineNumber);
+      Type->Handler(Fields + 1);
+   }
+   if (ferror(Manifest))
+      Fatal("Failed to read manifest");
+   BufferFree(&Line);
+}
+
+/**
+   Main
+*/
+
+void Usage(void)
+{
+   fprintf(stderr,
+           "Usage: ocrapack [options] OUTPUT [MANIFEST]\n"
+           "\n"
+           "Appends the payload described by MANIFEST (default: standard input)\n"
+           "to the stub image in OUTPUT.\n"
+           "\n"
+           "--stub FILE        Copy the stub image from FILE to OUTPUT first.\n"
+           "--lzma             Compress the payload with LZMA.\n"
+           "--codec NAME       Compress with none, lzma or lz4.\n"
+           "--block-size N     Put files in blocks of N bytes that are compressed\n"
+           "                   and decompressed in parallel (requires a codec).\n"
+           "--threads N        Blocks compressed at the same time (default: one per processor).\n"
+           "--dict-size N      LZMA dictionary size in bytes (default: 16777216).\n"
+           "--block-cache DIR  Reuse compressed blocks saved in DIR by earlier runs.\n"
+           "--toc              Write a table of contents after the opcodes.\n"
+           "--report FILE      Write the size of every file and its share of the\n"
+           "                   compressed payload to FILE (requires --toc).\n"
+           "--quiet            Don't print progress messages.\n");
+   exit(1);
+}
+
+/** Returns the value of the option at argv[*i] and skips past it. */
+const char* OptionValue(int argc, char** argv, int* i)
+{
+   if (*i + 1 >= argc)
+      Usage();
+   return argv[++*i];
+}
+
+unsigned long ParseNumber(int argc, char** argv, int* i)
+{
+   const char* Option = argv[*i];
+   const char* Value = OptionValue(argc, argv, i);
+   char* End;
+   unsigned long Number = strtoul(Value, &End, 10);
+   if (*End != 0 || End == Value)
+      Fatal("Invalid value for %s: %s", Option, Value);
+   return Number;
+}
+
+int ParseCodec(const char* Name)
+{
+   if (strcmp(Name, "none") == 0)
+      return TOC_CODEC_STORED;
+   if (strcmp(Name, "lzma") == 0)
+      return TOC_CODEC_LZMA;
+   if (strcmp(Name, "lz4") == 0)
+      return TOC_CODEC_LZ4;
+   Fatal("Unknown codec: %s", Name);
+   return TOC_CODEC_STORED;
+}
+
+int main(int argc, char** argv)
+{
+   const char* StubPath = NULL;
+   const char* ManifestPath = NULL;
+   FILE* Manifest = stdin;
+   int i;
+
+   ToolName = "ocrapack";
+   FatalCleanup = RemoveOutput;
+   LzmaEncProps_Init(&EncoderProps);
+   Crc32Init();
+   ThreadCount = GetProcessorCount();
+
+   for (i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "--stub") == 0)
+         StubPath = OptionValue(argc, argv, &i);
+      else if (strcmp(argv[i], "--lzma") == 0)
+         Codec = TOC_CODEC_LZMA;
+      else if (strcmp(argv[i], "--codec") == 0)
+         Codec = ParseCodec(OptionValue(argc, argv, &i));
+      else if (strcmp(argv[i], "--block-size") == 0)
+         BlockSize = ParseNumber(argc, argv, &i);
+      else if (strcmp(argv[i], "--threads") == 0)
+         ThreadCount = (int)ParseNumber(argc, argv, &i);
+      else if (strcmp(argv[i], "--dict-size") == 0)
+         EncoderProps.dictSize = (UInt32)ParseNumber(argc, argv, &i);
+      else if (strcmp(argv[i], "--block-cache") == 0)
+         BlockCacheDir = OptionValue(argc, argv, &i);
+      else if (strcmp(argv[i], "--toc") == 0)
+         TocEnabled = TRUE;
+      else if (strcmp(argv[i], "--report") == 0)
+         ReportPath = OptionValue(argc, argv, &i);
+      else if (strcmp(argv[i], "--quiet") == 0)
+         Quiet = TRUE;
+      else if (argv[i][0] == '-' && argv[i][1] == '-')
+         Usage();
+      else if (OutputPath == NULL)
+         OutputPath = argv[i];
+      else if (ManifestPath == NULL)
+         ManifestPath = argv[i];
+      else
+         Usage();
+   }
+
+   if (OutputPath == NULL)
+      Usage();
+   if (BlockSize && Codec == TOC_CODEC_STORED)
+      Fatal("--block-size requires --lzma or --codec");
+   if (Codec == TOC_CODEC_LZ4 && BlockSize == 0)
+      BlockSize = DEFAULT_BLOCK_SIZE;
+   if (BlockCacheDir && !BlockSize)
+      Fatal("--block-cache requires --block-size");
+   if (ReportPath && !TocEnabled)
+      Fatal("--report requires --toc");
+   if (ThreadCount < 1)
+      ThreadCount = 1;
+   if (ThreadCount > MAX_THREADS)
+      ThreadCount = MAX_THREADS;
+
+   if (BlockCacheDir)
+   {
+      struct stat st;
+#ifdef _WIN32
+      _mkdir(BlockCacheDir);
+#else
+      mkdir(BlockCacheDir, 0777);
+#endif
+      if (stat(BlockCacheDir, &st) != 0 || !(st.st_mode & S_IFDIR))
+         Fatal("Failed to create %s", BlockCacheDir);
+   }
+
+   if (ManifestPath && strcmp(ManifestPath, "-") != 0)
+   {
+      Manifest = fopen(ManifestPath, "rb");
+      if (Manifest == NULL)
+         Fatal("Failed to open %s", ManifestPath);
+   }
+#ifdef _WIN32
+   else
+      _setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+   if (StubPath)
+   {
+      FILE* Stub = fopen(StubPath, "rb");
+      unsigned char Data[COPY_BUFFER_SIZE];
+      size_t Count;
+      if (Stub == NULL)
+         Fatal("Failed to open %s", StubPath);
+      Output = fopen(OutputPath, "w+b");
+      if (Output == NULL)
+         Fatal("Failed to create %s", OutputPath);
+      while ((Count = fread(Data, 1, sizeof(Data), Stub)) > 0)
+         WriteOutput(Data, Count);
+      if (ferror(Stub))
+         Fatal("Failed to read %s", StubPath);
+      fclose(Stub);
+   }
+   else
+   {
+      Output = fopen(OutputPath, "r+b");
+      if (Output == NULL)
+         Fatal("Failed to open %s (use --stub to create it)", OutputPath);
+      if (fseek(Output, 0, SEEK_END) != 0)
+         Fatal("Failed to seek in %s", OutputPath);
+   }
+
+   {
+      long long OpcodeOffset = Tell(Output);
+      ProcessManifest(Manifest);
+      EndPayload();
+      WriteOutput(Launch.Data, Launch.Size);
+      WriteOutputUInt32(OP_END);
+      WriteLazyFiles();
+      WriteCacheKey();
+      if (BlockCacheDir)
+         Message("Block cache: %d hits, %d misses", BlockCacheHits, BlockCacheMisses);
+      WriteReport();
+      if (TocEnabled)
+      {
+         WriteOutputUInt32((UINT32)WriteToc());
+         WriteOutput(TocSignature, sizeof(TocSignature));
+      }
+      WriteOutputUInt32((UINT32)OpcodeOffset);
+      WriteOutput(Signature, sizeof(Signature));
+   }
+
+   if (Manifest != stdin)
+      fclose(Manifest);
+   if (fclose(Output) != 0)
+   {
+      Output = NULL;
+      fprintf(stderr, "ocrapack: Failed to write %s\n", OutputPath);
+      remove(OutputPath);
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,146 @@
+/*
+  OCRA Tools
+
+  Functions shared by ocrapack, ocraunpack and codecbench (see
+  ocratools.h).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#include "ocratools.h"
+
+const char* ToolName = "ocra";
+int FatalStatus = 1;
+void (*FatalCleanup)(void) = NULL;
+
+void Fatal(const char* Format, ...)
+{
+   va_list Args;
+   fprintf(stderr, "%s: ", ToolName);
+   va_start(Args, Format);
+   vfprintf(stderr, Format, Args);
+   va_end(Args);
+   fprintf(stderr, "\n");
+   if (FatalCleanup)
+      FatalCleanup();
+   exit(FatalStatus);
+}
+
+/**
+   Buffers
+*/
+
+void* MustAlloc(size_t Size)
+{
+   void* p = malloc(Size ? Size : 1);
+   if (p == NULL)
+      Fatal("Out of memory");
+   return p;
+}
+
+static void* LzmaAlloc(void* p, size_t Size) { return malloc(Size); }
+static void LzmaFree(void* p, void* Address) { free(Address); }
+ISzAlloc Alloc = { LzmaAlloc, LzmaFree };
+
+/** Makes room for Size more bytes and returns a pointer to them. */
+unsigned char* BufferReserve(Buffer* b, size_t Size)
+{
+   if (b->Size + Size > b->Capacity)
+   {
+      size_t Capacity = b->Capacity ? b->Capacity : 4096;
+      unsigned char* Data;
+      while (Capacity < b->Size + Size)
+         Capacity *= 2;
+      Data = (unsigned char*)realloc(b->Data, Capacity);
+      if (Data == NULL)
+         Fatal("Out of memory");
+      b->Data = Data;
+      b->Capacity = Capacity;
+   }
+   return b->Data + b->Size;
+}
+
+void BufferAppend(Buffer* b, const void* Data, size_t Size)
+{
+   memcpy(BufferReserve(b, Size), Data, Size);
+   b->Size += Size;
+}
+
+void BufferAppendUInt32(Buffer* b, UINT32 Value)
+{
+   unsigned char Bytes[4];
+   Bytes[0] = (unsigned char)Value;
+   Bytes[1] = (unsigned char)(Value >> 8);
+   Bytes[2] = (unsigned char)(Value >> 16);
+   Bytes[3] = (unsigned char)(Value >> 24);
+   BufferAppend(b, Bytes, 4);
+}
+
+void BufferFree(Buffer* b)
+{
+   free(b->Data);
+   b->Data = NULL;
+   b->Size = b->Capacity = 0;
+}
+
+/** Returns a monotonic time in seconds. */
+double Now(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER Count, Frequency;
+   QueryPerformanceCounter(&Count);
+   QueryPerformanceFrequency(&Frequency);
+   return (double)Count.QuadPart / (double)Frequency.QuadPart;
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+#endif
+}
+
+/**
+   CRC-32 (IEEE 802.3), used for the table of contents
+*/
+
+UINT32 Crc32Table[256];
+
+void Crc32Init(void)
+{
+   UINT32 i, j;
+   for (i = 0; i < 256; i++)
+   {
+      UINT32 c = i;
+      for (j = 0; j < 8; j++)
+         c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+      Crc32Table[i] = c;
+   }
+}
+
+/** Continues a CRC-32 with more data; start with 0. */
+UINT32 Crc32Update(UINT32 Crc, const unsigned char* Data, size_t Size)
+{
+   Crc = ~Crc;
+   while (Size--)
+      Crc = Crc32Table[(Crc ^ *Data++) & 0xFF] ^ (Crc >> 8);
+   return ~Crc;
+}
+
+int GetProcessorCount(void)
+{
+#ifdef _WIN32
+   SYSTEM_INFO SystemInfo;
+   GetSystemInfo(&SystemInfo);
+   return (int)SystemInfo.dwNumberOfProcessors;
+#else
+   long Count = sysconf(_SC_NPROCESSORS_ONLN);
+   return Count > 0 ? (int)Count : 1;
+#endif
+}
@@ -0,0 +1,66 @@
+/*
+  OCRA Tools
+
+  What ocrapack, ocraunpack and codecbench have in common: error
+  reporting, allocation, growable buffers, timing, CRC-32 and the
+  processor count. Like the tools, it builds on Windows and on POSIX
+  systems.
+*/
+
+#ifndef OCRATOOLS_H
+#define OCRATOOLS_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+typedef int BOOL;
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#include <Types.h>
+
+typedef unsigned int UINT32;
+
+/** A growable byte buffer. */
+typedef struct
+{
+   unsigned char* Data;
+   size_t Size;
+   size_t Capacity;
+} Buffer;
+
+/* Set by each tool before anything can fail: the name its messages
+   start with, the status Fatal exits with, and a function that Fatal
+   calls before exiting, or NULL. */
+extern const char* ToolName;
+extern int FatalStatus;
+extern void (*FatalCleanup)(void);
+
+/* Allocator for the LZMA encoder and decoder. */
+extern ISzAlloc Alloc;
+
+/* Fatal never returns, which spares its callers warnings about
+   values that are only set when it is not called. */
+#ifdef __GNUC__
+void Fatal(const char* Format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+#else
+void Fatal(const char* Format, ...);
+#endif
+void* MustAlloc(size_t Size);
+
+unsigned char* BufferReserve(Buffer* b, size_t Size);
+void BufferAppend(Buffer* b, const void* Data, size_t Size);
+void BufferAppendUInt32(Buffer* b, UINT32 Value);
+void BufferFree(Buffer* b);
+
+double Now(void);
+
+void Crc32Init(void);
+UINT32 Crc32Update(UINT32 Crc, const unsigned char* Data, size_t Size);
+
+int GetProcessorCount(void);
+
+#endif
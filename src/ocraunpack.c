@@ -0,0 +1,1027 @@
+/*
+  OCRA Unpacker
+
+  Reads an OCRA executable without running it. Lists the opcodes of
+  its payload, checks them, and extracts the files to a directory,
+  decoding compressed blocks on one thread per processor. Nothing is
+  launched: process and postprocess records are only listed.
+
+  Usage: ocraunpack [options] EXECUTABLE
+
+  The payload is found through the trailer at the end of the
+  executable: the opcode offset followed by the Signature, and the
+  table of contents (if any) before them, as written by ocrapack.
+  Every run decodes the whole payload and checks that the records fit
+  in their streams, that the blocks decode to their stated sizes, and,
+  when there is a table of contents, that every file is there with the
+  size and CRC-32 it lists. Files for lazy extraction and archive
+  files, which only the table of contents refers to, are checked and
+  extracted as well.
+
+  Names in the executable are relative to the extraction directory.
+  Names that are absolute or contain ".." are refused, so that a
+  damaged or hostile executable cannot write outside --extract DIR.
+
+  Unlike the stub, this program also builds on POSIX systems, so that
+  executables can be inspected and unpacked without Windows. The
+  format does not depend on the system that packed it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <LzmaDec.h>
+#include <Lz4Dec.h>
+#include <Bra.h>
+
+#include "ocratools.h"
+
+const unsigned char Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
+const unsigned char TocSignature[] = { 0x41, 0xb6, 0xba, 0x54 };
+
+#define OP_END 0
+#define OP_CREATE_DIRECTORY 1
+#define OP_CREATE_FILE 2
+#define OP_CREATE_PROCESS 3
+#define OP_DECOMPRESS_LZMA 4
+#define OP_SETENV 5
+#define OP_POST_CREATE_PROCESS 6
+#define OP_ENABLE_DEBUG_MODE 7
+#define OP_CREATE_INST_DIRECTORY 8
+#define OP_CREATE_CACHE_DIRECTORY 9
+#define OP_DECOMPRESS_BLOCKS 10
+#define OP_CREATE_LINK 11
+#define OP_CREATE_FILE_X86 12
+
+#define TOC_VERSION 2
+#define TOC_CODEC_STORED 0
+#define TOC_CODEC_LZMA 1
+#define TOC_CODEC_LZ4 2
+#define TOC_FLAG_LAZY 1
+#define TOC_FLAG_X86 2
+#define TOC_FLAG_BACKGROUND 4
+#define TOC_FLAG_ARCHIVE 8
+
+#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + 8)
+#define LZ4_HEADER_SIZE 8
+#define COPY_BUFFER_SIZE 65536
+#define MAX_THREADS 64
+
+/** Reads records from a stream of opcodes. */
+typedef struct
+{
+   unsigned char* Position;
+   unsigned char* End;
+} Reader;
+
+/** A file in the table of contents. */
+typedef struct
+{
+   char* Name;
+   unsigned int Flags;
+   unsigned int Codec;
+   unsigned int Stream;
+   unsigned long long Offset;
+   unsigned long long Size;
+   UINT32 Crc;
+   BOOL Seen;
+} TocEntry;
+
+/**
+   A compressed block to decode on a worker thread. Lazy blocks hold
+   the contents of the table of contents entries of their stream;
+   other blocks hold file records. What the records list goes to
+   Listing, which is printed once all blocks are done, so that the
+   listing stays in order.
+*/
+typedef struct
+{
+   unsigned int Codec;
+   unsigned char* Data;
+   size_t Size;
+   unsigned int Stream; /* Table of contents stream of a lazy block, else 0 */
+   int Index;
+   int Depth;
+   Buffer Listing;
+} Job;
+
+const char* ImagePath = NULL;
+unsigned char* Image = NULL;
+size_t ImageSize = 0;
+const char* ExtractDir = NULL;
+BOOL ListEnabled = FALSE;
+BOOL Quiet = FALSE;
+int ThreadCount = 0;
+
+TocEntry* TocEntries = NULL;
+int TocEntryCount = 0;
+unsigned long long* TocStreams = NULL; /* Offset and size pairs */
+int TocStreamCount = 0;
+
+/* Updated by the workers under Lock. */
+int Problems = 0;
+int FileCount = 0;
+int DirectoryCount = 0;
+int LinkCount = 0;
+unsigned long long FileBytes = 0;
+unsigned long long CompressedBytes = 0;
+unsigned long long DecodedBytes = 0;
+double DecodeTime = 0;
+
+Job* Jobs = NULL;
+int JobCount = 0;
+int NextJob = 0;
+
+#ifdef _WIN32
+CRITICAL_SECTION LockSection;
+#define InitLock() InitializeCriticalSection(&LockSection)
+#define Lock() EnterCriticalSection(&LockSection)
+#define Unlock() LeaveCriticalSection(&LockSection)
+#else
+pthread_mutex_t LockMutex = PTHREAD_MUTEX_INITIALIZER;
+#define InitLock()
+#define Lock() pthread_mutex_lock(&LockMutex)
+#define Unlock() pthread_mutex_unlock(&LockMutex)
+#endif
+
+/** Reports something wrong with the executable, and carries on. */
+void Problem(const char* Format, ...)
+{
+   va_list Args;
+   Lock();
+   Problems++;
+   fprintf(stderr, "ocraunpack: ");
+   va_start(Args, Format);
+   vfprintf(stderr, Format, Args);
+   va_end(Args);
+   fprintf(stderr, "\n");
+   Unlock();
+}
+
+/**
+   Adds a line to the listing, indented by Depth, either to the
+   listing of a block or to standard output.
+*/
+void List(Buffer* Listing, int Depth, const char* Format, ...)
+{
+   char Line[4096];
+   va_list Args;
+   int Length;
+   if (!ListEnabled)
+      return;
+   Length = Depth * 2;
+   memset(Line, ' ', Length);
+   va_start(Args, Format);
+   vsnprintf(Line + Length, sizeof(Line) - Length - 1, Format, Args);
+   va_end(Args);
+   Length = (int)strlen(Line);
+   Line[Length++] = '\n';
+   if (Listing)
+      BufferAppend(Listing, Line, Length);
+   else
+      fwrite(Line, 1, Length, stdout);
+}
+
+/**
+   Reading records
+*/
+
+UINT32 GetUInt32(const unsigned char* p)
+{
+   return (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+BOOL ReadUInt32(Reader* r, UINT32* Value)
+{
+   if (r->End - r->Position < 4)
+      return FALSE;
+   *Value = GetUInt32(r->Position);
+   r->Position += 4;
+   return TRUE;
+}
+
+/** Reads a NUL terminated string, which must end inside the stream. */
+BOOL ReadString(Reader* r, char** Value)
+{
+   unsigned char* Nul = (unsigned char*)memchr(r->Position, 0, r->End - r->Position);
+   if (Nul == NULL)
+      return FALSE;
+   *Value = (char*)r->Position;
+   r->Position = Nul + 1;
+   return TRUE;
+}
+
+BOOL ReadBytes(Reader* r, size_t Size, unsigned char** Data)
+{
+   if ((size_t)(r->End - r->Position) < Size)
+      return FALSE;
+   *Data = r->Position;
+   r->Position += Size;
+   return TRUE;
+}
+
+/**
+   Table of contents
+*/
+
+BOOL ReadVarint(Reader* r, unsigned long long* Value)
+{
+   int Shift = 0;
+   *Value = 0;
+   while (r->Position < r->End && Shift < 64)
+   {
+      unsigned char Byte = *r->Position++;
+      *Value |= (unsigned long long)(Byte & 0x7F) << Shift;
+      if (!(Byte & 0x80))
+         return TRUE;
+      Shift += 7;
+   }
+   return FALSE;
+}
+
+/** Reads a front coded name into Name, which holds the previous one. */
+BOOL ReadFrontCoded(Reader* r, Buffer* Name)
+{
+   unsigned long long Shared, Length;
+   unsigned char* Rest;
+   if (!ReadVarint(r, &Shared) || !ReadVarint(r, &Length) || Shared > Name->Size ||
+       !ReadBytes(r, (size_t)Length, &Rest))
+      return FALSE;
+   Name->Size = (size_t)Shared;
+   BufferAppend(Name, Rest, (size_t)Length);
+   BufferAppend(Name, "", 1);
+   Name->Size--;
+   return TRUE;
+}
+
+/** Reads the table of contents at Offset, if the trailer has one. */
+void ReadToc(void)
+{
+   Reader r;
+   Buffer Name = { 0 };
+   UINT32 Version, StreamCount, DirectoryCount, EntryCount, TotalLow, TotalHigh, PayloadSize;
+   UINT32 Offset;
+   int i;
+
+   if (ImageSize < 16 || memcmp(Image + ImageSize - 12, TocSignature, sizeof(TocSignature)) != 0)
+      return;
+   Offset = GetUInt32(Image + ImageSize - 16);
+   if (Offset >= ImageSize - 16)
+      Fatal("%s: the table of contents is outside the executable", ImagePath);
+   r.Position = Image + Offset;
+   r.End = Image + ImageSize - 16;
+   if (!ReadUInt32(&r, &Version) || !ReadUInt32(&r, &StreamCount) || !ReadUInt32(&r, &DirectoryCount) ||
+       !ReadUInt32(&r, &EntryCount) || !ReadUInt32(&r, &TotalLow) || !ReadUInt32(&r, &TotalHigh) ||
+       !ReadUInt32(&r, &PayloadSize))
+      Fatal("%s: the table of contents is truncated", ImagePath);
+   if (Version != TOC_VERSION)
+      Fatal("%s: unsupported table of contents version %u", ImagePath, Version);
+   if (StreamCount > ImageSize || EntryCount > ImageSize)
+      Fatal("%s: the table of contents is damaged", ImagePath);
+
+   TocStreams = (unsigned long long*)MustAlloc(StreamCount * 2 * sizeof(unsigned long long));
+   for (i = 0; i < (int)StreamCount * 2; i++)
+      if (!ReadVarint(&r, &TocStreams[i]))
+         Fatal("%s: the table of contents is truncated", ImagePath);
+   TocStreamCount = (int)StreamCount;
+   for (i = 0; i < (int)DirectoryCount; i++)
+      if (!ReadFrontCoded(&r, &Name))
+         Fatal("%s: the table of contents is truncated", ImagePath);
+
+   Name.Size = 0;
+   TocEntries = (TocEntry*)MustAlloc(EntryCount * sizeof(TocEntry));
+   for (i = 0; i < (int)EntryCount; i++)
+   {
+      TocEntry* e = &TocEntries[i];
+      unsigned long long Flags, Codec, Stream;
+      unsigned char* Crc;
+      if (!ReadFrontCoded(&r, &Name) || !ReadVarint(&r, &Flags) || !ReadVarint(&r, &Codec) ||
+          !ReadVarint(&r, &Stream) || !ReadVarint(&r, &e->Offset) || !ReadVarint(&r, &e->Size) ||
+          !ReadBytes(&r, 4, &Crc))
+         Fatal("%s: the table of contents is truncated", ImagePath);
+      e->Name = (char*)MustAlloc(Name.Size + 1);
+      memcpy(e->Name, Name.Data, Name.Size + 1);
+      e->Flags = (unsigned int)Flags;
+      e->Codec = (unsigned int)Codec;
+      e->Stream = (unsigned int)Stream;
+      e->Crc = GetUInt32(Crc);
+      e->Seen = FALSE;
+   }
+   TocEntryCount = (int)EntryCount;
+   BufferFree(&Name);
+
+   List(NULL, 0, "toc          %u files, %u directories, %u streams, %llu bytes",
+        EntryCount, DirectoryCount, StreamCount, (unsigned long long)TotalLow | ((unsigned long long)TotalHigh << 32));
+}
+
+/** Returns the table of contents entry of a file (the entries are sorted), or NULL. */
+TocEntry* FindTocEntry(const char* Name)
+{
+   int Low = 0, High = TocEntryCount - 1;
+   while (Low <= High)
+   {
+      int Middle = (Low + High) / 2;
+      int Order = strcmp(TocEntries[Middle].Name, Name);
+      if (Order == 0)
+         return &TocEntries[Middle];
+      if (Order < 0)
+         Low = Middle + 1;
+      else
+         High = Middle - 1;
+   }
+   return NULL;
+}
+
+/** Checks a file against its table of contents entry, if there is a table. */
+void CheckFile(const char* Name, const unsigned char* Data, size_t Size, BOOL Lazy)
+{
+   TocEntry* e;
+   if (TocEntries == NULL)
+      return;
+   e = FindTocEntry(Name);
+   if (e == NULL)
+      Problem("%s is not in the table of contents", Name);
+   else if (e->Size != Size || (!Lazy && (e->Flags & (TOC_FLAG_LAZY | TOC_FLAG_ARCHIVE))))
+      Problem("%s does not match the table of contents", Name);
+   else if (e->Crc != Crc32Update(0, Data, Size))
+      Problem("%s is damaged (CRC mismatch)", Name);
+   else
+      e->Seen = TRUE;
+}
+
+/**
+   Extraction
+*/
+
+/**
+   Returns the path of Name in the extraction directory, or NULL if
+   the name could refer to something outside it.
+*/
+char* TargetPath(const char* Name)
+{
+   const char* p = Name;
+   char* Path;
+   char* q;
+   if (*Name == 0 || *Name == '\\' || *Name == '/' || (Name[0] && Name[1] == ':'))
+      return NULL;
+   while (*p)
+   {
+      size_t Length = strcspn(p, "\\/");
+      if (Length == 2 && p[0] == '.' && p[1] == '.')
+         return NULL;
+      p += Length;
+      if (*p)
+         p++;
+   }
+   Path = (char*)MustAlloc(strlen(ExtractDir) + strlen(Name) + 2);
+   sprintf(Path, "%s/%s", ExtractDir, Name);
+   for (q = Path; *q; q++)
+   {
+#ifdef _WIN32
+      if (*q == '/')
+         *q = '\\';
+#else
+      if (*q == '\\')
+         *q = '/';
+#endif
+   }
+   return Path;
+}
+
+BOOL MakeDirectory(const char* Path)
+{
+#ifdef _WIN32
+   return _mkdir(Path) == 0 || errno == EEXIST;
+#else
+   return mkdir(Path, 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+/** Creates the directories that lead to Path. */
+void MakeParents(const char* Path)
+{
+   char* Parent = (char*)MustAlloc(strlen(Path) + 1);
+   char* p;
+   strcpy(Parent, Path);
+   for (p = Parent + strlen(ExtractDir) + 1; *p; p++)
+   {
+      if (*p == '/' || *p == '\\')
+      {
+         char Separator = *p;
+         *p = 0;
+         MakeDirectory(Parent);
+         *p = Separator;
+      }
+   }
+   free(Parent);
+}
+
+void CreateDirectoryRecord(const char* Name)
+{
+   char* Path;
+   Lock();
+   DirectoryCount++;
+   Unlock();
+   if (ExtractDir == NULL)
+      return;
+   Path = TargetPath(Name);
+   if (Path == NULL)
+   {
+      Problem("Refusing to create directory %s", Name);
+      return;
+   }
+   if (!MakeDirectory(Path))
+   {
+      MakeParents(Path);
+      if (!MakeDirectory(Path))
+         Problem("Failed to create %s: %s", Path, strerror(errno));
+   }
+   free(Path);
+}
+
+/** Checks a file and writes it to the extraction directory. */
+void CreateFileRecord(const char* Name, const unsigned char* Data, size_t Size, BOOL Lazy)
+{
+   char* Path;
+   FILE* f;
+
+   CheckFile(Name, Data, Size, Lazy);
+   Lock();
+   FileCount++;
+   FileBytes += Size;
+   Unlock();
+   if (ExtractDir == NULL)
+      return;
+
+   Path = TargetPath(Name);
+   if (Path == NULL)
+   {
+      Problem("Refusing to create file %s", Name);
+      return;
+   }
+   f = fopen(Path, "wb");
+   if (f == NULL)
+   {
+      MakeParents(Path);
+      f = fopen(Path, "wb");
+   }
+   if (f == NULL)
+      Problem("Failed to create %s: %s", Path, strerror(errno));
+   else if (fwrite(Data, 1, Size, f) != Size || fclose(f) != 0)
+      Problem("Failed to write %s", Path);
+   free(Path);
+}
+
+/** Copies a file, for links that cannot be hard links. */
+BOOL CopyWholeFile(const char* From, const char* To)
+{
+   unsigned char Data[COPY_BUFFER_SIZE];
+   size_t Count;
+   BOOL Failed;
+   FILE* In = fopen(From, "rb");
+   FILE* Out = In ? fopen(To, "wb") : NULL;
+   if (Out == NULL)
+   {
+      if (In)
+         fclose(In);
+      return FALSE;
+   }
+   while ((Count = fread(Data, 1, sizeof(Data), In)) > 0)
+      if (fwrite(Data, 1, Count, Out) != Count)
+         break;
+   Failed = ferror(In) || ferror(Out);
+   fclose(In);
+   return fclose(Out) == 0 && !Failed;
+}
+
+/** Creates a file with the contents of an earlier one, like the stub. */
+void CreateLinkRecord(const char* Name, const char* Existing)
+{
+   char* Path;
+   char* ExistingPath;
+   TocEntry* e = TocEntries ? FindTocEntry(Name) : NULL;
+
+   if (TocEntries && e == NULL)
+      Problem("%s is not in the table of contents", Name);
+   else if (e)
+      e->Seen = TRUE;
+   Lock();
+   LinkCount++;
+   Unlock();
+   if (ExtractDir == NULL)
+      return;
+
+   Path = TargetPath(Name);
+   ExistingPath = TargetPath(Existing);
+   if (Path == NULL || ExistingPath == NULL)
+      Problem("Refusing to link %s to %s", Name, Existing);
+   else
+   {
+#ifdef _WIN32
+      BOOL Linked = CreateHardLinkA(Path, ExistingPath, NULL);
+#else
+      BOOL Linked;
+      unlink(Path);
+      Linked = link(ExistingPath, Path) == 0;
+#endif
+      if (!Linked && !CopyWholeFile(ExistingPath, Path))
+         Problem("Failed to create %s from %s", Path, ExistingPath);
+   }
+   free(Path);
+   free(ExistingPath);
+}
+
+/**
+   Decoding
+*/
+
+const char* CodecName(unsigned int Codec)
+{
+   switch (Codec)
+   {
+   case TOC_CODEC_STORED: return "none";
+   case TOC_CODEC_LZMA: return "lzma";
+   case TOC_CODEC_LZ4: return "lz4";
+   default: return "unknown";
+   }
+}
+
+/**
+   Decodes a compressed block (header and data) into a buffer allocated
+   with malloc. OP_DECOMPRESS_LZMA uses the same header as LZMA blocks.
+*/
+BOOL DecodeBlock(unsigned int Codec, const unsigned char* Src, size_t Size, unsigned char** Data, size_t* DataSize)
+{
+   size_t HeaderSize = Codec == TOC_CODEC_LZMA ? LZMA_HEADER_SIZE : LZ4_HEADER_SIZE;
+   unsigned long long UnpackSize = 0;
+   unsigned char* Dest;
+   BOOL Ok;
+   double Start = Now();
+   int i;
+
+   if ((Codec != TOC_CODEC_LZMA && Codec != TOC_CODEC_LZ4) || Size < HeaderSize)
+      return FALSE;
+   for (i = 0; i < 8; i++)
+      UnpackSize |= (unsigned long long)Src[HeaderSize - 8 + i] << (8 * i);
+   if (UnpackSize > 0xFFFFFFFFULL)
+      return FALSE;
+
+   Dest = (unsigned char*)MustAlloc((size_t)UnpackSize);
+   if (Codec == TOC_CODEC_LZMA)
+   {
+      SizeT DestLen = (SizeT)UnpackSize;
+      SizeT SrcLen = Size - HeaderSize;
+      ELzmaStatus Status;
+      SRes Result = LzmaDecode(Dest, &DestLen, Src + HeaderSize, &SrcLen, Src, LZMA_PROPS_SIZE,
+                               LZMA_FINISH_END, &Status, &Alloc);
+      Ok = Result == SZ_OK && DestLen == UnpackSize;
+   }
+   else
+      Ok = Lz4_Decode(Dest, (size_t)UnpackSize, Src + HeaderSize, Size - HeaderSize);
+   if (!Ok)
+   {
+      free(Dest);
+      return FALSE;
+   }
+
+   Lock();
+   CompressedBytes += Size;
+   DecodedBytes += UnpackSize;
+   DecodeTime += Now() - Start;
+   Unlock();
+   *Data = Dest;
+   *DataSize = (size_t)UnpackSize;
+   return TRUE;
+}
+
+void RunBlocks(unsigned int Codec, unsigned char** Blocks, UINT32* Sizes, int Count, int Depth);
+
+/**
+   Lists, checks and extracts the records of a stream of opcodes.
+   Returns FALSE if the stream is damaged.
+*/
+BOOL ProcessRecords(Reader* r, Buffer* Listing, int Depth)
+{
+   while (r->Position < r->End)
+   {
+      UINT32 Opcode, a, b, c;
+      char* Name;
+      char* Value;
+      unsigned char* Data;
+
+      if (!ReadUInt32(r, &Opcode))
+         return FALSE;
+      switch (Opcode)
+      {
+      case OP_END:
+         List(Listing, Depth, "end");
+         return TRUE;
+
+      case OP_CREATE_DIRECTORY:
+         if (!ReadString(r, &Name))
+            return FALSE;
+         List(Listing, Depth, "mkdir        %s", Name);
+         CreateDirectoryRecord(Name);
+         break;
+
+      case OP_CREATE_FILE:
+      case OP_CREATE_FILE_X86:
+         if (!ReadString(r, &Name) || !ReadUInt32(r, &a) || !ReadBytes(r, a, &Data))
+            return FALSE;
+         List(Listing, Depth, "%-12s %s %u", Opcode == OP_CREATE_FILE ? "file" : "codefile", Name, a);
+         if (Opcode == OP_CREATE_FILE_X86)
+         {
+            UINT32 State;
+            x86_Convert_Init(State);
+            x86_Convert(Data, a, 0, &State, 0);
+         }
+         CreateFileRecord(Name, Data, a, FALSE);
+         break;
+
+      case OP_CREATE_LINK:
+         if (!ReadString(r, &Name) || !ReadString(r, &Value))
+            return FALSE;
+         List(Listing, Depth, "link         %s -> %s", Name, Value);
+         CreateLinkRecord(Name, Value);
+         break;
+
+      case OP_CREATE_PROCESS:
+      case OP_POST_CREATE_PROCESS:
+         if (!ReadString(r, &Name) || !ReadString(r, &Value))
+            return FALSE;
+         List(Listing, Depth, "%-12s %s %s", Opcode == OP_CREATE_PROCESS ? "process" : "postprocess", Name, Value);
+         break;
+
+      case OP_SETENV:
+         if (!ReadString(r, &Name) || !ReadString(r, &Value))
+            return FALSE;
+         List(Listing, Depth, "env          %s=%s", Name, Value);
+         break;
+
+      case OP_ENABLE_DEBUG_MODE:
+         List(Listing, Depth, "debug");
+         break;
+
+      case OP_CREATE_INST_DIRECTORY:
+         if (!ReadUInt32(r, &a) || !ReadUInt32(r, &b) || !ReadUInt32(r, &c))
+            return FALSE;
+         List(Listing, Depth, "instdir      next_to_exe=%u delete=%u chdir=%u", a, b, c);
+         break;
+
+      case OP_CREATE_CACHE_DIRECTORY:
+         if (!ReadString(r, &Name) || !ReadUInt32(r, &a) || !ReadUInt32(r, &c) || !ReadUInt32(r, &b))
+            return FALSE;
+         List(Listing, Depth, "cache        %s chdir=%u shared=%u payload=%u", Name, a, c, b);
+         break;
+
+      case OP_DECOMPRESS_LZMA:
+      {
+         size_t Size;
+         Reader Nested;
+         BOOL Ok;
+         if (!ReadUInt32(r, &a) || !ReadBytes(r, a, &Data))
+            return FALSE;
+         if (!DecodeBlock(TOC_CODEC_LZMA, Data, a, &Nested.Position, &Size))
+         {
+            Problem("Failed to decode the LZMA stream");
+            return FALSE;
+         }
+         List(Listing, Depth, "lzma         %u -> %lu bytes", a, (unsigned long)Size);
+         Data = Nested.Position;
+         Nested.End = Nested.Position + Size;
+         Ok = ProcessRecords(&Nested, Listing, Depth + 1);
+         free(Data);
+         if (!Ok)
+            Problem("The LZMA stream is damaged");
+         break;
+      }
+
+      case OP_DECOMPRESS_BLOCKS:
+      {
+         unsigned char** Blocks;
+         unsigned char* Sizes;
+         unsigned long long Total = 0;
+         UINT32 i;
+         if (!ReadUInt32(r, &a) || !ReadUInt32(r, &b) || b > (UINT32)(r->End - r->Position) / 4 ||
+             !ReadBytes(r, b * 4, &Sizes))
+            return FALSE;
+         Blocks = (unsigned char**)MustAlloc(b * sizeof(unsigned char*));
+         for (i = 0; i < b; i++)
+         {
+            Total += GetUInt32(Sizes + 4 * i);
+            if (!ReadBytes(r, GetUInt32(Sizes + 4 * i), &Blocks[i]))
+            {
+               free(Blocks);
+               return FALSE;
+            }
+         }
+         List(Listing, Depth, "blocks       %s, %u blocks, %llu bytes", CodecName(a), b, Total);
+         if (a == TOC_CODEC_LZMA || a == TOC_CODEC_LZ4)
+         {
+            UINT32* BlockSizes = (UINT32*)MustAlloc(b * sizeof(UINT32));
+            for (i = 0; i < b; i++)
+               BlockSizes[i] = GetUInt32(Sizes + 4 * i);
+            RunBlocks(a, Blocks, BlockSizes, (int)b, Depth + 1);
+            free(BlockSizes);
+         }
+         else
+            Problem("Unknown codec %u", a);
+         free(Blocks);
+         break;
+      }
+
+      default:
+         Problem("Unknown opcode %u", Opcode);
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/** Decodes a block and processes what it holds. */
+void RunJob(Job* j)
+{
+   unsigned char* Data;
+   size_t Size;
+   if (!DecodeBlock(j->Codec, j->Data, j->Size, &Data, &Size))
+   {
+      Problem("Failed to decode block %d", j->Index);
+      return;
+   }
+   List(&j->Listing, j->Depth, "block %-6d %lu -> %lu bytes", j->Index, (unsigned long)j->Size, (unsigned long)Size);
+   if (j->Stream)
+   {
+      int i;
+      for (i = 0; i < TocEntryCount; i++)
+      {
+         TocEntry* e = &TocEntries[i];
+         if (e->Stream != j->Stream || !(e->Flags & TOC_FLAG_LAZY))
+            continue;
+         List(&j->Listing, j->Depth + 1, "%-12s %s %llu", (e->Flags & TOC_FLAG_BACKGROUND) ? "bgfile" : "lazyfile", e->Name, e->Size);
+         if (e->Offset > Size || e->Size > Size - e->Offset)
+            Problem("%s is outside its block", e->Name);
+         else
+            CreateFileRecord(e->Name, Data + e->Offset, (size_t)e->Size, TRUE);
+      }
+   }
+   else
+   {
+      Reader r;
+      r.Position = Data;
+      r.End = Data + Size;
+      if (!ProcessRecords(&r, &j->Listing, j->Depth + 1))
+         Problem("Block %d is damaged", j->Index);
+   }
+   free(Data);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Worker(LPVOID p)
+#else
+static void* Worker(void* p)
+#endif
+{
+   for (;;)
+   {
+      int i;
+      Lock();
+      i = NextJob < JobCount ? NextJob++ : -1;
+      Unlock();
+      if (i < 0)
+         break;
+      RunJob(&Jobs[i]);
+   }
+   return 0;
+}
+
+/** Runs the jobs on up to ThreadCount threads, then prints their listings in order. */
+void RunJobs(void)
+{
+#ifdef _WIN32
+   HANDLE Threads[MAX_THREADS];
+#else
+   pthread_t Threads[MAX_THREADS];
+#endif
+   int Started = 0, i;
+
+   NextJob = 0;
+   for (i = 1; i < ThreadCount && i < JobCount; i++)
+   {
+#ifdef _WIN32
+      Threads[Started] = CreateThread(NULL, 0, Worker, NULL, 0, NULL);
+      if (Threads[Started] == NULL)
+         break;
+#else
+      if (pthread_create(&Threads[Started], NULL, Worker, NULL) != 0)
+         break;
+#endif
+      Started++;
+   }
+   Worker(NULL);
+   for (i = 0; i < Started; i++)
+   {
+#ifdef _WIN32
+      WaitForSingleObject(Threads[i], INFINITE);
+      CloseHandle(Threads[i]);
+#else
+      pthread_join(Threads[i], NULL);
+#endif
+   }
+
+   for (i = 0; i < JobCount; i++)
+   {
+      fwrite(Jobs[i].Listing.Data, 1, Jobs[i].Listing.Size, stdout);
+      BufferFree(&Jobs[i].Listing);
+   }
+   free(Jobs);
+   Jobs = NULL;
+   JobCount = 0;
+}
+
+void AddJob(unsigned int Codec, unsigned char* Data, size_t Size, unsigned int Stream, int Index, int Depth)
+{
+   Job* j;
+   Jobs = (Job*)realloc(Jobs, (JobCount + 1) * sizeof(Job));
+   if (Jobs == NULL)
+      Fatal("Out of memory");
+   j = &Jobs[JobCount++];
+   memset(j, 0, sizeof(Job));
+   j->Codec = Codec;
+   j->Data = Data;
+   j->Size = Size;
+   j->Stream = Stream;
+   j->Index = Index;
+   j->Depth = Depth;
+}
+
+/** Decodes and extracts the blocks of an OP_DECOMPRESS_BLOCKS record in parallel. */
+void RunBlocks(unsigned int Codec, unsigned char** Blocks, UINT32* Sizes, int Count, int Depth)
+{
+   int i;
+   for (i = 0; i < Count; i++)
+      AddJob(Codec, Blocks[i], Sizes[i], 0, i, Depth);
+   RunJobs();
+}
+
+/**
+   Extracts the files that only the table of contents refers to: the
+   stored ones directly, and the compressed ones a block at a time.
+*/
+void ProcessLazyFiles(void)
+{
+   unsigned int Stream;
+   int i;
+   for (i = 0; i < TocEntryCount; i++)
+   {
+      TocEntry* e = &TocEntries[i];
+      if (!(e->Flags & (TOC_FLAG_LAZY | TOC_FLAG_ARCHIVE)) || e->Stream != 0)
+         continue;
+      List(NULL, 0, "%-12s %s %llu", (e->Flags & TOC_FLAG_ARCHIVE) ? "archivefile" : (e->Flags & TOC_FLAG_BACKGROUND) ? "bgfile" : "lazyfile", e->Name, e->Size);
+      if (e->Offset > ImageSize || e->Size > ImageSize - e->Offset)
+         Problem("%s is outside the executable", e->Name);
+      else
+         CreateFileRecord(e->Name, Image + e->Offset, (size_t)e->Size, TRUE);
+   }
+   for (Stream = 1; Stream <= (unsigned int)TocStreamCount; Stream++)
+   {
+      unsigned long long Offset = TocStreams[2 * (Stream - 1)];
+      unsigned long long Size = TocStreams[2 * (Stream - 1) + 1];
+      unsigned int Codec = TOC_CODEC_STORED;
+      for (i = 0; i < TocEntryCount; i++)
+         if (TocEntries[i].Stream == Stream && (TocEntries[i].Flags & TOC_FLAG_LAZY))
+            Codec = TocEntries[i].Codec;
+      if (Codec == TOC_CODEC_STORED)
+         continue;
+      if (Offset > ImageSize || Size > ImageSize - Offset)
+         Problem("Stream %u is outside the executable", Stream);
+      else
+         AddJob(Codec, Image + Offset, (size_t)Size, Stream, (int)Stream - 1, 0);
+   }
+   RunJobs();
+}
+
+/**
+   Main
+*/
+
+void Usage(void)
+{
+   fprintf(stderr,
+           "Usage: ocraunpack [options] EXECUTABLE\n"
+           "\n"
+           "Checks the payload of an OCRA executable without running it.\n"
+           "\n"
+           "--list             List the records of the payload.\n"
+           "--extract DIR      Extract the files to DIR.\n"
+           "--threads N        Blocks decoded at the same time (default: one per processor).\n"
+           "--quiet            Don't print the summary.\n");
+   exit(2);
+}
+
+void ReadImage(void)
+{
+   FILE* f = fopen(ImagePath, "rb");
+   long long Size;
+   if (f == NULL)
+      Fatal("Failed to open %s", ImagePath);
+#ifdef _WIN32
+   _fseeki64(f, 0, SEEK_END);
+   Size = _ftelli64(f);
+#else
+   fseeko(f, 0, SEEK_END);
+   Size = ftello(f);
+#endif
+   if (Size < 0 || (unsigned long long)Size > (size_t)-1)
+      Fatal("%s is too large", ImagePath);
+   rewind(f);
+   ImageSize = (size_t)Size;
+   Image = (unsigned char*)MustAlloc(ImageSize);
+   if (fread(Image, 1, ImageSize, f) != ImageSize)
+      Fatal("Failed to read %s", ImagePath);
+   fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+   Reader r;
+   UINT32 OpcodeOffset;
+   double Start;
+   int i;
+
+   ToolName = "ocraunpack";
+   FatalStatus = 2;
+   InitLock();
+   Crc32Init();
+   ThreadCount = GetProcessorCount();
+
+   for (i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "--list") == 0)
+         ListEnabled = TRUE;
+      else if (strcmp(argv[i], "--extract") == 0 && i + 1 < argc)
+         ExtractDir = argv[++i];
+      else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+         ThreadCount = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--quiet") == 0)
+         Quiet = TRUE;
+      else if (argv[i][0] == '-' && argv[i][1] == '-')
+         Usage();
+      else if (ImagePath == NULL)
+         ImagePath = argv[i];
+      else
+         Usage();
+   }
+   if (ImagePath == NULL)
+      Usage();
+   if (ThreadCount < 1)
+      ThreadCount = 1;
+   if (ThreadCount > MAX_THREADS)
+      ThreadCount = MAX_THREADS;
+   if (ExtractDir && !MakeDirectory(ExtractDir))
+      Fatal("Failed to create %s", ExtractDir);
+
+   ReadImage();
+   if (ImageSize < 8 || memcmp(Image + ImageSize - 4, Signature, sizeof(Signature)) != 0)
+      Fatal("%s is not an OCRA executable", ImagePath);
+   OpcodeOffset = GetUInt32(Image + ImageSize - 8);
+   if (OpcodeOffset >= ImageSize - 8)
+      Fatal("%s: the opcode offset is outside the executable", ImagePath);
+
+   Start = Now();
+   ReadToc();
+   r.Position = Image + OpcodeOffset;
+   r.End = Image + ImageSize - 8;
+   if (!ProcessRecords(&r, NULL, 0))
+      Problem("The opcodes are damaged or truncated");
+   ProcessLazyFiles();
+   for (i = 0; i < TocEntryCount; i++)
+      if (!TocEntries[i].Seen)
+         Problem("%s is in the table of contents but not in the payload", TocEntries[i].Name);
+
+   if (!Quiet)
+   {
+      double Elapsed = Now() - Start;
+      fprintf(stderr, "%d files (%llu bytes), %d directories, %d links %s in %.1f ms (%.1f MB/s)\n",
+              FileCount, FileBytes, DirectoryCount, LinkCount, ExtractDir ? "extracted" : "checked",
+              Elapsed * 1000, Elapsed > 0 ? FileBytes / Elapsed / 1e6 : 0.0);
+      if (DecodedBytes)
+         fprintf(stderr, "Decoded %llu bytes from %llu in %.1f ms of decoding (%.1f MB/s per thread, %d threads)\n",
+                 DecodedBytes, CompressedBytes, DecodeTime * 1000,
+                 DecodeTime > 0 ? DecodedBytes / DecodeTime / 1e6 : 0.0, ThreadCount);
+      fprintf(stderr, "%s\n", Problems ? "FAILED" : "OK");
+   }
+   return Problems ? 1 : 0;
+}
@@ -6,11 +6,15 @@
 */
 
 #include <windows.h>
+#include <psapi.h>
 #include <string.h>
+#include <stdlib.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 const BYTE Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
+const BYTE TocSignature[] = { 0x41, 0xb6, 0xba, 0x54 };
 
 #define OP_END 0
 #define OP_CREATE_DIRECTORY 1
@@ -21,11 +25,33 @@ const BYTE Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
 #define OP_POST_CREATE_PROCRESS 6
 #define OP_ENABLE_DEBUG_MODE 7
 #define OP_CREATE_INST_DIRECTORY 8
-#define OP_MAX 9
+#define OP_CREATE_CACHE_DIRECTORY 9
+#define OP_DECOMPRESS_BLOCKS 10
+#define OP_CREATE_LINK 11
+#define OP_CREATE_FILE_X86 12
+#define OP_MAX 13
+
+#define TOC_VERSION 2
+#define TOC_CODEC_STORED 0
+#define TOC_CODEC_LZMA 1
+#define TOC_CODEC_LZ4 2
+#define TOC_CODEC_MAX 3
+#define TOC_FLAG_LAZY 1
+#define TOC_FLAG_BACKGROUND 4
+#define TOC_FLAG_ARCHIVE 8
 
 BOOL ProcessImage(LPVOID p, DWORD size);
 BOOL ProcessOpcodes(LPVOID* p);
+BOOL ProcessOpcodesUntil(LPVOID* p, LPVOID end);
+BOOL ProcessOpcode(LPVOID* p);
 void CreateAndWaitForProcess(LPTSTR ApplicationName, LPTSTR CommandLine);
+void IoInitialize();
+BOOL IoFlush();
+BOOL IoShutdown();
+BOOL TocPrepare();
+BOOL LazyStartServer();
+void LazyStartBackground();
+void LazyStopBackground();
 
 BOOL OpEnd(LPVOID* p);
 BOOL OpCreateFile(LPVOID* p);
@@ -36,10 +62,18 @@ BOOL OpSetEnv(LPVOID* p);
 BOOL OpPostCreateProcess(LPVOID* p);
 BOOL OpEnableDebugMode(LPVOID* p);
 BOOL OpCreateInstDirectory(LPVOID* p);
+BOOL OpCreateCacheDirectory(LPVOID* p);
+BOOL OpDecompressBlocks(LPVOID* p);
+BOOL OpCreateLink(LPVOID* p);
+BOOL OpCreateFileX86(LPVOID* p);
 
 #if WITH_LZMA
 #include <LzmaDec.h>
 #endif
+#if WITH_LZ4
+#include <Lz4Dec.h>
+#endif
+#include <Bra.h>
 
 typedef BOOL (*POpcodeHandler)(LPVOID*);
 
@@ -49,8 +83,12 @@ LPTSTR PostCreateProcess_CommandLine = NULL;
 DWORD ExitStatus = 0;
 BOOL ExitCondition = FALSE;
 BOOL DebugModeEnabled = FALSE;
-BOOL DeleteInstDirEnabled = FALSE;
+/* 0 to keep the installation directory, 1 to delete it, 2 to defer
+   its deletion (see DeferDeletion) */
+#define DELETE_INSTDIR_DEFER 2
+DWORD DeleteInstDirEnabled = FALSE;
 BOOL ChdirBeforeRunEnabled = TRUE;
+BOOL LazyServerRunning = FALSE;
 TCHAR ImageFileName[MAX_PATH];
 
 #if _CONSOLE
@@ -84,9 +122,378 @@ POpcodeHandler OpcodeHandlers[OP_MAX] =
    &OpPostCreateProcess,
    &OpEnableDebugMode,
    &OpCreateInstDirectory,
+   &OpCreateCacheDirectory,
+   &OpDecompressBlocks,
+   &OpCreateLink,
+   &OpCreateFileX86,
+};
+
+LPCSTR OpcodeNames[OP_MAX] =
+{
+   "OpEnd", "OpCreateDirectory", "OpCreateFile", "OpCreateProcess",
+   "OpDecompressLzma", "OpSetEnv", "OpPostCreateProcess",
+   "OpEnableDebugMode", "OpCreateInstDirectory", "OpCreateCacheDirectory",
+   "OpDecompressBlocks", "OpCreateLink", "OpCreateFileX86",
+};
+
+/*
+   Startup benchmarking. When OCRA_BENCHMARK names a file, the stub
+   times the phases of the run and appends them to that file as a line
+   of JSON, in milliseconds, when it exits. map, extract, launch, run,
+   cleanup and total are wall clock times. mkdir, decode and write add
+   up the time spent on every thread, so they overlap with each other
+   and may exceed extract. copied counts the bytes the stub copied
+   between its own buffers after decoding them, written the bytes it
+   copied into files with WriteFile, and mapped the bytes it decoded
+   straight into files (see MapInstFile).
+*/
+enum
+{
+   BENCH_MAP, BENCH_MKDIR, BENCH_DECODE, BENCH_WRITE, BENCH_EXTRACT,
+   BENCH_LAUNCH, BENCH_RUN, BENCH_CLEANUP, BENCH_TOTAL, BENCH_PHASES
+};
+
+const char* BenchPhaseNames[BENCH_PHASES] =
+{
+   "map", "mkdir", "decode", "write", "extract",
+   "launch", "run", "cleanup", "total"
 };
 
+BOOL BenchEnabled = FALSE;
+TCHAR BenchFileName[MAX_PATH];
+LONGLONG BenchTicks[BENCH_PHASES];
+LONGLONG BenchStartTime;
+LONG BenchFiles = 0;
+LONGLONG BenchCopied = 0;
+LONGLONG BenchWritten = 0;
+LONGLONG BenchMapped = 0;
+CRITICAL_SECTION BenchLock;
+
+BOOL TraceEnabled = FALSE;
+
+/** Returns the start time of a phase or event, if benchmarking or tracing. */
+LONGLONG TimerStart()
+{
+   LARGE_INTEGER Now;
+   if (!BenchEnabled && !TraceEnabled)
+      return 0;
+   QueryPerformanceCounter(&Now);
+   return Now.QuadPart;
+}
+
+/** Adds the time since Start to a phase. Safe to call from any thread. */
+void BenchEnd(int Phase, LONGLONG Start)
+{
+   LARGE_INTEGER Now;
+   if (!BenchEnabled)
+      return;
+   QueryPerformanceCounter(&Now);
+   EnterCriticalSection(&BenchLock);
+   BenchTicks[Phase] += Now.QuadPart - Start;
+   LeaveCriticalSection(&BenchLock);
+}
+
+/** Adds to a byte counter. Safe to call from any thread. */
+void BenchCount(LONGLONG* Counter, SIZE_T Bytes)
+{
+   if (!BenchEnabled)
+      return;
+   EnterCriticalSection(&BenchLock);
+   *Counter += Bytes;
+   LeaveCriticalSection(&BenchLock);
+}
+
+void BenchInitialize()
+{
+   DWORD len = GetEnvironmentVariable(_T("OCRA_BENCHMARK"), BenchFileName, MAX_PATH);
+   if (len == 0 || len >= MAX_PATH)
+      return;
+   InitializeCriticalSection(&BenchLock);
+   BenchEnabled = TRUE;
+   BenchStartTime = TimerStart();
+}
+
+/** Appends the phase times to the OCRA_BENCHMARK file. */
+void BenchReport()
+{
+   if (!BenchEnabled)
+      return;
+   BenchEnd(BENCH_TOTAL, BenchStartTime);
+
+   LARGE_INTEGER Frequency;
+   QueryPerformanceFrequency(&Frequency);
+   char Line[1024];
+   int Length = _snprintf(Line, sizeof(Line), "{\"exit\":%lu,\"files\":%ld", ExitStatus, BenchFiles);
+   int i;
+   for (i = 0; i < BENCH_PHASES; i++)
+   {
+      Length += _snprintf(Line + Length, sizeof(Line) - Length, ",\"%s\":%.3f",
+                          BenchPhaseNames[i], BenchTicks[i] * 1000.0 / Frequency.QuadPart);
+   }
+   Length += _snprintf(Line + Length, sizeof(Line) - Length, ",\"copied\":%.0f,\"written\":%.0f,\"mapped\":%.0f}\n",
+                       (double)BenchCopied, (double)BenchWritten, (double)BenchMapped);
+
+   HANDLE h = CreateFile(BenchFileName, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (h == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to open benchmark file '%s'.", BenchFileName);
+      return;
+   }
+   DWORD BytesWritten;
+   WriteFile(h, Line, Length, &BytesWritten, NULL);
+   CloseHandle(h);
+}
+
+/*
+   Tracing. When OCRA_TRACE names a file, the stub records the start
+   and duration of every opcode handler, directory and file it
+   creates, block of data it decompresses, process it launches and of
+   the cleanup, with the sizes involved. When it exits, it writes them
+   to that file in the Chrome trace event format, which
+   chrome://tracing and ui.perfetto.dev display as a timeline with one
+   row per thread, followed by the peak memory use. Events are kept in
+   memory until then. Without OCRA_TRACE, each event costs a test of
+   TraceEnabled.
+
+   The stub also sets OCRA_TRACE_START to its start time on the
+   monotonic clock, in microseconds. Executables built with --trace
+   preload ocra_trace.rb, which appends the time Ruby spends in require
+   and load to the OCRA_TRACE file relative to that time. The stub
+   deletes the file when it starts, and includes whatever Ruby appended
+   in its own trace.
+*/
+#define TRACE_CHUNK_EVENTS 4096
+
+typedef struct
+{
+   LPCSTR Category;
+   LPCSTR Name;
+   LPTSTR Detail;
+   LONGLONG Start;
+   LONGLONG Duration;
+   ULONGLONG Bytes;
+   DWORD ThreadId;
+} TraceEvent;
+
+typedef struct TraceChunk
+{
+   struct TraceChunk* Next;
+   DWORD Count;
+   TraceEvent Events[TRACE_CHUNK_EVENTS];
+} TraceChunk;
+
+TCHAR TraceFileName[MAX_PATH];
+TraceChunk* TraceFirst = NULL;
+TraceChunk* TraceLast = NULL;
+LONGLONG TraceStartTime;
+CRITICAL_SECTION TraceLock;
+
+void TraceInitialize()
+{
+   DWORD len = GetEnvironmentVariable(_T("OCRA_TRACE"), TraceFileName, MAX_PATH);
+   if (len == 0 || len >= MAX_PATH)
+      return;
+   InitializeCriticalSection(&TraceLock);
+   TraceEnabled = TRUE;
+   TraceStartTime = TimerStart();
+
+   (void)DeleteFile(TraceFileName);
+   LARGE_INTEGER Frequency;
+   QueryPerformanceFrequency(&Frequency);
+   TCHAR Start[32];
+   _sntprintf(Start, 32, _T("%.3f"), TraceStartTime * 1000000.0 / Frequency.QuadPart);
+   SetEnvironmentVariable(_T("OCRA_TRACE_START"), Start);
+}
+
+/**
+   Reads the events that child processes appended to the trace file.
+   Returns NULL if there are none.
+*/
+LPSTR TraceReadChildEvents(DWORD* Size)
+{
+   HANDLE h = CreateFile(TraceFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (h == INVALID_HANDLE_VALUE)
+      return NULL;
+   LPSTR Data = NULL;
+   *Size = GetFileSize(h, NULL);
+   if (*Size != INVALID_FILE_SIZE && *Size > 0)
+   {
+      Data = LocalAlloc(LMEM_FIXED, *Size);
+      DWORD BytesRead;
+      if (Data && (!ReadFile(h, Data, *Size, &BytesRead, NULL) || BytesRead != *Size))
+      {
+         LocalFree(Data);
+         Data = NULL;
+      }
+   }
+   CloseHandle(h);
+   return Data;
+}
+
+/**
+   Records an event that began at Start (from TimerStart) and ends
+   now. Bytes and Detail (e.g. a file name) are optional. Safe to call
+   from any thread.
+*/
+void TraceEnd(LPCSTR Category, LPCSTR Name, LONGLONG Start, ULONGLONG Bytes, LPCTSTR Detail)
+{
+   if (!TraceEnabled)
+      return;
+   LARGE_INTEGER Now;
+   QueryPerformanceCounter(&Now);
+   LPTSTR DetailCopy = NULL;
+   if (Detail)
+   {
+      DetailCopy = LocalAlloc(LMEM_FIXED, (lstrlen(Detail) + 1) * sizeof(TCHAR));
+      if (DetailCopy)
+         lstrcpy(DetailCopy, Detail);
+   }
+
+   EnterCriticalSection(&TraceLock);
+   if (TraceLast == NULL || TraceLast->Count == TRACE_CHUNK_EVENTS)
+   {
+      TraceChunk* Chunk = LocalAlloc(LMEM_FIXED, sizeof(TraceChunk));
+      if (Chunk == NULL)
+      {
+         LeaveCriticalSection(&TraceLock);
+         return;
+      }
+      Chunk->Next = NULL;
+      Chunk->Count = 0;
+      if (TraceLast)
+         TraceLast->Next = Chunk;
+      else
+         TraceFirst = Chunk;
+      TraceLast = Chunk;
+   }
+   TraceEvent* e = &TraceLast->Events[TraceLast->Count++];
+   e->Category = Category;
+   e->Name = Name;
+   e->Detail = DetailCopy;
+   e->Start = Start;
+   e->Duration = Now.QuadPart - Start;
+   e->Bytes = Bytes;
+   e->ThreadId = GetCurrentThreadId();
+   LeaveCriticalSection(&TraceLock);
+}
+
+/** Buffered output of the trace file. */
+typedef struct
+{
+   HANDLE File;
+   DWORD Length;
+   char Data[65536];
+} TraceWriter;
+
+void TraceWrite(TraceWriter* w, LPCSTR Format, ...)
+{
+   if (w->Length > sizeof(w->Data) - 1024)
+   {
+      DWORD BytesWritten;
+      WriteFile(w->File, w->Data, w->Length, &BytesWritten, NULL);
+      w->Length = 0;
+   }
+   va_list Args;
+   va_start(Args, Format);
+   int n = _vsnprintf(w->Data + w->Length, sizeof(w->Data) - w->Length, Format, Args);
+   va_end(Args);
+   if (n > 0)
+      w->Length += n;
+}
+
+/** Writes a file name as a JSON string, escaping backslashes and quotes. */
+void TraceWriteString(TraceWriter* w, LPCTSTR String)
+{
+   char Escaped[2 * MAX_PATH + 1];
+   int n = 0;
+   for (; *String && n < 2 * MAX_PATH - 1; String++)
+   {
+      if (*String == '\\' || *String == '"')
+         Escaped[n++] = '\\';
+      Escaped[n++] = (*String >= 0 && *String < ' ') ? '?' : (char)*String;
+   }
+   Escaped[n] = 0;
+   TraceWrite(w, "\"%s\"", Escaped);
+}
+
+/** Writes the recorded events and the peak memory use to the OCRA_TRACE file. */
+void TraceReport()
+{
+   if (!TraceEnabled)
+      return;
+
+   TraceWriter* w = LocalAlloc(LMEM_FIXED, sizeof(TraceWriter));
+   if (w == NULL)
+      return;
+   w->Length = 0;
+   DWORD ChildSize = 0;
+   LPSTR ChildEvents = TraceReadChildEvents(&ChildSize);
+   w->File = CreateFile(TraceFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (w->File == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to create trace file '%s'.", TraceFileName);
+      LocalFree(w);
+      LocalFree(ChildEvents);
+      return;
+   }
+
+   LARGE_INTEGER Now, Frequency;
+   QueryPerformanceCounter(&Now);
+   QueryPerformanceFrequency(&Frequency);
+   double Scale = 1000000.0 / Frequency.QuadPart;
+   DWORD Pid = GetCurrentProcessId();
+
+   TraceWrite(w, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+   TraceWrite(w, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%lu,\"args\":{\"name\":", Pid);
+   TraceWriteString(w, ImageFileName);
+   TraceWrite(w, "}}");
+
+   EnterCriticalSection(&TraceLock);
+   TraceChunk* Chunk;
+   for (Chunk = TraceFirst; Chunk; Chunk = Chunk->Next)
+   {
+      DWORD i;
+      for (i = 0; i < Chunk->Count; i++)
+      {
+         TraceEvent* e = &Chunk->Events[i];
+         TraceWrite(w, ",\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%.0f",
+                    e->Category, e->Name, Pid, e->ThreadId, (e->Start - TraceStartTime) * Scale,
+                    e->Duration * Scale, (double)e->Bytes);
+         if (e->Detail)
+         {
+            TraceWrite(w, ",\"name\":");
+            TraceWriteString(w, e->Detail);
+         }
+         TraceWrite(w, "}}");
+      }
+   }
+   LeaveCriticalSection(&TraceLock);
+
+   DWORD BytesWritten;
+   if (ChildEvents)
+   {
+      WriteFile(w->File, w->Data, w->Length, &BytesWritten, NULL);
+      w->Length = 0;
+      WriteFile(w->File, ChildEvents, ChildSize, &BytesWritten, NULL);
+      LocalFree(ChildEvents);
+   }
+
+   PROCESS_MEMORY_COUNTERS Memory;
+   ZeroMemory(&Memory, sizeof(Memory));
+   GetProcessMemoryInfo(GetCurrentProcess(), &Memory, sizeof(Memory));
+   TraceWrite(w, ",\n{\"ph\":\"C\",\"name\":\"memory\",\"pid\":%lu,\"ts\":%.3f,\"args\":{\"peak_working_set\":%.0f,\"peak_pagefile\":%.0f}}",
+              Pid, (Now.QuadPart - TraceStartTime) * Scale,
+              (double)Memory.PeakWorkingSetSize, (double)Memory.PeakPagefileUsage);
+   TraceWrite(w, "\n]}\n");
+
+   WriteFile(w->File, w->Data, w->Length, &BytesWritten, NULL);
+   CloseHandle(w->File);
+   LocalFree(w);
+}
+
 TCHAR InstDir[MAX_PATH];
+LPBYTE ImageBase = NULL;
+DWORD ImageSize = 0;
 
 /** Decoder: Zero-terminated string */
 LPTSTR GetString(LPVOID* p)
@@ -128,13 +535,43 @@ void FindExeDir(TCHAR* d)
    }
 }
 
-BOOL DeleteRecursively(LPTSTR path)
+/**
+   Limits on the work done deleting old files. Deletion stops
+   MaxTime milliseconds after Start (GetTickCount values), unless
+   MaxTime is 0, once MaxBytes have been deleted, or once Stop is set.
+*/
+typedef struct
+{
+   DWORD Start;
+   DWORD MaxTime;
+   ULONGLONG MaxBytes;
+   volatile BOOL Stop;
+   DWORD Files;
+   ULONGLONG Bytes;
+} DeleteBudget;
+
+typedef enum { DELETE_DONE, DELETE_FAILED, DELETE_OUT_OF_BUDGET } DeleteResult;
+
+BOOL BudgetExhausted(DeleteBudget* Budget)
+{
+   return Budget != NULL &&
+      (Budget->Stop || Budget->Bytes >= Budget->MaxBytes ||
+       (Budget->MaxTime > 0 && GetTickCount() - Budget->Start >= Budget->MaxTime));
+}
+
+/**
+   Delete a directory tree. Without a budget, files and directories
+   that cannot be deleted are scheduled for deletion at reboot. With
+   one, deletion stops when it is used up, and the deleted files are
+   counted against it.
+*/
+DeleteResult DeleteTree(LPTSTR path, DeleteBudget* Budget)
 {
    TCHAR findPath[MAX_PATH];
    DWORD pathLength;
    WIN32_FIND_DATA findData;
    HANDLE handle;
-   BOOL AnyFailed = FALSE;
+   DeleteResult Result = DELETE_DONE;
 
    lstrcpy(findPath, path);
    pathLength = lstrlen(findPath);
@@ -149,35 +586,56 @@ BOOL DeleteRecursively(LPTSTR path)
       findPath[pathLength] = 0;
       if (handle != INVALID_HANDLE_VALUE) {
          do {
+            if (BudgetExhausted(Budget)) {
+               Result = DELETE_OUT_OF_BUDGET;
+               break;
+            }
             if (pathLength + lstrlen(findData.cFileName) < MAX_PATH) {
                TCHAR subPath[MAX_PATH];
                lstrcpy(subPath, findPath);
                lstrcat(subPath, findData.cFileName);
                if ((lstrcmp(findData.cFileName, ".") != 0) && (lstrcmp(findData.cFileName, "..") != 0)) {
                   if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                     if (!DeleteRecursively(subPath))
-                        AnyFailed = TRUE;
+                     DeleteResult SubResult = DeleteTree(subPath, Budget);
+                     if (SubResult == DELETE_OUT_OF_BUDGET) {
+                        Result = DELETE_OUT_OF_BUDGET;
+                        break;
+                     }
+                     if (SubResult == DELETE_FAILED)
+                        Result = DELETE_FAILED;
+                  } else if (DeleteFile(subPath)) {
+                     if (Budget) {
+                        Budget->Files++;
+                        Budget->Bytes += ((ULONGLONG)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+                     }
                   } else {
-                     if (!DeleteFile(subPath)) {
+                     if (!Budget)
                         MoveFileEx(subPath, NULL, MOVEFILE_DELAY_UNTIL_REBOOT);
-                        AnyFailed = TRUE;
-                     }
+                     Result = DELETE_FAILED;
                   }
                }
             } else {
-               AnyFailed = TRUE;
+               Result = DELETE_FAILED;
             }
          } while (FindNextFile(handle, &findData));
          FindClose(handle);
       }
    } else {
-      AnyFailed = TRUE;
+      Result = DELETE_FAILED;
    }
+   if (Result == DELETE_OUT_OF_BUDGET)
+      return Result;
    if (!RemoveDirectory(findPath)) {
-      MoveFileEx(findPath, NULL, MOVEFILE_DELAY_UNTIL_REBOOT);
-      AnyFailed = TRUE;
+      if (!Budget)
+         MoveFileEx(findPath, NULL, MOVEFILE_DELAY_UNTIL_REBOOT);
+      Result = DELETE_FAILED;
    }
-   return AnyFailed;
+   return Result;
+}
+
+BOOL DeleteRecursively(LPTSTR path)
+{
+   return DeleteTree(path, NULL) == DELETE_DONE;
 }
 
 void MarkForDeletion(LPTSTR path)
@@ -195,375 +653,1983 @@ void DeleteRecursivelyNowOrLater(LPTSTR path)
       MarkForDeletion(path);
 }
 
-void DeleteOldFiles()
+#define TRASH_DIRECTORY_NAME _T("ocra-trash")
+
+/* Seconds a deferred deletion gets before a later launch takes over */
+#define TRASH_GRACE_SECONDS 60
+
+/* Seconds before a directory that could not be deleted is tried again */
+#define DELETE_RETRY_SECONDS 3600
+
+/* Default limits on deleting old files in one launch */
+#define GC_DEFAULT_TIME 50
+#define GC_DEFAULT_SIZE 256
+
+/**
+   Progress of the deletion of a directory, kept in its marker file
+   (as text) so that it adds up over the launches that share the work.
+   Failed is set when the last attempt ran into files that could not
+   be deleted, and the directory is then left alone for
+   DELETE_RETRY_SECONDS.
+*/
+typedef struct
+{
+   DWORD Launches;
+   DWORD Files;
+   DWORD KBytes;
+   DWORD Failed;
+} DeleteProgress;
+
+ULONGLONG FileTimeSeconds(FILETIME* Time)
 {
-   TCHAR path[MAX_PATH];
-   DWORD len = GetTempPath(MAX_PATH, path);
-   if (path[len-1] != '\\') {
-      lstrcat(path, "\\");
-      len += 1;
-   }
+   ULARGE_INTEGER Value;
+   Value.LowPart = Time->dwLowDateTime;
+   Value.HighPart = Time->dwHighDateTime;
+   return Value.QuadPart / 10000000;
+}
+
+/**
+   Delete the directories in path that are marked for deletion and
+   whose marker was created at least MinAge seconds ago, within the
+   budget. path must end with a backslash.
+
+   An instance holds the marker open without sharing while it deletes
+   the directory, so concurrent launches skip the directories others
+   are working on. The marker is deleted with the directory, or, when
+   the budget runs out first, updated with the progress made, and a
+   later launch continues where this one stopped. Returns FALSE when
+   the budget ran out.
+*/
+BOOL DeleteMarkedFiles(LPTSTR path, DWORD MinAge, DeleteBudget* Budget)
+{
+   DWORD len = lstrlen(path);
+   if (len + lstrlen("*.ocra-delete-me") >= MAX_PATH)
+      return TRUE;
    lstrcat(path, "*.ocra-delete-me");
    WIN32_FIND_DATA findData;
    HANDLE handle = FindFirstFile(path, &findData);
    path[len] = 0;
    if (handle == INVALID_HANDLE_VALUE)
-      return;
+      return TRUE;
+   FILETIME NowTime;
+   GetSystemTimeAsFileTime(&NowTime);
+   ULONGLONG Now = FileTimeSeconds(&NowTime);
+   BOOL Complete = TRUE;
    do {
+      if (FileTimeSeconds(&findData.ftCreationTime) + MinAge > Now)
+         continue;
+      if (len + lstrlen(findData.cFileName) >= MAX_PATH)
+         continue;
+
+      TCHAR markerPath[MAX_PATH];
       TCHAR ocraPath[MAX_PATH];
-      lstrcpy(ocraPath, path);
-      lstrcat(ocraPath, findData.cFileName);
-      DeleteFile(ocraPath);
-      DWORD len = lstrlen(ocraPath);
-      len -= lstrlen(".ocra-delete-me");
-      ocraPath[len] = 0;
-      DeleteRecursivelyNowOrLater(ocraPath);
+      lstrcpy(markerPath, path);
+      lstrcat(markerPath, findData.cFileName);
+      lstrcpy(ocraPath, markerPath);
+      ocraPath[lstrlen(ocraPath) - lstrlen(".ocra-delete-me")] = 0;
+
+      HANDLE Marker = CreateFile(markerPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      if (Marker == INVALID_HANDLE_VALUE)
+      {
+         DEBUG("Skipping '%s', which another instance is deleting", ocraPath);
+         continue;
+      }
+
+      DeleteProgress Progress = { 0, 0, 0, 0 };
+      char Text[64];
+      DWORD Read = 0;
+      if (ReadFile(Marker, Text, sizeof(Text) - 1, &Read, NULL))
+      {
+         Text[Read] = 0;
+         sscanf(Text, "%lu %lu %lu %lu", &Progress.Launches, &Progress.Files, &Progress.KBytes, &Progress.Failed);
+      }
+      if (Progress.Failed && FileTimeSeconds(&findData.ftLastWriteTime) + DELETE_RETRY_SECONDS > Now)
+      {
+         CloseHandle(Marker);
+         continue;
+      }
+
+      DWORD Files = Budget->Files;
+      ULONGLONG Bytes = Budget->Bytes;
+      DeleteResult Result = DELETE_DONE;
+      if (GetFileAttributes(ocraPath) != INVALID_FILE_ATTRIBUTES)
+         Result = DeleteTree(ocraPath, Budget);
+      DEBUG("Deleted %lu files from '%s'", Budget->Files - Files, ocraPath);
+
+      if (Result == DELETE_DONE)
+      {
+         CloseHandle(Marker);
+         DeleteFile(markerPath);
+         continue;
+      }
+
+      Progress.Launches++;
+      Progress.Files += Budget->Files - Files;
+      Progress.KBytes += (DWORD)((Budget->Bytes - Bytes) / 1024);
+      Progress.Failed = Result == DELETE_FAILED;
+      int Length = _snprintf(Text, sizeof(Text), "%lu %lu %lu %lu\n", Progress.Launches, Progress.Files, Progress.KBytes, Progress.Failed);
+      DWORD Written;
+      SetFilePointer(Marker, 0, NULL, FILE_BEGIN);
+      WriteFile(Marker, Text, Length, &Written, NULL);
+      SetEndOfFile(Marker);
+      CloseHandle(Marker);
+
+      if (Result == DELETE_OUT_OF_BUDGET)
+      {
+         Complete = FALSE;
+         break;
+      }
    } while (FindNextFile(handle, &findData));
    FindClose(handle);
+   return Complete;
 }
 
-BOOL OpCreateInstDirectory(LPVOID* p)
+/**
+   Delete the directories in path (of length len) that could not be
+   deleted, and those in its trash whose deferred deletion did not
+   finish in time. Returns FALSE when the budget ran out.
+*/
+BOOL DeleteOldFilesIn(LPTSTR path, DWORD len, DeleteBudget* Budget)
 {
-   DWORD DebugExtractMode = GetInteger(p);
+   if (len == 0 || len >= MAX_PATH - 32)
+      return TRUE;
+   if (path[len-1] != '\\')
+      lstrcat(path, "\\");
+   if (!DeleteMarkedFiles(path, 0, Budget))
+      return FALSE;
+   lstrcat(path, TRASH_DIRECTORY_NAME);
+   lstrcat(path, "\\");
+   return DeleteMarkedFiles(path, TRASH_GRACE_SECONDS, Budget);
+}
 
-   DeleteInstDirEnabled = GetInteger(p);
-   ChdirBeforeRunEnabled = GetInteger(p);
+/**
+   Delete what earlier runs left behind within the budget, in the temp
+   path and in OCRA_RAM_DIR (see RamChooseTarget).
+*/
+void DeleteOldFiles(DeleteBudget* Budget)
+{
+   LONGLONG Start = TimerStart();
+   TCHAR path[MAX_PATH];
+   if (DeleteOldFilesIn(path, GetTempPath(MAX_PATH, path), Budget))
+      DeleteOldFilesIn(path, GetEnvironmentVariable(_T("OCRA_RAM_DIR"), path, MAX_PATH), Budget);
+   TraceEnd("cleanup", "DeleteOldFiles", Start, Budget->Bytes, NULL);
+}
 
-   /* Create an installation directory that will hold the extracted files */
-   TCHAR TempPath[MAX_PATH];
-   if (DebugExtractMode)
-   {
-      // In debug extraction mode, create the temp directory next to the exe
-      FindExeDir(TempPath);
-      if (strlen(TempPath) == 0)
-      {
-         FATAL("Unable to find directory containing exe");
-         return FALSE;
-      }
-   }
-   else
+DeleteBudget GcBudget;
+BOOL GcBackground = FALSE;
+HANDLE GcThread = NULL;
+
+DWORD WINAPI GcThreadProc(LPVOID Parameter)
+{
+   DeleteOldFiles(&GcBudget);
+   return 0;
+}
+
+/**
+   Collect the directories left behind by earlier runs. By default,
+   this is done before extracting, and stops after OCRA_GC_TIME
+   milliseconds (GC_DEFAULT_TIME) or OCRA_GC_SIZE megabytes
+   (GC_DEFAULT_SIZE); OCRA_GC_TIME=0 turns it off. With
+   OCRA_GC_BACKGROUND=1, it is done instead at idle priority while the
+   program runs (see GcStartBackground), without a time limit.
+*/
+void GcInitialize()
+{
+   TCHAR Value[16];
+   DWORD Time = GC_DEFAULT_TIME;
+   DWORD Size = GC_DEFAULT_SIZE;
+   DWORD len = GetEnvironmentVariable(_T("OCRA_GC_TIME"), Value, 16);
+   if (len > 0 && len < 16)
+      Time = _ttoi(Value);
+   len = GetEnvironmentVariable(_T("OCRA_GC_SIZE"), Value, 16);
+   if (len > 0 && len < 16)
+      Size = _ttoi(Value);
+   if (Time == 0 || Size == 0)
+      return;
+
+   ZeroMemory(&GcBudget, sizeof(GcBudget));
+   GcBudget.MaxBytes = (ULONGLONG)Size * 1024 * 1024;
+   len = GetEnvironmentVariable(_T("OCRA_GC_BACKGROUND"), Value, 16);
+   if (len > 0 && len < 16 && _ttoi(Value) > 0)
    {
-      GetTempPath(MAX_PATH, TempPath);
+      GcBackground = TRUE;
+      return;
    }
+   GcBudget.Start = GetTickCount();
+   GcBudget.MaxTime = Time;
+   DeleteOldFiles(&GcBudget);
+}
 
-   UINT tempResult = GetTempFileName(TempPath, _T("ocrastub"), 0, InstDir);
-   if (tempResult == 0u)
+/** Start collecting in the background, if OCRA_GC_BACKGROUND is set. */
+void GcStartBackground()
+{
+   if (!GcBackground || GcThread != NULL)
+      return;
+   GcThread = CreateThread(NULL, 0, GcThreadProc, NULL, 0, NULL);
+   if (GcThread != NULL)
+      SetThreadPriority(GcThread, THREAD_PRIORITY_IDLE);
+}
+
+/**
+   Stop collecting in the background. Waits for the file being
+   deleted, so that the marker is updated before the stub exits.
+*/
+void GcStopBackground()
+{
+   if (GcThread == NULL)
+      return;
+   GcBudget.Stop = TRUE;
+   WaitForSingleObject(GcThread, INFINITE);
+   CloseHandle(GcThread);
+   GcThread = NULL;
+}
+
+/**
+   Start a detached process at idle priority that deletes path, and
+   then its marker if path is gone. It runs outside any job object the
+   stub is in when that is allowed, so that it survives the job being
+   closed.
+*/
+BOOL StartDeleter(LPCTSTR path)
+{
+   TCHAR Shell[MAX_PATH];
+   DWORD len = GetEnvironmentVariable(_T("ComSpec"), Shell, MAX_PATH);
+   if (len == 0 || len >= MAX_PATH)
    {
-      FATAL("Failed to get temp file name.");
-      return FALSE;
+      if (GetSystemDirectory(Shell, MAX_PATH - 16) == 0)
+         return FALSE;
+      lstrcat(Shell, _T("\\cmd.exe"));
    }
 
-   DEBUG("Creating installation directory: '%s'", InstDir);
+   TCHAR CommandLine[5 * MAX_PATH];
+   _sntprintf(CommandLine, 5 * MAX_PATH,
+              _T("\"%s\" /d /c rd /s /q \"%s\" & if not exist \"%s\" del /f /q \"%s.ocra-delete-me\""),
+              Shell, path, path, path);
+   CommandLine[5 * MAX_PATH - 1] = 0;
 
-   /* Attempt to delete the temp file created by GetTempFileName.
-      Ignore errors, i.e. if it doesn't exist. */
-   (void)DeleteFile(InstDir);
+   TCHAR SystemDirectory[MAX_PATH];
+   if (GetSystemDirectory(SystemDirectory, MAX_PATH) == 0)
+      lstrcpy(SystemDirectory, _T("C:\\"));
 
-   if (!CreateDirectory(InstDir, NULL))
+   STARTUPINFO StartupInfo;
+   PROCESS_INFORMATION ProcessInformation;
+   ZeroMemory(&StartupInfo, sizeof(StartupInfo));
+   StartupInfo.cb = sizeof(StartupInfo);
+   DWORD Flags = CREATE_NO_WINDOW | IDLE_PRIORITY_CLASS;
+   if (!CreateProcess(Shell, CommandLine, NULL, NULL, FALSE, Flags | CREATE_BREAKAWAY_FROM_JOB,
+                      NULL, SystemDirectory, &StartupInfo, &ProcessInformation) &&
+       !CreateProcess(Shell, CommandLine, NULL, NULL, FALSE, Flags,
+                      NULL, SystemDirectory, &StartupInfo, &ProcessInformation))
    {
-      FATAL("Failed to create installation directory.");
+      DEBUG("Failed to start deletion of '%s' (error %lu)", path, GetLastError());
       return FALSE;
    }
+   CloseHandle(ProcessInformation.hThread);
+   CloseHandle(ProcessInformation.hProcess);
    return TRUE;
 }
 
-int CALLBACK _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLine, int nCmdShow)
+/**
+   Deferred cleanup (instdir with DELETE set to 2). Moves the
+   installation directory into the trash next to it, which is a rename
+   on the same volume and so takes the same time whatever the size of
+   the payload, marks it for deletion and hands it to StartDeleter, so
+   that the exit status is returned right away. Should the deleter not
+   start or not finish, a launch after TRASH_GRACE_SECONDS deletes it
+   instead. Deletes the directory now if it cannot be moved, e.g.
+   because a process the program started is still using it.
+*/
+void DeferDeletion(LPTSTR path)
 {
-   DeleteOldFiles();
-
-   /* Find name of image */
-   if (!GetModuleFileName(NULL, ImageFileName, MAX_PATH))
+   TCHAR TrashDir[MAX_PATH];
+   TCHAR TrashPath[MAX_PATH];
+   lstrcpy(TrashDir, path);
+   LPTSTR Separator = _tcsrchr(TrashDir, '\\');
+   if (Separator == NULL || (Separator - TrashDir) + lstrlen(TRASH_DIRECTORY_NAME) + 16 >= MAX_PATH)
    {
-      FATAL("Failed to get executable name (error %lu).", GetLastError());
-      return -1;
+      DeleteRecursivelyNowOrLater(path);
+      return;
    }
+   lstrcpy(Separator + 1, TRASH_DIRECTORY_NAME);
+   if ((!CreateDirectory(TrashDir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) ||
+       GetTempFileName(TrashDir, _T("ocra"), 0, TrashPath) == 0u)
+   {
+      DEBUG("Failed to create trash directory '%s' (error %lu)", TrashDir, GetLastError());
+      DeleteRecursivelyNowOrLater(path);
+      return;
+   }
+   (void)DeleteFile(TrashPath);
+   if (!MoveFileEx(path, TrashPath, 0))
+   {
+      DEBUG("Failed to move '%s' to the trash (error %lu)", path, GetLastError());
+      DeleteRecursivelyNowOrLater(path);
+      return;
+   }
+   DEBUG("Moved installation directory to '%s'", TrashPath);
+   MarkForDeletion(TrashPath);
+   StartDeleter(TrashPath);
+}
 
+/*
+   Table of contents. ocrapack --toc appends a list of all directories
+   and files in the payload after the opcodes (see src/ocrapack.c for
+   the format). When present, the stub checks for free space and
+   creates all directories in one pass before extracting, and in debug
+   mode verifies the extracted files against their checksums. Lazy
+   files are only reachable through the table of contents, and archive
+   files are never extracted at all: Ruby reads them from the image
+   (see share/ocra/ocra_archive.rb).
+*/
+typedef struct
+{
+   LPTSTR Name;
+   DWORD Flags;
+   BOOL Extracted;
+   DWORD Codec;
+   DWORD Stream;
+   ULONGLONG Offset;
+   ULONGLONG Size;
+   DWORD Crc;
+} TocEntry;
+
+BOOL TocLoaded = FALSE;
+DWORD TocStreamCount = 0;
+DWORD TocDirectoryCount = 0;
+DWORD TocEntryCount = 0;
+DWORD TocLazyCount = 0;
+DWORD TocBackgroundCount = 0;
+ULONGLONG TocTotalSize = 0;
+ULONGLONG* TocStreams = NULL;
+LPTSTR* TocDirectories = NULL;
+TocEntry* TocEntries = NULL;
+BOOL TocDirectoriesCreated = FALSE;
+
+/** Decoder: LEB128 variable length integer. Fails past End. */
+BOOL GetVarint(LPBYTE* p, LPBYTE End, ULONGLONG* Value)
+{
+   int Shift = 0;
+   *Value = 0;
+   while (*p < End && Shift < 64)
+   {
+      BYTE b = *(*p)++;
+      *Value |= (ULONGLONG)(b & 0x7F) << Shift;
+      if (!(b & 0x80))
+         return TRUE;
+      Shift += 7;
+   }
+   return FALSE;
+}
 
-   /* By default, assume the installation directory is wherever the EXE is */
-   FindExeDir(InstDir);
-
-   /* Set up environment */
-   SetEnvironmentVariable(_T("OCRA_EXECUTABLE"), ImageFileName);
+/** Decoder: front coded name, sharing a prefix with Previous. */
+LPTSTR GetFrontCodedName(LPBYTE* p, LPBYTE End, LPTSTR Previous)
+{
+   ULONGLONG Shared, Length;
+   if (!GetVarint(p, End, &Shared) || !GetVarint(p, End, &Length))
+      return NULL;
+   if (Shared > (Previous ? (ULONGLONG)lstrlen(Previous) : 0) || Length > (ULONGLONG)(End - *p) || Shared + Length >= MAX_PATH)
+      return NULL;
+   LPTSTR Name = LocalAlloc(LMEM_FIXED, (Shared + Length + 1) * sizeof(TCHAR));
+   if (Name == NULL)
+      return NULL;
+   if (Shared)
+      memcpy(Name, Previous, Shared);
+   memcpy(Name + Shared, *p, Length);
+   Name[Shared + Length] = 0;
+   *p += Length;
+   return Name;
+}
 
-   SetConsoleCtrlHandler(&ConsoleHandleRoutine, TRUE);
+/**
+   Reads the table of contents, if the image has one. A missing table
+   is not an error; a damaged one is reported and ignored.
+*/
+void ReadToc(LPVOID ptr, DWORD size)
+{
+   if (size < 16 || memcmp(ptr + size - 12, TocSignature, 4) != 0)
+      return;
 
-   /* Open the image (executable) */
-   HANDLE hImage = CreateFile(ImageFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-   if (hImage == INVALID_HANDLE_VALUE)
+   DWORD TocOffset = *(DWORD*)(ptr + size - 16);
+   LPBYTE p = ptr + TocOffset;
+   LPBYTE End = ptr + size - 16;
+   if (TocOffset > size - 16 || End - p < 28 || *(DWORD*)p != TOC_VERSION)
    {
-      FATAL("Failed to open executable (%s)", ImageFileName);
-      return -1;
+      DEBUG("Ignoring unsupported table of contents.");
+      return;
    }
 
-   /* Create a file mapping */
-   DWORD FileSize = GetFileSize(hImage, NULL);
-   HANDLE hMem = CreateFileMapping(hImage, NULL, PAGE_READONLY, 0, FileSize, NULL);
-   if (hMem == INVALID_HANDLE_VALUE)
+   TocStreamCount = *(DWORD*)(p + 4);
+   TocDirectoryCount = *(DWORD*)(p + 8);
+   TocEntryCount = *(DWORD*)(p + 12);
+   TocTotalSize = *(DWORD*)(p + 16) | ((ULONGLONG)*(DWORD*)(p + 20) << 32);
+   p += 28;
+   if (TocStreamCount > (DWORD)(End - p) || TocDirectoryCount > (DWORD)(End - p) || TocEntryCount > (DWORD)(End - p))
    {
-      FATAL("Failed to create file mapping (error %lu)", GetLastError());
-      CloseHandle(hImage);
-      return -1;
+      FATAL("Damaged table of contents.");
+      return;
    }
 
-   /* Map the image into memory */
-   LPVOID lpv = MapViewOfFile(hMem, FILE_MAP_READ, 0, 0, 0);
-   if (lpv == NULL)
+   TocStreams = LocalAlloc(LMEM_FIXED, (2 * TocStreamCount + 1) * sizeof(ULONGLONG));
+   TocDirectories = LocalAlloc(LMEM_FIXED | LMEM_ZEROINIT, (TocDirectoryCount + 1) * sizeof(LPTSTR));
+   TocEntries = LocalAlloc(LMEM_FIXED | LMEM_ZEROINIT, (TocEntryCount + 1) * sizeof(TocEntry));
+   if (TocStreams == NULL || TocDirectories == NULL || TocEntries == NULL)
    {
-      FATAL("Failed to map view of executable into memory (error %lu).", GetLastError());
+      FATAL("Failed to allocate table of contents.");
+      return;
    }
-   else
-   {
-      if (!ProcessImage(lpv, FileSize))
-      {
-         ExitStatus = -1;
-      }
 
-      if (!UnmapViewOfFile(lpv))
+   DWORD i;
+   for (i = 0; i < 2 * TocStreamCount; i++)
+   {
+      if (!GetVarint(&p, End, &TocStreams[i]))
       {
-         FATAL("Failed to unmap view of executable.");
+         FATAL("Damaged table of contents.");
+         return;
       }
    }
 
-   if (!CloseHandle(hMem))
+   for (i = 0; i < TocDirectoryCount; i++)
    {
-      FATAL("Failed to close file mapping.");
+      TocDirectories[i] = GetFrontCodedName(&p, End, i ? TocDirectories[i - 1] : NULL);
+      if (TocDirectories[i] == NULL)
+      {
+         FATAL("Damaged table of contents.");
+         return;
+      }
    }
 
-   if (!CloseHandle(hImage))
+   for (i = 0; i < TocEntryCount; i++)
    {
-      FATAL("Failed to close executable.");
+      TocEntry* e = &TocEntries[i];
+      ULONGLONG Flags, Codec, Stream;
+      e->Name = GetFrontCodedName(&p, End, i ? TocEntries[i - 1].Name : NULL);
+      if (e->Name == NULL || !GetVarint(&p, End, &Flags) ||
+          !GetVarint(&p, End, &Codec) || !GetVarint(&p, End, &Stream) ||
+          !GetVarint(&p, End, &e->Offset) || !GetVarint(&p, End, &e->Size) ||
+          End - p < 4)
+      {
+         FATAL("Damaged table of contents.");
+         return;
+      }
+      e->Flags = (DWORD)Flags;
+      e->Codec = (DWORD)Codec;
+      e->Stream = (DWORD)Stream;
+      e->Crc = *(DWORD*)p;
+      p += 4;
+      if (e->Flags & TOC_FLAG_LAZY)
+         TocLazyCount++;
+      if ((e->Flags & TOC_FLAG_LAZY) && (e->Flags & TOC_FLAG_BACKGROUND))
+         TocBackgroundCount++;
+      /* Archive files take no disk space. */
+      if ((e->Flags & TOC_FLAG_ARCHIVE) && TocTotalSize >= e->Size)
+         TocTotalSize -= e->Size;
    }
 
-   if (ChdirBeforeRunEnabled)
-   {
-      DEBUG("Changing CWD to unpacked directory %s/src", InstDir);
-      SetCurrentDirectory(InstDir);
-      SetCurrentDirectory("./src");
-   }
+   TocLoaded = TRUE;
+}
 
-   if (PostCreateProcess_ApplicationName && PostCreateProcess_CommandLine)
+/** Binary search for a file in the table of contents. */
+TocEntry* TocFindEntry(LPTSTR Name)
+{
+   DWORD Low = 0, High = TocEntryCount;
+   while (Low < High)
    {
-      DEBUG("**********");
-      DEBUG("Starting app in: %s", InstDir);
-      DEBUG("**********");
-      CreateAndWaitForProcess(PostCreateProcess_ApplicationName, PostCreateProcess_CommandLine);
+      DWORD Mid = Low + (High - Low) / 2;
+      int Cmp = strcmp(TocEntries[Mid].Name, Name);
+      if (Cmp == 0)
+         return &TocEntries[Mid];
+      if (Cmp < 0)
+         Low = Mid + 1;
+      else
+         High = Mid;
    }
+   return NULL;
+}
 
-   if (DeleteInstDirEnabled)
+/** Binary search for a directory in the table of contents. */
+BOOL TocHasDirectory(LPTSTR Name)
+{
+   DWORD Low = 0, High = TocDirectoryCount;
+   while (Low < High)
    {
-      DEBUG("Deleting temporary installation directory %s", InstDir);
-      TCHAR SystemDirectory[MAX_PATH];
-      if (GetSystemDirectory(SystemDirectory, MAX_PATH) > 0)
-         SetCurrentDirectory(SystemDirectory);
+      DWORD Mid = Low + (High - Low) / 2;
+      int Cmp = strcmp(TocDirectories[Mid], Name);
+      if (Cmp == 0)
+         return TRUE;
+      if (Cmp < 0)
+         Low = Mid + 1;
       else
-         SetCurrentDirectory("C:\\");
-      DeleteRecursivelyNowOrLater(InstDir);
+         High = Mid;
    }
-
-   ExitProcess(ExitStatus);
-
-   /* Never gets here */
-   return 0;
+   return FALSE;
 }
 
 /**
-   Process the image by checking the signature and locating the first
-   opcode.
+   Prepares a new installation directory using the table of contents:
+   checks that the files will fit, and creates all directories up
+   front. Sorted order puts parents before their subdirectories.
 */
-BOOL ProcessImage(LPVOID ptr, DWORD size)
+BOOL TocPrepare()
 {
-   LPVOID pSig = ptr + size - 4;
-   if (memcmp(pSig, Signature, 4) == 0)
-   {
-      DEBUG("Good signature found.");
-      DWORD OpcodeOffset = *(DWORD*)(pSig - 4);
-      LPVOID pSeg = ptr + OpcodeOffset;
-      return ProcessOpcodes(&pSeg);
-   }
-   else
+   if (!TocLoaded)
+      return TRUE;
+
+   ULARGE_INTEGER FreeBytes;
+   if (GetDiskFreeSpaceEx(InstDir, &FreeBytes, NULL, NULL) && FreeBytes.QuadPart < TocTotalSize)
    {
-      FATAL("Bad signature in executable.");
+      FATAL("Not enough disk space to extract %I64u bytes to '%s'.", TocTotalSize, InstDir);
       return FALSE;
    }
-}
 
-/**
-   Process the opcodes in memory.
-*/
-BOOL ProcessOpcodes(LPVOID* p)
-{
-   while (!ExitCondition)
+   DWORD i;
+   for (i = 0; i < TocDirectoryCount; i++)
    {
-      DWORD opcode = GetInteger(p);
-      if (opcode < OP_MAX)
+      TCHAR DirName[MAX_PATH];
+      if (lstrlen(InstDir) + lstrlen(TocDirectories[i]) + 2 > MAX_PATH)
       {
-         if (!OpcodeHandlers[opcode](p))
-         {
-            return FALSE;
-         }
+         FATAL("Directory name too long.");
+         return FALSE;
       }
-      else
+      lstrcpy(DirName, InstDir);
+      lstrcat(DirName, _T("\\"));
+      lstrcat(DirName, TocDirectories[i]);
+      LONGLONG Start = TimerStart();
+      if (!CreateDirectory(DirName, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
       {
-         FATAL("Invalid opcode '%lu'.", opcode);
+         FATAL("Failed to create directory '%s'.", DirName);
          return FALSE;
       }
+      BenchEnd(BENCH_MKDIR, Start);
+      TraceEnd("io", "CreateDirectory", Start, 0, TocDirectories[i]);
    }
+   DEBUG("Table of contents: %lu files, %I64u bytes, created %lu directories.", TocEntryCount, TocTotalSize, TocDirectoryCount);
+   TocDirectoriesCreated = TRUE;
    return TRUE;
 }
 
-/**
-   Expands a specially formatted string, replacing | with the
-   temporary installation directory.
-*/
-void ExpandPath(LPTSTR* out, LPTSTR str)
+DWORD Crc32(DWORD Crc, LPBYTE Data, DWORD Size)
 {
-   DWORD OutSize = lstrlen(str) + sizeof(TCHAR);
-   LPTSTR a = str;
-   while ((a = _tcschr(a, L'|')))
+   static DWORD Table[256];
+   if (Table[1] == 0)
    {
-      OutSize += lstrlen(InstDir) - sizeof(TCHAR);
-      a++;
+      DWORD i, j;
+      for (i = 0; i < 256; i++)
+      {
+         DWORD c = i;
+         for (j = 0; j < 8; j++)
+            c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+         Table[i] = c;
+      }
    }
+   Crc = ~Crc;
+   while (Size--)
+      Crc = Table[(Crc ^ *Data++) & 0xFF] ^ (Crc >> 8);
+   return ~Crc;
+}
 
-   *out = LocalAlloc(LMEM_FIXED, OutSize);
-
-   LPTSTR OutPtr = *out;
-   while ((a = _tcschr(str, L'|')))
+/**
+   Checks the extracted files against the table of contents. Used in
+   debug mode only.
+*/
+BOOL TocVerify()
+{
+   static BYTE Buffer[65536];
+   DWORD i, Failures = 0;
+   for (i = 0; i < TocEntryCount; i++)
    {
-      int l = a - str;
-      if (l > 0)
+      if (TocEntries[i].Flags & (TOC_FLAG_LAZY | TOC_FLAG_ARCHIVE))
+         continue;
+
+      TCHAR Fn[MAX_PATH];
+      lstrcpy(Fn, InstDir);
+      lstrcat(Fn, _T("\\"));
+      lstrcat(Fn, TocEntries[i].Name);
+
+      HANDLE hFile = CreateFile(Fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      DWORD Crc = 0, BytesRead;
+      ULONGLONG Size = 0;
+      if (hFile != INVALID_HANDLE_VALUE)
       {
-         memcpy(OutPtr, str, l);
-         OutPtr += l;
-         str += l;
+         while (ReadFile(hFile, Buffer, sizeof(Buffer), &BytesRead, NULL) && BytesRead > 0)
+         {
+            Crc = Crc32(Crc, Buffer, BytesRead);
+            Size += BytesRead;
+         }
+         CloseHandle(hFile);
+      }
+      if (hFile == INVALID_HANDLE_VALUE || Size != TocEntries[i].Size || Crc != TocEntries[i].Crc)
+      {
+         DEBUG("Verification failed: '%s'", Fn);
+         Failures++;
       }
-      str += sizeof(TCHAR);
-      lstrcpy(OutPtr, InstDir);
-      OutPtr += lstrlen(OutPtr);
    }
-   lstrcpy(OutPtr, str);
+   DEBUG("Verified %lu files, %lu failures.", TocEntryCount, Failures);
+   return Failures == 0;
 }
 
+/*
+   RAM-backed extraction. Windows has neither tmpfs nor memfd, but it
+   has RAM disks, and files created with FILE_ATTRIBUTE_TEMPORARY,
+   which the file cache keeps in memory and only writes back when it
+   runs short, so that files deleted when the program exits need never
+   reach the disk. This is off unless OCRA_RAM_LIMIT is set. When the
+   payload (TocTotalSize) fits in OCRA_RAM_LIMIT megabytes and in half
+   the available physical memory, a temporary installation directory
+   goes in OCRA_RAM_DIR, or else on a RAM disk (the temp path's drive
+   or the first drive that reports DRIVE_RAMDISK), if it has room, and
+   otherwise in the temp path with temporary files. Larger payloads,
+   and those of executables without a table of contents, whose size is
+   not known up front, are extracted as usual. The cleanup of earlier
+   runs looks in OCRA_RAM_DIR as well as the temp path; directories
+   left on another RAM disk by a crashed run are gone after a reboot.
+*/
+
+BOOL RamTemporaryFiles = FALSE;
+
 /**
-   Finds the start of the first argument after the current one. Handles quoted arguments.
+   Checks that Dir exists and has room for the payload, and unless
+   AnyDrive is set, that it is on a RAM disk.
 */
-LPTSTR SkipArg(LPTSTR str)
+BOOL RamDirFits(LPCTSTR Dir, BOOL AnyDrive)
 {
-   if (*str == '"')
-   {
-      str++;
-      while (*str && *str != '"') { str++; }
-      if (*str == '"') { str++; }
-   }
-   else
+   DWORD Attributes = GetFileAttributes(Dir);
+   if (Attributes == INVALID_FILE_ATTRIBUTES || !(Attributes & FILE_ATTRIBUTE_DIRECTORY))
+      return FALSE;
+   if (!AnyDrive)
    {
-      while (*str && *str != ' ') { str++; }
+      TCHAR Root[4] = { Dir[0], _T(':'), _T('\\'), 0 };
+      if (lstrlen(Dir) < 2 || Dir[1] != _T(':') || GetDriveType(Root) != DRIVE_RAMDISK)
+         return FALSE;
    }
-   while (*str && *str != ' ') { str++; }
-   return str;
+   ULARGE_INTEGER FreeBytes;
+   return GetDiskFreeSpaceEx(Dir, &FreeBytes, NULL, NULL) && FreeBytes.QuadPart >= TocTotalSize;
 }
 
 /**
-   Create a file (OP_CREATE_FILE opcode handler)
+   Chooses the directory that holds a temporary installation
+   directory. Copies it to Path, with a trailing backslash, and returns
+   what kind of location it is for the debug and trace output:
+   "ramdisk", "temporary" (the temp path with temporary files) or
+   "disk".
 */
-BOOL OpCreateFile(LPVOID* p)
+LPCTSTR RamChooseTarget(LPTSTR Path)
 {
-   BOOL Result = TRUE;
-   LPTSTR FileName = GetString(p);
-   DWORD FileSize = GetInteger(p);
-   LPVOID Data = *p;
-   *p += FileSize;
+   TCHAR Value[MAX_PATH];
+   ULONGLONG Limit = 0;
+   DWORD len = GetEnvironmentVariable(_T("OCRA_RAM_LIMIT"), Value, MAX_PATH);
+   if (len > 0 && len < MAX_PATH)
+      Limit = _ttoi(Value);
+   Limit *= 1024 * 1024;
+
+   GetTempPath(MAX_PATH, Path);
+   if (Limit == 0 || !TocLoaded)
+      return _T("disk");
+
+   MEMORYSTATUSEX Memory;
+   Memory.dwLength = sizeof(Memory);
+   if (GlobalMemoryStatusEx(&Memory) && Memory.ullAvailPhys / 2 < Limit)
+      Limit = Memory.ullAvailPhys / 2;
+   if (TocTotalSize > Limit)
+   {
+      DEBUG("Payload of %I64u bytes exceeds the RAM budget of %I64u bytes.", TocTotalSize, Limit);
+      return _T("disk");
+   }
 
-   TCHAR Fn[MAX_PATH];
-   lstrcpy(Fn, InstDir);
-   lstrcat(Fn, _T("\\"));
-   lstrcat(Fn, FileName);
+   len = GetEnvironmentVariable(_T("OCRA_RAM_DIR"), Value, MAX_PATH);
+   if (len > 0 && len < MAX_PATH - 16 && RamDirFits(Value, TRUE))
+   {
+      lstrcpy(Path, Value);
+      if (Path[len - 1] != _T('\\'))
+         lstrcat(Path, _T("\\"));
+      return _T("ramdisk");
+   }
+   else if (len > 0)
+   {
+      DEBUG("OCRA_RAM_DIR '%s' does not exist or is too small.", Value);
+   }
 
-   DEBUG("CreateFile(%s, %lu)", Fn, FileSize);
-   HANDLE hFile = CreateFile(Fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
-   if (hFile != INVALID_HANDLE_VALUE)
+   if (RamDirFits(Path, FALSE))
+      return _T("ramdisk");
+
+   DWORD Drives = GetLogicalDrives();
+   int Drive;
+   for (Drive = 0; Drive < 26; Drive++)
    {
-      DWORD BytesWritten;
-      if (!WriteFile(hFile, Data, FileSize, &BytesWritten, NULL))
-      {
-         FATAL("Write failure (%lu)", GetLastError());
-         Result = FALSE;
-      }
-      if (BytesWritten != FileSize)
+      TCHAR Root[4] = { _T('A') + Drive, _T(':'), _T('\\'), 0 };
+      if ((Drives & (1 << Drive)) && RamDirFits(Root, FALSE))
       {
-         FATAL("Write size failure");
-         Result = FALSE;
+         lstrcpy(Path, Root);
+         return _T("ramdisk");
       }
-      CloseHandle(hFile);
-   }
-   else
-   {
-      FATAL("Failed to create file '%s'", Fn);
-      Result = FALSE;
    }
 
-   return Result;
+   RamTemporaryFiles = TRUE;
+   return _T("temporary");
 }
 
-/**
-   Create a directory (OP_CREATE_DIRECTORY opcode handler)
-*/
-BOOL OpCreateDirectory(LPVOID* p)
+BOOL OpCreateInstDirectory(LPVOID* p)
 {
-   LPTSTR DirectoryName = GetString(p);
-
-   TCHAR DirName[MAX_PATH];
-   lstrcpy(DirName, InstDir);
-   lstrcat(DirName, _T("\\"));
-   lstrcat(DirName, DirectoryName);
+   DWORD DebugExtractMode = GetInteger(p);
 
-   DEBUG("CreateDirectory(%s)", DirName);
+   DeleteInstDirEnabled = GetInteger(p);
+   ChdirBeforeRunEnabled = GetInteger(p);
 
-   if (!CreateDirectory(DirName, NULL))
+   /* Create an installation directory that will hold the extracted files */
+   TCHAR TempPath[MAX_PATH];
+   if (DebugExtractMode)
    {
-      if (GetLastError() == ERROR_ALREADY_EXISTS)
-      {
-         DEBUG("Directory already exists");
-      }
-      else
+      // In debug extraction mode, create the temp directory next to the exe
+      FindExeDir(TempPath);
+      if (strlen(TempPath) == 0)
       {
-         FATAL("Failed to create directory '%s'.", DirName);
+         FATAL("Unable to find directory containing exe");
          return FALSE;
       }
    }
+   else if (DeleteInstDirEnabled)
+   {
+      LONGLONG Start = TimerStart();
+      LPCTSTR Target = RamChooseTarget(TempPath);
+      TCHAR Detail[MAX_PATH + 16];
+      _sntprintf(Detail, MAX_PATH + 16, _T("%s %s"), Target, TempPath);
+      Detail[MAX_PATH + 15] = 0;
+      DEBUG("Extraction target: %s (%I64u bytes)", Detail, TocTotalSize);
+      TraceEnd("image", "ChooseTarget", Start, TocTotalSize, Detail);
+   }
+   else
+   {
+      GetTempPath(MAX_PATH, TempPath);
+   }
 
-   return TRUE;
-}
-
-void GetCreateProcessInfo(LPVOID* p, LPTSTR* pApplicationName, LPTSTR* pCommandLine)
-{
-   LPTSTR ImageName = GetString(p);
-   LPTSTR CmdLine = GetString(p);
+   UINT tempResult = GetTempFileName(TempPath, _T("ocrastub"), 0, InstDir);
+   if (tempResult == 0u)
+   {
+      FATAL("Failed to get temp file name.");
+      return FALSE;
+   }
 
-   ExpandPath(pApplicationName, ImageName);
+   DEBUG("Creating installation directory: '%s'", InstDir);
 
-   LPTSTR ExpandedCommandLine;
-   ExpandPath(&ExpandedCommandLine, CmdLine);
+   /* Attempt to delete the temp file created by GetTempFileName.
+      Ignore errors, i.e. if it doesn't exist. */
+   (void)DeleteFile(InstDir);
 
-   LPTSTR MyCmdLine = GetCommandLine();
-   LPTSTR MyArgs = SkipArg(MyCmdLine);
+   if (!CreateDirectory(InstDir, NULL))
+   {
+      FATAL("Failed to create installation directory.");
+      return FALSE;
+   }
+   return TocPrepare();
+}
 
-   *pCommandLine = LocalAlloc(LMEM_FIXED, lstrlen(ExpandedCommandLine) + sizeof(TCHAR) + lstrlen(MyArgs) + sizeof(TCHAR));
-   lstrcpy(*pCommandLine, ExpandedCommandLine);
-   lstrcat(*pCommandLine, _T(" "));
-   lstrcat(*pCommandLine, MyArgs);
+#define CACHE_MARKER_NAME _T(".ocra-complete")
 
-   LocalFree(ExpandedCommandLine);
+/**
+   Find (and create) the per-user directory holding cached
+   extractions. Uses %LOCALAPPDATA%\ocra-cache, or the temp path when
+   LOCALAPPDATA is not set.
+*/
+BOOL FindCacheRoot(TCHAR* d)
+{
+   DWORD len = GetEnvironmentVariable(_T("LOCALAPPDATA"), d, MAX_PATH);
+   if (len == 0 || len >= MAX_PATH)
+      len = GetTempPath(MAX_PATH, d);
+   if (len == 0 || len >= MAX_PATH - 16)
+      return FALSE;
+   if (d[len-1] != '\\')
+      lstrcat(d, _T("\\"));
+   lstrcat(d, _T("ocra-cache"));
+   return CreateDirectory(d, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
 }
 
 /**
-   Create a new process and wait for it to complete (OP_CREATE_PROCESS
-   opcode handler)
+   Checks whether a cache directory holds a complete extraction. The
+   marker is written last, before the directory is renamed into place.
 */
-BOOL OpCreateProcess(LPVOID* p)
+BOOL CacheIsComplete(LPTSTR dir)
 {
-   LPTSTR ApplicationName;
-   LPTSTR CommandLine;
+   TCHAR Marker[MAX_PATH];
+   lstrcpy(Marker, dir);
+   lstrcat(Marker, _T("\\"));
+   lstrcat(Marker, CACHE_MARKER_NAME);
+   return GetFileAttributes(Marker) != INVALID_FILE_ATTRIBUTES;
+}
+
+BOOL WriteCacheMarker(LPTSTR dir)
+{
+   TCHAR Marker[MAX_PATH];
+   lstrcpy(Marker, dir);
+   lstrcat(Marker, _T("\\"));
+   lstrcat(Marker, CACHE_MARKER_NAME);
+   HANDLE h = CreateFile(Marker, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (h == INVALID_HANDLE_VALUE)
+      return FALSE;
+   CloseHandle(h);
+   return TRUE;
+}
+
+/* Lock file of the cache or shared directory in use (see CacheLock) */
+HANDLE CacheLockFile = INVALID_HANDLE_VALUE;
+TCHAR CacheLockPath[MAX_PATH];
+TCHAR CacheLockedDir[MAX_PATH];
+BOOL CacheDeleteAfter = FALSE;
+
+/**
+   Open the lock file. It may be deleted by the last instance using a
+   shared directory, so it is opened with FILE_SHARE_DELETE, and an
+   open that fails while the deletion is pending is retried.
+*/
+BOOL CacheOpenLock()
+{
+   int Tries;
+   for (Tries = 0; Tries < 1000; Tries++)
+   {
+      CacheLockFile = CreateFile(CacheLockPath, GENERIC_READ | GENERIC_WRITE,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+      if (CacheLockFile != INVALID_HANDLE_VALUE)
+         return TRUE;
+      if (GetLastError() != ERROR_ACCESS_DENIED)
+         return FALSE;
+      Sleep(1);
+   }
+   return FALSE;
+}
+
+/**
+   Checks that the open lock file is still the one at CacheLockPath,
+   and not one that was deleted while this instance waited for it.
+*/
+BOOL CacheLockIsCurrent()
+{
+   BY_HANDLE_FILE_INFORMATION Locked, Current;
+   HANDLE h = CreateFile(CacheLockPath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                         NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (h == INVALID_HANDLE_VALUE)
+      return FALSE;
+   BOOL Result = GetFileInformationByHandle(CacheLockFile, &Locked) &&
+      GetFileInformationByHandle(h, &Current) &&
+      Locked.dwVolumeSerialNumber == Current.dwVolumeSerialNumber &&
+      Locked.nFileIndexHigh == Current.nFileIndexHigh &&
+      Locked.nFileIndexLow == Current.nFileIndexLow;
+   CloseHandle(h);
+   return Result;
+}
+
+/**
+   Lock the lock file next to the cache directory, shared while the
+   directory is used and exclusive while it is extracted or deleted.
+   Fails instead of waiting for the lock unless Wait is set.
+*/
+BOOL CacheLock(BOOL Exclusive, BOOL Wait)
+{
+   OVERLAPPED Overlapped;
+   ZeroMemory(&Overlapped, sizeof(Overlapped));
+   DWORD Flags = (Exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0) | (Wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+   return LockFileEx(CacheLockFile, Flags, 0, 1, 0, &Overlapped);
+}
+
+void CacheUnlock()
+{
+   OVERLAPPED Overlapped;
+   ZeroMemory(&Overlapped, sizeof(Overlapped));
+   UnlockFileEx(CacheLockFile, 0, 1, 0, &Overlapped);
+}
+
+/**
+   Wait for the lock on the current lock file. A lock file deleted
+   while waiting is replaced by a new one, which is locked instead.
+*/
+BOOL CacheAcquire(BOOL Exclusive)
+{
+   for (;;)
+   {
+      if (!CacheLock(Exclusive, TRUE))
+         return FALSE;
+      if (CacheLockIsCurrent())
+         return TRUE;
+      CacheUnlock();
+      CloseHandle(CacheLockFile);
+      if (!CacheOpenLock())
+         return FALSE;
+   }
+}
+
+/**
+   Extract the payload into CacheDir. Files are extracted into a
+   private staging directory in CacheRoot which is renamed into place
+   once complete, so a crashed run never leaves a half-populated cache
+   directory behind. Called with the exclusive lock held.
+*/
+BOOL ExtractToCache(LPTSTR CacheRoot, LPTSTR CacheDir, LPVOID Payload, DWORD PayloadSize)
+{
+   if (GetTempFileName(CacheRoot, _T("ocrastub"), 0, InstDir) == 0u)
+   {
+      FATAL("Failed to get temp file name.");
+      return FALSE;
+   }
+
+   DEBUG("Creating cache staging directory: '%s'", InstDir);
+
+   (void)DeleteFile(InstDir);
+
+   if (!CreateDirectory(InstDir, NULL))
+   {
+      FATAL("Failed to create cache staging directory.");
+      return FALSE;
+   }
+
+   BOOL Success = TocPrepare() && ProcessOpcodesUntil(&Payload, Payload + PayloadSize) && IoFlush();
+
+   if (Success && !WriteCacheMarker(InstDir))
+   {
+      FATAL("Failed to write cache marker (error %lu).", GetLastError());
+      Success = FALSE;
+   }
+
+   /* Remove what an interrupted deletion left behind */
+   if (Success && GetFileAttributes(CacheDir) != INVALID_FILE_ATTRIBUTES && !CacheIsComplete(CacheDir))
+      DeleteRecursively(CacheDir);
+
+   if (Success && MoveFileEx(InstDir, CacheDir, 0))
+   {
+      DEBUG("Moved staging directory into cache: '%s'", CacheDir);
+      lstrcpy(InstDir, CacheDir);
+      return TRUE;
+   }
+
+   if (Success && !CacheIsComplete(CacheDir))
+   {
+      FATAL("Failed to move staging directory into cache (error %lu).", GetLastError());
+      Success = FALSE;
+   }
+
+   /* Either extraction failed, or an instance of an older stub, which
+      does not lock, completed the cache directory first. */
+   DeleteRecursivelyNowOrLater(InstDir);
+   if (Success)
+   {
+      DEBUG("Cache was populated by another instance: '%s'", CacheDir);
+      lstrcpy(InstDir, CacheDir);
+   }
+   return Success;
+}
+
+/**
+   Extract the payload that follows into a directory keyed by the
+   payload's content hash, or skip it entirely if another run already
+   did so (OP_CREATE_CACHE_DIRECTORY opcode handler).
+
+   With DELETE unset, the directory is in the per-user cache and is
+   kept for later runs (--cache). With DELETE set, it is in the temp
+   path, shared by the instances that run at the same time, and the
+   last of them deletes it (--shared).
+
+   Instances coordinate through a lock file next to the directory.
+   Each holds a shared lock while it uses the directory. One that finds
+   the directory incomplete waits for an exclusive lock, checks again
+   and extracts, and the others wait for their locks until it is done,
+   so that the payload is extracted once however many instances start
+   together.
+*/
+BOOL OpCreateCacheDirectory(LPVOID* p)
+{
+   LPTSTR Hash = GetString(p);
+   ChdirBeforeRunEnabled = GetInteger(p);
+   BOOL Shared = GetInteger(p);
+   DWORD PayloadSize = GetInteger(p);
+   LPVOID Payload = *p;
+   *p += PayloadSize;
+
+   TCHAR CacheRoot[MAX_PATH];
+   if (Shared)
+   {
+      DWORD len = GetTempPath(MAX_PATH, CacheRoot);
+      if (len == 0 || len >= MAX_PATH)
+      {
+         FATAL("Failed to find the temp path.");
+         return FALSE;
+      }
+      if (CacheRoot[len-1] == '\\')
+         CacheRoot[len-1] = 0;
+   }
+   else if (!FindCacheRoot(CacheRoot))
+   {
+      FATAL("Failed to create cache directory.");
+      return FALSE;
+   }
+
+   if (lstrlen(CacheRoot) + lstrlen(Hash) + 16 > MAX_PATH)
+   {
+      FATAL("Cache directory name too long.");
+      return FALSE;
+   }
+
+   TCHAR CacheDir[MAX_PATH];
+   lstrcpy(CacheDir, CacheRoot);
+   lstrcat(CacheDir, Shared ? _T("\\ocra-") : _T("\\"));
+   lstrcat(CacheDir, Hash);
+
+   lstrcpy(CacheLockPath, CacheDir);
+   lstrcat(CacheLockPath, _T(".lock"));
+   if (!CacheOpenLock())
+   {
+      FATAL("Failed to open cache lock file '%s' (error %lu).", CacheLockPath, GetLastError());
+      return FALSE;
+   }
+   lstrcpy(CacheLockedDir, CacheDir);
+   CacheDeleteAfter = Shared;
+
+   LONGLONG Start = TimerStart();
+   for (;;)
+   {
+      if (!CacheAcquire(FALSE))
+      {
+         FATAL("Failed to lock '%s' (error %lu).", CacheLockPath, GetLastError());
+         return FALSE;
+      }
+      if (CacheIsComplete(CacheDir))
+      {
+         DEBUG("Using cached installation directory: '%s'", CacheDir);
+         TraceEnd("cache", "CacheLock", Start, 0, CacheDir);
+         lstrcpy(InstDir, CacheDir);
+         return TRUE;
+      }
+      CacheUnlock();
+
+      /* Wait for the instances checking the directory, or for the one
+         extracting it, and check again once it is ours. */
+      if (!CacheAcquire(TRUE))
+      {
+         FATAL("Failed to lock '%s' (error %lu).", CacheLockPath, GetLastError());
+         return FALSE;
+      }
+      TraceEnd("cache", "CacheLock", Start, 0, CacheDir);
+      BOOL Success = CacheIsComplete(CacheDir) || ExtractToCache(CacheRoot, CacheDir, Payload, PayloadSize);
+      CacheUnlock();
+      if (!Success)
+         return FALSE;
+      Start = TimerStart();
+   }
+}
+
+/**
+   Give up the shared lock on the cache directory as the stub exits.
+   For a shared directory, the last instance to do so deletes it: it
+   renames the directory and deletes the lock file under an exclusive
+   lock, so that instances starting meanwhile extract the payload
+   again with a new lock file, and then deletes the directory.
+   A directory that cannot be renamed, because a program is still
+   using it, is left for the next instance to reuse.
+*/
+void CacheRelease()
+{
+   if (CacheLockFile == INVALID_HANDLE_VALUE)
+      return;
+   CacheUnlock();
+   if (CacheDeleteAfter && CacheLock(TRUE, FALSE))
+   {
+      TCHAR CacheRoot[MAX_PATH];
+      TCHAR DeletePath[MAX_PATH];
+      lstrcpy(CacheRoot, CacheLockedDir);
+      LPTSTR Separator = _tcsrchr(CacheRoot, '\\');
+      if (Separator != NULL)
+         *Separator = 0;
+      BOOL Moved = FALSE;
+      if (GetTempFileName(CacheRoot, _T("ocrastub"), 0, DeletePath) != 0u)
+      {
+         (void)DeleteFile(DeletePath);
+         Moved = MoveFileEx(CacheLockedDir, DeletePath, 0);
+      }
+      if (Moved)
+         (void)DeleteFile(CacheLockPath);
+      CacheUnlock();
+      if (Moved)
+      {
+         DEBUG("Deleting shared installation directory %s", CacheLockedDir);
+         DeleteRecursivelyNowOrLater(DeletePath);
+      }
+      else
+      {
+         DEBUG("Leaving shared installation directory %s (error %lu)", CacheLockedDir, GetLastError());
+      }
+   }
+   CloseHandle(CacheLockFile);
+   CacheLockFile = INVALID_HANDLE_VALUE;
+}
+
+int CALLBACK _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLine, int nCmdShow)
+{
+   BenchInitialize();
+   TraceInitialize();
+
+   GcInitialize();
+
+   /* Find name of image */
+   if (!GetModuleFileName(NULL, ImageFileName, MAX_PATH))
+   {
+      FATAL("Failed to get executable name (error %lu).", GetLastError());
+      return -1;
+   }
+
+
+   /* By default, assume the installation directory is wherever the EXE is */
+   FindExeDir(InstDir);
+
+   /* Set up environment */
+   SetEnvironmentVariable(_T("OCRA_EXECUTABLE"), ImageFileName);
+
+   SetConsoleCtrlHandler(&ConsoleHandleRoutine, TRUE);
+
+   /* Open the image (executable) */
+   LONGLONG MapStart = TimerStart();
+   HANDLE hImage = CreateFile(ImageFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+   if (hImage == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to open executable (%s)", ImageFileName);
+      return -1;
+   }
+
+   /* Create a file mapping */
+   DWORD FileSize = GetFileSize(hImage, NULL);
+   HANDLE hMem = CreateFileMapping(hImage, NULL, PAGE_READONLY, 0, FileSize, NULL);
+   if (hMem == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to create file mapping (error %lu)", GetLastError());
+      CloseHandle(hImage);
+      return -1;
+   }
+
+   /* Map the image into memory */
+   LPVOID lpv = MapViewOfFile(hMem, FILE_MAP_READ, 0, 0, 0);
+   BenchEnd(BENCH_MAP, MapStart);
+   TraceEnd("image", "MapViewOfFile", MapStart, FileSize, ImageFileName);
+   if (lpv == NULL)
+   {
+      FATAL("Failed to map view of executable into memory (error %lu).", GetLastError());
+   }
+   else
+   {
+      LONGLONG ExtractStart = TimerStart();
+      IoInitialize();
+
+      if (!ProcessImage(lpv, FileSize))
+      {
+         ExitStatus = -1;
+      }
+
+      if (!IoShutdown())
+      {
+         ExitStatus = -1;
+      }
+      BenchEnd(BENCH_EXTRACT, ExtractStart);
+      TraceEnd("image", "ProcessImage", ExtractStart, FileSize, NULL);
+
+      if (DebugModeEnabled && TocLoaded && ExitStatus == 0 && !TocVerify())
+      {
+         FATAL("Extracted files do not match the table of contents.");
+         ExitStatus = -1;
+      }
+
+      /* The lazy extraction server reads from the image while the
+         program runs, so it stays mapped until the stub exits. */
+      if (TocLazyCount > 0 && ExitStatus == 0)
+      {
+         if (!LazyStartServer())
+         {
+            ExitStatus = -1;
+         }
+      }
+      else if (!UnmapViewOfFile(lpv))
+      {
+         FATAL("Failed to unmap view of executable.");
+      }
+   }
+
+   if (!LazyServerRunning)
+   {
+      if (!CloseHandle(hMem))
+      {
+         FATAL("Failed to close file mapping.");
+      }
+
+      if (!CloseHandle(hImage))
+      {
+         FATAL("Failed to close executable.");
+      }
+   }
+
+   if (ChdirBeforeRunEnabled)
+   {
+      DEBUG("Changing CWD to unpacked directory %s/src", InstDir);
+      SetCurrentDirectory(InstDir);
+      SetCurrentDirectory("./src");
+   }
+
+   if (PostCreateProcess_ApplicationName && PostCreateProcess_CommandLine)
+   {
+      DEBUG("**********");
+      DEBUG("Starting app in: %s", InstDir);
+      DEBUG("**********");
+      CreateAndWaitForProcess(PostCreateProcess_ApplicationName, PostCreateProcess_CommandLine);
+   }
+
+   if (DeleteInstDirEnabled || CacheDeleteAfter)
+   {
+      TCHAR SystemDirectory[MAX_PATH];
+      if (GetSystemDirectory(SystemDirectory, MAX_PATH) > 0)
+         SetCurrentDirectory(SystemDirectory);
+      else
+         SetCurrentDirectory("C:\\");
+   }
+
+   if (DeleteInstDirEnabled)
+   {
+      DEBUG("Deleting temporary installation directory %s", InstDir);
+      LONGLONG CleanupStart = TimerStart();
+      if (DeleteInstDirEnabled == DELETE_INSTDIR_DEFER)
+         DeferDeletion(InstDir);
+      else
+         DeleteRecursivelyNowOrLater(InstDir);
+      BenchEnd(BENCH_CLEANUP, CleanupStart);
+      TraceEnd("cleanup", DeleteInstDirEnabled == DELETE_INSTDIR_DEFER ? "DeferDeletion" : "DeleteRecursively",
+               CleanupStart, 0, InstDir);
+   }
+
+   LONGLONG ReleaseStart = TimerStart();
+   CacheRelease();
+   if (CacheDeleteAfter)
+   {
+      BenchEnd(BENCH_CLEANUP, ReleaseStart);
+      TraceEnd("cleanup", "CacheRelease", ReleaseStart, 0, InstDir);
+   }
+
+   BenchReport();
+   TraceReport();
+   ExitProcess(ExitStatus);
+
+   /* Never gets here */
+   return 0;
+}
+
+/**
+   Process the image by checking the signature and locating the first
+   opcode.
+*/
+BOOL ProcessImage(LPVOID ptr, DWORD size)
+{
+   LPVOID pSig = ptr + size - 4;
+   if (memcmp(pSig, Signature, 4) == 0)
+   {
+      DEBUG("Good signature found.");
+      ImageBase = ptr;
+      ImageSize = size;
+      ReadToc(ptr, size);
+      DWORD OpcodeOffset = *(DWORD*)(pSig - 4);
+      LPVOID pSeg = ptr + OpcodeOffset;
+      return ProcessOpcodes(&pSeg);
+   }
+   else
+   {
+      FATAL("Bad signature in executable.");
+      return FALSE;
+   }
+}
+
+/**
+   Process a single opcode.
+*/
+BOOL ProcessOpcode(LPVOID* p)
+{
+   DWORD opcode = GetInteger(p);
+   if (opcode < OP_MAX)
+   {
+      if (!TraceEnabled)
+         return OpcodeHandlers[opcode](p);
+      LPVOID Begin = *p;
+      LONGLONG Start = TimerStart();
+      BOOL Result = OpcodeHandlers[opcode](p);
+      TraceEnd("opcode", OpcodeNames[opcode], Start, *p - Begin, NULL);
+      return Result;
+   }
+   else
+   {
+      FATAL("Invalid opcode '%lu'.", opcode);
+      return FALSE;
+   }
+}
+
+/**
+   Process the opcodes in memory.
+*/
+BOOL ProcessOpcodes(LPVOID* p)
+{
+   while (!ExitCondition)
+   {
+      if (!ProcessOpcode(p))
+      {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/**
+   Process the opcodes in memory, stopping at the end of the range.
+*/
+BOOL ProcessOpcodesUntil(LPVOID* p, LPVOID end)
+{
+   while (!ExitCondition && *p < end)
+   {
+      if (!ProcessOpcode(p))
+      {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/**
+   Expands a specially formatted string, replacing | with the
+   temporary installation directory.
+*/
+void ExpandPath(LPTSTR* out, LPTSTR str)
+{
+   DWORD OutSize = lstrlen(str) + sizeof(TCHAR);
+   LPTSTR a = str;
+   while ((a = _tcschr(a, L'|')))
+   {
+      OutSize += lstrlen(InstDir) - sizeof(TCHAR);
+      a++;
+   }
+
+   *out = LocalAlloc(LMEM_FIXED, OutSize);
+
+   LPTSTR OutPtr = *out;
+   while ((a = _tcschr(str, L'|')))
+   {
+      int l = a - str;
+      if (l > 0)
+      {
+         memcpy(OutPtr, str, l);
+         OutPtr += l;
+         str += l;
+      }
+      str += sizeof(TCHAR);
+      lstrcpy(OutPtr, InstDir);
+      OutPtr += lstrlen(OutPtr);
+   }
+   lstrcpy(OutPtr, str);
+}
+
+/**
+   Finds the start of the first argument after the current one. Handles quoted arguments.
+*/
+LPTSTR SkipArg(LPTSTR str)
+{
+   if (*str == '"')
+   {
+      str++;
+      while (*str && *str != '"') { str++; }
+      if (*str == '"') { str++; }
+   }
+   else
+   {
+      while (*str && *str != ' ') { str++; }
+   }
+   while (*str && *str != ' ') { str++; }
+   return str;
+}
+
+/* Files at least this large are extended to their full size before
+   being written in chunks, so the file system can allocate them in
+   one go. */
+#define IO_PREALLOCATE_MIN_SIZE (1024 * 1024)
+
+/**
+   Checks that the path of a file in the installation directory fits
+   in MAX_PATH characters.
+*/
+BOOL CheckInstPath(LPCTSTR FileName)
+{
+   if (lstrlen(InstDir) + 1 + lstrlen(FileName) < MAX_PATH)
+      return TRUE;
+   FATAL("File name too long: '%s\\%s'", InstDir, FileName);
+   return FALSE;
+}
+
+/**
+   Writes the path of a file in the installation directory to Path,
+   which holds MAX_PATH characters.
+*/
+BOOL GetInstPath(LPTSTR Path, LPCTSTR FileName)
+{
+   if (!CheckInstPath(FileName))
+      return FALSE;
+   lstrcpy(Path, InstDir);
+   lstrcat(Path, _T("\\"));
+   lstrcat(Path, FileName);
+   return TRUE;
+}
+
+/**
+   Opens a file in the installation directory with the given access.
+*/
+HANDLE OpenInstFile(LPTSTR FileName, DWORD FileSize, DWORD Access)
+{
+   TCHAR Fn[MAX_PATH];
+   if (!GetInstPath(Fn, FileName))
+      return INVALID_HANDLE_VALUE;
+
+   DEBUG("CreateFile(%s, %lu)", Fn, FileSize);
+   LONGLONG Start = TimerStart();
+   HANDLE hFile = CreateFile(Fn, Access, 0, NULL, CREATE_ALWAYS, RamTemporaryFiles ? FILE_ATTRIBUTE_TEMPORARY : 0, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to create file '%s'", Fn);
+   }
+   else if (FileSize >= IO_PREALLOCATE_MIN_SIZE)
+   {
+      if (SetFilePointer(hFile, FileSize, NULL, FILE_BEGIN) == FileSize)
+         SetEndOfFile(hFile);
+      SetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+   }
+   if (BenchEnabled)
+   {
+      InterlockedIncrement(&BenchFiles);
+      BenchEnd(BENCH_WRITE, Start);
+   }
+   TraceEnd("io", "CreateFile", Start, FileSize, FileName);
+   return hFile;
+}
+
+/**
+   Opens a file in the installation directory for writing.
+*/
+HANDLE CreateInstFile(LPTSTR FileName, DWORD FileSize)
+{
+   return OpenInstFile(FileName, FileSize, GENERIC_WRITE);
+}
+
+/** Closes a file opened with CreateInstFile. */
+void CloseInstFile(HANDLE hFile)
+{
+   LONGLONG Start = TimerStart();
+   CloseHandle(hFile);
+   BenchEnd(BENCH_WRITE, Start);
+   TraceEnd("io", "CloseHandle", Start, 0, NULL);
+}
+
+/**
+   Writes a block of data to a file opened with CreateInstFile.
+*/
+BOOL WriteInstFile(HANDLE hFile, LPVOID Data, DWORD Size)
+{
+   DWORD BytesWritten;
+   LONGLONG Start = TimerStart();
+   BOOL Written = WriteFile(hFile, Data, Size, &BytesWritten, NULL);
+   BenchCount(&BenchWritten, BytesWritten);
+   BenchEnd(BENCH_WRITE, Start);
+   TraceEnd("io", "WriteFile", Start, Size, NULL);
+   if (!Written)
+   {
+      FATAL("Write failure (%lu)", GetLastError());
+      return FALSE;
+   }
+   if (BytesWritten != Size)
+   {
+      FATAL("Write size failure");
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Creates a file in the installation directory and writes all of its
+   contents, blocking until done.
+*/
+BOOL WriteWholeInstFile(LPTSTR FileName, LPVOID Data, DWORD Size)
+{
+   HANDLE hFile = CreateInstFile(FileName, Size);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      return FALSE;
+   }
+
+   BOOL Result = WriteInstFile(hFile, Data, Size);
+   CloseInstFile(hFile);
+   return Result;
+}
+
+/*
+   Mapped files. A large file that is decoded from an LZMA stream is
+   opened for reading and writing, sized up front and mapped, and the
+   decoder writes into the view. The data then goes straight into the
+   file's pages, instead of being decoded into the window and copied
+   again by WriteFile. OCRA_MAP_FILES=0 writes these files with
+   WriteFile instead.
+*/
+
+/* Smaller files are cheaper to write than to map. */
+#define MAP_MIN_SIZE (256 * 1024)
+
+BOOL MapFilesEnabled = TRUE;
+
+void MapFilesInitialize()
+{
+   TCHAR Value[16];
+   DWORD len = GetEnvironmentVariable(_T("OCRA_MAP_FILES"), Value, 16);
+   if (len > 0 && len < 16)
+      MapFilesEnabled = _ttoi(Value) != 0;
+}
+
+/**
+   Opens a file in the installation directory so that it can be
+   mapped by MapInstFile.
+*/
+HANDLE CreateMappableInstFile(LPTSTR FileName, DWORD FileSize)
+{
+   return OpenInstFile(FileName, FileSize, MapFilesEnabled ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE);
+}
+
+/**
+   Extends a file opened with CreateMappableInstFile to FileSize bytes
+   and maps it for writing. Returns NULL if the file cannot be mapped,
+   in which case it is written with WriteInstFile.
+*/
+LPBYTE MapInstFile(HANDLE hFile, DWORD FileSize, HANDLE* hMapping)
+{
+   if (!MapFilesEnabled || FileSize < MAP_MIN_SIZE)
+      return NULL;
+   LONGLONG Start = TimerStart();
+   LPBYTE View = NULL;
+   *hMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE, 0, FileSize, NULL);
+   if (*hMapping)
+   {
+      View = MapViewOfFile(*hMapping, FILE_MAP_WRITE, 0, 0, FileSize);
+      if (View == NULL)
+         CloseHandle(*hMapping);
+   }
+   if (View == NULL)
+      DEBUG("Failed to map file (error %lu), writing it instead", GetLastError());
+   BenchEnd(BENCH_WRITE, Start);
+   TraceEnd("io", "MapViewOfFile", Start, FileSize, NULL);
+   return View;
+}
+
+/** Unmaps a file mapped with MapInstFile. */
+void UnmapInstFile(LPBYTE View, HANDLE hMapping, DWORD FileSize)
+{
+   LONGLONG Start = TimerStart();
+   UnmapViewOfFile(View);
+   CloseHandle(hMapping);
+   BenchCount(&BenchMapped, FileSize);
+   BenchEnd(BENCH_WRITE, Start);
+   TraceEnd("io", "UnmapViewOfFile", Start, FileSize, NULL);
+}
+
+/*
+   Extraction I/O. Files are created either by the blocking backend
+   (WriteWholeInstFile) or by a queued backend, where worker threads
+   create, write and close files while the caller continues decoding.
+   Creating and closing files dominates the cost of extracting many
+   small files, and much of it is spent waiting (e.g. for virus
+   scanners), so it overlaps well.
+
+   The queue holds copies of the file contents, so callers may reuse
+   their buffers immediately, except for contents that stay in memory
+   until the queue is flushed: those in the mapped image (stored
+   files) and in decoded blocks, which are kept until their last file
+   is written (see IoBuffer). Only files up to IO_MAX_QUEUED_SIZE are
+   queued; larger files are written by the caller. The queued backend
+   is used by default on machines with more than one processor.
+   OCRA_IO_QUEUE_DEPTH sets the number of files that may be queued; 0
+   selects the blocking backend.
+*/
+#define IO_DEFAULT_QUEUE_DEPTH 32
+#define IO_MAX_QUEUE_DEPTH 1024
+#define IO_MAX_QUEUED_SIZE (256 * 1024)
+#define IO_WORKER_THREADS 4
+
+/**
+   A decoded block that queued files refer to instead of copying their
+   contents out of it. It is freed when the last reference is released.
+*/
+typedef struct
+{
+   LONG volatile References;
+   LPBYTE Data;
+} IoBuffer;
+
+typedef struct
+{
+   TCHAR FileName[MAX_PATH];
+   DWORD Size;
+   LPBYTE Source;
+   IoBuffer* Buffer;
+   BYTE Data[1];
+} IoRequest;
+
+IoRequest** IoQueue = NULL;
+DWORD IoQueueDepth = 0;
+DWORD IoQueueHead = 0;
+DWORD IoQueueTail = 0;
+CRITICAL_SECTION IoQueueLock;
+HANDLE IoSlotsSemaphore = NULL;
+HANDLE IoItemsSemaphore = NULL;
+HANDLE IoIdleEvent = NULL;
+HANDLE IoWorkers[IO_WORKER_THREADS];
+DWORD IoWorkerCount = 0;
+LONG volatile IoPending = 0;
+LONG volatile IoFailed = FALSE;
+
+/**
+   Takes ownership of a buffer allocated with LocalAlloc, so that
+   queued files can refer to it. Returns NULL if out of memory, and
+   the caller keeps ownership.
+*/
+IoBuffer* IoCreateBuffer(LPBYTE Data)
+{
+   IoBuffer* Buffer = LocalAlloc(LMEM_FIXED, sizeof(IoBuffer));
+   if (Buffer)
+   {
+      Buffer->References = 1;
+      Buffer->Data = Data;
+   }
+   return Buffer;
+}
+
+/** Releases a reference to a buffer, freeing it after the last one. */
+void IoReleaseBuffer(IoBuffer* Buffer)
+{
+   if (InterlockedDecrement(&Buffer->References) == 0)
+   {
+      LocalFree(Buffer->Data);
+      LocalFree(Buffer);
+   }
+}
+
+DWORD WINAPI IoWorker(LPVOID lpParameter)
+{
+   for (;;)
+   {
+      WaitForSingleObject(IoItemsSemaphore, INFINITE);
+      EnterCriticalSection(&IoQueueLock);
+      IoRequest* Request = IoQueue[IoQueueTail];
+      IoQueueTail = (IoQueueTail + 1) % IoQueueDepth;
+      LeaveCriticalSection(&IoQueueLock);
+      ReleaseSemaphore(IoSlotsSemaphore, 1, NULL);
+
+      if (Request == NULL)
+         break;
+
+      if (!WriteWholeInstFile(Request->FileName, Request->Source, Request->Size))
+         InterlockedExchange(&IoFailed, TRUE);
+      if (Request->Buffer)
+         IoReleaseBuffer(Request->Buffer);
+      LocalFree(Request);
+
+      if (InterlockedDecrement(&IoPending) == 0)
+         SetEvent(IoIdleEvent);
+   }
+   return 0;
+}
+
+/**
+   Selects the I/O backend and starts the worker threads of the queued
+   backend.
+*/
+void IoInitialize()
+{
+   MapFilesInitialize();
+
+   SYSTEM_INFO SystemInfo;
+   GetSystemInfo(&SystemInfo);
+   IoQueueDepth = SystemInfo.dwNumberOfProcessors > 1 ? IO_DEFAULT_QUEUE_DEPTH : 0;
+   TCHAR Value[16];
+   DWORD len = GetEnvironmentVariable(_T("OCRA_IO_QUEUE_DEPTH"), Value, 16);
+   if (len > 0 && len < 16)
+      IoQueueDepth = _ttoi(Value);
+   if (IoQueueDepth > IO_MAX_QUEUE_DEPTH)
+      IoQueueDepth = IO_MAX_QUEUE_DEPTH;
+   if (IoQueueDepth == 0)
+   {
+      DEBUG("Using blocking I/O");
+      return;
+   }
+
+   /* Extra slots, so that a stop request can be queued for every
+      worker even when the queue is full. */
+   IoQueueDepth += IO_WORKER_THREADS;
+   IoQueue = LocalAlloc(LMEM_FIXED, IoQueueDepth * sizeof(IoRequest*));
+   InitializeCriticalSection(&IoQueueLock);
+   IoSlotsSemaphore = CreateSemaphore(NULL, IoQueueDepth - IO_WORKER_THREADS, IoQueueDepth, NULL);
+   IoItemsSemaphore = CreateSemaphore(NULL, 0, IoQueueDepth, NULL);
+   IoIdleEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   if (IoQueue && IoSlotsSemaphore && IoItemsSemaphore && IoIdleEvent)
+   {
+      while (IoWorkerCount < IO_WORKER_THREADS)
+      {
+         HANDLE h = CreateThread(NULL, 0, IoWorker, NULL, 0, NULL);
+         if (h == NULL)
+            break;
+         IoWorkers[IoWorkerCount++] = h;
+      }
+   }
+   if (IoWorkerCount == 0)
+   {
+      DEBUG("Failed to start I/O workers, using blocking I/O");
+      IoQueueDepth = 0;
+      return;
+   }
+   DEBUG("Using queued I/O (depth %lu, %lu workers)", IoQueueDepth - IO_WORKER_THREADS, IoWorkerCount);
+}
+
+/**
+   Adds a request to the queue, waiting for a free slot.
+*/
+void IoEnqueue(IoRequest* Request)
+{
+   WaitForSingleObject(IoSlotsSemaphore, INFINITE);
+   EnterCriticalSection(&IoQueueLock);
+   IoQueue[IoQueueHead] = Request;
+   IoQueueHead = (IoQueueHead + 1) % IoQueueDepth;
+   LeaveCriticalSection(&IoQueueLock);
+   ReleaseSemaphore(IoItemsSemaphore, 1, NULL);
+}
+
+/**
+   Creates a file in the installation directory with the given
+   contents, which are in Buffer if it is not NULL. The file may be
+   written after this returns; call IoFlush before relying on it.
+*/
+BOOL IoCreateFileInBuffer(LPTSTR FileName, LPVOID Data, DWORD Size, IoBuffer* Buffer)
+{
+   /* Fail here rather than when a worker gets to the file. */
+   if (!CheckInstPath(FileName))
+      return FALSE;
+
+   if (IoQueueDepth == 0 || Size > IO_MAX_QUEUED_SIZE)
+      return WriteWholeInstFile(FileName, Data, Size);
+
+   if (IoFailed)
+      return FALSE;
+
+   BOOL InImage = (LPBYTE)Data >= ImageBase && (LPBYTE)Data + Size <= ImageBase + ImageSize;
+   BOOL Copy = !InImage && Buffer == NULL;
+   IoRequest* Request = LocalAlloc(LMEM_FIXED, sizeof(IoRequest) + (Copy ? Size : 0));
+   if (Request == NULL)
+      return WriteWholeInstFile(FileName, Data, Size);
+   lstrcpy(Request->FileName, FileName);
+   Request->Size = Size;
+   Request->Buffer = NULL;
+   if (Copy)
+   {
+      memcpy(Request->Data, Data, Size);
+      BenchCount(&BenchCopied, Size);
+      Request->Source = Request->Data;
+   }
+   else
+   {
+      Request->Source = Data;
+      if (!InImage)
+      {
+         InterlockedIncrement(&Buffer->References);
+         Request->Buffer = Buffer;
+      }
+   }
+
+   InterlockedIncrement(&IoPending);
+   IoEnqueue(Request);
+   return TRUE;
+}
+
+/**
+   Creates a file in the installation directory with the given
+   contents. The caller may reuse Data when this returns.
+*/
+BOOL IoCreateFile(LPTSTR FileName, LPVOID Data, DWORD Size)
+{
+   return IoCreateFileInBuffer(FileName, Data, Size, NULL);
+}
+
+/**
+   Waits until all queued files have been written. Returns FALSE if
+   any of them failed.
+*/
+BOOL IoFlush()
+{
+   while (IoPending > 0)
+      WaitForSingleObject(IoIdleEvent, INFINITE);
+   return !IoFailed;
+}
+
+/**
+   Waits for queued files and stops the I/O workers.
+*/
+BOOL IoShutdown()
+{
+   BOOL Result = IoFlush();
+   DWORD i;
+   for (i = 0; i < IoWorkerCount; i++)
+      IoEnqueue(NULL);
+   for (i = 0; i < IoWorkerCount; i++)
+   {
+      WaitForSingleObject(IoWorkers[i], INFINITE);
+      CloseHandle(IoWorkers[i]);
+   }
+   IoWorkerCount = 0;
+   return Result;
+}
+
+/**
+   Create a file (OP_CREATE_FILE opcode handler)
+*/
+BOOL OpCreateFile(LPVOID* p)
+{
+   LPTSTR FileName = GetString(p);
+   DWORD FileSize = GetInteger(p);
+   LPVOID Data = *p;
+   *p += FileSize;
+
+   return IoCreateFile(FileName, Data, FileSize);
+}
+
+/**
+   Reverses the branch conversion that ocrapack applies to x86 code
+   (see the codefile record in src/ocrapack.c).
+*/
+void X86Decode(LPBYTE Data, DWORD Size)
+{
+   UInt32 State;
+   x86_Convert_Init(State);
+   x86_Convert(Data, Size, 0, &State, 0);
+}
+
+/**
+   Create a file of x86 code (OP_CREATE_FILE_X86 opcode handler)
+*/
+BOOL OpCreateFileX86(LPVOID* p)
+{
+   LPTSTR FileName = GetString(p);
+   DWORD FileSize = GetInteger(p);
+   LPBYTE Data = LocalAlloc(LMEM_FIXED, FileSize ? FileSize : 1);
+   if (Data == NULL)
+   {
+      FATAL("Failed to allocate memory for '%s'.", FileName);
+      return FALSE;
+   }
+   CopyMemory(Data, *p, FileSize);
+   BenchCount(&BenchCopied, FileSize);
+   *p += FileSize;
+   X86Decode(Data, FileSize);
+   BOOL Result = IoCreateFile(FileName, Data, FileSize);
+   LocalFree(Data);
+   return Result;
+}
+
+/**
+   Create a directory (OP_CREATE_DIRECTORY opcode handler)
+*/
+BOOL OpCreateDirectory(LPVOID* p)
+{
+   LPTSTR DirectoryName = GetString(p);
+
+   if (TocDirectoriesCreated && TocHasDirectory(DirectoryName))
+   {
+      return TRUE;
+   }
+
+   TCHAR DirName[MAX_PATH];
+   lstrcpy(DirName, InstDir);
+   lstrcat(DirName, _T("\\"));
+   lstrcat(DirName, DirectoryName);
+
+   DEBUG("CreateDirectory(%s)", DirName);
+
+   LONGLONG Start = TimerStart();
+   if (!CreateDirectory(DirName, NULL))
+   {
+      if (GetLastError() == ERROR_ALREADY_EXISTS)
+      {
+         DEBUG("Directory already exists");
+      }
+      else
+      {
+         FATAL("Failed to create directory '%s'.", DirName);
+         return FALSE;
+      }
+   }
+   BenchEnd(BENCH_MKDIR, Start);
+   TraceEnd("io", "CreateDirectory", Start, 0, DirectoryName);
+
+   return TRUE;
+}
+
+/**
+   Create a file with the same contents as one created earlier
+   (OP_CREATE_LINK opcode handler). The file is hard linked to the
+   earlier one where the file system allows it, and copied otherwise.
+*/
+BOOL OpCreateLink(LPVOID* p)
+{
+   LPTSTR LinkName = GetString(p);
+   LPTSTR ExistingName = GetString(p);
+
+   TCHAR Link[MAX_PATH];
+   TCHAR Existing[MAX_PATH];
+   if (!GetInstPath(Link, LinkName) || !GetInstPath(Existing, ExistingName))
+      return FALSE;
+
+   /* The existing file may still be waiting in the I/O queue. */
+   if (!IoFlush())
+      return FALSE;
+
+   DEBUG("CreateHardLink(%s, %s)", Link, Existing);
+   if (CreateHardLink(Link, Existing, NULL))
+      return TRUE;
+
+   DEBUG("Failed to create hard link (%lu), copying", GetLastError());
+   if (!CopyFile(Existing, Link, FALSE))
+   {
+      FATAL("Failed to create file '%s'", Link);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+void GetCreateProcessInfo(LPVOID* p, LPTSTR* pApplicationName, LPTSTR* pCommandLine)
+{
+   LPTSTR ImageName = GetString(p);
+   LPTSTR CmdLine = GetString(p);
+
+   ExpandPath(pApplicationName, ImageName);
+
+   LPTSTR ExpandedCommandLine;
+   ExpandPath(&ExpandedCommandLine, CmdLine);
+
+   LPTSTR MyCmdLine = GetCommandLine();
+   LPTSTR MyArgs = SkipArg(MyCmdLine);
+
+   *pCommandLine = LocalAlloc(LMEM_FIXED, lstrlen(ExpandedCommandLine) + sizeof(TCHAR) + lstrlen(MyArgs) + sizeof(TCHAR));
+   lstrcpy(*pCommandLine, ExpandedCommandLine);
+   lstrcat(*pCommandLine, _T(" "));
+   lstrcat(*pCommandLine, MyArgs);
+
+   LocalFree(ExpandedCommandLine);
+}
+
+/**
+   Create a new process and wait for it to complete (OP_CREATE_PROCESS
+   opcode handler)
+*/
+BOOL OpCreateProcess(LPVOID* p)
+{
+   LPTSTR ApplicationName;
+   LPTSTR CommandLine;
+   if (!IoFlush())
+   {
+      return FALSE;
+   }
    GetCreateProcessInfo(p, &ApplicationName, &CommandLine);
    CreateAndWaitForProcess(ApplicationName, CommandLine);
    LocalFree(ApplicationName);
@@ -571,107 +2637,1221 @@ BOOL OpCreateProcess(LPVOID* p)
    return TRUE;
 }
 
-void CreateAndWaitForProcess(LPTSTR ApplicationName, LPTSTR CommandLine)
+void CreateAndWaitForProcess(LPTSTR ApplicationName, LPTSTR CommandLine)
+{
+   PROCESS_INFORMATION ProcessInformation;
+   STARTUPINFO StartupInfo;
+   ZeroMemory(&StartupInfo, sizeof(StartupInfo));
+   StartupInfo.cb = sizeof(StartupInfo);
+   LONGLONG Start = TimerStart();
+   BOOL r = CreateProcess(ApplicationName, CommandLine, NULL, NULL,
+                          TRUE, 0, NULL, NULL, &StartupInfo, &ProcessInformation);
+   BenchEnd(BENCH_LAUNCH, Start);
+   TraceEnd("process", "CreateProcess", Start, 0, ApplicationName);
+
+   if (!r)
+   {
+      FATAL("Failed to create process (%s): %lu", ApplicationName, GetLastError());
+      return;
+   }
+
+   LazyStartBackground();
+   GcStartBackground();
+   Start = TimerStart();
+   WaitForSingleObject(ProcessInformation.hProcess, INFINITE);
+   BenchEnd(BENCH_RUN, Start);
+   TraceEnd("process", "WaitForSingleObject", Start, 0, ApplicationName);
+   GcStopBackground();
+   LazyStopBackground();
+
+   if (!GetExitCodeProcess(ProcessInformation.hProcess, &ExitStatus))
+   {
+      FATAL("Failed to get exit status (error %lu).", GetLastError());
+   }
+
+   CloseHandle(ProcessInformation.hProcess);
+   CloseHandle(ProcessInformation.hThread);
+}
+
+/**
+ * Sets up a process to be created after all other opcodes have been processed. This can be used to create processes
+ * after the temporary files have all been created and memory has been freed.
+ */
+BOOL OpPostCreateProcess(LPVOID* p)
+{
+   DEBUG("PostCreateProcess");
+   if (PostCreateProcess_ApplicationName || PostCreateProcess_CommandLine)
+   {
+      return FALSE;
+   }
+   else
+   {
+      GetCreateProcessInfo(p, &PostCreateProcess_ApplicationName, &PostCreateProcess_CommandLine);
+      return TRUE;
+   }
+}
+
+BOOL OpEnableDebugMode(LPVOID* p)
+{
+   DebugModeEnabled = TRUE;
+   DEBUG("Ocra stub running in debug mode");
+   return TRUE;
+}
+
+/**
+   Returns the number of threads to decode with. Defaults to
+   the number of processors; OCRA_DECODE_THREADS overrides it.
+*/
+DWORD GetDecodeThreadCount()
+{
+   TCHAR Value[16];
+   DWORD len = GetEnvironmentVariable(_T("OCRA_DECODE_THREADS"), Value, 16);
+   if (len > 0 && len < 16 && _ttoi(Value) > 0)
+      return _ttoi(Value);
+   SYSTEM_INFO SystemInfo;
+   GetSystemInfo(&SystemInfo);
+   return SystemInfo.dwNumberOfProcessors > 0 ? SystemInfo.dwNumberOfProcessors : 1;
+}
+
+#if WITH_LZMA
+void* SzAlloc(void* p, size_t size) { p = p; return LocalAlloc(LMEM_FIXED, size); }
+void SzFree(void* p, void* address) { p = p; LocalFree(address); }
+ISzAlloc alloc = { SzAlloc, SzFree };
+
+#define LZMA_UNPACKSIZE_SIZE 8
+#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
+
+/* Size of the window that decompressed opcodes are parsed from. Every
+   opcode except the contents of OP_CREATE_FILE must fit in half of
+   it. */
+#define LZMA_WINDOW_SIZE (256 * 1024)
+
+/* Number and size of the chunks passed from the decoder thread to the
+   writer thread when decoding is pipelined. */
+#define LZMA_PIPELINE_CHUNKS 8
+#define LZMA_PIPELINE_CHUNK_SIZE (256 * 1024)
+
+typedef struct
+{
+   Byte Data[LZMA_PIPELINE_CHUNK_SIZE];
+   SizeT Length;
+} LzmaChunk;
+
+/**
+   Single producer, single consumer ring of decoded chunks. The decoder
+   thread fills chunks and advances Head; the writer thread empties
+   them and advances Tail. A chunk of length zero ends the stream.
+*/
+typedef struct
+{
+   LzmaChunk* Chunks;
+   LONG volatile Head;
+   LONG volatile Tail;
+   LONG volatile Abort;
+   BOOL Failed;
+   BOOL Finished;
+   SizeT ChunkPos;
+   HANDLE DataEvent;
+   HANDLE SpaceEvent;
+   LONGLONG DecoderStall;
+   LONGLONG WriterStall;
+} LzmaPipeline;
+
+/**
+   State for decoding an LZMA stream incrementally. Decoded bytes that
+   have not been consumed yet are Window[Pos..End).
+*/
+typedef struct
+{
+   CLzmaDec Dec;
+   Byte* Src;
+   SizeT SrcLeft;
+   UInt64 OutLeft;
+   Byte* Window;
+   SizeT Pos;
+   SizeT End;
+   LzmaPipeline* Pipeline;
+} LzmaStream;
+
+/**
+   Decodes up to *Size bytes into Dest. *Size is set to the number of
+   bytes decoded, which is less than requested only at the end of the
+   stream.
+*/
+BOOL LzmaStreamDecode(LzmaStream* s, Byte* Dest, SizeT* Size)
+{
+   LONGLONG Start = TimerStart();
+   SizeT Total = 0;
+   while (Total < *Size && s->OutLeft > 0)
+   {
+      SizeT outLen = *Size - Total;
+      if (outLen > s->OutLeft)
+         outLen = (SizeT)s->OutLeft;
+      SizeT inLen = s->SrcLeft;
+      ELzmaStatus status;
+      if (LzmaDec_DecodeToBuf(&s->Dec, Dest + Total, &outLen, s->Src, &inLen, LZMA_FINISH_ANY, &status) != SZ_OK)
+      {
+         FATAL("LZMA decompression failed.");
+         return FALSE;
+      }
+      s->Src += inLen;
+      s->SrcLeft -= inLen;
+      Total += outLen;
+      s->OutLeft -= outLen;
+      if (status == LZMA_STATUS_FINISHED_WITH_MARK)
+      {
+         s->OutLeft = 0;
+      }
+      else if (outLen == 0 && inLen == 0)
+      {
+         FATAL("LZMA stream is truncated.");
+         return FALSE;
+      }
+   }
+   *Size = Total;
+   BenchEnd(BENCH_DECODE, Start);
+   TraceEnd("decode", "LzmaDecode", Start, Total, NULL);
+   return TRUE;
+}
+
+/** Returns the elapsed time since Start in milliseconds. */
+LONGLONG ElapsedMilliseconds(LARGE_INTEGER Start)
+{
+   LARGE_INTEGER Now, Frequency;
+   QueryPerformanceCounter(&Now);
+   QueryPerformanceFrequency(&Frequency);
+   return (Now.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart;
+}
+
+/**
+   Decoder thread of a pipelined stream. Decodes into the chunk ring
+   until the stream ends or the writer aborts.
+*/
+DWORD WINAPI LzmaPipelineDecoder(LPVOID lpParameter)
+{
+   LzmaStream* s = (LzmaStream*)lpParameter;
+   LzmaPipeline* p = s->Pipeline;
+   for (;;)
+   {
+      while (p->Head - p->Tail == LZMA_PIPELINE_CHUNKS && !p->Abort)
+      {
+         LARGE_INTEGER Start;
+         QueryPerformanceCounter(&Start);
+         WaitForSingleObject(p->SpaceEvent, INFINITE);
+         p->DecoderStall += ElapsedMilliseconds(Start);
+      }
+      if (p->Abort)
+         break;
+
+      LzmaChunk* Chunk = &p->Chunks[p->Head % LZMA_PIPELINE_CHUNKS];
+      Chunk->Length = LZMA_PIPELINE_CHUNK_SIZE;
+      if (!LzmaStreamDecode(s, Chunk->Data, &Chunk->Length))
+      {
+         p->Failed = TRUE;
+         Chunk->Length = 0;
+      }
+      MemoryBarrier();
+      InterlockedIncrement(&p->Head);
+      SetEvent(p->DataEvent);
+      if (Chunk->Length == 0)
+         break;
+   }
+   return 0;
+}
+
+/**
+   Copies up to *Size decoded bytes from the chunk ring into Dest,
+   waiting for the decoder thread when the ring is empty.
+*/
+BOOL LzmaPipelineRead(LzmaPipeline* p, Byte* Dest, SizeT* Size)
+{
+   SizeT Total = 0;
+   while (Total < *Size && !p->Finished)
+   {
+      if (p->Tail == p->Head)
+      {
+         LARGE_INTEGER Start;
+         QueryPerformanceCounter(&Start);
+         WaitForSingleObject(p->DataEvent, INFINITE);
+         p->WriterStall += ElapsedMilliseconds(Start);
+         continue;
+      }
+      MemoryBarrier();
+
+      LzmaChunk* Chunk = &p->Chunks[p->Tail % LZMA_PIPELINE_CHUNKS];
+      if (Chunk->Length == 0)
+      {
+         p->Finished = TRUE;
+         if (p->Failed)
+            return FALSE;
+         break;
+      }
+
+      SizeT n = Chunk->Length - p->ChunkPos;
+      if (n > *Size - Total)
+         n = *Size - Total;
+      memcpy(Dest + Total, Chunk->Data + p->ChunkPos, n);
+      BenchCount(&BenchCopied, n);
+      Total += n;
+      p->ChunkPos += n;
+      if (p->ChunkPos == Chunk->Length)
+      {
+         p->ChunkPos = 0;
+         InterlockedIncrement(&p->Tail);
+         SetEvent(p->SpaceEvent);
+      }
+   }
+   *Size = Total;
+   return TRUE;
+}
+
+/**
+   Moves unconsumed data to the start of the window and fills it up
+   with decoded data, until the window is full or the stream ends.
+*/
+BOOL LzmaStreamFill(LzmaStream* s)
+{
+   if (s->Pos > 0)
+   {
+      memmove(s->Window, s->Window + s->Pos, s->End - s->Pos);
+      BenchCount(&BenchCopied, s->End - s->Pos);
+      s->End -= s->Pos;
+      s->Pos = 0;
+   }
+
+   SizeT Size = LZMA_WINDOW_SIZE - s->End;
+   BOOL Result;
+   if (s->Pipeline)
+      Result = LzmaPipelineRead(s->Pipeline, s->Window + s->End, &Size);
+   else
+      Result = LzmaStreamDecode(s, s->Window + s->End, &Size);
+   s->End += Size;
+   return Result;
+}
+
+/**
+   Reads the next Size bytes of the decompressed stream into Dest. What
+   is left in the window is copied, and the rest is decoded straight
+   into Dest, leaving the window empty.
+*/
+BOOL LzmaStreamRead(LzmaStream* s, Byte* Dest, DWORD Size)
+{
+   DWORD Done = s->End - s->Pos;
+   if (Done > Size)
+      Done = Size;
+   CopyMemory(Dest, s->Window + s->Pos, Done);
+   BenchCount(&BenchCopied, Done);
+   s->Pos += Done;
+   while (Done < Size)
+   {
+      SizeT Length = Size - Done;
+      BOOL Result;
+      if (s->Pipeline)
+         Result = LzmaPipelineRead(s->Pipeline, Dest + Done, &Length);
+      else
+         Result = LzmaStreamDecode(s, Dest + Done, &Length);
+      if (!Result)
+         return FALSE;
+      if (Length == 0)
+      {
+         FATAL("Unexpected end of compressed stream.");
+         return FALSE;
+      }
+      Done += Length;
+   }
+   return TRUE;
+}
+
+/**
+   Create a file from the decompressed stream by decoding into a
+   mapped view of it. Sets *Mapped to FALSE, without reading from the
+   stream, if the file cannot be mapped.
+*/
+BOOL LzmaStreamCreateMappedFile(LzmaStream* s, HANDLE hFile, DWORD FileSize, BOOL X86, BOOL* Mapped)
+{
+   HANDLE hMapping;
+   LPBYTE View = MapInstFile(hFile, FileSize, &hMapping);
+   *Mapped = View != NULL;
+   if (View == NULL)
+      return TRUE;
+   BOOL Result = LzmaStreamRead(s, View, FileSize);
+   if (Result && X86)
+      X86Decode(View, FileSize);
+   UnmapInstFile(View, hMapping, FileSize);
+   return Result;
+}
+
+/**
+   Create a file of x86 code from the decompressed stream. The whole
+   file is needed to reverse the branch conversion, so a file that is
+   larger than what is left of the window is decoded into a mapped
+   view of it, or else collected in a buffer.
+*/
+BOOL LzmaStreamCreateFileX86(LzmaStream* s, LPTSTR FileName, DWORD FileSize)
+{
+   if (s->End - s->Pos >= FileSize)
+   {
+      X86Decode(s->Window + s->Pos, FileSize);
+      s->Pos += FileSize;
+      return IoCreateFile(FileName, s->Window + s->Pos - FileSize, FileSize);
+   }
+
+   HANDLE hFile = CreateMappableInstFile(FileName, FileSize);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      return FALSE;
+   }
+
+   BOOL Mapped;
+   BOOL Result = LzmaStreamCreateMappedFile(s, hFile, FileSize, TRUE, &Mapped);
+   if (Result && !Mapped)
+   {
+      LPBYTE Data = LocalAlloc(LMEM_FIXED, FileSize);
+      if (Data == NULL)
+      {
+         FATAL("Failed to allocate memory for '%s'.", FileName);
+         Result = FALSE;
+      }
+      else
+      {
+         Result = LzmaStreamRead(s, Data, FileSize);
+         if (Result)
+         {
+            X86Decode(Data, FileSize);
+            Result = WriteInstFile(hFile, Data, FileSize);
+         }
+         LocalFree(Data);
+      }
+   }
+
+   CloseInstFile(hFile);
+   return Result;
+}
+
+/**
+   Create a file from the decompressed stream, writing it as it is
+   decoded (OP_CREATE_FILE and OP_CREATE_FILE_X86 opcode handler for
+   LZMA streams).
+*/
+BOOL LzmaStreamCreateFile(LzmaStream* s, BOOL X86)
+{
+   LPVOID p = s->Window + s->Pos;
+   LPTSTR FileName = GetString(&p);
+   DWORD FileSize = GetInteger(&p);
+   s->Pos = (Byte*)p - s->Window;
+
+   if (X86)
+      return LzmaStreamCreateFileX86(s, FileName, FileSize);
+
+   /* Files that are already decoded in full are handed to the I/O
+      backend. Others are decoded into a mapped view of the file, or
+      else written as they are decoded. */
+   if (s->End - s->Pos >= FileSize)
+   {
+      s->Pos += FileSize;
+      return IoCreateFile(FileName, s->Window + s->Pos - FileSize, FileSize);
+   }
+
+   HANDLE hFile = CreateMappableInstFile(FileName, FileSize);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      return FALSE;
+   }
+
+   BOOL Mapped;
+   BOOL Result = LzmaStreamCreateMappedFile(s, hFile, FileSize, FALSE, &Mapped);
+   while (!Mapped && Result && FileSize > 0)
+   {
+      if (s->Pos == s->End)
+      {
+         if (!LzmaStreamFill(s))
+         {
+            Result = FALSE;
+            break;
+         }
+         if (s->Pos == s->End)
+         {
+            FATAL("Unexpected end of compressed stream.");
+            Result = FALSE;
+            break;
+         }
+      }
+      DWORD Chunk = s->End - s->Pos;
+      if (Chunk > FileSize)
+         Chunk = FileSize;
+      Result = WriteInstFile(hFile, s->Window + s->Pos, Chunk);
+      s->Pos += Chunk;
+      FileSize -= Chunk;
+   }
+
+   CloseInstFile(hFile);
+   return Result;
+}
+
+/**
+   Process the opcodes in an LZMA stream as they are decoded. Only a
+   window of the decompressed data is held in memory at any time.
+*/
+BOOL ProcessLzmaStream(LzmaStream* s)
+{
+   while (!ExitCondition)
+   {
+      if (s->End - s->Pos < LZMA_WINDOW_SIZE / 2 && !LzmaStreamFill(s))
+      {
+         return FALSE;
+      }
+
+      if (s->Pos == s->End)
+      {
+         return TRUE;
+      }
+
+      LPVOID p = s->Window + s->Pos;
+      DWORD opcode = *(DWORD*)p;
+      if (opcode == OP_CREATE_FILE || opcode == OP_CREATE_FILE_X86)
+      {
+         s->Pos += 4;
+         if (!LzmaStreamCreateFile(s, opcode == OP_CREATE_FILE_X86))
+         {
+            return FALSE;
+         }
+      }
+      else if (opcode == OP_DECOMPRESS_LZMA || opcode == OP_CREATE_CACHE_DIRECTORY || opcode == OP_DECOMPRESS_BLOCKS)
+      {
+         FATAL("Opcode '%lu' is not allowed in a compressed stream.", opcode);
+         return FALSE;
+      }
+      else
+      {
+         if (!ProcessOpcode(&p))
+         {
+            return FALSE;
+         }
+         s->Pos = (Byte*)p - s->Window;
+      }
+
+      if (s->Pos > s->End)
+      {
+         FATAL("Corrupt compressed stream.");
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/**
+   Process the opcodes in an LZMA stream, decoding it on a separate
+   thread so that decoding overlaps with writing files.
+*/
+BOOL ProcessLzmaStreamPipelined(LzmaStream* s)
+{
+   LzmaPipeline p;
+   ZeroMemory(&p, sizeof(p));
+   p.Chunks = LocalAlloc(LMEM_FIXED, LZMA_PIPELINE_CHUNKS * sizeof(LzmaChunk));
+   p.DataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   p.SpaceEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+   s->Pipeline = &p;
+
+   HANDLE hDecoder = NULL;
+   if (p.Chunks && p.DataEvent && p.SpaceEvent)
+      hDecoder = CreateThread(NULL, 0, LzmaPipelineDecoder, s, 0, NULL);
+
+   BOOL Success;
+   if (hDecoder)
+   {
+      Success = ProcessLzmaStream(s);
+      InterlockedExchange(&p.Abort, TRUE);
+      SetEvent(p.SpaceEvent);
+      WaitForSingleObject(hDecoder, INFINITE);
+      CloseHandle(hDecoder);
+      DEBUG("Pipeline stalls: decoder waited %lu ms for writer, writer waited %lu ms for decoder",
+            (DWORD)p.DecoderStall, (DWORD)p.WriterStall);
+   }
+   else
+   {
+      DEBUG("Failed to start decoder thread, decoding serially");
+      s->Pipeline = NULL;
+      Success = ProcessLzmaStream(s);
+   }
+
+   if (p.DataEvent)
+      CloseHandle(p.DataEvent);
+   if (p.SpaceEvent)
+      CloseHandle(p.SpaceEvent);
+   if (p.Chunks)
+      LocalFree(p.Chunks);
+   return Success;
+}
+
+/**
+   Decompress an LZMA stream and process the opcodes in it. With
+   UsePipeline set, decoding runs on a separate thread from file
+   creation.
+*/
+BOOL DecompressLzma(Byte* src, DWORD CompressedSize, BOOL UsePipeline)
+{
+   BOOL Success = TRUE;
+
+   UInt64 unpackSize = 0;
+   int i;
+   for (i = 0; i < 8; i++)
+   {
+      unpackSize += (UInt64)src[LZMA_PROPS_SIZE + i] << (i * 8);
+   }
+
+   CLzmaProps props;
+   if (LzmaProps_Decode(&props, src, LZMA_PROPS_SIZE) != SZ_OK)
+   {
+      FATAL("Unsupported LZMA properties.");
+      return FALSE;
+   }
+
+   /* The dictionary never needs to be larger than the uncompressed
+      data, so small payloads use correspondingly less memory. */
+   SizeT DicBufSize = props.dicSize;
+   if (unpackSize < DicBufSize)
+      DicBufSize = unpackSize > 0 ? (SizeT)unpackSize : 1;
+
+   LzmaStream s;
+   LzmaDec_Construct(&s.Dec);
+   if (LzmaDec_AllocateProbs(&s.Dec, src, LZMA_PROPS_SIZE, &alloc) != SZ_OK)
+   {
+      FATAL("Failed to allocate LZMA decoder.");
+      return FALSE;
+   }
+   s.Dec.dic = LocalAlloc(LMEM_FIXED, DicBufSize);
+   s.Dec.dicBufSize = DicBufSize;
+   s.Window = LocalAlloc(LMEM_FIXED, LZMA_WINDOW_SIZE);
+   if (s.Dec.dic == NULL || s.Window == NULL)
+   {
+      FATAL("Failed to allocate LZMA buffers.");
+      Success = FALSE;
+   }
+   else
+   {
+      s.Src = src + LZMA_HEADER_SIZE;
+      s.SrcLeft = CompressedSize - LZMA_HEADER_SIZE;
+      s.OutLeft = unpackSize;
+      s.Pos = s.End = 0;
+      s.Pipeline = NULL;
+      LzmaDec_Init(&s.Dec);
+      if (UsePipeline)
+         Success = ProcessLzmaStreamPipelined(&s);
+      else
+         Success = ProcessLzmaStream(&s);
+   }
+
+   if (s.Window)
+      LocalFree(s.Window);
+   if (s.Dec.dic)
+      LocalFree(s.Dec.dic);
+   LzmaDec_FreeProbs(&s.Dec, &alloc);
+   return Success;
+}
+
+BOOL OpDecompressLzma(LPVOID* p)
 {
-   PROCESS_INFORMATION ProcessInformation;
-   STARTUPINFO StartupInfo;
-   ZeroMemory(&StartupInfo, sizeof(StartupInfo));
-   StartupInfo.cb = sizeof(StartupInfo);
-   BOOL r = CreateProcess(ApplicationName, CommandLine, NULL, NULL,
-                          TRUE, 0, NULL, NULL, &StartupInfo, &ProcessInformation);
+   DWORD CompressedSize = GetInteger(p);
+   DEBUG("LzmaDecode(%ld)", CompressedSize);
 
-   if (!r)
+   Byte* src = (Byte*)*p;
+   *p += CompressedSize;
+
+   return DecompressLzma(src, CompressedSize, GetDecodeThreadCount() > 1);
+}
+
+/**
+   Decodes an LZMA block (header and data) into a buffer allocated
+   with LocalAlloc.
+*/
+BOOL LzmaDecodeBlock(LPBYTE Src, DWORD Size, LPBYTE* Data, DWORD* DataSize)
+{
+   if (Size < LZMA_HEADER_SIZE)
+      return FALSE;
+
+   ULONGLONG UnpackSize = 0;
+   int i;
+   for (i = 0; i < LZMA_UNPACKSIZE_SIZE; i++)
+      UnpackSize |= (ULONGLONG)Src[LZMA_PROPS_SIZE + i] << (8 * i);
+   if (UnpackSize > 0xFFFFFFFF)
+      return FALSE;
+
+   LPBYTE Dest = LocalAlloc(LMEM_FIXED, UnpackSize ? (SIZE_T)UnpackSize : 1);
+   if (Dest == NULL)
+      return FALSE;
+
+   SizeT DestLen = (SizeT)UnpackSize;
+   SizeT SrcLen = Size - LZMA_HEADER_SIZE;
+   ELzmaStatus Status;
+   SRes Result = LzmaDecode(Dest, &DestLen, Src + LZMA_HEADER_SIZE, &SrcLen,
+                            Src, LZMA_PROPS_SIZE, LZMA_FINISH_END, &Status, &alloc);
+   if (Result != SZ_OK || DestLen != UnpackSize)
    {
-      FATAL("Failed to create process (%s): %lu", ApplicationName, GetLastError());
-      return;
+      DEBUG("LZMA decompression failed (error %d)", Result);
+      LocalFree(Dest);
+      return FALSE;
    }
+   *Data = Dest;
+   *DataSize = (DWORD)DestLen;
+   return TRUE;
+}
 
-   WaitForSingleObject(ProcessInformation.hProcess, INFINITE);
+#endif
 
-   if (!GetExitCodeProcess(ProcessInformation.hProcess, &ExitStatus))
+#if WITH_LZ4
+#define LZ4_HEADER_SIZE 8
+
+/**
+   Decodes an LZ4 block (the uncompressed size as a 64 bit integer,
+   then the data) into a buffer allocated with LocalAlloc.
+*/
+BOOL Lz4DecodeBlock(LPBYTE Src, DWORD Size, LPBYTE* Data, DWORD* DataSize)
+{
+   if (Size < LZ4_HEADER_SIZE)
+      return FALSE;
+
+   ULONGLONG UnpackSize = 0;
+   int i;
+   for (i = 0; i < LZ4_HEADER_SIZE; i++)
+      UnpackSize |= (ULONGLONG)Src[i] << (8 * i);
+   if (UnpackSize > 0xFFFFFFFF)
+      return FALSE;
+
+   LPBYTE Dest = LocalAlloc(LMEM_FIXED, UnpackSize ? (SIZE_T)UnpackSize : 1);
+   if (Dest == NULL)
+      return FALSE;
+
+   if (!Lz4_Decode(Dest, (size_t)UnpackSize, Src + LZ4_HEADER_SIZE, Size - LZ4_HEADER_SIZE))
    {
-      FATAL("Failed to get exit status (error %lu).", GetLastError());
+      DEBUG("LZ4 decompression failed");
+      LocalFree(Dest);
+      return FALSE;
    }
+   *Data = Dest;
+   *DataSize = (DWORD)UnpackSize;
+   return TRUE;
+}
+#endif
 
-   CloseHandle(ProcessInformation.hProcess);
-   CloseHandle(ProcessInformation.hThread);
+/*
+   Block codecs. Compressed blocks (OP_DECOMPRESS_BLOCKS and the
+   streams of the table of contents) name the codec that decodes them.
+   Decode decodes a whole block into a buffer allocated with
+   LocalAlloc. A block is in memory in full, so decoding it in one
+   call avoids the copying and input buffering of a streaming decoder.
+*/
+typedef struct
+{
+   LPCTSTR Name;
+   BOOL (*Decode)(LPBYTE Src, DWORD Size, LPBYTE* Data, DWORD* DataSize);
+} BlockCodec;
+
+BlockCodec BlockCodecs[TOC_CODEC_MAX] =
+{
+   { _T("stored"), NULL },
+#if WITH_LZMA
+   { _T("lzma"), &LzmaDecodeBlock },
+#else
+   { _T("lzma"), NULL },
+#endif
+#if WITH_LZ4
+   { _T("lz4"), &Lz4DecodeBlock },
+#else
+   { _T("lz4"), NULL },
+#endif
+};
+
+/** Returns the codec with the given id, or NULL if it is not built in. */
+BlockCodec* GetBlockCodec(DWORD Codec)
+{
+   if (Codec >= TOC_CODEC_MAX || BlockCodecs[Codec].Decode == NULL)
+      return NULL;
+   return &BlockCodecs[Codec];
 }
 
 /**
- * Sets up a process to be created after all other opcodes have been processed. This can be used to create processes
- * after the temporary files have all been created and memory has been freed.
- */
-BOOL OpPostCreateProcess(LPVOID* p)
+   Creates the files in a decoded block. Blocks hold only
+   OP_CREATE_FILE and OP_CREATE_FILE_X86 opcodes. x86 code is
+   converted in place. Queued files refer to the block in Buffer
+   instead of copying their contents, if it is not NULL.
+*/
+BOOL ProcessFileBlock(LPBYTE Data, DWORD Size, IoBuffer* Buffer)
 {
-   DEBUG("PostCreateProcess");
-   if (PostCreateProcess_ApplicationName || PostCreateProcess_CommandLine)
+   LPVOID p = Data;
+   LPVOID End = Data + Size;
+   while (p < End && !ExitCondition)
+   {
+      DWORD Opcode = End - p < 4 ? OP_END : *(DWORD*)p;
+      if (Opcode != OP_CREATE_FILE && Opcode != OP_CREATE_FILE_X86)
+      {
+         FATAL("Corrupt compressed block.");
+         return FALSE;
+      }
+      p += 4;
+      LPTSTR FileName = p;
+      while (p < End && *(LPTSTR)p)
+         p += sizeof(TCHAR);
+      p += sizeof(TCHAR);
+      if (End - p < 4)
+      {
+         FATAL("Corrupt compressed block.");
+         return FALSE;
+      }
+      DWORD FileSize = GetInteger(&p);
+      if ((DWORD)(End - p) < FileSize)
+      {
+         FATAL("Corrupt compressed block.");
+         return FALSE;
+      }
+      if (Opcode == OP_CREATE_FILE_X86)
+         X86Decode(p, FileSize);
+      if (!IoCreateFileInBuffer(FileName, p, FileSize, Buffer))
+         return FALSE;
+      p += FileSize;
+   }
+   return TRUE;
+}
+
+/** Creates the files in a compressed block. */
+BOOL DecompressBlock(BlockCodec* Codec, LPBYTE Src, DWORD Size)
+{
+   LPBYTE Data;
+   DWORD DataSize;
+   LONGLONG Start = TimerStart();
+   if (!Codec->Decode(Src, Size, &Data, &DataSize))
    {
+      FATAL("Failed to decompress %s block.", Codec->Name);
       return FALSE;
    }
+   BenchEnd(BENCH_DECODE, Start);
+   TraceEnd("decode", Codec->Name, Start, DataSize, NULL);
+   /* The block is freed once its last queued file is written. */
+   IoBuffer* Buffer = IoCreateBuffer(Data);
+   BOOL Result = ProcessFileBlock(Data, DataSize, Buffer);
+   if (Buffer)
+      IoReleaseBuffer(Buffer);
    else
+      LocalFree(Data);
+   return Result;
+}
+
+/**
+   Shared state for the worker threads decoding a set of independently
+   compressed blocks.
+*/
+typedef struct
+{
+   BlockCodec* Codec;
+   LPBYTE* Blocks;
+   DWORD* BlockSizes;
+   LONG BlockCount;
+   LONG volatile NextBlock;
+   LONG volatile Failed;
+} BlockSet;
+
+DWORD WINAPI BlockWorker(LPVOID lpParameter)
+{
+   BlockSet* set = (BlockSet*)lpParameter;
+   while (!set->Failed)
    {
-      GetCreateProcessInfo(p, &PostCreateProcess_ApplicationName, &PostCreateProcess_CommandLine);
+      LONG i = InterlockedIncrement(&set->NextBlock) - 1;
+      if (i >= set->BlockCount)
+         break;
+      if (!DecompressBlock(set->Codec, set->Blocks[i], set->BlockSizes[i]))
+         InterlockedExchange(&set->Failed, TRUE);
+   }
+   return 0;
+}
+
+#define DECODE_MAX_THREADS 64
+
+/**
+   Decompress a set of independently compressed blocks on a pool of
+   worker threads. Each block holds only OP_CREATE_FILE opcodes
+   (OP_DECOMPRESS_BLOCKS opcode handler).
+*/
+BOOL OpDecompressBlocks(LPVOID* p)
+{
+   DWORD CodecId = GetInteger(p);
+   DWORD BlockCount = GetInteger(p);
+   DWORD* BlockSizes = (DWORD*)*p;
+   *p += BlockCount * sizeof(DWORD);
+
+   BlockCodec* Codec = GetBlockCodec(CodecId);
+   if (Codec == NULL)
+   {
+      FATAL("Unsupported codec %lu.", CodecId);
+      return FALSE;
+   }
+
+   LPBYTE* Blocks = LocalAlloc(LMEM_FIXED, BlockCount * sizeof(LPBYTE));
+   DWORD i;
+   for (i = 0; i < BlockCount; i++)
+   {
+      Blocks[i] = (LPBYTE)*p;
+      *p += BlockSizes[i];
+   }
+
+   DWORD ThreadCount = GetDecodeThreadCount();
+   if (ThreadCount > BlockCount)
+      ThreadCount = BlockCount;
+   if (ThreadCount > DECODE_MAX_THREADS)
+      ThreadCount = DECODE_MAX_THREADS;
+
+   DEBUG("DecodeBlocks(%s, %lu blocks, %lu threads)", Codec->Name, BlockCount, ThreadCount);
+   DWORD StartTime = GetTickCount();
+
+   BlockSet set;
+   set.Codec = Codec;
+   set.Blocks = Blocks;
+   set.BlockSizes = BlockSizes;
+   set.BlockCount = BlockCount;
+   set.NextBlock = 0;
+   set.Failed = FALSE;
+
+   /* The calling thread is one of the workers. */
+   HANDLE Threads[DECODE_MAX_THREADS];
+   DWORD ThreadsStarted = 0;
+   for (i = 1; i < ThreadCount; i++)
+   {
+      HANDLE h = CreateThread(NULL, 0, BlockWorker, &set, 0, NULL);
+      if (h == NULL)
+         break;
+      Threads[ThreadsStarted++] = h;
+   }
+   BlockWorker(&set);
+   for (i = 0; i < ThreadsStarted; i++)
+   {
+      WaitForSingleObject(Threads[i], INFINITE);
+      CloseHandle(Threads[i]);
+   }
+
+   DEBUG("DecodeBlocks finished in %lu ms", GetTickCount() - StartTime);
+
+   LocalFree(Blocks);
+   return !set.Failed;
+}
+
+/*
+   Lazy extraction. Files added with ocrapack's lazyfile record are not
+   extracted before the program starts. Instead, the stub serves
+   requests for them on a named pipe (OCRA_LAZY_PIPE) while the program
+   runs, and the interposer preloaded into Ruby
+   (share/ocra/ocra_lazy.rb) requests each file before first using it.
+   A request is a name from the table of contents followed by a
+   newline; the reply is '1' once the file exists, or '0'.
+*/
+#define LAZY_PIPE_BUFFER_SIZE 4096
+
+TCHAR LazyPipeName[MAX_PATH];
+CRITICAL_SECTION LazyLock;
+DWORD LazyBlockStream = 0;
+LPBYTE LazyBlockData = NULL;
+DWORD LazyBlockSize = 0;
+
+/**
+   Decodes the block of a table of contents stream into LazyBlockData.
+   The last decoded block is kept, as files that are used together are
+   usually stored together.
+*/
+BOOL LazyDecodeBlock(DWORD CodecId, DWORD Stream)
+{
+   if (LazyBlockData && LazyBlockStream == Stream)
       return TRUE;
+   BlockCodec* Codec = GetBlockCodec(CodecId);
+   if (Codec == NULL || Stream == 0 || Stream > TocStreamCount)
+      return FALSE;
+
+   ULONGLONG Offset = TocStreams[2 * (Stream - 1)];
+   ULONGLONG Size = TocStreams[2 * (Stream - 1) + 1];
+   if (Offset + Size > ImageSize)
+      return FALSE;
+
+   if (LazyBlockData)
+      LocalFree(LazyBlockData);
+   LazyBlockData = NULL;
+   if (!Codec->Decode(ImageBase + Offset, (DWORD)Size, &LazyBlockData, &LazyBlockSize))
+   {
+      DEBUG("Failed to decode stream %lu", Stream);
+      LazyBlockData = NULL;
+      return FALSE;
    }
+   LazyBlockStream = Stream;
+   return TRUE;
 }
 
-BOOL OpEnableDebugMode(LPVOID* p)
+/**
+   Extracts a lazy file. It is written under a temporary name and then
+   renamed, so the program never sees a partial file, and a file left
+   by an earlier run (with --cache) is kept. The temporary name
+   includes the process ID, since instances sharing the install
+   directory (--shared, --cache) may extract the same file at once.
+*/
+BOOL LazyExtract(TocEntry* e)
 {
-   DebugModeEnabled = TRUE;
-   DEBUG("Ocra stub running in debug mode");
+   TCHAR Partial[MAX_PATH], FromPath[MAX_PATH], ToPath[MAX_PATH];
+   LPBYTE Data;
+
+   if (e->Extracted)
+      return TRUE;
+
+   if (lstrlen(InstDir) + lstrlen(e->Name) + 32 > MAX_PATH)
+      return FALSE;
+   lstrcpy(ToPath, InstDir);
+   lstrcat(ToPath, _T("\\"));
+   lstrcat(ToPath, e->Name);
+   if (GetFileAttributes(ToPath) != INVALID_FILE_ATTRIBUTES)
+   {
+      e->Extracted = TRUE;
+      return TRUE;
+   }
+
+   if (e->Codec == TOC_CODEC_STORED && e->Offset + e->Size <= ImageSize)
+   {
+      Data = ImageBase + e->Offset;
+   }
+   else if (e->Codec != TOC_CODEC_STORED && LazyDecodeBlock(e->Codec, e->Stream) && e->Offset + e->Size <= LazyBlockSize)
+   {
+      Data = LazyBlockData + e->Offset;
+   }
+   else
+   {
+      DEBUG("Cannot extract '%s' on demand", e->Name);
+      return FALSE;
+   }
+
+   _sntprintf(Partial, MAX_PATH, _T("%s.ocra-partial-%lu"), e->Name, GetCurrentProcessId());
+   Partial[MAX_PATH - 1] = 0;
+   lstrcpy(FromPath, InstDir);
+   lstrcat(FromPath, _T("\\"));
+   lstrcat(FromPath, Partial);
+   if (!WriteWholeInstFile(Partial, Data, (DWORD)e->Size))
+      return FALSE;
+   if (!MoveFileEx(FromPath, ToPath, MOVEFILE_REPLACE_EXISTING))
+   {
+      if (GetFileAttributes(ToPath) != INVALID_FILE_ATTRIBUTES)
+      {
+         DEBUG("'%s' was extracted by another instance", e->Name);
+         DeleteFile(FromPath);
+         e->Extracted = TRUE;
+         return TRUE;
+      }
+      DEBUG("Failed to rename '%s' (error %lu)", FromPath, GetLastError());
+      DeleteFile(FromPath);
+      return FALSE;
+   }
+   e->Extracted = TRUE;
    return TRUE;
 }
 
-#if WITH_LZMA
-void* SzAlloc(void* p, size_t size) { p = p; return LocalAlloc(LMEM_FIXED, size); }
-void SzFree(void* p, void* address) { p = p; LocalFree(address); }
-ISzAlloc alloc = { SzAlloc, SzFree };
+/** Handles one request. Eager files already exist. */
+BOOL LazyRequest(LPTSTR Name)
+{
+   BOOL Result = FALSE;
+   EnterCriticalSection(&LazyLock);
+   TocEntry* e = TocFindEntry(Name);
+   if (e)
+      Result = (e->Flags & TOC_FLAG_LAZY) ? LazyExtract(e) : TRUE;
+   LeaveCriticalSection(&LazyLock);
+   DEBUG("Lazy extraction of '%s': %s", Name, Result ? "done" : "failed");
+   return Result;
+}
 
-#define LZMA_UNPACKSIZE_SIZE 8
-#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
+/** Serves the requests of one connected client until it disconnects. */
+DWORD WINAPI LazyServeClient(LPVOID lpParameter)
+{
+   HANDLE hPipe = (HANDLE)lpParameter;
+   char Request[2 * MAX_PATH];
+   DWORD Used = 0, BytesRead, BytesWritten;
+   BOOL Connected = TRUE;
 
-BOOL OpDecompressLzma(LPVOID* p)
+   while (Connected && ReadFile(hPipe, Request + Used, sizeof(Request) - Used, &BytesRead, NULL) && BytesRead > 0)
+   {
+      char* Line = Request;
+      char* End;
+      Used += BytesRead;
+      while (Connected && (End = memchr(Line, '\n', Request + Used - Line)) != NULL)
+      {
+         *End = 0;
+         char Reply = LazyRequest(Line) ? '1' : '0';
+         Connected = WriteFile(hPipe, &Reply, 1, &BytesWritten, NULL);
+         Line = End + 1;
+      }
+      Used -= Line - Request;
+      memmove(Request, Line, Used);
+      if (Used == sizeof(Request))
+         break; /* Not a valid name */
+   }
+
+   DisconnectNamedPipe(hPipe);
+   CloseHandle(hPipe);
+   return 0;
+}
+
+HANDLE LazyCreatePipe(DWORD Flags)
 {
-   BOOL Success = TRUE;
+   return CreateNamedPipe(LazyPipeName, PIPE_ACCESS_DUPLEX | Flags,
+                          PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                          PIPE_UNLIMITED_INSTANCES, LAZY_PIPE_BUFFER_SIZE, LAZY_PIPE_BUFFER_SIZE, 0, NULL);
+}
 
-   DWORD CompressedSize = GetInteger(p);
-   DEBUG("LzmaDecode(%ld)", CompressedSize);
+/**
+   Accepts clients for as long as the stub runs. Each client (the
+   program and any Ruby processes it starts) is served on its own
+   thread, while the next pipe instance waits for a connection.
+*/
+DWORD WINAPI LazyServer(LPVOID lpParameter)
+{
+   HANDLE hPipe = (HANDLE)lpParameter;
+   while (hPipe != INVALID_HANDLE_VALUE)
+   {
+      if (ConnectNamedPipe(hPipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED)
+      {
+         HANDLE hThread = CreateThread(NULL, 0, LazyServeClient, hPipe, 0, NULL);
+         if (hThread)
+            CloseHandle(hThread);
+         else
+            LazyServeClient(hPipe);
+      }
+      else
+      {
+         CloseHandle(hPipe);
+      }
+      hPipe = LazyCreatePipe(0);
+   }
+   DEBUG("Lazy extraction server stopped (error %lu)", GetLastError());
+   return 0;
+}
 
-   Byte* src = (Byte*)*p;
-   *p += CompressedSize;
+/**
+   Starts serving lazy files and publishes the pipe name to the
+   program. The first pipe instance is created here, so the program
+   can connect as soon as it starts.
+*/
+BOOL LazyStartServer()
+{
+   _sntprintf(LazyPipeName, MAX_PATH, _T("\\\\.\\pipe\\ocra-lazy-%lu-%lu"), GetCurrentProcessId(), GetTickCount());
+   InitializeCriticalSection(&LazyLock);
 
-   UInt64 unpackSize = 0;
-   int i;
-   for (i = 0; i < 8; i++)
+   HANDLE hPipe = LazyCreatePipe(FILE_FLAG_FIRST_PIPE_INSTANCE);
+   if (hPipe == INVALID_HANDLE_VALUE)
    {
-      unpackSize += (UInt64)src[LZMA_PROPS_SIZE + i] << (i * 8);
+      FATAL("Failed to create lazy extraction pipe (error %lu).", GetLastError());
+      return FALSE;
    }
 
-   Byte* DecompressedData = LocalAlloc(LMEM_FIXED, unpackSize);
+   HANDLE hThread = CreateThread(NULL, 0, LazyServer, hPipe, 0, NULL);
+   if (hThread == NULL)
+   {
+      FATAL("Failed to start lazy extraction server (error %lu).", GetLastError());
+      CloseHandle(hPipe);
+      return FALSE;
+   }
+   CloseHandle(hThread);
+
+   SetEnvironmentVariable(_T("OCRA_LAZY_PIPE"), LazyPipeName);
+   DEBUG("Serving %lu lazy files on %s", TocLazyCount, LazyPipeName);
+   LazyServerRunning = TRUE;
+   return TRUE;
+}
+
+/*
+   Background extraction. Lazy files with TOC_FLAG_BACKGROUND (written
+   by ocra --early-launch) are extracted on a thread once the program
+   has started, instead of only when it asks for them. The program
+   starts as soon as the files it needs to boot are written, and a
+   request for a file the thread has not reached yet is served right
+   away, or waits until the thread has written it.
+*/
+HANDLE LazyBackgroundThread = NULL;
+LONG volatile LazyBackgroundStop = FALSE;
+
+/** Orders entries by where their contents are stored. */
+int LazyCompareEntries(const void* a, const void* b)
+{
+   const TocEntry* x = *(const TocEntry**)a;
+   const TocEntry* y = *(const TocEntry**)b;
+   if (x->Stream != y->Stream)
+      return x->Stream < y->Stream ? -1 : 1;
+   if (x->Offset != y->Offset)
+      return x->Offset < y->Offset ? -1 : 1;
+   return 0;
+}
 
-   SizeT lzmaDecompressedSize = unpackSize;
-   SizeT inSizePure = CompressedSize - LZMA_HEADER_SIZE;
-   ELzmaStatus status;
-   SRes res = LzmaDecode(DecompressedData, &lzmaDecompressedSize, src + LZMA_HEADER_SIZE, &inSizePure,
-                         src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY, &status, &alloc);
-   if (res != SZ_OK)
+/**
+   Extracts the background files in the order they are stored, which
+   is the order in which the program is expected to use them, and
+   decodes each block once.
+*/
+DWORD WINAPI LazyBackgroundProc(LPVOID lpParameter)
+{
+   TocEntry** Entries = (TocEntry**)lpParameter;
+   DWORD Count = 0, Extracted = 0, i;
+   ULONGLONG Bytes = 0;
+   LONGLONG Start = TimerStart();
+   for (i = 0; i < TocEntryCount; i++)
    {
-      FATAL("LZMA decompression failed.");
-      Success = FALSE;
+      if ((TocEntries[i].Flags & TOC_FLAG_LAZY) && (TocEntries[i].Flags & TOC_FLAG_BACKGROUND))
+         Entries[Count++] = &TocEntries[i];
    }
-   else
+   qsort(Entries, Count, sizeof(TocEntry*), LazyCompareEntries);
+
+   for (i = 0; i < Count && !LazyBackgroundStop; i++)
    {
-      LPVOID decPtr = DecompressedData;
-      if (!ProcessOpcodes(&decPtr))
+      EnterCriticalSection(&LazyLock);
+      if (!Entries[i]->Extracted)
       {
-         Success = FALSE;
+         if (LazyExtract(Entries[i]))
+         {
+            Extracted++;
+            Bytes += Entries[i]->Size;
+         }
+         else
+         {
+            DEBUG("Failed to extract '%s' in the background", Entries[i]->Name);
+         }
       }
+      LeaveCriticalSection(&LazyLock);
    }
 
-   LocalFree(DecompressedData);
-   return Success;
+   DEBUG("Extracted %lu of %lu files in the background", Extracted, Count);
+   TraceEnd("lazy", "Background", Start, Bytes, NULL);
+   LocalFree(Entries);
+   return 0;
+}
+
+/** Starts extracting the background files, once the program runs. */
+void LazyStartBackground()
+{
+   if (!LazyServerRunning || TocBackgroundCount == 0 || LazyBackgroundThread != NULL)
+      return;
+   TocEntry** Entries = LocalAlloc(LMEM_FIXED, TocBackgroundCount * sizeof(TocEntry*));
+   if (Entries == NULL)
+      return;
+   LazyBackgroundThread = CreateThread(NULL, 0, LazyBackgroundProc, Entries, 0, NULL);
+   if (LazyBackgroundThread == NULL)
+   {
+      DEBUG("Failed to start background extraction (error %lu)", GetLastError());
+      LocalFree(Entries);
+      return;
+   }
+   SetThreadPriority(LazyBackgroundThread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+/**
+   Stops extracting in the background. Waits for the file being
+   written, so that no file is being written when the installation
+   directory is deleted.
+*/
+void LazyStopBackground()
+{
+   if (LazyBackgroundThread == NULL)
+      return;
+   LazyBackgroundStop = TRUE;
+   WaitForSingleObject(LazyBackgroundThread, INFINITE);
+   CloseHandle(LazyBackgroundThread);
+   LazyBackgroundThread = NULL;
 }
-#endif
 
 BOOL OpEnd(LPVOID* p)
 {
@@ -0,0 +1,396 @@
+# Startup benchmark for the stub.
+#
+# Generates synthetic payloads, packs them with ocrapack and runs the
+# resulting executables with OCRA_BENCHMARK set, so that the stub
+# reports how long each phase took (map, mkdir, decode, write,
+# extract, launch, run, cleanup and total; see src/stub.c) and how many
+# bytes it copied between buffers, wrote and decoded straight into
+# mapped files. Writes one line of JSON per stub and configuration,
+# with the median of each phase over the runs, and prints a summary
+# table to stderr.
+#
+#   ruby test/benchmark.rb [options]
+#
+# The corpus options take comma separated lists, and every combination
+# is benchmarked:
+#
+#   --files N,...      Number of files (default 100,1000,10000).
+#   --size SIZE,...    Total size of the files, in bytes or with a K, M
+#                      or G suffix (default 1M,64M).
+#   --depth N,...      Depth of the directory tree (default 2).
+#   --data KIND,...    text (compressible, like source code) or random
+#                      (incompressible) (default text,random).
+#   --codec NAME,...   Codec passed to ocrapack (default lzma,lz4,none).
+#   --block-size N     Passed to ocrapack as --block-size.
+#   --mode MODE,...    How the executable starts the program (default
+#                      eager):
+#                        eager   extracts every file, then launches the
+#                                --launch program.
+#                        reader  extracts every file, then launches a
+#                                Ruby script that reads 1% of them and
+#                                prints a line.
+#                        lazy    extracts only the script, which reads
+#                                the same files through
+#                                share/ocra/ocra_lazy.rb (lazyfile
+#                                records, as with ocra --lazy-extract).
+#
+# The stub options take comma separated lists too, and each value is
+# run against every executable:
+#
+#   --threads N,...    Decoding threads, passed as OCRA_DECODE_THREADS
+#                      (default: the stub's, one per processor). Give
+#                      --block-size too, as a payload of one block is
+#                      decoded by one thread.
+#   --queue-depth N,...
+#                      Files queued for the I/O threads, passed as
+#                      OCRA_IO_QUEUE_DEPTH; 0 selects blocking writes
+#                      (default: the stub's).
+#
+# Other options:
+#
+#   --stub EXE         Stub to benchmark. Give it more than once to
+#                      compare builds (default share/ocra/stub.exe).
+#   --ocrapack EXE     Packer (default share/ocra/ocrapack.exe,
+#                      src/ocrapack.exe or src/ocrapack).
+#   --runs N           Runs per configuration (default 5).
+#   --work DIR         Where corpora and executables are kept between
+#                      invocations (default ocra-benchmark in the
+#                      temporary directory).
+#   --output FILE      Append the results to FILE instead of stdout.
+#   --runner CMD       Command that runs the executables, e.g. wine
+#                      when benchmarking on Linux.
+#   --launch PROGRAM   Program the executables launch (default cmd.exe
+#                      /c exit 0), which times process creation.
+#   --ruby EXE         Ruby that runs the script of the reader and lazy
+#                      modes (default the one running the benchmark).
+#
+# Besides the stub's phases, the time until the program first writes
+# to stdout (first_output) is measured from the outside, which is when
+# a user sees it start; a program that writes nothing counts as
+# starting when it exits.
+#
+# On Linux, the stub can be built against the Win32 emulation in
+# test/posix (make -C src posixstub ocrapack.exe), which runs images
+# given as its first argument:
+#
+#   ruby test/benchmark.rb --runner src/posixstub --stub src/posixstub \
+#     --ocrapack src/ocrapack --launch /bin/true
+#
+# The script of the lazy mode then talks to the emulated pipe (a Unix
+# domain socket) instead.
+#
+# Its timings show how the stub's code performs, not what the same
+# work costs on Windows (see test/posix/winposix.c).
+#
+# Executables cannot exceed 4 GB, so the largest stored payloads are
+# skipped.
+
+require "fileutils"
+require "json"
+require "rbconfig"
+require "tmpdir"
+
+module OcraBenchmark
+  OCRA_ROOT = File.expand_path("..", __dir__)
+
+  # Files per directory at the bottom of the tree.
+  FILES_PER_DIRECTORY = 100
+
+  PHASES = %w[map mkdir decode write extract launch run cleanup total]
+
+  MAX_EXECUTABLE_SIZE = 0xFFFFFFFF
+
+  MODES = %w[eager reader lazy]
+
+  # Every READ_INTERVAL-th file is read by the script of the reader and
+  # lazy modes.
+  READ_INTERVAL = 100
+
+  # The script of the reader and lazy modes, extracted to the root of
+  # the installation directory with the list of files to read.
+  READER = <<-'RUBY'
+    # Reads the files listed in ocra-benchmark-reads.txt, then prints
+    # one line. In the lazy mode, they are extracted as they are read.
+    if ENV["OCRA_LAZY_PIPE"]
+      unless File::ALT_SEPARATOR
+        # The Win32 emulation in test/posix serves the pipe on a Unix
+        # domain socket, and passes paths with backslashes.
+        require "socket"
+        ENV["OCRA_EXECUTABLE"] = ENV["OCRA_EXECUTABLE"].tr("\\", "/")
+      end
+      require File.join(__dir__, "ocra", "ocra_lazy")
+      unless File::ALT_SEPARATOR
+        OcraLazyExtract.define_singleton_method(:connect) do
+          @pipe = UNIXSocket.new("/tmp/ocrapipe-" + @pipe_name.split("\\").last)
+        end
+      end
+    end
+    names = File.read(File.join(__dir__, "ocra-benchmark-reads.txt")).split("\n")
+    bytes = names.sum { |name| File.binread(File.join(__dir__, name)).bytesize }
+    puts "read #{names.size} files (#{bytes} bytes)"
+  RUBY
+
+  # Words that text files are made of.
+  WORDS = %w[def end class module self if else elsif unless while do
+             return require attr_reader nil true false each map select
+             @name @options File Dir Pathname String Array Hash ||= ==
+             ( ) { } | . , : => + - * / # 'ocra' "name"] + (1..64).map(&:to_s)
+
+  @options = {
+    :files => [100, 1000, 10000],
+    :size => [1024 * 1024, 64 * 1024 * 1024],
+    :depth => [2],
+    :data => %w[text random],
+    :codec => %w[lzma lz4 none],
+    :block_size => nil,
+    :modes => %w[eager],
+    :threads => [nil],
+    :queue_depth => [nil],
+    :stubs => [],
+    :ocrapack => nil,
+    :runs => 5,
+    :work => File.join(Dir.tmpdir, "ocra-benchmark"),
+    :output => nil,
+    :runner => nil,
+    :launch => nil,
+    :ruby => RbConfig.ruby,
+  }
+
+  class << self
+    attr_reader :options
+
+    def fatal_error(message)
+      $stderr.puts "ERROR: #{message}"
+      exit 1
+    end
+
+    def parse_size(text)
+      value = text =~ /\A(\d+)([kmg]?)\z/i ? $1.to_i : fatal_error("Invalid size #{text}")
+      value * { "" => 1, "k" => 1024, "m" => 1024 ** 2, "g" => 1024 ** 3 }[$2.downcase]
+    end
+
+    def list(text, &block)
+      text.to_s.split(",").map(&block)
+    end
+
+    def parseargs(argv)
+      while arg = argv.shift
+        case arg
+        when "--files" then @options[:files] = list(argv.shift) { |n| Integer(n) }
+        when "--size" then @options[:size] = list(argv.shift) { |s| parse_size(s) }
+        when "--depth" then @options[:depth] = list(argv.shift) { |n| Integer(n) }
+        when "--data" then @options[:data] = list(argv.shift) { |d| d }
+        when "--codec" then @options[:codec] = list(argv.shift) { |c| c }
+        when "--block-size" then @options[:block_size] = parse_size(argv.shift.to_s)
+        when "--mode" then @options[:modes] = list(argv.shift) { |m| m }
+        when "--threads" then @options[:threads] = list(argv.shift) { |n| Integer(n) }
+        when "--queue-depth" then @options[:queue_depth] = list(argv.shift) { |n| Integer(n) }
+        when "--stub" then @options[:stubs] << File.expand_path(argv.shift.to_s)
+        when "--ocrapack" then @options[:ocrapack] = File.expand_path(argv.shift.to_s)
+        when "--runs" then @options[:runs] = Integer(argv.shift)
+        when "--work" then @options[:work] = File.expand_path(argv.shift.to_s)
+        when "--output" then @options[:output] = argv.shift
+        when "--runner" then @options[:runner] = argv.shift
+        when "--launch" then @options[:launch] = argv.shift
+        when "--ruby" then @options[:ruby] = argv.shift
+        else fatal_error "Unknown option #{arg}"
+        end
+      end
+      unknown = @options[:data] - %w[text random]
+      fatal_error "Unknown data kind #{unknown.join(', ')}" unless unknown.empty?
+      unknown = @options[:modes] - MODES
+      fatal_error "Unknown mode #{unknown.join(', ')}" unless unknown.empty?
+      @options[:stubs] << File.join(OCRA_ROOT, "share", "ocra", "stub.exe") if @options[:stubs].empty?
+      @options[:ocrapack] ||= [File.join(OCRA_ROOT, "share", "ocra", "ocrapack.exe"),
+                               File.join(OCRA_ROOT, "src", "ocrapack.exe"),
+                               File.join(OCRA_ROOT, "src", "ocrapack")].find { |path| File.exist?(path) }
+      fatal_error "ocrapack not found, build it with rake build_stub" unless @options[:ocrapack]
+      (@options[:stubs] + [@options[:ocrapack]]).each do |path|
+        fatal_error "#{path} not found" unless File.exist?(path)
+      end
+    end
+
+    # Returns the relative directory of file number i, in a tree of
+    # the given depth with the same number of subdirectories at each
+    # level.
+    def directory(i, files, depth)
+      return nil if depth == 0
+      leaves = (files + FILES_PER_DIRECTORY - 1) / FILES_PER_DIRECTORY
+      fanout = [(leaves ** (1.0 / depth)).ceil, 1].max
+      leaf = i % leaves
+      Array.new(depth) { |level| "d#{leaf / fanout ** (depth - level - 1) % fanout}" }.join("/")
+    end
+
+    # Generates a corpus unless an earlier run did, and returns its
+    # directory and the relative paths of its directories and files.
+    def corpus(files, size, depth, data)
+      dir = File.join(@options[:work], "corpus-#{files}-#{size}-#{depth}-#{data}")
+      names = Array.new(files) { |i| [directory(i, files, depth), "f#{i}.#{data == 'text' ? 'rb' : 'bin'}"].compact.join("/") }
+      directories = names.map { |name| File.dirname(name) }.uniq - ["."]
+      directories = directories.flat_map { |d| d.split("/").each_index.map { |n| d.split("/")[0..n].join("/") } }.uniq.sort
+      marker = File.join(dir, ".complete")
+      return dir, directories, names if File.exist?(marker)
+
+      $stderr.puts "Generating #{files} #{data} files (#{size} bytes) in #{dir}"
+      FileUtils.rm_rf(dir)
+      random = Random.new(files ^ size ^ depth)
+      lines = Array.new(4096) { Array.new(1 + random.rand(12)) { WORDS[random.rand(WORDS.size)] }.join(" ") + "\n" }
+      weights = Array.new(files) { 0.1 + random.rand * 1.8 }
+      scale = size / weights.sum
+      FileUtils.mkdir_p(dir)
+      directories.each { |d| FileUtils.mkdir_p(File.join(dir, d)) }
+      names.each_with_index do |name, i|
+        length = (weights[i] * scale).to_i
+        File.open(File.join(dir, name), "wb") do |file|
+          while length > 0
+            chunk = [length, 1024 * 1024].min
+            if data == "random"
+              file << random.bytes(chunk)
+            else
+              text = +""
+              text << lines[random.rand(lines.size)] while text.size < chunk
+              file << text[0, chunk]
+            end
+            length -= chunk
+          end
+        end
+      end
+      File.write(marker, "")
+      return dir, directories, names
+    end
+
+    def launch_record(mode)
+      if mode != "eager"
+        ["postprocess", @options[:ruby], "\"#{@options[:ruby]}\" \"|\\ocra-benchmark-reader.rb\""]
+      elsif @options[:launch]
+        ["postprocess", @options[:launch], "\"#{@options[:launch]}\""]
+      else
+        comspec = ENV["ComSpec"] || "C:\\Windows\\System32\\cmd.exe"
+        ["postprocess", comspec, "\"#{comspec}\" /c exit 0"]
+      end
+    end
+
+    # Writes the script of the reader and lazy modes and the list of
+    # files it reads next to a corpus, and returns their paths.
+    def reader(corpus_dir, names)
+      script = "#{corpus_dir}-reader.rb"
+      reads = "#{corpus_dir}-reads.txt"
+      File.write(script, READER.gsub(/^    /, ""))
+      File.write(reads, names.each_slice(READ_INTERVAL).map(&:first).join("\n"))
+      return script, reads
+    end
+
+    # Packs a corpus into an executable with the given stub, unless an
+    # up to date one exists. Returns its path.
+    def pack(stub, stub_index, corpus_dir, directories, names, codec, mode)
+      exe = "#{corpus_dir}-#{codec}-#{@options[:block_size] || 0}-#{mode}-stub#{stub_index}.exe"
+      inputs = [stub, @options[:ocrapack], __FILE__] + %w[ocra_lazy.rb ocra_preload.rb].map { |name| File.join(OCRA_ROOT, "share", "ocra", name) }
+      return exe if File.exist?(exe) && inputs.all? { |input| File.mtime(exe) > File.mtime(input) }
+
+      manifest = exe.sub(/\.exe\z/, ".manifest")
+      File.open(manifest, "wb") do |file|
+        record = lambda do |*fields|
+          file << fields.map { |field| field.to_s.gsub(/[\\\t\n]/, "\\" => "\\\\", "\t" => "\\t", "\n" => "\\n") }.join("\t") << "\n"
+        end
+        record.call("instdir", 0, 1, 0)
+        directories.each { |d| record.call("mkdir", d.tr("/", "\\")) }
+        if mode != "eager"
+          script, reads = reader(corpus_dir, names)
+          record.call("file", "ocra-benchmark-reader.rb", script)
+          record.call("file", "ocra-benchmark-reads.txt", reads)
+        end
+        if mode == "lazy"
+          record.call("mkdir", "ocra")
+          %w[ocra_lazy.rb ocra_preload.rb].each do |name|
+            record.call("file", "ocra\\#{name}", File.join(OCRA_ROOT, "share", "ocra", name))
+          end
+        end
+        type = mode == "lazy" ? "lazyfile" : "file"
+        names.each { |name| record.call(type, name.tr("/", "\\"), File.join(corpus_dir, name)) }
+        record.call(*launch_record(mode))
+      end
+      command = [@options[:ocrapack], "--stub", stub, "--codec", codec, "--toc", "--quiet"]
+      command.push("--block-size", @options[:block_size].to_s) if @options[:block_size]
+      command.push(exe, manifest)
+      system(*command) or fatal_error "#{command.join(' ')} failed"
+      exe
+    end
+
+    def median(values)
+      sorted = values.sort
+      (sorted[(sorted.size - 1) / 2] + sorted[sorted.size / 2]) / 2.0
+    end
+
+    # Returns the environment variables that set the stub options of a
+    # configuration, leaving out those that use the stub's default.
+    def stub_env(threads, queue_depth)
+      env = {}
+      env["OCRA_DECODE_THREADS"] = threads.to_s if threads
+      env["OCRA_IO_QUEUE_DEPTH"] = queue_depth.to_s if queue_depth
+      env
+    end
+
+    # Runs an executable and returns the median of each phase, of the
+    # time until the program first wrote to stdout, and of the time
+    # until it exited.
+    def measure(exe, env = {})
+      report = File.join(@options[:work], "report.jsonl")
+      samples = Array.new(@options[:runs]) do
+        File.delete(report) if File.exist?(report)
+        command = @options[:runner].to_s.split + [exe]
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        first_output = nil
+        IO.popen(env.merge("OCRA_BENCHMARK" => report), command, "rb") do |io|
+          io.readpartial(4096) rescue EOFError
+          first_output = (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) * 1000
+          io.read
+        end
+        wall = (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) * 1000
+        fatal_error "#{exe} failed" unless $?.success?
+        fatal_error "#{exe} did not write #{report}; does the stub support OCRA_BENCHMARK?" unless File.exist?(report)
+        JSON.parse(File.read(report).lines.last).merge("first_output" => first_output, "wall" => wall)
+      end
+      result = { "files_written" => samples.last["files"], "exit" => samples.last["exit"],
+                 "copied" => samples.last["copied"], "written" => samples.last["written"],
+                 "mapped" => samples.last["mapped"] }
+      (PHASES + ["first_output", "wall"]).each { |phase| result[phase] = median(samples.map { |s| s[phase] }).round(3) }
+      result
+    end
+
+    def run
+      FileUtils.mkdir_p(@options[:work])
+      output = @options[:output] ? File.open(@options[:output], "a") : $stdout
+      output.sync = true
+      $stderr.puts format("%-6s %6s %6s %10s %3s %-6s %-5s %-6s %10s %3s %4s" + " %9s" * 7, "stub", "runs", "files", "size",
+                          "dep", "data", "codec", "mode", "exe size", "thr", "qd",
+                          "extract", "decode", "write", "launch", "cleanup", "total", "first")
+      @options[:files].product(@options[:size], @options[:depth], @options[:data]).each do |files, size, depth, data|
+        corpus_dir, directories, names = corpus(files, size, depth, data)
+        @options[:codec].product(@options[:modes], @options[:stubs].each_with_index.to_a).each do |codec, mode, (stub, index)|
+          config = { "stub" => stub, "files" => files, "size" => size, "depth" => depth, "data" => data,
+                     "codec" => codec, "mode" => mode, "block_size" => @options[:block_size], "runs" => @options[:runs] }
+          if codec == "none" && size >= MAX_EXECUTABLE_SIZE
+            output.puts JSON.generate(config.merge("skipped" => "executable would exceed 4 GB"))
+            next
+          end
+          exe = pack(stub, index, corpus_dir, directories, names, codec, mode)
+          @options[:threads].product(@options[:queue_depth]).each do |threads, queue_depth|
+            result = config.merge("threads" => threads, "queue_depth" => queue_depth, "exe_size" => File.size(exe))
+            result = result.merge(measure(exe, stub_env(threads, queue_depth)))
+            output.puts JSON.generate(result)
+            $stderr.puts format("%-6s %6d %6d %10d %3d %-6s %-5s %-6s %10d %3s %4s" + " %9.1f" * 7, "##{index}", @options[:runs],
+                                files, size, depth, data, codec, mode, result["exe_size"], threads || "-", queue_depth || "-",
+                                *%w[extract decode write launch cleanup total first_output].map { |phase| result[phase] })
+          end
+        end
+      end
+    ensure
+      output.close if output && output != $stdout
+    end
+  end
+end
+
+if __FILE__ == $0
+  OcraBenchmark.parseargs(ARGV)
+  OcraBenchmark.run
+end
@@ -0,0 +1,4 @@
+require_relative "lib/archivelib"
+exit 1 unless ArchiveLib::VALUE == 42
+exit 2 unless ArchiveLib.data == "used\n"
+exit 3 unless require_relative("lib/archivelib") == false
@@ -0,0 +1,7 @@
+module ArchiveLib
+  VALUE = 42
+
+  def self.data
+    OcraResource.read(File.join(__dir__, "..", "data", "used.txt"))
+  end
+end
@@ -0,0 +1,3 @@
+dir = File.dirname(__FILE__)
+exit 1 unless File.read(File.join(dir, "data.txt")) == "duplicate contents\n"
+exit 2 unless File.read(File.join(dir, "copy", "data.txt")) == "duplicate contents\n"
@@ -0,0 +1,3 @@
+require "digest/sha1"
+data = File.join(File.dirname($0), "data.bin")
+exit 1 unless Digest::SHA1.file(data).hexdigest == ARGV[0]
@@ -0,0 +1,3 @@
+require_relative "lib/lazylib"
+exit 1 unless LazyLib::VALUE == 42
+exit 2 unless File.read(File.join(File.dirname(__FILE__), "data", "used.txt")) == "used\n"
@@ -0,0 +1,3 @@
+module LazyLib
+  VALUE = 42
+end
@@ -0,0 +1,5 @@
+require "digest/sha1"
+ARGV.each_slice(2) do |name, digest|
+  path = File.join(File.dirname($0), name)
+  exit 1 unless Digest::SHA1.file(path).hexdigest == digest
+end
@@ -0,0 +1,3 @@
+exit if defined?(Ocra)
+File.write("instance-#{Process.pid}.txt", File.dirname(File.expand_path(__FILE__)))
+sleep 1
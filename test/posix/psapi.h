@@ -0,0 +1,24 @@
+/* GetProcessMemoryInfo for src/stub.c (see windows.h). */
+
+#ifndef OCRA_POSIX_PSAPI_H
+#define OCRA_POSIX_PSAPI_H
+
+#include <windows.h>
+
+typedef struct
+{
+   DWORD cb;
+   DWORD PageFaultCount;
+   SIZE_T PeakWorkingSetSize;
+   SIZE_T WorkingSetSize;
+   SIZE_T QuotaPeakPagedPoolUsage;
+   SIZE_T QuotaPagedPoolUsage;
+   SIZE_T QuotaPeakNonPagedPoolUsage;
+   SIZE_T QuotaNonPagedPoolUsage;
+   SIZE_T PagefileUsage;
+   SIZE_T PeakPagefileUsage;
+} PROCESS_MEMORY_COUNTERS;
+
+BOOL GetProcessMemoryInfo(HANDLE Process, PROCESS_MEMORY_COUNTERS* Counters, DWORD Size);
+
+#endif
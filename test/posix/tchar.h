@@ -0,0 +1,16 @@
+/* The ANSI mappings of tchar.h that src/stub.c uses (see windows.h). */
+
+#ifndef OCRA_POSIX_TCHAR_H
+#define OCRA_POSIX_TCHAR_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define _T(x) x
+#define _tcschr strchr
+#define _tcsrchr strrchr
+#define _sntprintf snprintf
+#define _ttoi atoi
+#define _tWinMain WinMain
+
+#endif
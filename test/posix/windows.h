@@ -0,0 +1,351 @@
+/*
+  The subset of the Win32 API that src/stub.c uses, implemented on
+  POSIX by winposix.c, so that the stub can be run, tested and
+  benchmarked on Linux. See winposix.c for what is emulated and how
+  faithfully.
+*/
+
+#ifndef OCRA_POSIX_WINDOWS_H
+#define OCRA_POSIX_WINDOWS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Types */
+
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef unsigned int UINT;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef size_t SIZE_T;
+typedef char TCHAR;
+typedef char* LPTSTR;
+typedef const char* LPCTSTR;
+typedef char* LPSTR;
+typedef const char* LPCSTR;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef BYTE* LPBYTE;
+typedef DWORD* LPDWORD;
+typedef void* HANDLE;
+typedef void* HINSTANCE;
+typedef void* HMODULE;
+typedef void* HLOCAL;
+
+typedef union
+{
+   struct { DWORD LowPart; LONG HighPart; };
+   LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef union
+{
+   struct { DWORD LowPart; DWORD HighPart; };
+   ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct
+{
+   DWORD dwLowDateTime;
+   DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct
+{
+   DWORD dwFileAttributes;
+   FILETIME ftCreationTime;
+   FILETIME ftLastAccessTime;
+   FILETIME ftLastWriteTime;
+   DWORD nFileSizeHigh;
+   DWORD nFileSizeLow;
+   TCHAR cFileName[260];
+} WIN32_FIND_DATA;
+
+typedef struct
+{
+   DWORD dwFileAttributes;
+   FILETIME ftCreationTime;
+   FILETIME ftLastAccessTime;
+   FILETIME ftLastWriteTime;
+   DWORD dwVolumeSerialNumber;
+   DWORD nFileSizeHigh;
+   DWORD nFileSizeLow;
+   DWORD nNumberOfLinks;
+   DWORD nFileIndexHigh;
+   DWORD nFileIndexLow;
+} BY_HANDLE_FILE_INFORMATION;
+
+typedef struct
+{
+   HANDLE hProcess;
+   HANDLE hThread;
+   DWORD dwProcessId;
+   DWORD dwThreadId;
+} PROCESS_INFORMATION;
+
+typedef struct
+{
+   DWORD cb;
+   DWORD dwFlags;
+   WORD wShowWindow;
+   HANDLE hStdInput;
+   HANDLE hStdOutput;
+   HANDLE hStdError;
+} STARTUPINFO;
+
+typedef struct
+{
+   DWORD dwOemId;
+   DWORD dwPageSize;
+   LPVOID lpMinimumApplicationAddress;
+   LPVOID lpMaximumApplicationAddress;
+   ULONG_PTR dwActiveProcessorMask;
+   DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+typedef struct
+{
+   DWORD dwLength;
+   DWORD dwMemoryLoad;
+   ULONGLONG ullTotalPhys;
+   ULONGLONG ullAvailPhys;
+   ULONGLONG ullTotalPageFile;
+   ULONGLONG ullAvailPageFile;
+   ULONGLONG ullTotalVirtual;
+   ULONGLONG ullAvailVirtual;
+   ULONGLONG ullAvailExtendedVirtual;
+} MEMORYSTATUSEX;
+
+typedef struct
+{
+   ULONG_PTR Internal;
+   ULONG_PTR InternalHigh;
+   DWORD Offset;
+   DWORD OffsetHigh;
+   HANDLE hEvent;
+} OVERLAPPED;
+
+typedef struct
+{
+   DWORD nLength;
+   LPVOID lpSecurityDescriptor;
+   BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+typedef struct
+{
+   void* Mutex;
+} CRITICAL_SECTION;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+
+/* Constants */
+
+#define WINAPI
+#define CALLBACK
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define INVALID_FILE_SIZE ((DWORD)0xFFFFFFFF)
+
+#define FILE_ATTRIBUTE_HIDDEN 0x2
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_ATTRIBUTE_TEMPORARY 0x100
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define FILE_FLAG_DELETE_ON_CLOSE 0x04000000
+#define FILE_FLAG_OVERLAPPED 0x40000000
+#define FILE_FLAG_FIRST_PIPE_INSTANCE 0x00080000
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_APPEND_DATA 4
+#define FILE_SHARE_READ 1
+#define FILE_SHARE_WRITE 2
+#define FILE_SHARE_DELETE 4
+
+#define CREATE_NEW 1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+
+#define MOVEFILE_REPLACE_EXISTING 1
+#define MOVEFILE_DELAY_UNTIL_REBOOT 4
+
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_NO_MORE_FILES 18
+#define ERROR_SHARING_VIOLATION 32
+#define ERROR_LOCK_VIOLATION 33
+#define ERROR_FILE_EXISTS 80
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_ENVVAR_NOT_FOUND 203
+#define ERROR_PIPE_CONNECTED 535
+
+#define LMEM_FIXED 0
+#define LMEM_ZEROINIT 0x40
+
+#define PAGE_READONLY 2
+#define PAGE_READWRITE 4
+#define FILE_MAP_WRITE 2
+#define FILE_MAP_READ 4
+
+#define MB_OK 0
+#define MB_ICONWARNING 0x30
+
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define STILL_ACTIVE 259
+
+#define LOCKFILE_FAIL_IMMEDIATELY 1
+#define LOCKFILE_EXCLUSIVE_LOCK 2
+
+#define CREATE_SUSPENDED 4
+#define DETACHED_PROCESS 8
+#define IDLE_PRIORITY_CLASS 0x40
+#define CREATE_NEW_PROCESS_GROUP 0x200
+#define BELOW_NORMAL_PRIORITY_CLASS 0x4000
+#define CREATE_BREAKAWAY_FROM_JOB 0x01000000
+#define CREATE_NO_WINDOW 0x08000000
+#define STARTF_USESHOWWINDOW 1
+#define SW_HIDE 0
+
+#define THREAD_PRIORITY_BELOW_NORMAL (-1)
+#define THREAD_PRIORITY_IDLE (-15)
+
+#define PIPE_ACCESS_DUPLEX 3
+#define PIPE_TYPE_BYTE 0
+#define PIPE_READMODE_BYTE 0
+#define PIPE_WAIT 0
+#define PIPE_REJECT_REMOTE_CLIENTS 8
+#define PIPE_UNLIMITED_INSTANCES 255
+
+#define DRIVE_FIXED 3
+#define DRIVE_RAMDISK 6
+
+/* Microsoft C runtime names */
+#define _snprintf snprintf
+#define _vsnprintf vsnprintf
+
+#define ZeroMemory(p, n) memset((p), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+#define MAKEINTRESOURCE(x) ((LPTSTR)(uintptr_t)(x))
+
+/* Errors and memory */
+
+DWORD GetLastError(void);
+HLOCAL LocalAlloc(UINT Flags, SIZE_T Bytes);
+HLOCAL LocalFree(HLOCAL Memory);
+void MemoryBarrier(void);
+BOOL GlobalMemoryStatusEx(MEMORYSTATUSEX* Status);
+
+/* Strings */
+
+int lstrlen(LPCTSTR s);
+LPTSTR lstrcpy(LPTSTR Destination, LPCTSTR Source);
+LPTSTR lstrcat(LPTSTR Destination, LPCTSTR Source);
+int lstrcmp(LPCTSTR a, LPCTSTR b);
+
+/* Files and directories */
+
+HANDLE CreateFile(LPCTSTR Name, DWORD Access, DWORD Share, SECURITY_ATTRIBUTES* Security,
+                  DWORD Disposition, DWORD Flags, HANDLE Template);
+BOOL CloseHandle(HANDLE h);
+BOOL ReadFile(HANDLE h, LPVOID Buffer, DWORD Size, LPDWORD Read, OVERLAPPED* Overlapped);
+BOOL WriteFile(HANDLE h, LPCVOID Buffer, DWORD Size, LPDWORD Written, OVERLAPPED* Overlapped);
+DWORD GetFileSize(HANDLE h, LPDWORD High);
+DWORD SetFilePointer(HANDLE h, LONG Distance, LONG* High, DWORD Method);
+BOOL SetEndOfFile(HANDLE h);
+BOOL GetFileInformationByHandle(HANDLE h, BY_HANDLE_FILE_INFORMATION* Information);
+BOOL LockFileEx(HANDLE h, DWORD Flags, DWORD Reserved, DWORD Low, DWORD High, OVERLAPPED* Overlapped);
+BOOL UnlockFileEx(HANDLE h, DWORD Reserved, DWORD Low, DWORD High, OVERLAPPED* Overlapped);
+DWORD GetFileAttributes(LPCTSTR Name);
+BOOL CreateDirectory(LPCTSTR Name, SECURITY_ATTRIBUTES* Security);
+BOOL RemoveDirectory(LPCTSTR Name);
+BOOL DeleteFile(LPCTSTR Name);
+BOOL MoveFileEx(LPCTSTR From, LPCTSTR To, DWORD Flags);
+BOOL CopyFile(LPCTSTR From, LPCTSTR To, BOOL FailIfExists);
+BOOL CreateHardLink(LPCTSTR Name, LPCTSTR Existing, SECURITY_ATTRIBUTES* Security);
+HANDLE FindFirstFile(LPCTSTR Pattern, WIN32_FIND_DATA* Data);
+BOOL FindNextFile(HANDLE h, WIN32_FIND_DATA* Data);
+BOOL FindClose(HANDLE h);
+DWORD GetTempPath(DWORD Size, LPTSTR Buffer);
+UINT GetTempFileName(LPCTSTR Directory, LPCTSTR Prefix, UINT Unique, LPTSTR Name);
+BOOL SetCurrentDirectory(LPCTSTR Name);
+UINT GetSystemDirectory(LPTSTR Buffer, UINT Size);
+BOOL GetDiskFreeSpaceEx(LPCTSTR Directory, ULARGE_INTEGER* Available, ULARGE_INTEGER* Total, ULARGE_INTEGER* Free);
+UINT GetDriveType(LPCTSTR Root);
+DWORD GetLogicalDrives(void);
+
+/* File mappings */
+
+HANDLE CreateFileMapping(HANDLE File, SECURITY_ATTRIBUTES* Security, DWORD Protect,
+                         DWORD SizeHigh, DWORD SizeLow, LPCTSTR Name);
+LPVOID MapViewOfFile(HANDLE Mapping, DWORD Access, DWORD OffsetHigh, DWORD OffsetLow, SIZE_T Size);
+BOOL UnmapViewOfFile(LPCVOID View);
+
+/* Named pipes */
+
+HANDLE CreateNamedPipe(LPCTSTR Name, DWORD OpenMode, DWORD PipeMode, DWORD MaxInstances,
+                       DWORD OutBufferSize, DWORD InBufferSize, DWORD Timeout, SECURITY_ATTRIBUTES* Security);
+BOOL ConnectNamedPipe(HANDLE Pipe, OVERLAPPED* Overlapped);
+BOOL DisconnectNamedPipe(HANDLE Pipe);
+
+/* Processes and environment */
+
+DWORD GetModuleFileName(HMODULE Module, LPTSTR Buffer, DWORD Size);
+LPTSTR GetCommandLine(void);
+DWORD GetEnvironmentVariable(LPCTSTR Name, LPTSTR Buffer, DWORD Size);
+BOOL SetEnvironmentVariable(LPCTSTR Name, LPCTSTR Value);
+BOOL SetConsoleCtrlHandler(BOOL (*Handler)(DWORD), BOOL Add);
+BOOL CreateProcess(LPCTSTR Application, LPTSTR CommandLine, SECURITY_ATTRIBUTES* ProcessSecurity,
+                   SECURITY_ATTRIBUTES* ThreadSecurity, BOOL InheritHandles, DWORD Flags, LPVOID Environment,
+                   LPCTSTR Directory, STARTUPINFO* StartupInfo, PROCESS_INFORMATION* ProcessInformation);
+BOOL GetExitCodeProcess(HANDLE Process, LPDWORD ExitCode);
+DWORD GetCurrentProcessId(void);
+HANDLE GetCurrentProcess(void);
+void ExitProcess(UINT ExitCode);
+int MessageBox(HANDLE Window, LPCTSTR Text, LPCTSTR Caption, UINT Type);
+
+/* Threads and synchronization */
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES* Security, SIZE_T StackSize, LPTHREAD_START_ROUTINE Start,
+                    LPVOID Parameter, DWORD Flags, LPDWORD ThreadId);
+BOOL SetThreadPriority(HANDLE Thread, int Priority);
+DWORD GetCurrentThreadId(void);
+HANDLE CreateEvent(SECURITY_ATTRIBUTES* Security, BOOL ManualReset, BOOL InitialState, LPCTSTR Name);
+BOOL SetEvent(HANDLE Event);
+HANDLE CreateSemaphore(SECURITY_ATTRIBUTES* Security, LONG InitialCount, LONG MaximumCount, LPCTSTR Name);
+BOOL ReleaseSemaphore(HANDLE Semaphore, LONG ReleaseCount, LONG* PreviousCount);
+DWORD WaitForSingleObject(HANDLE h, DWORD Milliseconds);
+void InitializeCriticalSection(CRITICAL_SECTION* Section);
+void EnterCriticalSection(CRITICAL_SECTION* Section);
+void LeaveCriticalSection(CRITICAL_SECTION* Section);
+LONG InterlockedIncrement(LONG volatile* Value);
+LONG InterlockedDecrement(LONG volatile* Value);
+LONG InterlockedExchange(LONG volatile* Target, LONG Value);
+
+/* Time */
+
+void Sleep(DWORD Milliseconds);
+DWORD GetTickCount(void);
+void GetSystemTimeAsFileTime(FILETIME* Time);
+BOOL QueryPerformanceCounter(LARGE_INTEGER* Count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* Frequency);
+void GetSystemInfo(SYSTEM_INFO* Information);
+
+#endif
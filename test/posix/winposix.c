@@ -0,0 +1,1152 @@
+/*
+  Win32 emulation for running src/stub.c on Linux.
+
+  The stub is a Windows program, but most of what it does (mapping the
+  image, decoding, writing files, locking, threads) has a close POSIX
+  equivalent. This file implements the calls declared in windows.h on
+  top of them, so that the stub can be built and run where Windows is
+  not available, and so that its tests and benchmarks can be rerun by
+  anyone with a Linux machine:
+
+    make -C src posixstub
+    src/posixstub EXECUTABLE [ARGUMENTS]
+
+  EXECUTABLE is an image built by ocrapack; the emulated
+  GetModuleFileName returns it. Paths use backslashes in the stub and
+  are translated to slashes here, so a TEMP of /tmp/x becomes \tmp\x\
+  in the stub and /tmp/x/ on disk. The program the image launches
+  (the postprocess record, e.g. /bin/true) is run with /bin/sh, which
+  reads the Windows command line closely enough for simple arguments.
+
+  This is a test tool, and some things are only approximated:
+
+  - Share modes are only honoured for files opened without any sharing,
+    which take an exclusive flock, and Linux lets files that are open
+    be renamed and deleted, which Windows does not.
+  - MOVEFILE_DELAY_UNTIL_REBOOT does nothing.
+  - Creation times are modification times.
+  - CREATE_SUSPENDED is ignored and the new process starts at once.
+  - Named pipes are Unix domain sockets in /tmp, named after the last
+    component of the pipe name (/tmp/ocrapipe-NAME).
+  - Only tmpfs reports DRIVE_RAMDISK, and there are no drive letters.
+
+  Timings measured with it say how the stub's code performs on Linux,
+  not how the same work performs on Windows, whose file system costs
+  (e.g. for creating files) are quite different.
+*/
+
+#define _GNU_SOURCE
+#include "windows.h"
+#include "psapi.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+
+#define TMPFS_MAGIC 0x01021994
+
+/* Seconds between 1601-01-01, the FILETIME epoch, and 1970-01-01 */
+#define FILETIME_EPOCH_OFFSET 11644473600ULL
+
+enum HandleKind
+{
+   HANDLE_FILE,
+   HANDLE_MAPPING,
+   HANDLE_FIND,
+   HANDLE_THREAD,
+   HANDLE_EVENT,
+   HANDLE_SEMAPHORE,
+   HANDLE_PROCESS,
+   HANDLE_PIPE
+};
+
+typedef struct
+{
+   enum HandleKind Kind;
+   int Fd;
+   char* DeleteOnClose;        /* Files: path to delete when closed */
+   size_t Size;                /* Mappings: size of the file */
+   BOOL Writable;              /* Mappings: opened with PAGE_READWRITE */
+   DIR* Directory;             /* Finds */
+   char Pattern[MAX_PATH];     /* Finds: file name pattern */
+   pthread_t Thread;           /* Threads */
+   LPTHREAD_START_ROUTINE Start;
+   LPVOID Parameter;
+   pid_t Pid;                  /* Processes */
+   BOOL Done;                  /* Threads and processes: has exited */
+   DWORD ExitCode;
+   BOOL ManualReset;           /* Events */
+   LONG Count;                 /* Events: signaled; semaphores: count */
+   LONG MaximumCount;
+   pthread_mutex_t Mutex;
+   pthread_cond_t Condition;
+} Handle;
+
+static __thread DWORD LastError;
+static char ImageName[MAX_PATH];
+static char CommandLine[32768];
+
+DWORD GetLastError(void)
+{
+   return LastError;
+}
+
+/* Sets the last error from errno. */
+static void SetErrno(void)
+{
+   switch (errno)
+   {
+   case ENOENT: case ENOTDIR: LastError = ERROR_FILE_NOT_FOUND; break;
+   case EEXIST: LastError = ERROR_ALREADY_EXISTS; break;
+   case EACCES: case EPERM: case ENOTEMPTY: case EBUSY: LastError = ERROR_ACCESS_DENIED; break;
+   default: LastError = 0x20000000 | errno; break;
+   }
+}
+
+/* Returns a path with slashes for backslashes. Rotates through a few
+   buffers per thread, so that two paths can be used at once. */
+static const char* PosixPath(LPCTSTR Path)
+{
+   static __thread char Buffers[4][4096];
+   static __thread int Next;
+   char* Result = Buffers[Next++ & 3];
+   char* c;
+   snprintf(Result, sizeof(Buffers[0]), "%s", Path);
+   for (c = Result; *c; c++)
+      if (*c == '\\')
+         *c = '/';
+   return Result;
+}
+
+static Handle* NewHandle(enum HandleKind Kind)
+{
+   Handle* h = calloc(1, sizeof(Handle));
+   h->Kind = Kind;
+   h->Fd = -1;
+   pthread_mutex_init(&h->Mutex, NULL);
+   pthread_cond_init(&h->Condition, NULL);
+   return h;
+}
+
+static void TimeToFileTime(time_t Time, FILETIME* FileTime)
+{
+   ULONGLONG Value = ((ULONGLONG)Time + FILETIME_EPOCH_OFFSET) * 10000000ULL;
+   FileTime->dwLowDateTime = (DWORD)Value;
+   FileTime->dwHighDateTime = (DWORD)(Value >> 32);
+}
+
+/* Errors and memory */
+
+HLOCAL LocalAlloc(UINT Flags, SIZE_T Bytes)
+{
+   if (Bytes == 0)
+      Bytes = 1;
+   return (Flags & LMEM_ZEROINIT) ? calloc(1, Bytes) : malloc(Bytes);
+}
+
+HLOCAL LocalFree(HLOCAL Memory)
+{
+   free(Memory);
+   return NULL;
+}
+
+void MemoryBarrier(void)
+{
+   __sync_synchronize();
+}
+
+BOOL GlobalMemoryStatusEx(MEMORYSTATUSEX* Status)
+{
+   struct sysinfo Info;
+   if (sysinfo(&Info) != 0)
+      return FALSE;
+   Status->ullTotalPhys = (ULONGLONG)Info.totalram * Info.mem_unit;
+   Status->ullAvailPhys = (ULONGLONG)(Info.freeram + Info.bufferram) * Info.mem_unit;
+   return TRUE;
+}
+
+BOOL GetProcessMemoryInfo(HANDLE Process, PROCESS_MEMORY_COUNTERS* Counters, DWORD Size)
+{
+   struct rusage Usage;
+   long Pages = 0, Resident = 0;
+   FILE* Statm = fopen("/proc/self/statm", "r");
+   if (Statm)
+   {
+      if (fscanf(Statm, "%ld %ld", &Pages, &Resident) != 2)
+         Resident = 0;
+      fclose(Statm);
+   }
+   getrusage(RUSAGE_SELF, &Usage);
+   memset(Counters, 0, Size);
+   Counters->cb = Size;
+   Counters->WorkingSetSize = (SIZE_T)Resident * sysconf(_SC_PAGESIZE);
+   Counters->PeakWorkingSetSize = (SIZE_T)Usage.ru_maxrss * 1024;
+   return TRUE;
+}
+
+/* Strings */
+
+int lstrlen(LPCTSTR s)
+{
+   return s ? (int)strlen(s) : 0;
+}
+
+LPTSTR lstrcpy(LPTSTR Destination, LPCTSTR Source)
+{
+   return strcpy(Destination, Source);
+}
+
+LPTSTR lstrcat(LPTSTR Destination, LPCTSTR Source)
+{
+   return strcat(Destination, Source);
+}
+
+int lstrcmp(LPCTSTR a, LPCTSTR b)
+{
+   return strcmp(a, b);
+}
+
+/* Files and directories */
+
+HANDLE CreateFile(LPCTSTR Name, DWORD Access, DWORD Share, SECURITY_ATTRIBUTES* Security,
+                  DWORD Disposition, DWORD Flags, HANDLE Template)
+{
+   const char* Path = PosixPath(Name);
+   int Mode;
+   if ((Access & GENERIC_READ) && (Access & GENERIC_WRITE))
+      Mode = O_RDWR;
+   else if (Access & (GENERIC_WRITE | FILE_APPEND_DATA))
+      Mode = O_WRONLY;
+   else
+      Mode = O_RDONLY;
+   if (Access == FILE_APPEND_DATA)
+      Mode |= O_APPEND;
+   switch (Disposition)
+   {
+   case CREATE_NEW: Mode |= O_CREAT | O_EXCL; break;
+   case CREATE_ALWAYS: Mode |= O_CREAT | O_TRUNC; break;
+   case OPEN_ALWAYS: Mode |= O_CREAT; break;
+   }
+
+   int Fd = open(Path, Mode | O_CLOEXEC, 0755);
+   if (Fd < 0)
+   {
+      SetErrno();
+      return INVALID_HANDLE_VALUE;
+   }
+   if (Share == 0 && flock(Fd, LOCK_EX | LOCK_NB) != 0)
+   {
+      close(Fd);
+      LastError = ERROR_SHARING_VIOLATION;
+      return INVALID_HANDLE_VALUE;
+   }
+   Handle* h = NewHandle(HANDLE_FILE);
+   h->Fd = Fd;
+   if (Flags & FILE_FLAG_DELETE_ON_CLOSE)
+      h->DeleteOnClose = strdup(Path);
+   return h;
+}
+
+BOOL CloseHandle(HANDLE Object)
+{
+   Handle* h = Object;
+   if (h == NULL || h == INVALID_HANDLE_VALUE)
+      return FALSE;
+   if (h->Fd >= 0)
+      close(h->Fd);
+   if (h->DeleteOnClose)
+   {
+      unlink(h->DeleteOnClose);
+      free(h->DeleteOnClose);
+   }
+   if (h->Kind == HANDLE_THREAD)
+   {
+      /* The thread still refers to its handle; let it go when done. */
+      pthread_detach(h->Thread);
+      return TRUE;
+   }
+   free(h);
+   return TRUE;
+}
+
+BOOL ReadFile(HANDLE Object, LPVOID Buffer, DWORD Size, LPDWORD Read, OVERLAPPED* Overlapped)
+{
+   Handle* h = Object;
+   ssize_t Result = read(h->Fd, Buffer, Size);
+   if (Result < 0)
+   {
+      SetErrno();
+      *Read = 0;
+      return FALSE;
+   }
+   *Read = (DWORD)Result;
+   return TRUE;
+}
+
+BOOL WriteFile(HANDLE Object, LPCVOID Buffer, DWORD Size, LPDWORD Written, OVERLAPPED* Overlapped)
+{
+   Handle* h = Object;
+   DWORD Total = 0;
+   while (Total < Size)
+   {
+      ssize_t Result = write(h->Fd, (const char*)Buffer + Total, Size - Total);
+      if (Result < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         SetErrno();
+         *Written = Total;
+         return FALSE;
+      }
+      Total += (DWORD)Result;
+   }
+   *Written = Total;
+   return TRUE;
+}
+
+DWORD GetFileSize(HANDLE Object, LPDWORD High)
+{
+   Handle* h = Object;
+   struct stat st;
+   if (fstat(h->Fd, &st) != 0)
+   {
+      SetErrno();
+      return INVALID_FILE_SIZE;
+   }
+   if (High)
+      *High = (DWORD)((ULONGLONG)st.st_size >> 32);
+   return (DWORD)st.st_size;
+}
+
+DWORD SetFilePointer(HANDLE Object, LONG Distance, LONG* High, DWORD Method)
+{
+   Handle* h = Object;
+   off_t Offset = High ? (off_t)(((ULONGLONG)(DWORD)*High << 32) | (DWORD)Distance) : Distance;
+   int Whence = Method == FILE_BEGIN ? SEEK_SET : Method == FILE_CURRENT ? SEEK_CUR : SEEK_END;
+   off_t Result = lseek(h->Fd, Offset, Whence);
+   if (Result < 0)
+   {
+      SetErrno();
+      return INVALID_FILE_SIZE;
+   }
+   if (High)
+      *High = (LONG)((ULONGLONG)Result >> 32);
+   return (DWORD)Result;
+}
+
+BOOL SetEndOfFile(HANDLE Object)
+{
+   Handle* h = Object;
+   if (ftruncate(h->Fd, lseek(h->Fd, 0, SEEK_CUR)) == 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+BOOL GetFileInformationByHandle(HANDLE Object, BY_HANDLE_FILE_INFORMATION* Information)
+{
+   Handle* h = Object;
+   struct stat st;
+   if (fstat(h->Fd, &st) != 0)
+   {
+      SetErrno();
+      return FALSE;
+   }
+   memset(Information, 0, sizeof(*Information));
+   Information->dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+   TimeToFileTime(st.st_mtime, &Information->ftCreationTime);
+   TimeToFileTime(st.st_atime, &Information->ftLastAccessTime);
+   TimeToFileTime(st.st_mtime, &Information->ftLastWriteTime);
+   Information->dwVolumeSerialNumber = (DWORD)st.st_dev;
+   Information->nFileSizeHigh = (DWORD)((ULONGLONG)st.st_size >> 32);
+   Information->nFileSizeLow = (DWORD)st.st_size;
+   Information->nNumberOfLinks = (DWORD)st.st_nlink;
+   Information->nFileIndexHigh = (DWORD)((ULONGLONG)st.st_ino >> 32);
+   Information->nFileIndexLow = (DWORD)st.st_ino;
+   return TRUE;
+}
+
+BOOL LockFileEx(HANDLE Object, DWORD Flags, DWORD Reserved, DWORD Low, DWORD High, OVERLAPPED* Overlapped)
+{
+   Handle* h = Object;
+   int Operation = (Flags & LOCKFILE_EXCLUSIVE_LOCK) ? LOCK_EX : LOCK_SH;
+   if (Flags & LOCKFILE_FAIL_IMMEDIATELY)
+      Operation |= LOCK_NB;
+   while (flock(h->Fd, Operation) != 0)
+   {
+      if (errno != EINTR)
+      {
+         LastError = ERROR_LOCK_VIOLATION;
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+BOOL UnlockFileEx(HANDLE Object, DWORD Reserved, DWORD Low, DWORD High, OVERLAPPED* Overlapped)
+{
+   Handle* h = Object;
+   return flock(h->Fd, LOCK_UN) == 0;
+}
+
+DWORD GetFileAttributes(LPCTSTR Name)
+{
+   struct stat st;
+   if (stat(PosixPath(Name), &st) != 0)
+   {
+      SetErrno();
+      return INVALID_FILE_ATTRIBUTES;
+   }
+   return S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+}
+
+BOOL CreateDirectory(LPCTSTR Name, SECURITY_ATTRIBUTES* Security)
+{
+   if (mkdir(PosixPath(Name), 0755) == 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+BOOL RemoveDirectory(LPCTSTR Name)
+{
+   if (rmdir(PosixPath(Name)) == 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+BOOL DeleteFile(LPCTSTR Name)
+{
+   if (unlink(PosixPath(Name)) == 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+BOOL MoveFileEx(LPCTSTR From, LPCTSTR To, DWORD Flags)
+{
+   if (Flags & MOVEFILE_DELAY_UNTIL_REBOOT)
+      return TRUE;
+   if (Flags & MOVEFILE_REPLACE_EXISTING)
+   {
+      if (rename(PosixPath(From), PosixPath(To)) == 0)
+         return TRUE;
+   }
+   else if (renameat2(AT_FDCWD, PosixPath(From), AT_FDCWD, PosixPath(To), RENAME_NOREPLACE) == 0)
+   {
+      return TRUE;
+   }
+   SetErrno();
+   return FALSE;
+}
+
+BOOL CopyFile(LPCTSTR From, LPCTSTR To, BOOL FailIfExists)
+{
+   char Buffer[65536];
+   ssize_t Read;
+   BOOL Result = TRUE;
+   int In = open(PosixPath(From), O_RDONLY | O_CLOEXEC);
+   if (In < 0)
+   {
+      SetErrno();
+      return FALSE;
+   }
+   int Out = open(PosixPath(To), O_WRONLY | O_CREAT | O_CLOEXEC | (FailIfExists ? O_EXCL : O_TRUNC), 0755);
+   if (Out < 0)
+   {
+      SetErrno();
+      close(In);
+      return FALSE;
+   }
+   while (Result && (Read = read(In, Buffer, sizeof(Buffer))) > 0)
+      Result = write(Out, Buffer, Read) == Read;
+   if (!Result || Read < 0)
+   {
+      SetErrno();
+      Result = FALSE;
+   }
+   close(In);
+   close(Out);
+   return Result;
+}
+
+BOOL CreateHardLink(LPCTSTR Name, LPCTSTR Existing, SECURITY_ATTRIBUTES* Security)
+{
+   if (link(PosixPath(Existing), PosixPath(Name)) == 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+/* Returns the next directory entry matching the pattern of a find. */
+static BOOL NextMatch(Handle* h, WIN32_FIND_DATA* Data)
+{
+   struct dirent* Entry;
+   struct stat st;
+   while ((Entry = readdir(h->Directory)) != NULL)
+   {
+      if (fnmatch(h->Pattern, Entry->d_name, FNM_CASEFOLD) != 0)
+         continue;
+      memset(Data, 0, sizeof(*Data));
+      snprintf(Data->cFileName, sizeof(Data->cFileName), "%s", Entry->d_name);
+      if (fstatat(dirfd(h->Directory), Entry->d_name, &st, 0) == 0)
+      {
+         Data->dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+         Data->nFileSizeHigh = (DWORD)((ULONGLONG)st.st_size >> 32);
+         Data->nFileSizeLow = (DWORD)st.st_size;
+         TimeToFileTime(st.st_mtime, &Data->ftCreationTime);
+         TimeToFileTime(st.st_atime, &Data->ftLastAccessTime);
+         TimeToFileTime(st.st_mtime, &Data->ftLastWriteTime);
+      }
+      return TRUE;
+   }
+   LastError = ERROR_NO_MORE_FILES;
+   return FALSE;
+}
+
+HANDLE FindFirstFile(LPCTSTR Pattern, WIN32_FIND_DATA* Data)
+{
+   char Directory[4096];
+   const char* Path = PosixPath(Pattern);
+   const char* Slash = strrchr(Path, '/');
+   if (Slash == NULL)
+      strcpy(Directory, ".");
+   else if (Slash == Path)
+      strcpy(Directory, "/");
+   else
+      snprintf(Directory, sizeof(Directory), "%.*s", (int)(Slash - Path), Path);
+
+   DIR* d = opendir(Directory);
+   if (d == NULL)
+   {
+      SetErrno();
+      return INVALID_HANDLE_VALUE;
+   }
+   Handle* h = NewHandle(HANDLE_FIND);
+   h->Directory = d;
+   snprintf(h->Pattern, sizeof(h->Pattern), "%s", Slash ? Slash + 1 : Path);
+   if (!NextMatch(h, Data))
+   {
+      closedir(d);
+      free(h);
+      LastError = ERROR_FILE_NOT_FOUND;
+      return INVALID_HANDLE_VALUE;
+   }
+   return h;
+}
+
+BOOL FindNextFile(HANDLE Object, WIN32_FIND_DATA* Data)
+{
+   return NextMatch(Object, Data);
+}
+
+BOOL FindClose(HANDLE Object)
+{
+   Handle* h = Object;
+   closedir(h->Directory);
+   free(h);
+   return TRUE;
+}
+
+/* Returns TEMP (or /tmp) with backslashes and a trailing backslash. */
+DWORD GetTempPath(DWORD Size, LPTSTR Buffer)
+{
+   const char* Temp = getenv("TEMP");
+   char Path[MAX_PATH];
+   char* c;
+   snprintf(Path, sizeof(Path), "%s", Temp && *Temp ? Temp : "/tmp");
+   for (c = Path; *c; c++)
+      if (*c == '/')
+         *c = '\\';
+   if (c > Path && c[-1] != '\\')
+      strcat(Path, "\\");
+   if (strlen(Path) + 1 > Size)
+      return (DWORD)strlen(Path) + 1;
+   strcpy(Buffer, Path);
+   return (DWORD)strlen(Path);
+}
+
+/* Creates <Directory>\<first three characters of Prefix><hex>.tmp, as
+   Windows does. */
+UINT GetTempFileName(LPCTSTR Directory, LPCTSTR Prefix, UINT Unique, LPTSTR Name)
+{
+   static LONG Counter;
+   size_t Length = strlen(Directory);
+   const char* Separator = Length > 0 && (Directory[Length - 1] == '\\' || Directory[Length - 1] == '/') ? "" : "\\";
+   int Tries;
+   for (Tries = 0; Tries < 65536; Tries++)
+   {
+      UINT Value = (UINT)(getpid() * 31 + __sync_add_and_fetch(&Counter, 1)) & 0xFFFF;
+      if (Value == 0)
+         continue;
+      snprintf(Name, MAX_PATH, "%s%s%.3s%X.tmp", Directory, Separator, Prefix, Value);
+      int Fd = open(PosixPath(Name), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+      if (Fd >= 0)
+      {
+         close(Fd);
+         return Value;
+      }
+      if (errno != EEXIST)
+      {
+         SetErrno();
+         return 0;
+      }
+   }
+   LastError = ERROR_FILE_EXISTS;
+   return 0;
+}
+
+BOOL SetCurrentDirectory(LPCTSTR Name)
+{
+   if (chdir(PosixPath(Name)) == 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+UINT GetSystemDirectory(LPTSTR Buffer, UINT Size)
+{
+   snprintf(Buffer, Size, "\\bin");
+   return (UINT)strlen(Buffer);
+}
+
+BOOL GetDiskFreeSpaceEx(LPCTSTR Directory, ULARGE_INTEGER* Available, ULARGE_INTEGER* Total, ULARGE_INTEGER* Free)
+{
+   struct statvfs s;
+   if (statvfs(PosixPath(Directory), &s) != 0)
+   {
+      SetErrno();
+      return FALSE;
+   }
+   if (Available)
+      Available->QuadPart = (ULONGLONG)s.f_bavail * s.f_frsize;
+   if (Total)
+      Total->QuadPart = (ULONGLONG)s.f_blocks * s.f_frsize;
+   if (Free)
+      Free->QuadPart = (ULONGLONG)s.f_bfree * s.f_frsize;
+   return TRUE;
+}
+
+UINT GetDriveType(LPCTSTR Root)
+{
+   struct statfs s;
+   if (statfs(PosixPath(Root), &s) != 0)
+      return 1; /* DRIVE_NO_ROOT_DIR */
+   return s.f_type == TMPFS_MAGIC ? DRIVE_RAMDISK : DRIVE_FIXED;
+}
+
+DWORD GetLogicalDrives(void)
+{
+   return 0;
+}
+
+/* File mappings */
+
+/* Views and their sizes, for UnmapViewOfFile */
+typedef struct View
+{
+   void* Address;
+   size_t Size;
+   struct View* Next;
+} View;
+
+static View* Views = NULL;
+static pthread_mutex_t ViewsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+HANDLE CreateFileMapping(HANDLE File, SECURITY_ATTRIBUTES* Security, DWORD Protect,
+                         DWORD SizeHigh, DWORD SizeLow, LPCTSTR Name)
+{
+   Handle* f = File;
+   struct stat st;
+   size_t Size = (size_t)(((ULONGLONG)SizeHigh << 32) | SizeLow);
+   if (fstat(f->Fd, &st) != 0)
+   {
+      SetErrno();
+      return NULL;
+   }
+   if (Size == 0)
+      Size = st.st_size;
+   if (Protect == PAGE_READWRITE && (off_t)Size > st.st_size && ftruncate(f->Fd, Size) != 0)
+   {
+      SetErrno();
+      return NULL;
+   }
+   Handle* h = NewHandle(HANDLE_MAPPING);
+   h->Fd = dup(f->Fd);
+   h->Size = Size;
+   h->Writable = Protect == PAGE_READWRITE;
+   return h;
+}
+
+LPVOID MapViewOfFile(HANDLE Mapping, DWORD Access, DWORD OffsetHigh, DWORD OffsetLow, SIZE_T Size)
+{
+   Handle* h = Mapping;
+   off_t Offset = (off_t)(((ULONGLONG)OffsetHigh << 32) | OffsetLow);
+   if (Size == 0)
+      Size = h->Size - Offset;
+   int Protection = (Access & FILE_MAP_WRITE) && h->Writable ? PROT_READ | PROT_WRITE : PROT_READ;
+   void* Address = mmap(NULL, Size, Protection, MAP_SHARED, h->Fd, Offset);
+   if (Address == MAP_FAILED)
+   {
+      SetErrno();
+      return NULL;
+   }
+   View* v = malloc(sizeof(View));
+   v->Address = Address;
+   v->Size = Size;
+   pthread_mutex_lock(&ViewsMutex);
+   v->Next = Views;
+   Views = v;
+   pthread_mutex_unlock(&ViewsMutex);
+   return Address;
+}
+
+BOOL UnmapViewOfFile(LPCVOID Address)
+{
+   View** p;
+   pthread_mutex_lock(&ViewsMutex);
+   for (p = &Views; *p; p = &(*p)->Next)
+   {
+      if ((*p)->Address == Address)
+      {
+         View* v = *p;
+         *p = v->Next;
+         pthread_mutex_unlock(&ViewsMutex);
+         munmap(v->Address, v->Size);
+         free(v);
+         return TRUE;
+      }
+   }
+   pthread_mutex_unlock(&ViewsMutex);
+   return FALSE;
+}
+
+/* Named pipes */
+
+static int PipeListener = -1;
+static pthread_mutex_t PipeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Every instance of a pipe accepts connections on one listening
+   socket, which the first instance creates. */
+HANDLE CreateNamedPipe(LPCTSTR Name, DWORD OpenMode, DWORD PipeMode, DWORD MaxInstances,
+                       DWORD OutBufferSize, DWORD InBufferSize, DWORD Timeout, SECURITY_ATTRIBUTES* Security)
+{
+   pthread_mutex_lock(&PipeMutex);
+   if (PipeListener < 0)
+   {
+      struct sockaddr_un Address;
+      const char* Base = strrchr(Name, '\\');
+      memset(&Address, 0, sizeof(Address));
+      Address.sun_family = AF_UNIX;
+      snprintf(Address.sun_path, sizeof(Address.sun_path), "/tmp/ocrapipe-%s", Base ? Base + 1 : Name);
+      unlink(Address.sun_path);
+      int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (Fd < 0 || bind(Fd, (struct sockaddr*)&Address, sizeof(Address)) != 0 || listen(Fd, 16) != 0)
+      {
+         SetErrno();
+         if (Fd >= 0)
+            close(Fd);
+         pthread_mutex_unlock(&PipeMutex);
+         return INVALID_HANDLE_VALUE;
+      }
+      PipeListener = Fd;
+   }
+   pthread_mutex_unlock(&PipeMutex);
+   return NewHandle(HANDLE_PIPE);
+}
+
+BOOL ConnectNamedPipe(HANDLE Pipe, OVERLAPPED* Overlapped)
+{
+   Handle* h = Pipe;
+   h->Fd = accept4(PipeListener, NULL, NULL, SOCK_CLOEXEC);
+   if (h->Fd >= 0)
+      return TRUE;
+   SetErrno();
+   return FALSE;
+}
+
+BOOL DisconnectNamedPipe(HANDLE Pipe)
+{
+   Handle* h = Pipe;
+   if (h->Fd >= 0)
+      close(h->Fd);
+   h->Fd = -1;
+   return TRUE;
+}
+
+/* Processes and environment */
+
+DWORD GetModuleFileName(HMODULE Module, LPTSTR Buffer, DWORD Size)
+{
+   snprintf(Buffer, Size, "%s", ImageName);
+   return (DWORD)strlen(Buffer);
+}
+
+LPTSTR GetCommandLine(void)
+{
+   return CommandLine;
+}
+
+DWORD GetEnvironmentVariable(LPCTSTR Name, LPTSTR Buffer, DWORD Size)
+{
+   const char* Value = getenv(Name);
+   if (Value == NULL)
+   {
+      LastError = ERROR_ENVVAR_NOT_FOUND;
+      return 0;
+   }
+   DWORD Length = (DWORD)strlen(Value);
+   if (Length + 1 > Size)
+      return Length + 1;
+   strcpy(Buffer, Value);
+   return Length;
+}
+
+BOOL SetEnvironmentVariable(LPCTSTR Name, LPCTSTR Value)
+{
+   return (Value ? setenv(Name, Value, 1) : unsetenv(Name)) == 0;
+}
+
+BOOL SetConsoleCtrlHandler(BOOL (*Handler)(DWORD), BOOL Add)
+{
+   return TRUE;
+}
+
+/* Runs Application with the arguments of CommandLine (everything
+   after its first, possibly quoted, word) through /bin/sh. */
+BOOL CreateProcess(LPCTSTR Application, LPTSTR CommandLine, SECURITY_ATTRIBUTES* ProcessSecurity,
+                   SECURITY_ATTRIBUTES* ThreadSecurity, BOOL InheritHandles, DWORD Flags, LPVOID Environment,
+                   LPCTSTR Directory, STARTUPINFO* StartupInfo, PROCESS_INFORMATION* ProcessInformation)
+{
+   char Command[65536];
+   const char* Arguments = CommandLine;
+   char* Posix = strdup(PosixPath(Application));
+   if (*Arguments == '"')
+   {
+      Arguments = strchr(Arguments + 1, '"');
+      Arguments = Arguments ? Arguments + 1 : "";
+   }
+   else
+   {
+      Arguments += strcspn(Arguments, " \t");
+   }
+   snprintf(Command, sizeof(Command), "'%s'%s", Posix, PosixPath(Arguments));
+   char* Cwd = Directory ? strdup(PosixPath(Directory)) : NULL;
+
+   pid_t Pid = fork();
+   if (Pid == 0)
+   {
+      if (Cwd && chdir(Cwd) != 0)
+         _exit(127);
+      execl("/bin/sh", "sh", "-c", Command, (char*)NULL);
+      _exit(127);
+   }
+   free(Posix);
+   free(Cwd);
+   if (Pid < 0)
+   {
+      SetErrno();
+      return FALSE;
+   }
+   Handle* h = NewHandle(HANDLE_PROCESS);
+   h->Pid = Pid;
+   ProcessInformation->hProcess = h;
+   ProcessInformation->hThread = NewHandle(HANDLE_EVENT);
+   ProcessInformation->dwProcessId = (DWORD)Pid;
+   ProcessInformation->dwThreadId = 0;
+   return TRUE;
+}
+
+BOOL GetExitCodeProcess(HANDLE Process, LPDWORD ExitCode)
+{
+   Handle* h = Process;
+   *ExitCode = h->Done ? h->ExitCode : STILL_ACTIVE;
+   return TRUE;
+}
+
+DWORD GetCurrentProcessId(void)
+{
+   return (DWORD)getpid();
+}
+
+HANDLE GetCurrentProcess(void)
+{
+   return (HANDLE)(intptr_t)-1;
+}
+
+void ExitProcess(UINT ExitCode)
+{
+   fflush(NULL);
+   exit(ExitCode);
+}
+
+int MessageBox(HANDLE Window, LPCTSTR Text, LPCTSTR Caption, UINT Type)
+{
+   fprintf(stderr, "%s: %s\n", Caption, Text);
+   return 0;
+}
+
+/* Threads and synchronization */
+
+static void* ThreadMain(void* Parameter)
+{
+   Handle* h = Parameter;
+   DWORD Result = h->Start(h->Parameter);
+   pthread_mutex_lock(&h->Mutex);
+   h->ExitCode = Result;
+   h->Done = TRUE;
+   pthread_cond_broadcast(&h->Condition);
+   pthread_mutex_unlock(&h->Mutex);
+   return NULL;
+}
+
+HANDLE CreateThread(SECURITY_ATTRIBUTES* Security, SIZE_T StackSize, LPTHREAD_START_ROUTINE Start,
+                    LPVOID Parameter, DWORD Flags, LPDWORD ThreadId)
+{
+   Handle* h = NewHandle(HANDLE_THREAD);
+   h->Start = Start;
+   h->Parameter = Parameter;
+   if (pthread_create(&h->Thread, NULL, ThreadMain, h) != 0)
+   {
+      free(h);
+      return NULL;
+   }
+   return h;
+}
+
+BOOL SetThreadPriority(HANDLE Thread, int Priority)
+{
+   return TRUE;
+}
+
+DWORD GetCurrentThreadId(void)
+{
+   return (DWORD)syscall(SYS_gettid);
+}
+
+HANDLE CreateEvent(SECURITY_ATTRIBUTES* Security, BOOL ManualReset, BOOL InitialState, LPCTSTR Name)
+{
+   Handle* h = NewHandle(HANDLE_EVENT);
+   h->ManualReset = ManualReset;
+   h->Count = InitialState ? 1 : 0;
+   return h;
+}
+
+BOOL SetEvent(HANDLE Event)
+{
+   Handle* h = Event;
+   pthread_mutex_lock(&h->Mutex);
+   h->Count = 1;
+   pthread_cond_broadcast(&h->Condition);
+   pthread_mutex_unlock(&h->Mutex);
+   return TRUE;
+}
+
+HANDLE CreateSemaphore(SECURITY_ATTRIBUTES* Security, LONG InitialCount, LONG MaximumCount, LPCTSTR Name)
+{
+   Handle* h = NewHandle(HANDLE_SEMAPHORE);
+   h->Count = InitialCount;
+   h->MaximumCount = MaximumCount;
+   return h;
+}
+
+BOOL ReleaseSemaphore(HANDLE Semaphore, LONG ReleaseCount, LONG* PreviousCount)
+{
+   Handle* h = Semaphore;
+   pthread_mutex_lock(&h->Mutex);
+   if (PreviousCount)
+      *PreviousCount = h->Count;
+   if (h->Count + ReleaseCount > h->MaximumCount)
+   {
+      pthread_mutex_unlock(&h->Mutex);
+      return FALSE;
+   }
+   h->Count += ReleaseCount;
+   pthread_cond_broadcast(&h->Condition);
+   pthread_mutex_unlock(&h->Mutex);
+   return TRUE;
+}
+
+/* Waits for a child process, polling when there is a timeout. */
+static DWORD WaitForProcess(Handle* h, DWORD Milliseconds)
+{
+   int Status;
+   DWORD Waited = 0;
+   if (h->Done)
+      return WAIT_OBJECT_0;
+   for (;;)
+   {
+      pid_t Result = waitpid(h->Pid, &Status, Milliseconds == INFINITE ? 0 : WNOHANG);
+      if (Result == h->Pid)
+         break;
+      if (Result < 0 && errno != EINTR)
+         return WAIT_OBJECT_0;
+      if (Result == 0)
+      {
+         if (Waited >= Milliseconds)
+            return WAIT_TIMEOUT;
+         usleep(1000);
+         Waited++;
+      }
+   }
+   h->ExitCode = WIFEXITED(Status) ? (DWORD)WEXITSTATUS(Status) : 128 + WTERMSIG(Status);
+   h->Done = TRUE;
+   return WAIT_OBJECT_0;
+}
+
+DWORD WaitForSingleObject(HANDLE Object, DWORD Milliseconds)
+{
+   Handle* h = Object;
+   struct timespec Deadline;
+   if (h->Kind == HANDLE_PROCESS)
+      return WaitForProcess(h, Milliseconds);
+
+   if (Milliseconds != INFINITE)
+   {
+      clock_gettime(CLOCK_REALTIME, &Deadline);
+      Deadline.tv_sec += Milliseconds / 1000;
+      Deadline.tv_nsec += (long)(Milliseconds % 1000) * 1000000L;
+      if (Deadline.tv_nsec >= 1000000000L)
+      {
+         Deadline.tv_sec++;
+         Deadline.tv_nsec -= 1000000000L;
+      }
+   }
+   pthread_mutex_lock(&h->Mutex);
+   while (h->Kind == HANDLE_THREAD ? !h->Done : h->Count == 0)
+   {
+      if (Milliseconds == INFINITE)
+      {
+         pthread_cond_wait(&h->Condition, &h->Mutex);
+      }
+      else if (pthread_cond_timedwait(&h->Condition, &h->Mutex, &Deadline) != 0)
+      {
+         pthread_mutex_unlock(&h->Mutex);
+         return WAIT_TIMEOUT;
+      }
+   }
+   if (h->Kind == HANDLE_SEMAPHORE)
+      h->Count--;
+   else if (h->Kind == HANDLE_EVENT && !h->ManualReset)
+      h->Count = 0;
+   pthread_mutex_unlock(&h->Mutex);
+   return WAIT_OBJECT_0;
+}
+
+void InitializeCriticalSection(CRITICAL_SECTION* Section)
+{
+   pthread_mutexattr_t Attributes;
+   pthread_mutexattr_init(&Attributes);
+   pthread_mutexattr_settype(&Attributes, PTHREAD_MUTEX_RECURSIVE);
+   Section->Mutex = malloc(sizeof(pthread_mutex_t));
+   pthread_mutex_init(Section->Mutex, &Attributes);
+   pthread_mutexattr_destroy(&Attributes);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION* Section)
+{
+   pthread_mutex_lock(Section->Mutex);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION* Section)
+{
+   pthread_mutex_unlock(Section->Mutex);
+}
+
+LONG InterlockedIncrement(LONG volatile* Value)
+{
+   return __sync_add_and_fetch(Value, 1);
+}
+
+LONG InterlockedDecrement(LONG volatile* Value)
+{
+   return __sync_sub_and_fetch(Value, 1);
+}
+
+LONG InterlockedExchange(LONG volatile* Target, LONG Value)
+{
+   return __sync_lock_test_and_set(Target, Value);
+}
+
+/* Time */
+
+void Sleep(DWORD Milliseconds)
+{
+   usleep((useconds_t)Milliseconds * 1000);
+}
+
+DWORD GetTickCount(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (DWORD)(t.tv_sec * 1000 + t.tv_nsec / 1000000);
+}
+
+void GetSystemTimeAsFileTime(FILETIME* Time)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_REALTIME, &t);
+   ULONGLONG Value = ((ULONGLONG)t.tv_sec + FILETIME_EPOCH_OFFSET) * 10000000ULL + t.tv_nsec / 100;
+   Time->dwLowDateTime = (DWORD)Value;
+   Time->dwHighDateTime = (DWORD)(Value >> 32);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* Count)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   Count->QuadPart = (LONGLONG)t.tv_sec * 1000000000LL + t.tv_nsec;
+   return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* Frequency)
+{
+   Frequency->QuadPart = 1000000000LL;
+   return TRUE;
+}
+
+void GetSystemInfo(SYSTEM_INFO* Information)
+{
+   memset(Information, 0, sizeof(*Information));
+   Information->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE);
+   Information->dwNumberOfProcessors = (DWORD)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* Entry point */
+
+int WinMain(HINSTANCE Instance, HINSTANCE PreviousInstance, LPTSTR CommandLine, int Show);
+
+int main(int argc, char** argv)
+{
+   int i;
+   if (argc < 2)
+   {
+      fprintf(stderr, "Usage: %s EXECUTABLE [ARGUMENTS]\n", argv[0]);
+      return 2;
+   }
+   if (realpath(argv[1], ImageName) == NULL)
+      snprintf(ImageName, sizeof(ImageName), "%s", argv[1]);
+   snprintf(CommandLine, sizeof(CommandLine), "\"%s\"", ImageName);
+   for (i = 2; i < argc; i++)
+   {
+      strncat(CommandLine, " ", sizeof(CommandLine) - strlen(CommandLine) - 1);
+      strncat(CommandLine, argv[i], sizeof(CommandLine) - strlen(CommandLine) - 1);
+   }
+   return WinMain(NULL, NULL, CommandLine, 0);
+}
@@ -4,6 +4,8 @@ require "tmpdir"
 require "fileutils"
 require "rbconfig"
 require "pathname"
+require "digest/sha1"
+require "json"
 
 begin
   require "rubygems"
@@ -88,7 +90,7 @@ class TestOcra < MiniTest::Test
   end
 
   def with_tmpdir(files = [], path = nil)
-    tempdirname = path || File.join(ENV['TEMP'], ".ocratest-#{$$}-#{rand 2**32}").tr('\\','/')
+    tempdirname = path || File.join(ENV['TEMP'] || Dir.tmpdir, ".ocratest-#{$$}-#{rand 2**32}").tr('\\','/')
     mkdir_p tempdirname
     begin
       cp files, tempdirname
@@ -100,6 +102,22 @@ class TestOcra < MiniTest::Test
     end
   end
 
+  # Builds largefile.exe from the largefile fixture, with data.bin
+  # (size random bytes below 16) and data2.bin (the same, reversed) to
+  # add to it, and yields the SHA1 of data.bin in a pristine
+  # environment with the executable.
+  def with_large_file(*ocra_args, size: 3 * 1024 * 1024)
+    with_fixture 'largefile' do
+      data = Array.new(size) { rand(16) }.pack("C*")
+      File.open("data.bin", "wb") { |f| f << data }
+      File.open("data2.bin", "wb") { |f| f << data.reverse }
+      assert system("ruby", ocra, "largefile.rb", "data.bin", *ocra_args)
+      pristine_env "largefile.exe" do
+        yield Digest::SHA1.hexdigest(data)
+      end
+    end
+  end
+
   def each_path_combo(*files)
     # In same directory as first file
     basedir = Pathname.new(files[0]).realpath.parent
@@ -200,6 +218,318 @@ class TestOcra < MiniTest::Test
     end
   end
 
+  # Test that files larger than the decompression window are extracted
+  # intact from an LZMA compressed executable, both when they are
+  # decoded into a mapped view and when they are written, and that the
+  # memory the stub uses is bounded by the dictionary and the window
+  # rather than growing with the payload. The private bytes
+  # (peak_pagefile in the trace) are checked, as the working set also
+  # counts the pages of the mapped image and files, which do grow with
+  # the payload.
+  def test_lzma_large_file
+    dictionary = 16 * 1024 * 1024 # ocrapack --dict-size
+    window = 256 * 1024 # LZMA_WINDOW_SIZE in src/stub.c
+    slack = 16 * 1024 * 1024 # heap, pipeline chunks, queued files
+    sizes = [3 * 1024 * 1024, 30 * 1024 * 1024]
+    peaks = sizes.map do |size|
+      with_large_file "--quiet", "--lzma", size: size do |digest|
+        %w[1 0].product(%w[1 2]).each do |map_files, threads|
+          with_env "OCRA_MAP_FILES" => map_files, "OCRA_DECODE_THREADS" => threads do
+            assert system("largefile.exe", digest), "OCRA_MAP_FILES=#{map_files} OCRA_DECODE_THREADS=#{threads}"
+          end
+        end
+        trace = File.expand_path("trace.json")
+        with_env "OCRA_TRACE" => trace do
+          assert system("largefile.exe", digest)
+        end
+        events = JSON.parse(File.read(trace))["traceEvents"]
+        events.find { |event| event["name"] == "memory" }["args"]["peak_pagefile"]
+      end
+    end
+    peaks.each do |peak|
+      assert_operator peak, :<, dictionary + window + slack
+    end
+    # The dictionary is smaller than --dict-size when the payload is,
+    # so it may grow by the difference, give or take how many files
+    # were queued for writing at once.
+    assert_operator peaks[1] - peaks[0], :<, dictionary - sizes[0] + slack / 4
+  end
+
+  # The stub should extract to OCRA_RAM_DIR, or to temporary files,
+  # when the files fit in OCRA_RAM_LIMIT, and report where in its trace
+  def test_ram_target
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", "--quiet", "--lzma")
+      pristine_env "helloworld.exe" do
+        mkdir "ram"
+        trace = File.expand_path("trace.json")
+        { { "OCRA_RAM_LIMIT" => "512", "OCRA_RAM_DIR" => File.expand_path("ram").tr("/", "\\") } => /\Aramdisk .*\\ram\\\z/,
+          { "OCRA_RAM_LIMIT" => "512" } => /\A(temporary|ramdisk) /,
+          { "OCRA_RAM_LIMIT" => "0" } => /\Adisk /,
+          {} => /\Adisk / }.each do |env, target|
+          with_env env.merge("OCRA_TRACE" => trace) do
+            assert system("helloworld.exe")
+          end
+          events = JSON.parse(File.read(trace))["traceEvents"]
+          choice = events.find { |event| event["name"] == "ChooseTarget" }
+          assert_match target, choice["args"]["name"]
+        end
+        assert_equal [], Dir["ram/*"]
+      end
+    end
+  end
+
+  # Test that files spread over several independently compressed
+  # blocks are extracted intact.
+  def test_lzma_blocks
+    with_large_file "data2.bin", "--quiet", "--lzma", "--lzma-block-size", "1" do |digest|
+      assert system("largefile.exe", digest)
+    end
+  end
+
+  # Test that data the decoders handle differently (incompressible
+  # data, matches shorter and longer than a word, runs and tiny files)
+  # is extracted intact with every codec.
+  def test_codec_roundtrip
+    with_fixture 'roundtrip' do
+      text = File.read(__FILE__)
+      files = {
+        "random.bin" => Array.new(1024 * 1024) { rand(256) }.pack("C*"),
+        "short.bin" => Array.new(1024 * 1024) { |i| "abcdefg"[i % (1 + i / 4096 % 7)] }.join,
+        "text.rb" => text * 20,
+        "runs.bin" => "\0" * 1024 * 1024 + "x" * 1000,
+        "tiny.bin" => "x",
+        "empty.bin" => "",
+      }
+      args = []
+      files.each do |name, data|
+        File.open(name, "wb") { |f| f << data }
+        args.push(name, Digest::SHA1.hexdigest(data))
+      end
+      [["--lzma"], ["--lzma", "--lzma-block-size", "1"], ["--codec", "lz4"]].each do |codec|
+        assert system("ruby", ocra, "roundtrip.rb", *files.keys, "--quiet", *codec)
+        pristine_env "roundtrip.exe" do
+          assert system("roundtrip.exe", *args), "#{codec.join(' ')} round trip failed"
+        end
+      end
+    end
+  end
+
+  # Test that LZ4 compressed blocks are extracted intact.
+  def test_codec_lz4
+    with_large_file "data2.bin", "--quiet", "--codec", "lz4", "--lzma-block-size", "1" do |digest|
+      assert File.size("largefile.exe") < 2 * 3 * 1024 * 1024
+      assert system("largefile.exe", digest)
+    end
+  end
+
+  # Executables and DLLs should be extracted intact through the x86
+  # filter, which should not make the executable larger
+  def test_bcj
+    with_fixture 'helloworld' do
+      [[], ["--lzma-block-size", "1"]].each do |blocks|
+        sizes = [[], ["--no-bcj"]].map do |bcj|
+          assert system("ruby", ocra, "helloworld.rb", "--quiet", "--lzma", *blocks, *bcj)
+          pristine_env "helloworld.exe" do
+            assert system("helloworld.exe")
+          end
+          File.size("helloworld.exe")
+        end
+        assert sizes[0] <= sizes[1], "#{sizes[0]} > #{sizes[1]} with #{blocks.join(' ')}"
+      end
+    end
+  end
+
+  # OCRA_TRACE should make the executable write a Chrome trace of what
+  # it did
+  def test_trace
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", "--quiet", "--lzma")
+      pristine_env "helloworld.exe" do
+        trace = File.expand_path("trace.json")
+        with_env "OCRA_TRACE" => trace do
+          assert system("helloworld.exe")
+        end
+        events = JSON.parse(File.read(trace))["traceEvents"]
+        names = events.map { |event| event["name"] }
+        %w[OpDecompressLzma CreateFile WriteFile CreateProcess DeleteRecursively memory].each do |name|
+          assert_includes names, name
+        end
+        memory = events.find { |event| event["name"] == "memory" }
+        assert memory["args"]["peak_working_set"] > 0
+      end
+    end
+  end
+
+  # With --trace, the require timings of the Ruby process should be
+  # added to the trace of the stub
+  def test_trace_requires
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", "--quiet", "--trace")
+      pristine_env "helloworld.exe" do
+        trace = File.expand_path("trace.json")
+        with_env "OCRA_TRACE" => trace do
+          assert system("helloworld.exe")
+        end
+        events = JSON.parse(File.read(trace))["traceEvents"]
+        assert events.any? { |event| event["cat"] == "require" }
+        main = events.find { |event| event["name"] == "main" }
+        launch = events.find { |event| event["name"] == "CreateProcess" }
+        assert main["ts"] > launch["ts"]
+      end
+    end
+  end
+
+  # Rebuilding with --build-cache should reuse the compressed blocks
+  # and produce the same executable
+  def test_build_cache
+    with_fixture 'helloworld' do
+      args = ["ruby", ocra, "helloworld.rb", "--quiet", "--lzma", "--build-cache", "blockcache"]
+      assert system(*args)
+      assert !Dir["blockcache/*"].empty?
+      first = File.open("helloworld.exe", "rb") { |f| f.read }
+      assert system(*args)
+      assert_equal first, File.open("helloworld.exe", "rb") { |f| f.read }
+      pristine_env "helloworld.exe" do
+        assert system("helloworld.exe")
+      end
+    end
+  end
+
+  # The build report should account for every file and the whole
+  # compressed payload
+  def test_report
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", "--quiet", "--report", "report.json")
+      report = JSON.parse(File.read("report.json"))
+      assert_equal File.size("helloworld.exe"), report["size"]
+      categories = report["files"].map { |file| file["category"] }
+      assert_includes categories, "source"
+      assert_includes categories, "dll"
+      compressed = report["files"].inject(0) { |sum, file| sum + file["compressed"] }
+      assert compressed <= report["streams"].inject(0) { |sum, stream| sum + stream["compressed"] }
+      assert report["phases"].key?("pack")
+    end
+  end
+
+  # ocrapack should build an executable from a hand written manifest
+  def test_ocrapack_manifest
+    with_fixture 'helloworld' do
+      cmd = File.join(ENV["SystemRoot"], "system32", "cmd.exe").tr("/", "\\")
+      manifest = [
+        "instdir\t0\t1\t1",
+        "mkdir\tsrc",
+        "file\tsrc\\\\helloworld.rb\thelloworld.rb",
+        "postprocess\t#{cmd.gsub("\\", "\\\\\\\\")}\tcmd /c if exist src\\\\helloworld.rb exit 3",
+      ].join("\n")
+      pack = File.join(OcraRoot, "share", "ocra", "ocrapack.exe")
+      stub = File.join(OcraRoot, "share", "ocra", "stub.exe")
+      IO.popen([pack, "--quiet", "--lzma", "--stub", stub, "manifest.exe"], "wb") { |io| io << manifest }
+      assert $?.success?
+      pristine_env "manifest.exe" do
+        system("manifest.exe")
+        assert_equal 3, $?.exitstatus
+      end
+    end
+  end
+
+  # ocraunpack should list, check and extract an executable without
+  # running it
+  def test_ocraunpack
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", *DefaultArgs)
+      unpack = File.join(OcraRoot, "share", "ocra", "ocraunpack.exe")
+      listing = IO.popen([unpack, "--list", "--quiet", "helloworld.exe"]) { |io| io.read }
+      assert $?.success?
+      assert_match(/^\s*file\s+src\\helloworld\.rb /, listing)
+      assert_match(/^postprocess /, listing)
+      assert system(unpack, "--quiet", "--extract", "unpacked", "helloworld.exe")
+      assert_equal File.read("helloworld.rb"), File.read("unpacked/src/helloworld.rb")
+    end
+  end
+
+  # Executables should carry a table of contents after the opcodes
+  def test_table_of_contents
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", *DefaultArgs)
+      trailer = File.open("helloworld.exe", "rb") { |f| f.seek(-12, IO::SEEK_END); f.read(4) }
+      assert_equal "\x41\xb6\xba\x54".b, trailer
+      pristine_env "helloworld.exe" do
+        assert system("helloworld.exe")
+      end
+    end
+  end
+
+  # With --lazy-extract option, exe should only unpack the files that
+  # the script uses
+  def test_lazy_extract
+    with_fixture 'lazyextract' do
+      100.times { |i| File.open("data/unused#{i}.txt", "w") { |f| f.puts "unused #{i}" } }
+      assert system("ruby", ocra, "lazyextract.rb", "lib/lazylib.rb", "data/**/*", *(DefaultArgs + ["--lazy-extract", "--debug-extract"]))
+      pristine_env "lazyextract.exe" do
+        assert system("lazyextract.exe")
+        extracted = Dir["ocr*/src/**/*"].select { |path| File.file?(path) }
+        extracted.map! { |path| path.sub(/\Aocr[^\/]*\/src\//, "") }
+        assert_equal ["data/used.txt", "lazyextract.rb", "lib/lazylib.rb"], extracted.sort
+      end
+    end
+  end
+
+  # With --early-launch option, exe should start the script before
+  # unpacking the files it has not loaded yet, and unpack any of them
+  # it uses on demand
+  def test_early_launch
+    with_fixture 'lazyextract' do
+      100.times { |i| File.open("data/unused#{i}.txt", "w") { |f| f.puts "unused #{i}" } }
+      assert system("ruby", ocra, "lazyextract.rb", "lib/lazylib.rb", "data/**/*", *(DefaultArgs + ["--early-launch", "--debug-extract"]))
+      pristine_env "lazyextract.exe" do
+        assert system("lazyextract.exe")
+        assert_equal [], Dir["ocr*/**/*.ocra-partial"]
+        Dir["ocr*/src/data/unused*.txt"].each do |path|
+          assert_equal "unused #{path[/unused(\d+)/, 1]}\n", File.read(path)
+        end
+      end
+    end
+  end
+
+  # With --archive option, exe should require scripts and read data
+  # files from the executable instead of unpacking them
+  def test_archive
+    with_fixture 'archive' do
+      assert system("ruby", ocra, "archive.rb", "lib/archivelib.rb", "data/used.txt", *(DefaultArgs + ["--archive", "--debug-extract"]))
+      pristine_env "archive.exe" do
+        assert system("archive.exe")
+        extracted = Dir["ocr*/src/**/*"].select { |path| File.file?(path) }
+        extracted.map! { |path| path.sub(/\Aocr[^\/]*\/src\//, "") }
+        assert_equal ["archive.rb"], extracted
+      end
+    end
+  end
+
+  # The archive script should serve require and OcraResource from an
+  # executable packed by ocrapack in a system Ruby as well, so that it
+  # can be tested without Windows
+  def test_archive_system_ruby
+    pack = [File.join(OcraRoot, "share", "ocra", "ocrapack.exe"), File.join(OcraRoot, "src", "ocrapack.exe"),
+            File.join(OcraRoot, "src", "ocrapack")].find { |path| File.file?(path) }
+    skip "ocrapack is not built" unless pack
+    with_fixture 'archive' do
+      manifest = ["instdir\t0\t1\t0"]
+      %w[lib/archivelib.rb data/used.txt].each do |file|
+        manifest << "archivefile\tsrc\\\\#{file.gsub("/", "\\\\\\\\")}\t#{File.expand_path(file)}"
+      end
+      File.open("stub", "wb") { |f| f << "MZ" }
+      IO.popen([pack, "--quiet", "--lzma", "--toc", "--stub", "stub", "archive.exe"], "wb") { |io| io << manifest.join("\n") }
+      assert $?.success?
+      mkdir_p ["root/ocra", "root/src"]
+      cp %w[ocra_archive.rb ocra_preload.rb].map { |name| File.join(OcraRoot, "share", "ocra", name) }, "root/ocra"
+      cp "archive.rb", "root/src"
+      with_env "OCRA_EXECUTABLE" => File.expand_path("archive.exe") do
+        assert system("ruby", "-Iroot/ocra", "-rocra_archive", "root/src/archive.rb")
+      end
+    end
+  end
+
   # With --debug-extract option, exe should unpack to local directory and leave it in place
   def test_debug_extract
     with_fixture 'helloworld' do
@@ -212,6 +542,56 @@ class TestOcra < MiniTest::Test
     end
   end
 
+  # With --cache option, exe should unpack to a per-user cache once
+  # and reuse it on later runs
+  def test_cache
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", *(DefaultArgs + ["--cache"]))
+      pristine_env "helloworld.exe" do
+        with_env "LOCALAPPDATA" => Dir.pwd.tr('/', '\\') do
+          assert system("helloworld.exe")
+          assert_equal 1, Dir["ocra-cache/*/.ocra-complete"].size
+          assert system("helloworld.exe")
+          assert_equal 1, Dir["ocra-cache/*"].size
+        end
+      end
+    end
+  end
+
+  # With --shared option, instances running at the same time should
+  # unpack once to the same directory, which the last one deletes
+  def test_shared
+    with_fixture 'shared' do
+      assert system("ruby", ocra, "shared.rb", *(DefaultArgs + ["--shared"]))
+      pristine_env "shared.exe" do
+        with_env "TEMP" => Dir.pwd.tr('/', '\\'), "TMP" => Dir.pwd.tr('/', '\\') do
+          pids = Array.new(8) { Process.spawn("shared.exe") }
+          assert pids.all? { |pid| Process.wait2(pid)[1].success? }
+          dirs = Dir["instance-*.txt"].map { |path| File.read(path) }
+          assert_equal 8, dirs.size
+          assert_equal 1, dirs.uniq.size
+          assert_equal [], Dir["ocra-*"]
+        end
+      end
+    end
+  end
+
+  # With --defer-cleanup option, exe should move the temporary
+  # directory to the trash and have it deleted in the background
+  def test_defer_cleanup
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", *(DefaultArgs + ["--defer-cleanup"]))
+      pristine_env "helloworld.exe" do
+        with_env "TEMP" => Dir.pwd.tr('/', '\\'), "TMP" => Dir.pwd.tr('/', '\\') do
+          assert system("helloworld.exe")
+          assert_equal 0, Dir["ocrastub*"].size
+          50.times { break if Dir["ocra-trash/*"].empty?; sleep 0.1 }
+          assert_equal [], Dir["ocra-trash/*"]
+        end
+      end
+    end
+  end
+
   # Test that the --output option allows us to specify a different exe name
   def test_output_option
     with_fixture 'helloworld' do
@@ -540,6 +920,17 @@ class TestOcra < MiniTest::Test
     end
   end
 
+  # Files with identical contents should be stored once and linked
+  # or copied when extracted.
+  def test_duplicate_files
+    with_fixture 'duplicates' do
+      assert system("ruby", ocra, "duplicates.rb", "data.txt", "copy/data.txt", *DefaultArgs)
+      pristine_env "duplicates.exe" do
+        assert system("duplicates.exe")
+      end
+    end
+  end
+
   # Test that when exceptions are thrown, no executable will be built.
   def test_exception
     with_fixture 'exception' do
@@ -594,6 +985,30 @@ class TestOcra < MiniTest::Test
     end
   end
 
+  # Directories left behind by earlier runs should be deleted within
+  # the OCRA_GC_SIZE budget, and later runs should continue the work
+  def test_delete_old_files
+    with_fixture 'helloworld' do
+      assert system("ruby", ocra, "helloworld.rb", *DefaultArgs)
+      pristine_env "helloworld.exe" do
+        mkdir_p "ocrastubleft/data"
+        4.times { |i| File.binwrite("ocrastubleft/data/#{i}.bin", "x" * 512 * 1024) }
+        File.write("ocrastubleft.ocra-delete-me", "")
+        with_env "TEMP" => Dir.pwd.tr('/', '\\'), "TMP" => Dir.pwd.tr('/', '\\') do
+          with_env "OCRA_GC_SIZE" => "1" do
+            assert system("helloworld.exe")
+          end
+          assert File.exist?("ocrastubleft.ocra-delete-me")
+          assert_equal 1, File.read("ocrastubleft.ocra-delete-me").split[0].to_i
+          assert_equal 2, Dir["ocrastubleft/data/*"].size
+          assert system("helloworld.exe")
+          assert !File.exist?("ocrastubleft")
+          assert !File.exist?("ocrastubleft.ocra-delete-me")
+        end
+      end
+    end
+  end
+
   def test_temp_with_space
     with_fixture 'helloworld' do
       assert system("ruby", ocra, "helloworld.rb", *DefaultArgs)